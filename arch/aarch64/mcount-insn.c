@@ -222,10 +222,8 @@ int disasm_check_insns(struct mcount_disasm_engine *disasm, struct mcount_dynami
 	struct dynamic_bad_symbol *badsym;
 
 	badsym = mcount_find_badsym(mdi, info->addr);
-	if (badsym != NULL) {
-		badsym->reverted = true;
+	if (badsym != NULL)
 		return INSTRUMENT_FAILED;
-	}
 
 	count = cs_disasm(disasm->engine, (void *)info->addr, info->sym->size, info->addr, 0,
 			  &insn);
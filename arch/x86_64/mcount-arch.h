@@ -56,6 +56,7 @@ struct mcount_disasm_info;
 #define ENDBR_INSN_SIZE 4
 #define CET_JMP_INSN_SIZE 7 /* indirect jump + prefix */
 #define NOP_INSN_SIZE 1
+#define DENTRY_STUB_SIZE 15 /* address + indirect call with prefix */
 
 int disasm_check_insns(struct mcount_disasm_engine *disasm, struct mcount_dynamic_info *mdi,
 		       struct mcount_disasm_info *info);
@@ -1,5 +1,8 @@
+#include <signal.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
 #include <unistd.h>
 
 /* This should be defined before #include "utils.h" */
@@ -12,6 +15,19 @@
 #include "utils/symbol.h"
 #include "utils/utils.h"
 
+#ifndef MEMBARRIER_CMD_QUERY
+#define MEMBARRIER_CMD_QUERY 0
+#endif
+#ifndef MEMBARRIER_CMD_GLOBAL
+#define MEMBARRIER_CMD_GLOBAL (1 << 0)
+#endif
+#ifndef MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE
+#define MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE (1 << 5)
+#endif
+#ifndef MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE
+#define MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE (1 << 6)
+#endif
+
 static const unsigned char fentry_nop_patt1[] = { 0x67, 0x0f, 0x1f, 0x04, 0x00 };
 static const unsigned char fentry_nop_patt2[] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
 static const unsigned char patchable_gcc_nop[] = { 0x90, 0x90, 0x90, 0x90, 0x90 };
@@ -416,21 +432,54 @@ static int patch_xray_func(struct mcount_dynamic_info *mdi, struct uftrace_symbo
  *
  */
 
+/*
+ * Write the entry stub for the function before the saved instructions.
+ * It calls __dentry_direct__ which finds the saved instructions from
+ * the return address (of the stub) so no need to search the hashmap.
+ *
+ *  ---------------------------------
+ *  | QW &__dentry_direct__         |
+ *  ---------------------------------
+ *  | call qword ptr [rip - 15]     |  <-- call from the function
+ *  ---------------------------------
+ *  | [origin_code_size]            |  <-- return address of the stub
+ *  ---------------------------------
+ */
+static void write_entry_stub(struct mcount_orig_insn *orig)
+{
+	unsigned char stub[DENTRY_STUB_SIZE] = {
+		[8] = 0x3e, 0xff, 0x15, 0xf1, 0xff, 0xff, 0xff,
+	};
+	unsigned long dentry_addr = (unsigned long)__dentry_direct__;
+
+	memcpy(stub, &dentry_addr, sizeof(dentry_addr));
+	memcpy(orig->stub, stub, sizeof(stub));
+}
+
 /*
  * Patch the instruction to the address as given for arguments.
  */
-static void patch_code(struct mcount_dynamic_info *mdi, struct mcount_disasm_info *info)
+static void patch_code(struct mcount_dynamic_info *mdi, struct mcount_disasm_info *info,
+		       struct mcount_orig_insn *orig)
 {
 	void *origin_code_addr;
 	unsigned char call_insn[] = { 0xe8, 0x00, 0x00, 0x00, 0x00 };
-	uint32_t target_addr = get_target_addr(mdi, info->addr);
+	uint32_t target_addr;
 
 	/* patch address */
 	origin_code_addr = (void *)info->addr;
 
-	if (info->has_intel_cet) {
+	if (info->has_intel_cet)
 		origin_code_addr += ENDBR_INSN_SIZE;
-		target_addr = get_target_addr(mdi, info->addr + ENDBR_INSN_SIZE);
+
+	target_addr = get_target_addr(mdi, (unsigned long)origin_code_addr);
+
+	/* call the entry stub directly if it's in reach */
+	if (orig->stub) {
+		long disp = orig->stub + 8 - (origin_code_addr + CALL_INSN_SIZE);
+
+		if (disp == (int32_t)disp)
+			target_addr = disp;
 	}
 
 	/* build the instrumentation instruction */
@@ -463,8 +512,23 @@ static void patch_code(struct mcount_dynamic_info *mdi, struct mcount_disasm_inf
 	__builtin___clear_cache(origin_code_addr, origin_code_addr + info->orig_size);
 }
 
-static int patch_normal_func(struct mcount_dynamic_info *mdi, struct uftrace_symbol *sym,
-			     struct mcount_disasm_engine *disasm)
+/* check the function can be patched, it doesn't change the code */
+static int plan_normal_func(struct mcount_dynamic_info *mdi, struct mcount_disasm_info *info,
+			    struct mcount_disasm_engine *disasm)
+{
+	int state;
+
+	info->addr = mdi->map->start + info->sym->addr;
+
+	state = disasm_check_insns(disasm, mdi, info);
+	if (state != INSTRUMENT_SUCCESS) {
+		pr_dbg3("  >> %s: %s\n", state == INSTRUMENT_FAILED ? "FAIL" : "SKIP",
+			info->sym->name);
+	}
+	return state;
+}
+
+static int patch_planned_func(struct mcount_dynamic_info *mdi, struct mcount_disasm_info *info)
 {
 	uint8_t jmp_insn[15] = {
 		0x3e,
@@ -472,20 +536,11 @@ static int patch_normal_func(struct mcount_dynamic_info *mdi, struct uftrace_sym
 		0x25,
 	};
 	uint64_t jmp_target;
-	struct mcount_disasm_info info = {
-		.sym = sym,
-		.addr = mdi->map->start + sym->addr,
-	};
+	struct mcount_orig_insn *orig;
 	unsigned call_offset = CALL_INSN_SIZE;
-	int state;
 
-	state = disasm_check_insns(disasm, mdi, &info);
-	if (state != INSTRUMENT_SUCCESS) {
-		pr_dbg3("  >> %s: %s\n", state == INSTRUMENT_FAILED ? "FAIL" : "SKIP", sym->name);
-		return state;
-	}
-
-	pr_dbg2("force patch normal func: %s (patch size: %d)\n", sym->name, info.orig_size);
+	pr_dbg2("force patch normal func: %s (patch size: %d)\n", info->sym->name,
+		info->orig_size);
 
 	/*
 	 *  stored origin instruction block:
@@ -497,24 +552,44 @@ static int patch_normal_func(struct mcount_dynamic_info *mdi, struct uftrace_sym
 	 *  | [Return   address] |
 	 *  ----------------------
 	 */
-	jmp_target = info.addr + info.orig_size;
-	if (info.has_intel_cet) {
+	jmp_target = info->addr + info->orig_size;
+	if (info->has_intel_cet) {
 		jmp_target += ENDBR_INSN_SIZE;
 		call_offset += ENDBR_INSN_SIZE;
 	}
 
 	memcpy(jmp_insn + CET_JMP_INSN_SIZE, &jmp_target, sizeof(jmp_target));
 
-	if (info.has_jump)
-		mcount_save_code(&info, call_offset, jmp_insn, 0);
+	info->stub_size = DENTRY_STUB_SIZE;
+
+	if (info->has_jump)
+		orig = mcount_save_code(info, call_offset, jmp_insn, 0);
 	else
-		mcount_save_code(&info, call_offset, jmp_insn, sizeof(jmp_insn));
+		orig = mcount_save_code(info, call_offset, jmp_insn, sizeof(jmp_insn));
+
+	if (orig->stub)
+		write_entry_stub(orig);
 
-	patch_code(mdi, &info);
+	patch_code(mdi, info, orig);
 
 	return INSTRUMENT_SUCCESS;
 }
 
+static int patch_normal_func(struct mcount_dynamic_info *mdi, struct uftrace_symbol *sym,
+			     struct mcount_disasm_engine *disasm)
+{
+	struct mcount_disasm_info info = {
+		.sym = sym,
+	};
+	int state;
+
+	state = plan_normal_func(mdi, &info, disasm);
+	if (state != INSTRUMENT_SUCCESS)
+		return state;
+
+	return patch_planned_func(mdi, &info);
+}
+
 static int unpatch_func(uint8_t *insn, char *name)
 {
 	uint8_t nop5[] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
@@ -576,15 +651,20 @@ static int unpatch_mcount_func(struct mcount_dynamic_info *mdi, struct uftrace_s
 	return INSTRUMENT_SKIPPED;
 }
 
+static bool too_small_func(struct uftrace_symbol *sym, unsigned min_size)
+{
+	if (min_size < CALL_INSN_SIZE + 1)
+		min_size = CALL_INSN_SIZE + 1;
+
+	return sym->size < min_size;
+}
+
 int mcount_patch_func(struct mcount_dynamic_info *mdi, struct uftrace_symbol *sym,
 		      struct mcount_disasm_engine *disasm, unsigned min_size)
 {
 	int result = INSTRUMENT_SKIPPED;
 
-	if (min_size < CALL_INSN_SIZE + 1)
-		min_size = CALL_INSN_SIZE + 1;
-
-	if (sym->size < min_size)
+	if (too_small_func(sym, min_size))
 		return result;
 
 	switch (mdi->type) {
@@ -610,6 +690,40 @@ int mcount_patch_func(struct mcount_dynamic_info *mdi, struct uftrace_symbol *sy
 	return result;
 }
 
+/*
+ * Disassemble the function for the full dynamic patch (DYNAMIC_NONE)
+ * in advance.  This can be called from multiple threads with different
+ * @disasm engines.  Other types are cheap so just leave them to
+ * mcount_patch_planned().
+ */
+int mcount_plan_func(struct mcount_dynamic_info *mdi, struct mcount_disasm_info *info,
+		     struct mcount_disasm_engine *disasm, unsigned min_size)
+{
+	if (mdi->type != DYNAMIC_NONE)
+		return INSTRUMENT_SUCCESS;
+
+	if (too_small_func(info->sym, min_size))
+		return INSTRUMENT_SKIPPED;
+
+	return plan_normal_func(mdi, info, disasm);
+}
+
+int mcount_patch_planned(struct mcount_dynamic_info *mdi, struct mcount_disasm_info *info,
+			 struct mcount_disasm_engine *disasm, unsigned min_size)
+{
+	struct dynamic_bad_symbol *badsym;
+
+	if (mdi->type != DYNAMIC_NONE)
+		return mcount_patch_func(mdi, info->sym, disasm, min_size);
+
+	/* other function can jump into it, which was found after the plan */
+	badsym = mcount_find_badsym(mdi, info->addr);
+	if (badsym != NULL)
+		return INSTRUMENT_FAILED;
+
+	return patch_planned_func(mdi, info);
+}
+
 int mcount_unpatch_func(struct mcount_dynamic_info *mdi, struct uftrace_symbol *sym,
 			struct mcount_disasm_engine *disasm)
 {
@@ -630,6 +744,211 @@ int mcount_unpatch_func(struct mcount_dynamic_info *mdi, struct uftrace_symbol *
 	return result;
 }
 
+extern void mcount(void);
+
+/* check if it's a call to libmcount directly or through a trampoline */
+static bool is_mcount_call(uint8_t *insn)
+{
+	unsigned char trampoline[] = { 0x3e, 0xff, 0x25, 0x01, 0x00, 0x00, 0x00, 0xcc };
+	unsigned char stub[] = { 0x3e, 0xff, 0x15, 0xf1, 0xff, 0xff, 0xff };
+	unsigned long target;
+	int32_t disp;
+
+	if (insn[0] != 0xe8)
+		return false;
+
+	memcpy(&disp, &insn[1], sizeof(disp));
+	target = (unsigned long)insn + CALL_INSN_SIZE + disp;
+
+	if (!memcmp((void *)target, trampoline, sizeof(trampoline)))
+		memcpy(&target, (void *)target + sizeof(trampoline), sizeof(target));
+	else if (!memcmp((void *)target, stub, sizeof(stub)))
+		memcpy(&target, (void *)target - sizeof(target), sizeof(target));
+
+	return target == (unsigned long)__fentry__ || target == (unsigned long)__dentry__ ||
+	       target == (unsigned long)__dentry_direct__ || target == (unsigned long)mcount;
+}
+
+/*
+ * Write the first bytes of the instruction in a single (aligned) store
+ * so that other threads see either the old or the new instruction.
+ */
+static bool write_insn_atomic(uint8_t *insn, void *buf, unsigned len)
+{
+	uint64_t *word = (void *)((unsigned long)insn & ~7UL);
+	unsigned offset = (unsigned long)insn & 7UL;
+	union {
+		uint64_t word;
+		uint8_t bytes[8];
+	} patch;
+
+	if (offset + len > sizeof(patch))
+		return false;
+
+	patch.word = __atomic_load_n(word, __ATOMIC_RELAXED);
+	memcpy(&patch.bytes[offset], buf, len);
+	__atomic_store_n(word, patch.word, __ATOMIC_SEQ_CST);
+
+	__builtin___clear_cache((void *)word, (void *)(word + 1));
+	return true;
+}
+
+/* serialize instruction fetch on all threads like sync_core() in the kernel */
+static void sync_core_all(void)
+{
+	static int cmd = -1;
+
+	if (cmd < 0) {
+		int mask = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+
+		if (mask < 0)
+			cmd = 0;
+		else if ((mask & MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE) &&
+			 syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE,
+				 0) == 0)
+			cmd = MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE;
+		else if (mask & MEMBARRIER_CMD_GLOBAL)
+			cmd = MEMBARRIER_CMD_GLOBAL;
+		else
+			cmd = 0;
+
+		pr_dbg2("use membarrier command %d to sync cores\n", cmd);
+	}
+
+	if (cmd)
+		syscall(__NR_membarrier, cmd, 0);
+}
+
+/* addresses ever patched with int3, a late SIGTRAP might come after patching */
+struct int3_site {
+	struct int3_site *next;
+	unsigned long addr;
+};
+
+static struct int3_site *int3_sites;
+static struct sigaction old_trap_sigact;
+
+static void int3_trap_handler(int sig, siginfo_t *info, void *arg)
+{
+	ucontext_t *uc = arg;
+	unsigned long ip = uc->uc_mcontext.gregs[REG_RIP] - 1;
+	struct int3_site *site;
+
+	if (info->si_code != SI_KERNEL)
+		goto out;
+
+	for (site = __atomic_load_n(&int3_sites, __ATOMIC_ACQUIRE); site; site = site->next) {
+		if (site->addr != ip)
+			continue;
+
+		/* wait for the new instruction and run it again */
+		while (__atomic_load_n((uint8_t *)ip, __ATOMIC_ACQUIRE) == 0xcc)
+			cpu_relax();
+
+		uc->uc_mcontext.gregs[REG_RIP] = ip;
+		return;
+	}
+
+out:
+	/* not ours, pass it to the original handler */
+	if (old_trap_sigact.sa_flags & SA_SIGINFO)
+		old_trap_sigact.sa_sigaction(sig, info, arg);
+	else if (old_trap_sigact.sa_handler == SIG_DFL) {
+		sigaction(sig, &old_trap_sigact, NULL);
+		raise(sig);
+	}
+	else if (old_trap_sigact.sa_handler != SIG_IGN)
+		old_trap_sigact.sa_handler(sig);
+}
+
+static void add_int3_site(unsigned long addr)
+{
+	struct int3_site *site;
+
+	for (site = int3_sites; site; site = site->next) {
+		if (site->addr == addr)
+			return;
+	}
+
+	if (int3_sites == NULL) {
+		struct sigaction sa = {
+			.sa_sigaction = int3_trap_handler,
+			.sa_flags = SA_SIGINFO | SA_RESTART,
+		};
+
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGTRAP, &sa, &old_trap_sigact);
+	}
+
+	site = xmalloc(sizeof(*site));
+	site->addr = addr;
+	site->next = int3_sites;
+	__atomic_store_n(&int3_sites, site, __ATOMIC_RELEASE);
+}
+
+/*
+ * Replace the instruction while other threads might run it.  Use a
+ * single store if possible, otherwise put an int3 at the first byte
+ * and update the rest before the first byte.  Threads hitting the
+ * int3 will wait in the signal handler until it's done.
+ */
+static void write_insn_runtime(uint8_t *insn, uint8_t *buf, unsigned len)
+{
+	uint8_t int3 = 0xcc;
+
+	if (write_insn_atomic(insn, buf, len)) {
+		sync_core_all();
+		return;
+	}
+
+	add_int3_site((unsigned long)insn);
+
+	write_insn_atomic(insn, &int3, 1);
+	sync_core_all();
+
+	memcpy(insn + 1, buf + 1, len - 1);
+	__builtin___clear_cache((void *)insn, (void *)insn + len);
+	sync_core_all();
+
+	write_insn_atomic(insn, buf, 1);
+	sync_core_all();
+}
+
+/*
+ * Unpatch the function while the program is running.  The @addr is the
+ * return address of the call instruction to libmcount.  For functions
+ * patched by instruction rewriting (DYNAMIC_NONE), it restores the
+ * original instructions.  Otherwise the call is replaced by a NOP (or
+ * a short jump over it).  The caller should make the code writable.
+ */
+int mcount_arch_unpatch_runtime(unsigned long addr)
+{
+	uint8_t *insn = (void *)addr - CALL_INSN_SIZE;
+	uint8_t nop5[] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+	uint8_t jmp3[] = { 0xeb, 0x03 };
+	struct mcount_orig_insn *moi;
+
+	if (!is_mcount_call(insn))
+		return INSTRUMENT_SKIPPED;
+
+	moi = mcount_find_insn(addr);
+	if (moi != NULL) {
+		/* the remaining part is not executed until the call is gone */
+		memcpy(insn + CALL_INSN_SIZE, moi->orig + CALL_INSN_SIZE,
+		       moi->orig_size - CALL_INSN_SIZE);
+
+		write_insn_runtime(insn, moi->orig, CALL_INSN_SIZE);
+	}
+	else if (write_insn_atomic(insn, nop5, sizeof(nop5)) ||
+		 write_insn_atomic(insn, jmp3, sizeof(jmp3)))
+		sync_core_all();
+	else
+		write_insn_runtime(insn, nop5, sizeof(nop5));
+
+	pr_dbg2("unpatch %p at runtime\n", insn);
+	return INSTRUMENT_SUCCESS;
+}
+
 static void revert_normal_func(struct mcount_dynamic_info *mdi, struct uftrace_symbol *sym,
 			       struct mcount_disasm_engine *disasm)
 {
@@ -89,6 +89,17 @@ static int x86_reg_index(int capstone_reg)
  * indirect jump to the target.
  *
  */
+/*
+ * The absolute address at @pos of the new instruction is valid only at
+ * the current load address (the patch cache saves it relative to that).
+ * The instruction will be copied at the current copy_size.
+ */
+static void add_insn_reloc(struct mcount_disasm_info *info, int pos)
+{
+	if (info->nr_reloc < MAX_INSN_RELOC)
+		info->reloc[info->nr_reloc++] = info->copy_size + pos;
+}
+
 static int handle_rel_jmp(cs_insn *insn, uint8_t insns[], struct mcount_dynamic_info *mdi,
 			  struct mcount_disasm_info *info)
 {
@@ -124,6 +135,7 @@ static int handle_rel_jmp(cs_insn *insn, uint8_t insns[], struct mcount_dynamic_
 
 		memcpy(insns, relocated_insn, JMP_INSN_SIZE);
 		memcpy(insns + JMP_INSN_SIZE, &target, sizeof(target));
+		add_insn_reloc(info, JMP_INSN_SIZE);
 
 		info->modified = true;
 		/*
@@ -217,6 +229,8 @@ static int handle_call(cs_insn *insn, uint8_t insns[], struct mcount_disasm_info
 	memcpy(&insns[6], jump, sizeof(jump));
 	memcpy(&insns[12], &ret_addr, sizeof(ret_addr));
 	memcpy(&insns[20], &target, sizeof(target));
+	add_insn_reloc(info, 12);
+	add_insn_reloc(info, 20);
 
 	info->modified = true;
 	info->has_jump = true;
@@ -281,6 +295,7 @@ static int handle_lea(cs_insn *insn, uint8_t insns[], struct mcount_disasm_info
 	memcpy(&mov_insns[IMM], &target, sizeof(target));
 
 	memcpy(insns, mov_insns, sizeof(mov_insns));
+	add_insn_reloc(info, IMM);
 	info->modified = true;
 
 	return sizeof(mov_insns);
@@ -366,6 +381,7 @@ static int handle_mov(cs_insn *insn, uint8_t insns[], struct mcount_disasm_info
 		memcpy(&lea_insns[IMM], &target, sizeof(target));
 
 		memcpy(insns, lea_insns, sizeof(lea_insns));
+		add_insn_reloc(info, IMM);
 
 		/* skip REX prefix */
 		insn_size--;
@@ -573,10 +589,8 @@ int disasm_check_insns(struct mcount_disasm_engine *disasm, struct mcount_dynami
 	unsigned long addr = info->addr;
 
 	badsym = mcount_find_badsym(mdi, info->addr);
-	if (badsym != NULL) {
-		badsym->reverted = true;
+	if (badsym != NULL)
 		return INSTRUMENT_FAILED;
-	}
 
 	/*
 	 * some compilers split cold part of the code into a separate function
@@ -690,6 +704,8 @@ TEST_CASE(dynamic_x86_handle_lea)
 	pr_dbg("handling LEA instruction\n");
 	new_size = handle_pic(insn, new_insns, &info);
 	TEST_EQ(new_size, 10);
+	TEST_EQ(info.nr_reloc, 1);
+	TEST_EQ(info.reloc[0], 2);
 
 	cs_free(insn, count);
 
@@ -758,6 +774,9 @@ TEST_CASE(dynamic_x86_handle_call)
 	pr_dbg("handling CALL instruction\n");
 	new_size = handle_call(insn, new_insns, &info);
 	TEST_EQ(new_size, 28);
+	TEST_EQ(info.nr_reloc, 2);
+	TEST_EQ(info.reloc[0], 12);
+	TEST_EQ(info.reloc[1], 20);
 
 	cs_free(insn, count);
 
@@ -8,6 +8,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <sys/resource.h>
@@ -35,6 +36,8 @@ struct fill_handler_arg {
 	struct uftrace_opts *opts;
 	struct rusage *rusage;
 	char *elapsed_time;
+	struct uftrace_clock_info *clock;
+	char *buf_backing;
 	char buf[PATH_MAX];
 };
 
@@ -848,13 +851,78 @@ static int read_uftrace_version(void *arg)
 	return 0;
 }
 
+static int fill_clock_info(void *arg)
+{
+	struct fill_handler_arg *fha = arg;
+	struct uftrace_clock_info *clock = fha->clock;
+
+	/* it's only needed to convert TSC timestamps */
+	if (clock == NULL)
+		return -1;
+
+	return dprintf(fha->fd, "clockinfo:tsc freq=%" PRIu64 " tsc=%" PRIu64 " mono=%" PRIu64 "\n",
+		       clock->freq, clock->tsc, clock->mono);
+}
+
+static int read_clock_info(void *arg)
+{
+	struct read_handler_arg *rha = arg;
+	struct uftrace_data *handle = rha->handle;
+	struct uftrace_clock_info *clock = &handle->info.clock;
+	char *buf = rha->buf;
+
+	if (fgets(buf, sizeof(rha->buf), handle->fp) == NULL)
+		return -1;
+
+	if (strncmp(buf, "clockinfo:tsc ", 14))
+		return -1;
+
+	if (sscanf(&buf[14], "freq=%" SCNu64 " tsc=%" SCNu64 " mono=%" SCNu64, &clock->freq,
+		   &clock->tsc, &clock->mono) != 3)
+		return -1;
+
+	if (clock->freq == 0)
+		return -1;
+
+	return 0;
+}
+
+static int fill_buf_info(void *arg)
+{
+	struct fill_handler_arg *fha = arg;
+
+	/* only saved when --hugepage is used */
+	if (fha->buf_backing == NULL)
+		return -1;
+
+	return dprintf(fha->fd, "bufinfo:%s\n", fha->buf_backing);
+}
+
+static int read_buf_info(void *arg)
+{
+	struct read_handler_arg *rha = arg;
+	struct uftrace_data *handle = rha->handle;
+	char *buf = rha->buf;
+
+	if (fgets(buf, sizeof(rha->buf), handle->fp) == NULL)
+		return -1;
+
+	if (strncmp(buf, "bufinfo:", 8))
+		return -1;
+
+	handle->info.buf_backing = copy_info_str(&buf[8]);
+
+	return 0;
+}
+
 struct uftrace_info_handler {
 	enum uftrace_info_bits bit;
 	int (*handler)(void *arg);
 };
 
 void fill_uftrace_info(uint64_t *info_mask, int fd, struct uftrace_opts *opts, int status,
-		       struct rusage *rusage, char *elapsed_time)
+		       struct rusage *rusage, char *elapsed_time, struct uftrace_clock_info *clock,
+		       char *buf_backing)
 {
 	size_t i;
 	off_t offset;
@@ -864,6 +932,8 @@ void fill_uftrace_info(uint64_t *info_mask, int fd, struct uftrace_opts *opts, i
 		.exit_status = status,
 		.rusage = rusage,
 		.elapsed_time = elapsed_time,
+		.clock = clock,
+		.buf_backing = buf_backing,
 	};
 	struct uftrace_info_handler fill_handlers[] = {
 		{ EXE_NAME, fill_exe_name },
@@ -880,6 +950,8 @@ void fill_uftrace_info(uint64_t *info_mask, int fd, struct uftrace_opts *opts, i
 		{ RECORD_DATE, fill_record_date },
 		{ PATTERN_TYPE, fill_pattern_type },
 		{ VERSION, fill_uftrace_version },
+		{ CLOCKINFO, fill_clock_info },
+		{ BUFINFO, fill_buf_info },
 	};
 
 	for (i = 0; i < ARRAY_SIZE(fill_handlers); i++) {
@@ -923,6 +995,8 @@ int read_uftrace_info(uint64_t info_mask, struct uftrace_data *handle)
 		{ RECORD_DATE, read_record_date },
 		{ PATTERN_TYPE, read_pattern_type },
 		{ VERSION, read_uftrace_version },
+		{ CLOCKINFO, read_clock_info },
+		{ BUFINFO, read_buf_info },
 	};
 
 	memset(&handle->info, 0, sizeof(handle->info));
@@ -953,6 +1027,7 @@ void clear_uftrace_info(struct uftrace_info *info)
 	free(info->record_date);
 	free(info->elapsed_time);
 	free(info->uftrace_version);
+	free(info->buf_backing);
 	free(info->retspec);
 	free(info->autoarg);
 	free(info->autoret);
@@ -1008,6 +1083,13 @@ void process_uftrace_info(struct uftrace_data *handle, struct uftrace_opts *opts
 	if (info_mask & MEMINFO)
 		process(data, fmt, "memory info", info->meminfo);
 
+	if (info_mask & CLOCKINFO)
+		process(data, "# %-20s: tsc (%.3f MHz)\n", "clock source",
+			info->clock.freq / 1000000.0);
+
+	if (info_mask & BUFINFO)
+		process(data, fmt, "buffer backing", info->buf_backing);
+
 	if (info_mask & LOADINFO)
 		process(data, "# %-20s: %.02f / %.02f / %.02f (1 / 5 / 15 min)\n", "system load",
 			info->load1, info->load5, info->load15);
@@ -1206,6 +1288,193 @@ static void print_task_info(struct uftrace_data *handle)
 	}
 }
 
+/* should be in sync with libmcount/internal.h::enum mcount_overhead_class */
+enum overhead_class {
+	OVERHEAD_ENTRY,
+	OVERHEAD_EXIT,
+	OVERHEAD_PLTHOOK,
+	OVERHEAD_MAX,
+};
+
+static const char *overhead_class_name[] = { "entry", "exit", "plthook" };
+
+struct overhead_info {
+	int tid;
+	uint64_t elapsed; /* nsec */
+	uint64_t ticks; /* elapsed ticks */
+	uint64_t count[OVERHEAD_MAX];
+	uint64_t time[OVERHEAD_MAX]; /* nsec */
+	uint64_t nr_switch;
+	uint64_t nr_alloc;
+	uint64_t nr_lost;
+	uint64_t bytes;
+};
+
+static int cmp_overhead_info(const void *a, const void *b)
+{
+	const struct overhead_info *oa = a;
+	const struct overhead_info *ob = b;
+
+	return oa->tid - ob->tid;
+}
+
+/* convert the ticks in the hooks to nsec using the ratio of the elapsed time */
+static uint64_t overhead_tick_to_nsec(uint64_t tick, uint64_t ticks, uint64_t elapsed)
+{
+	if (ticks == 0)
+		return 0;
+	return (double)tick * elapsed / ticks;
+}
+
+static int read_overhead_file(char *dirname, struct overhead_info **pinfo)
+{
+	FILE *fp;
+	char *fname = NULL;
+	char *line = NULL;
+	size_t sz = 0;
+	struct overhead_info *info = NULL;
+	struct overhead_info oi;
+	uint64_t ticks[OVERHEAD_MAX];
+	int nr = 0;
+	int i, k;
+
+	xasprintf(&fname, "%s/%s", dirname, "overhead.txt");
+
+	fp = fopen(fname, "r");
+	if (fp == NULL) {
+		free(fname);
+		return -1;
+	}
+
+	pr_dbg("reading %s file\n", fname);
+	while (getline(&line, &sz, fp) >= 0) {
+		if (strncmp(line, "OVERHEAD ", 9))
+			continue;
+
+		memset(&oi, 0, sizeof(oi));
+		if (sscanf(line + 9,
+			   "tid=%d elapsed=%" SCNu64 " ticks=%" SCNu64 " entry=%" SCNu64 ",%" SCNu64
+			   " exit=%" SCNu64 ",%" SCNu64 " plthook=%" SCNu64 ",%" SCNu64
+			   " switch=%" SCNu64 " alloc=%" SCNu64 " lost=%" SCNu64 " bytes=%" SCNu64,
+			   &oi.tid, &oi.elapsed, &oi.ticks, &oi.count[OVERHEAD_ENTRY],
+			   &ticks[OVERHEAD_ENTRY], &oi.count[OVERHEAD_EXIT], &ticks[OVERHEAD_EXIT],
+			   &oi.count[OVERHEAD_PLTHOOK], &ticks[OVERHEAD_PLTHOOK], &oi.nr_switch,
+			   &oi.nr_alloc, &oi.nr_lost, &oi.bytes) != 13)
+			continue;
+
+		for (k = 0; k < OVERHEAD_MAX; k++)
+			oi.time[k] = overhead_tick_to_nsec(ticks[k], oi.ticks, oi.elapsed);
+
+		/* a task can flush multiple times (e.g. before exec) */
+		for (i = 0; i < nr; i++) {
+			if (info[i].tid == oi.tid)
+				break;
+		}
+
+		if (i == nr) {
+			info = xrealloc(info, (nr + 1) * sizeof(*info));
+			info[nr++] = oi;
+			continue;
+		}
+
+		info[i].elapsed += oi.elapsed;
+		for (k = 0; k < OVERHEAD_MAX; k++) {
+			info[i].count[k] += oi.count[k];
+			info[i].time[k] += oi.time[k];
+		}
+		info[i].nr_switch += oi.nr_switch;
+		info[i].nr_alloc += oi.nr_alloc;
+		info[i].nr_lost += oi.nr_lost;
+		info[i].bytes += oi.bytes;
+	}
+
+	qsort(info, nr, sizeof(*info), cmp_overhead_info);
+	*pinfo = info;
+
+	free(line);
+	fclose(fp);
+	free(fname);
+	return nr;
+}
+
+static void print_overhead_ratio(uint64_t part, uint64_t total)
+{
+	pr_out("  %6.2f%%", total ? 100.0 * part / total : 0.0);
+}
+
+static void print_overhead_info(struct uftrace_opts *opts)
+{
+	struct overhead_info *info = NULL;
+	struct overhead_info total = {
+		.tid = 0,
+	};
+	uint64_t time;
+	int nr;
+	int i, k;
+
+	nr = read_overhead_file(opts->dirname, &info);
+	if (nr < 0) {
+		pr_out("uftrace: no overhead data in %s (record with --overhead)\n", opts->dirname);
+		return;
+	}
+
+	pr_out("# recorder overhead per task\n");
+	pr_out("# ==========================\n");
+	pr_out("#   TID       Elapsed    Overhead    Ratio       Hooks  Switches  Allocs   Lost   Written\n");
+
+	for (i = 0; i < nr; i++) {
+		struct overhead_info *oi = &info[i];
+
+		time = 0;
+		for (k = 0; k < OVERHEAD_MAX; k++) {
+			time += oi->time[k];
+			total.count[k] += oi->count[k];
+			total.time[k] += oi->time[k];
+		}
+		total.elapsed += oi->elapsed;
+		total.nr_switch += oi->nr_switch;
+		total.nr_alloc += oi->nr_alloc;
+		total.nr_lost += oi->nr_lost;
+		total.bytes += oi->bytes;
+
+		pr_out("  %6d  ", oi->tid);
+		print_time_unit(oi->elapsed);
+		pr_out("  ");
+		print_time_unit(time);
+		print_overhead_ratio(time, oi->elapsed);
+		pr_out("  %10" PRIu64 "  %8" PRIu64 "  %6" PRIu64 "  %5" PRIu64 "  %5" PRIu64 " KB\n",
+		       oi->count[OVERHEAD_ENTRY] + oi->count[OVERHEAD_EXIT] +
+			       oi->count[OVERHEAD_PLTHOOK],
+		       oi->nr_switch, oi->nr_alloc, oi->nr_lost, oi->bytes / 1024);
+	}
+
+	time = 0;
+	for (k = 0; k < OVERHEAD_MAX; k++)
+		time += total.time[k];
+
+	pr_out("\n# recorder overhead per hook\n");
+	pr_out("# ==========================\n");
+	pr_out("#  Hook           Calls    Overhead    Avg/call    Ratio\n");
+
+	for (k = 0; k < OVERHEAD_MAX; k++) {
+		pr_out("  %-8s  %10" PRIu64 "  ", overhead_class_name[k], total.count[k]);
+		print_time_unit(total.time[k]);
+		pr_out("  ");
+		print_time_unit(total.count[k] ? total.time[k] / total.count[k] : 0);
+		print_overhead_ratio(total.time[k], time);
+		pr_out("\n");
+	}
+
+	pr_out("\n# total: ");
+	print_time_unit(time);
+	pr_out(" in %d task(s) (%.2f%% of task time), %" PRIu64 " buffer switches, %" PRIu64
+	       " allocations, %" PRIu64 " lost records\n",
+	       nr, total.elapsed ? 100.0 * time / total.elapsed : 0.0, total.nr_switch,
+	       total.nr_alloc, total.nr_lost);
+
+	free(info);
+}
+
 int command_info(int argc, char *argv[], struct uftrace_opts *opts)
 {
 	int ret;
@@ -1244,6 +1513,11 @@ int command_info(int argc, char *argv[], struct uftrace_opts *opts)
 		goto out;
 	}
 
+	if (opts->overhead) {
+		print_overhead_info(opts);
+		goto out;
+	}
+
 	fstack_setup_task(opts->tid, &handle);
 	if (opts->show_task) {
 		/* ignore errors */
@@ -8,6 +8,7 @@
 
 #include "libmcount/mcount.h"
 #include "uftrace.h"
+#include "utils/filter.h"
 #include "utils/fstack.h"
 #include "utils/kernel.h"
 #include "utils/socket.h"
@@ -98,7 +99,21 @@ static void setup_child_environ(struct uftrace_opts *opts)
 }
 
 /* Forward all client options to the agent */
-static int forward_options(struct uftrace_opts *opts)
+static int forward_filter_string(int sfd, enum uftrace_dopt opt, char *str)
+{
+	char *user_str = uftrace_clear_kernel(str);
+	int ret;
+
+	/* filters on kernel functions cannot be changed at runtime */
+	if (user_str == NULL)
+		return 0;
+
+	ret = socket_send_string(sfd, opt, user_str);
+	free(user_str);
+	return ret;
+}
+
+int forward_options(struct uftrace_opts *opts)
 {
 	int sfd;
 	struct sockaddr_un addr;
@@ -113,6 +128,42 @@ static int forward_options(struct uftrace_opts *opts)
 		goto socket_error;
 	}
 
+	if (opts->snapshot && socket_send_option(sfd, UFTRACE_DOPT_SNAPSHOT, NULL, 0) == -1) {
+		pr_warn("cannot request flight recorder snapshot\n");
+		ret = -1;
+	}
+
+	if (opts->trace != TRACE_STATE_NONE) {
+		bool enable = opts->trace == TRACE_STATE_ON;
+
+		if (socket_send_option(sfd, UFTRACE_DOPT_TRACE, &enable, sizeof(enable)) == -1) {
+			pr_warn("cannot change the trace state\n");
+			ret = -1;
+		}
+	}
+
+	if (opts->filter && forward_filter_string(sfd, UFTRACE_DOPT_FILTER, opts->filter) == -1) {
+		pr_warn("cannot change the filters\n");
+		ret = -1;
+	}
+
+	if (opts->trigger && forward_filter_string(sfd, UFTRACE_DOPT_TRIGGER, opts->trigger) == -1) {
+		pr_warn("cannot change the triggers\n");
+		ret = -1;
+	}
+
+	if (opts->depth != OPT_DEPTH_DEFAULT &&
+	    socket_send_option(sfd, UFTRACE_DOPT_DEPTH, &opts->depth, sizeof(opts->depth)) == -1) {
+		pr_warn("cannot change the depth\n");
+		ret = -1;
+	}
+
+	if (opts->threshold && socket_send_option(sfd, UFTRACE_DOPT_THRESHOLD, &opts->threshold,
+						  sizeof(opts->threshold)) == -1) {
+		pr_warn("cannot change the time filter\n");
+		ret = -1;
+	}
+
 	if (socket_send_option(sfd, UFTRACE_DOPT_CLOSE, NULL, 0) == -1) {
 		pr_warn("cannot terminate agent connection\n");
 		ret = -1;
@@ -191,6 +242,14 @@ int command_live(int argc, char *argv[], struct uftrace_opts *opts)
 			start_pager(setup_pager());
 
 		pr_dbg("live-record finished.. \n");
+		if (opts->aggregate) {
+			/* there's no record to replay, show the summary only */
+			ret2 = command_report(argc, argv, opts);
+			if (ret == UFTRACE_EXIT_SUCCESS)
+				ret = ret2;
+			goto out;
+		}
+
 		if (opts->report) {
 			pr_out("#\n# uftrace report\n#\n");
 			ret2 = command_report(argc, argv, opts);
@@ -206,6 +265,7 @@ int command_live(int argc, char *argv[], struct uftrace_opts *opts)
 			ret = ret2;
 	}
 
+out:
 	cleanup_tempdir();
 
 	return ret;
@@ -15,7 +15,10 @@
 #include <sys/mman.h>
 #include <sys/personality.h>
 #include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -41,27 +44,66 @@ struct shmem_list {
 static LIST_HEAD(shmem_list_head);
 static LIST_HEAD(shmem_need_unlink);
 
+/* shmem buffer passed by fd from libmcount (--hugepage) */
+struct shmem_fd {
+	struct list_head list;
+	char id[SHMEM_NAME_SIZE];
+	int fd;
+	int tid;
+	/* number of write buffers not written yet */
+	int refcnt;
+	/* replaced by a new buffer or the task exited */
+	bool stale;
+	/* mapped once and kept until it's released */
+	void *map;
+};
+
+static LIST_HEAD(shmem_fd_list);
+static pthread_mutex_t shmem_fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static int shmem_fd_sock = -1;
+static int shmem_backing[SHMEM_BACKING_MAX];
+
 struct buf_list {
 	struct list_head list;
+	/* link in a (lock-free) buf queue */
+	struct buf_list *next;
 	int tid;
 	void *shmem_buf;
+	struct shmem_fd *sfd;
 };
 
-static LIST_HEAD(buf_free_list);
-static LIST_HEAD(buf_write_list);
-
-/* currently active writers */
-static LIST_HEAD(writer_list);
+/* writers return bufs here, only the main thread takes them out */
+static struct buf_list *buf_free_queue;
+/* bufs taken from the free queue, used by the main thread only */
+static struct buf_list *buf_free_cache;
 
-static pthread_mutex_t free_list_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t write_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static bool buf_done;
-static int thread_ctl[2];
 
 static bool has_perf_event;
 static bool has_sched_event;
 static bool finish_received;
 
+/* TSC timestamps are converted by the reader using the calibration */
+static bool use_tsc_clock;
+static struct uftrace_clock_info tsc_clock;
+
+static bool use_ring_buffer;
+static bool use_flight_recorder;
+
+/* buffers and rings of a task are written by the writer (tid % nr_thread) */
+static struct writer_arg **writer_args;
+static int nr_writer_args;
+
+#define RING_POLL_MSEC 1
+
+struct ring_list {
+	struct list_head list;
+	struct mcount_shmem_ring *ring;
+	int tid;
+	int fd;
+	bool done;
+};
+
 static bool can_use_fast_libmcount(struct uftrace_opts *opts)
 {
 	if (debug)
@@ -217,6 +259,20 @@ static void setup_child_environ(struct uftrace_opts *opts, int argc, char *argv[
 			snprintf(buf, sizeof(buf), "%d", opts->size_filter);
 			setenv("UFTRACE_PATCH_SIZE", buf, 1);
 		}
+
+		if (opts->patch_jobs) {
+			snprintf(buf, sizeof(buf), "%d", opts->patch_jobs);
+			setenv("UFTRACE_PATCH_JOBS", buf, 1);
+		}
+
+		if (opts->no_patch_cache)
+			setenv("UFTRACE_NO_PATCH_CACHE", "1", 1);
+
+		if (opts->unpatch_rate) {
+			snprintf(buf, sizeof(buf), "%lu,%" PRIu64, opts->unpatch_rate,
+				 opts->unpatch_time);
+			setenv("UFTRACE_AUTO_UNPATCH", buf, 1);
+		}
 	}
 
 	if (opts->event) {
@@ -275,6 +331,31 @@ static void setup_child_environ(struct uftrace_opts *opts, int argc, char *argv[
 		setenv("UFTRACE_BUFFER", buf, 1);
 	}
 
+	if (opts->ring_buffer)
+		setenv("UFTRACE_RING_BUFFER", "1", 1);
+
+	if (opts->compact_record)
+		setenv("UFTRACE_COMPACT_RECORD", "1", 1);
+
+	if (opts->hugepage)
+		setenv("UFTRACE_HUGEPAGE", "1", 1);
+
+	if (opts->aggregate)
+		setenv("UFTRACE_AGGREGATE", "1", 1);
+
+	if (opts->overhead)
+		setenv("UFTRACE_OVERHEAD", "1", 1);
+
+	if (opts->flight_recorder) {
+		snprintf(buf, sizeof(buf), "%lu", opts->flight_recorder);
+		setenv("UFTRACE_FLIGHT_RECORDER", buf, 1);
+	}
+
+	if (opts->buffer_pool) {
+		snprintf(buf, sizeof(buf), "%d", opts->buffer_pool);
+		setenv("UFTRACE_BUFFER_POOL", buf, 1);
+	}
+
 	if (opts->logfile) {
 		snprintf(buf, sizeof(buf), "%d", fileno(logfp));
 		setenv("UFTRACE_LOGFD", buf, 1);
@@ -320,6 +401,12 @@ static void setup_child_environ(struct uftrace_opts *opts, int argc, char *argv[
 	if (opts->clock)
 		setenv("UFTRACE_CLOCK", opts->clock, 1);
 
+	if (use_tsc_clock) {
+		snprintf(buf, sizeof(buf), "%" PRIu64 ",%" PRIu64 ",%" PRIu64, tsc_clock.freq,
+			 tsc_clock.tsc, tsc_clock.mono);
+		setenv("UFTRACE_TSC_CLOCK", buf, 1);
+	}
+
 	if (opts->with_syms)
 		setenv("UFTRACE_SYMBOL_DIR", opts->with_syms, 1);
 
@@ -403,6 +490,12 @@ static uint64_t calc_feat_mask(struct uftrace_opts *opts)
 	if (opts->estimate_return)
 		features |= ESTIMATE_RETURN;
 
+	if (opts->compact_record)
+		features |= COMPACT_RECORD;
+
+	if (opts->aggregate)
+		features |= AGGREGATE;
+
 	xasprintf(&buf, "%s/*.dbg", opts->dirname);
 	if (glob(buf, GLOB_NOSORT, NULL, &g) != GLOB_NOMATCH)
 		features |= DEBUG_INFO;
@@ -414,7 +507,7 @@ static uint64_t calc_feat_mask(struct uftrace_opts *opts)
 }
 
 int fill_file_header(struct uftrace_opts *opts, int status, struct rusage *rusage,
-		     char *elapsed_time)
+		     char *elapsed_time, struct uftrace_clock_info *clock, char *buf_backing)
 {
 	int fd, efd;
 	int ret = -1;
@@ -437,7 +530,7 @@ int fill_file_header(struct uftrace_opts *opts, int status, struct rusage *rusag
 		goto close_efd;
 
 	strncpy(hdr.magic, UFTRACE_MAGIC_STR, UFTRACE_MAGIC_LEN);
-	hdr.version = UFTRACE_FILE_VERSION;
+	hdr.version = opts->compact_record ? UFTRACE_FILE_VERSION_MAX : UFTRACE_FILE_VERSION;
 	hdr.header_size = sizeof(hdr);
 	hdr.endian = elf_ident[EI_DATA];
 	hdr.elf_class = elf_ident[EI_CLASS];
@@ -450,7 +543,8 @@ int fill_file_header(struct uftrace_opts *opts, int status, struct rusage *rusag
 	if (write(fd, &hdr, sizeof(hdr)) != (int)sizeof(hdr))
 		pr_err("writing header info failed");
 
-	fill_uftrace_info(&hdr.info_mask, fd, opts, status, rusage, elapsed_time);
+	fill_uftrace_info(&hdr.info_mask, fd, opts, status, rusage, elapsed_time, clock,
+			  buf_backing);
 
 try_write:
 	ret = pwrite(fd, &hdr, sizeof(hdr), 0);
@@ -507,6 +601,246 @@ static char *make_disk_name(const char *dirname, int tid)
 	return filename;
 }
 
+static void setup_shmem_fd_channel(const char *dirname)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	struct rlimit rlim;
+	int sock;
+
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", dirname, SHMEM_FD_CHANNEL) >=
+	    (int)sizeof(addr.sun_path)) {
+		pr_warn("directory name is too long, huge pages are not used\n");
+		return;
+	}
+
+	sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		pr_err("cannot create buffer channel");
+
+	unlink(addr.sun_path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		pr_warn("cannot bind buffer channel, huge pages are not used: %m\n");
+		close(sock);
+		return;
+	}
+
+	/* it keeps fds of all active buffers */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rlim) < 0)
+			pr_dbg("cannot raise open file limit: %m\n");
+	}
+
+	shmem_fd_sock = sock;
+}
+
+static void free_shmem_fd(struct shmem_fd *sfd, size_t bufsize)
+{
+	if (sfd->map)
+		munmap(sfd->map, bufsize);
+	close(sfd->fd);
+	free(sfd);
+}
+
+/* should be called with shmem_fd_lock held */
+static void release_shmem_fd(struct shmem_fd *sfd, size_t bufsize)
+{
+	list_del(&sfd->list);
+	sfd->stale = true;
+
+	/* otherwise, writer will free it after writing the buffer */
+	if (sfd->refcnt == 0)
+		free_shmem_fd(sfd, bufsize);
+}
+
+static struct shmem_fd *find_shmem_fd(char *sess_id)
+{
+	struct shmem_fd *sfd;
+
+	list_for_each_entry(sfd, &shmem_fd_list, list) {
+		if (!strcmp(sfd->id, sess_id))
+			return sfd;
+	}
+	return NULL;
+}
+
+static void add_shmem_fd(struct mcount_shmem_fd_msg *fdmsg, int fd, size_t bufsize)
+{
+	struct shmem_fd *sfd;
+
+	fdmsg->name[sizeof(fdmsg->name) - 1] = '\0';
+	if (strlen(fdmsg->name) >= SHMEM_NAME_SIZE || fdmsg->backing < 0 ||
+	    fdmsg->backing >= SHMEM_BACKING_MAX) {
+		pr_dbg("invalid shmem buffer fd message\n");
+		close(fd);
+		return;
+	}
+
+	pr_dbg2("MSG  FD  : %s (backing: %d)\n", fdmsg->name, fdmsg->backing);
+
+	/* libmcount can allocate a buffer with the same name again */
+	pthread_mutex_lock(&shmem_fd_lock);
+	sfd = find_shmem_fd(fdmsg->name);
+	if (sfd)
+		release_shmem_fd(sfd, bufsize);
+	pthread_mutex_unlock(&shmem_fd_lock);
+
+	sfd = xzalloc(sizeof(*sfd));
+	strcpy(sfd->id, fdmsg->name);
+	sfd->fd = fd;
+	parse_msg_id(sfd->id, NULL, &sfd->tid, NULL);
+
+	pthread_mutex_lock(&shmem_fd_lock);
+	list_add_tail(&sfd->list, &shmem_fd_list);
+	pthread_mutex_unlock(&shmem_fd_lock);
+
+	shmem_backing[fdmsg->backing]++;
+}
+
+static void recv_shmem_fd(size_t bufsize)
+{
+	struct mcount_shmem_fd_msg fdmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {
+		.iov_base = &fdmsg,
+		.iov_len = sizeof(fdmsg),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	struct cmsghdr *cmsg;
+	ssize_t len;
+	int fd;
+
+	if (shmem_fd_sock < 0)
+		return;
+
+	while (true) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		len = recvmsg(shmem_fd_sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				pr_dbg("receiving buffer fd failed: %m\n");
+			break;
+		}
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS) {
+			/* it fails to get the fd if it reached the open file limit */
+			pr_dbg("no fd in the message (truncated: %d)\n",
+			       !!(msg.msg_flags & MSG_CTRUNC));
+			continue;
+		}
+
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+		if (len != (ssize_t)sizeof(fdmsg)) {
+			pr_dbg("invalid shmem buffer fd message\n");
+			close(fd);
+			continue;
+		}
+
+		add_shmem_fd(&fdmsg, fd, bufsize);
+	}
+}
+
+static void release_task_shmem_fd(int tid, size_t bufsize)
+{
+	struct shmem_fd *sfd, *tmp;
+
+	pthread_mutex_lock(&shmem_fd_lock);
+	list_for_each_entry_safe(sfd, tmp, &shmem_fd_list, list) {
+		if (sfd->tid == tid)
+			release_shmem_fd(sfd, bufsize);
+	}
+	pthread_mutex_unlock(&shmem_fd_lock);
+}
+
+static void finish_shmem_fd_channel(const char *dirname, size_t bufsize)
+{
+	struct shmem_fd *sfd, *tmp;
+	char *channel = NULL;
+
+	if (shmem_fd_sock < 0)
+		return;
+
+	/* called after all writers gone, no lock is needed */
+	list_for_each_entry_safe(sfd, tmp, &shmem_fd_list, list) {
+		list_del(&sfd->list);
+		free_shmem_fd(sfd, bufsize);
+	}
+
+	close(shmem_fd_sock);
+	shmem_fd_sock = -1;
+
+	xasprintf(&channel, "%s/%s", dirname, SHMEM_FD_CHANNEL);
+	unlink(channel);
+	free(channel);
+}
+
+/* release the shmem buffer after writing the contents */
+static void put_shmem_buffer(struct buf_list *buf, size_t bufsize)
+{
+	struct shmem_fd *sfd = buf->sfd;
+
+	if (sfd == NULL) {
+		munmap(buf->shmem_buf, bufsize);
+		buf->shmem_buf = NULL;
+		return;
+	}
+
+	pthread_mutex_lock(&shmem_fd_lock);
+	if (--sfd->refcnt == 0 && sfd->stale)
+		free_shmem_fd(sfd, bufsize);
+	pthread_mutex_unlock(&shmem_fd_lock);
+
+	buf->shmem_buf = NULL;
+	buf->sfd = NULL;
+}
+
+static char *get_shmem_backing_info(size_t bufsize)
+{
+	static const char *const backing_name[] = {
+		[SHMEM_BACKING_SHM] = "shm",
+		[SHMEM_BACKING_MEMFD] = "memfd",
+		[SHMEM_BACKING_HUGEPAGE] = "hugepage",
+	};
+	char *info = NULL;
+	char *tmp;
+	int i;
+
+	if (shmem_fd_sock < 0)
+		return NULL;
+
+	for (i = SHMEM_BACKING_MAX - 1; i >= 0; i--) {
+		if (shmem_backing[i] == 0)
+			continue;
+
+		tmp = info;
+		xasprintf(&info, "%s%s%s x %d", tmp ?: "", tmp ? ", " : "", backing_name[i],
+			  shmem_backing[i]);
+		free(tmp);
+	}
+
+	/* no buffer was passed by fd */
+	if (info == NULL)
+		info = xstrdup(backing_name[SHMEM_BACKING_SHM]);
+
+	tmp = info;
+	xasprintf(&info, "%s (%zu KB buffer)", tmp, bufsize / KB);
+	free(tmp);
+
+	return info;
+}
+
 static void write_buffer_file(const char *dirname, struct buf_list *buf)
 {
 	int fd;
@@ -538,27 +872,364 @@ static void write_buffer(struct buf_list *buf, struct uftrace_opts *opts, int so
 }
 
 struct writer_arg {
-	struct list_head list;
-	struct list_head bufs;
+	/* bufs to write (in reverse order) */
+	struct buf_list *queue;
+	/* eventfd to wake up the writer */
+	int efd;
+	struct list_head rings;
+	pthread_mutex_t ring_lock;
 	struct uftrace_opts *opts;
 	struct uftrace_kernel_writer *kern;
 	struct uftrace_perf_writer *perf;
+	/* cached fds of data files (in LRU order) */
+	struct list_head fds;
+	int nr_fds;
+	/* pipe for --splice (vmsplice + splice) */
+	int pipe[2];
+	bool no_splice;
+	uint64_t write_bytes;
+	uint64_t write_nsec;
 	int sock;
 	int idx;
-	int tid;
 	int nr_cpu;
 	int cpus[];
 };
 
+static struct writer_arg *get_tid_writer(int tid)
+{
+	return writer_args[tid % nr_writer_args];
+}
+
+/*
+ * Push the buf to a lock-free queue (a LIFO stack actually).  The
+ * consumer takes all bufs at once so it's free from the ABA problem.
+ * Returns true if the queue was empty.
+ */
+static bool push_buf_queue(struct buf_list **queue, struct buf_list *buf)
+{
+	struct buf_list *old = __atomic_load_n(queue, __ATOMIC_RELAXED);
+
+	do {
+		buf->next = old;
+	} while (!__atomic_compare_exchange_n(queue, &old, buf, true, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	return old == NULL;
+}
+
+/* take all bufs in the queue and add them to the list in the pushed order */
+static bool take_buf_queue(struct buf_list **queue, struct list_head *head)
+{
+	struct buf_list *buf = __atomic_exchange_n(queue, NULL, __ATOMIC_ACQUIRE);
+	LIST_HEAD(tmp);
+
+	if (buf == NULL)
+		return false;
+
+	while (buf) {
+		list_add(&buf->list, &tmp);
+		buf = buf->next;
+	}
+	list_splice_tail(&tmp, head);
+	return true;
+}
+
+static void wakeup_writer(struct writer_arg *warg)
+{
+	uint64_t kick = 1;
+
+	if (write(warg->efd, &kick, sizeof(kick)) < 0 && !buf_done)
+		pr_err("waking up writer failed");
+}
+
+/* max number of buffers (and bytes) written at once */
+#define WRITER_IOV_MAX 64
+#define WRITER_BATCH_SIZE (64 * 1024 * KB)
+
+/* max number of cached fds in a writer */
+#define WRITER_FD_MAX 1024
+
+struct writer_fd {
+	struct list_head list;
+	int tid;
+	int fd;
+};
+
+static int writer_fd_max = WRITER_FD_MAX;
+
+static void setup_writer_fd_max(int nr_writers)
+{
+	struct rlimit rlim;
+	rlim_t avail;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0 || rlim.rlim_cur == RLIM_INFINITY)
+		return;
+
+	/* leave a half for other files (shmem buffers, perf events and so on) */
+	avail = rlim.rlim_cur / 2 / nr_writers;
+	if (avail < WRITER_FD_MAX)
+		writer_fd_max = avail ?: 1;
+
+	pr_dbg2("cache %d fds per writer\n", writer_fd_max);
+}
+
+static int open_disk_file(const char *filename, struct uftrace_opts *opts)
+{
+	int flags = O_WRONLY | O_CREAT | O_APPEND;
+
+	/* splice() and sendfile() fail with O_APPEND, seek to the end before writing */
+	if (opts->splice)
+		flags &= ~O_APPEND;
+
+	return open(filename, flags, 0644);
+}
+
+static int seek_disk_file(int fd, struct uftrace_opts *opts)
+{
+	/* other writer might append data using a different fd */
+	if (opts->splice && lseek(fd, 0, SEEK_END) < 0)
+		pr_err("seek disk file");
+
+	return fd;
+}
+
+static int get_writer_fd(struct writer_arg *warg, int tid)
+{
+	struct writer_fd *wfd;
+	char *filename;
+	int fd;
+
+	list_for_each_entry(wfd, &warg->fds, list) {
+		if (wfd->tid == tid) {
+			list_move(&wfd->list, &warg->fds);
+			return seek_disk_file(wfd->fd, warg->opts);
+		}
+	}
+
+	filename = make_disk_name(warg->opts->dirname, tid);
+
+	while (true) {
+		fd = open_disk_file(filename, warg->opts);
+		if (fd >= 0 || errno != EMFILE || warg->nr_fds == 0)
+			break;
+
+		/* close the least recently used one and retry */
+		wfd = list_last_entry(&warg->fds, struct writer_fd, list);
+		close(wfd->fd);
+		list_del(&wfd->list);
+		free(wfd);
+		warg->nr_fds--;
+	}
+
+	if (fd < 0)
+		pr_err("open disk file");
+	free(filename);
+
+	if (warg->nr_fds >= writer_fd_max) {
+		wfd = list_last_entry(&warg->fds, struct writer_fd, list);
+		close(wfd->fd);
+		list_del(&wfd->list);
+	}
+	else {
+		wfd = xmalloc(sizeof(*wfd));
+		warg->nr_fds++;
+	}
+
+	wfd->tid = tid;
+	wfd->fd = fd;
+	list_add(&wfd->list, &warg->fds);
+
+	return seek_disk_file(fd, warg->opts);
+}
+
+static void close_writer_fds(struct writer_arg *warg)
+{
+	struct writer_fd *wfd, *tmp;
+
+	list_for_each_entry_safe(wfd, tmp, &warg->fds, list) {
+		close(wfd->fd);
+		list_del(&wfd->list);
+		free(wfd);
+	}
+	warg->nr_fds = 0;
+}
+
+/* total amount of data written by writers (for --time) */
+static uint64_t total_write_bytes;
+static uint64_t total_write_nsec;
+static bool splice_failed;
+
+static uint64_t writer_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void disable_splice(struct writer_arg *warg)
+{
+	pr_dbg("splice write failed, fall back to write: %m\n");
+
+	if (warg->pipe[0] >= 0) {
+		close(warg->pipe[0]);
+		close(warg->pipe[1]);
+		warg->pipe[0] = warg->pipe[1] = -1;
+	}
+
+	warg->no_splice = true;
+	splice_failed = true;
+}
+
+/*
+ * Move the buffer contents to the file through a pipe.  The kernel still
+ * copies the data into the page cache of the file, but the splice() to a
+ * regular file is done when it returns, so libmcount can reuse the buffer
+ * after this.  Returns the size written, the caller should write the rest
+ * if it failed.
+ */
+static size_t splice_buffer(struct writer_arg *warg, int fd, char *data, size_t size)
+{
+	size_t done = 0;
+	ssize_t in, out;
+
+	if (warg->pipe[0] < 0) {
+		if (pipe2(warg->pipe, O_CLOEXEC) < 0) {
+			disable_splice(warg);
+			return 0;
+		}
+		/* it's ok to fail, just moves less data at once */
+		fcntl(warg->pipe[1], F_SETPIPE_SZ, warg->opts->bufsize);
+	}
+
+	while (done < size) {
+		struct iovec iov = {
+			.iov_base = data + done,
+			.iov_len = size - done,
+		};
+
+		in = vmsplice(warg->pipe[1], &iov, 1, 0);
+		if (in < 0 && errno == EINTR)
+			continue;
+		if (in <= 0)
+			goto fail;
+
+		while (in > 0) {
+			out = splice(warg->pipe[0], NULL, fd, NULL, in, SPLICE_F_MOVE);
+			if (out < 0 && errno == EINTR)
+				continue;
+			if (out <= 0)
+				goto fail;
+
+			in -= out;
+			done += out;
+		}
+	}
+	return done;
+
+fail:
+	/* the remaining data in the pipe is discarded, write it again */
+	disable_splice(warg);
+	return done;
+}
+
+/* memfd-backed buffers (--hugepage) can be copied in the kernel */
+static size_t sendfile_buffer(struct writer_arg *warg, int fd, struct shmem_fd *sfd, size_t size)
+{
+	off_t offset = offsetof(struct mcount_shmem_buffer, data);
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < size) {
+		ret = sendfile(fd, sfd->fd, &offset, size - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			disable_splice(warg);
+			break;
+		}
+		done += ret;
+	}
+	return done;
+}
+
+static void write_buf_splice(struct writer_arg *warg, struct buf_list *buf)
+{
+	struct mcount_shmem_buffer *shmbuf = buf->shmem_buf;
+	int fd = get_writer_fd(warg, buf->tid);
+	size_t done;
+
+	if (buf->sfd)
+		done = sendfile_buffer(warg, fd, buf->sfd, shmbuf->size);
+	else
+		done = splice_buffer(warg, fd, shmbuf->data, shmbuf->size);
+
+	if (done < shmbuf->size && write_all(fd, shmbuf->data + done, shmbuf->size - done) < 0)
+		pr_err("write shmem buffer");
+}
+
+static void write_buf_iov(struct writer_arg *warg, int tid, struct iovec *iov, int nr_iov)
+{
+	int fd = get_writer_fd(warg, tid);
+
+	if (writev_all(fd, iov, nr_iov) < 0)
+		pr_err("write shmem buffer");
+}
+
+/* write consecutive buffers of the same task with a single writev() */
+static void write_buf_list_file(struct list_head *buf_head, struct writer_arg *warg)
+{
+	struct iovec iov[WRITER_IOV_MAX];
+	struct buf_list *buf;
+	size_t total = 0;
+	int nr_iov = 0;
+	int tid = -1;
+	uint64_t start = writer_time();
+
+	list_for_each_entry(buf, buf_head, list) {
+		struct mcount_shmem_buffer *shmbuf = buf->shmem_buf;
+
+		warg->write_bytes += shmbuf->size;
+
+		if (warg->opts->splice && !warg->no_splice) {
+			write_buf_splice(warg, buf);
+			continue;
+		}
+
+		if (nr_iov && (buf->tid != tid || nr_iov == WRITER_IOV_MAX ||
+			       total + shmbuf->size > WRITER_BATCH_SIZE)) {
+			write_buf_iov(warg, tid, iov, nr_iov);
+			nr_iov = 0;
+			total = 0;
+		}
+
+		tid = buf->tid;
+		iov[nr_iov].iov_base = shmbuf->data;
+		iov[nr_iov].iov_len = shmbuf->size;
+		nr_iov++;
+		total += shmbuf->size;
+	}
+
+	if (nr_iov)
+		write_buf_iov(warg, tid, iov, nr_iov);
+
+	warg->write_nsec += writer_time() - start;
+}
+
 static void write_buf_list(struct list_head *buf_head, struct uftrace_opts *opts,
 			   struct writer_arg *warg)
 {
 	struct buf_list *buf;
 
+	if (!opts->host)
+		write_buf_list_file(buf_head, warg);
+
 	list_for_each_entry(buf, buf_head, list) {
 		struct mcount_shmem_buffer *shmbuf = buf->shmem_buf;
 
-		write_buffer(buf, opts, warg->sock);
+		if (opts->host)
+			send_trace_data(warg->sock, buf->tid, shmbuf->data, shmbuf->size);
+		shmbuf->size = 0;
 
 		/*
 		 * Now it has consumed all contents in the shmem buffer,
@@ -568,16 +1239,177 @@ static void write_buf_list(struct list_head *buf_head, struct uftrace_opts *opts
 		__sync_synchronize();
 		shmbuf->flag = SHMEM_FL_WRITTEN;
 
-		munmap(shmbuf, opts->bufsize);
-		buf->shmem_buf = NULL;
+		put_shmem_buffer(buf, opts->bufsize);
 	}
 
-	pthread_mutex_lock(&free_list_lock);
 	while (!list_empty(buf_head)) {
-		struct list_head *l = buf_head->next;
-		list_move(l, &buf_free_list);
+		buf = list_first_entry(buf_head, struct buf_list, list);
+		list_del(&buf->list);
+		push_buf_queue(&buf_free_queue, buf);
 	}
-	pthread_mutex_unlock(&free_list_lock);
+}
+
+static void write_ring_data(struct ring_list *rl, struct writer_arg *warg, void *data, size_t len)
+{
+	struct uftrace_opts *opts = warg->opts;
+	char *filename;
+	uint64_t start;
+	size_t done = 0;
+
+	if (opts->host) {
+		send_trace_data(warg->sock, rl->tid, data, len);
+		return;
+	}
+
+	/* keep the file open as the ring is consumed frequently */
+	if (rl->fd < 0) {
+		filename = make_disk_name(opts->dirname, rl->tid);
+		rl->fd = open_disk_file(filename, opts);
+		if (rl->fd < 0)
+			pr_err("open disk file");
+		free(filename);
+	}
+
+	start = writer_time();
+	seek_disk_file(rl->fd, opts);
+
+	if (opts->splice && !warg->no_splice)
+		done = splice_buffer(warg, rl->fd, data, len);
+
+	if (done < len && write_all(rl->fd, data + done, len - done) < 0)
+		pr_err("write shmem ring");
+
+	warg->write_bytes += len;
+	warg->write_nsec += writer_time() - start;
+}
+
+static void consume_ring(struct ring_list *rl, struct writer_arg *warg)
+{
+	struct mcount_shmem_ring *ring = rl->ring;
+	void *data = (void *)ring + ring->offset;
+	uint64_t head, tail;
+	size_t pos, len;
+
+	/* paired with libmcount/record.c::commit_record_buffer() */
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = ring->tail;
+
+	if (head == tail)
+		return;
+
+	pos = tail & (ring->size - 1);
+	len = head - tail;
+
+	/* the writer doesn't have the mirror mapping */
+	if (pos + len > ring->size) {
+		write_ring_data(rl, warg, data + pos, ring->size - pos);
+		len -= ring->size - pos;
+		pos = 0;
+	}
+	write_ring_data(rl, warg, data + pos, len);
+
+	/* paired with libmcount/record.c::get_shmem_ring() */
+	__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+static void release_ring(struct ring_list *rl)
+{
+	list_del(&rl->list);
+
+	if (rl->fd >= 0)
+		close(rl->fd);
+	munmap(rl->ring, rl->ring->offset + rl->ring->size);
+	free(rl);
+}
+
+static void consume_ring_list(struct writer_arg *warg, bool finish)
+{
+	struct ring_list *rl, *tmp;
+
+	pthread_mutex_lock(&warg->ring_lock);
+	list_for_each_entry_safe(rl, tmp, &warg->rings, list) {
+		consume_ring(rl, warg);
+
+		/* the task is gone, nothing will be added */
+		if (rl->done || finish)
+			release_ring(rl);
+	}
+	pthread_mutex_unlock(&warg->ring_lock);
+}
+
+static void add_ring_list(char *sess_id)
+{
+	int fd, tid;
+	struct stat stbuf;
+	struct ring_list *rl, *pos;
+	struct writer_arg *warg;
+	struct mcount_shmem_ring *ring;
+
+	if (nr_writer_args == 0)
+		return;
+
+	fd = shm_open(sess_id, O_RDWR, 0600);
+	if (fd < 0) {
+		pr_dbg("open shmem ring failed: %s: %m\n", sess_id);
+		return;
+	}
+
+	if (fstat(fd, &stbuf) < 0)
+		pr_err("stat shmem ring");
+
+	ring = mmap(NULL, stbuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		pr_err("mmap shmem ring");
+
+	close(fd);
+	/* both sides have it mapped now, the name is not needed anymore */
+	shm_unlink(sess_id);
+
+	if (!(ring->flag & SHMEM_FL_RING) ||
+	    (off_t)(ring->offset + ring->size) != stbuf.st_size) {
+		pr_warn("invalid shmem ring: %s\n", sess_id);
+		munmap(ring, stbuf.st_size);
+		return;
+	}
+
+	parse_msg_id(sess_id, NULL, &tid, NULL);
+
+	rl = xmalloc(sizeof(*rl));
+	rl->ring = ring;
+	rl->tid = tid;
+	rl->fd = -1;
+	rl->done = false;
+
+	warg = get_tid_writer(tid);
+
+	pthread_mutex_lock(&warg->ring_lock);
+	/* previous ring of the same tid (due to exec) should be drained first */
+	list_for_each_entry(pos, &warg->rings, list) {
+		if (pos->tid == tid)
+			pos->done = true;
+	}
+	list_add_tail(&rl->list, &warg->rings);
+	pthread_mutex_unlock(&warg->ring_lock);
+}
+
+static void finish_ring_list(char *sess_id)
+{
+	int tid;
+	struct ring_list *rl;
+	struct writer_arg *warg;
+
+	if (nr_writer_args == 0)
+		return;
+
+	parse_msg_id(sess_id, NULL, &tid, NULL);
+	warg = get_tid_writer(tid);
+
+	pthread_mutex_lock(&warg->ring_lock);
+	list_for_each_entry(rl, &warg->rings, list) {
+		if (rl->tid == tid)
+			rl->done = true;
+	}
+	pthread_mutex_unlock(&warg->ring_lock);
 }
 
 static int setup_pollfd(struct pollfd **pollfd, struct writer_arg *warg, bool setup_perf,
@@ -594,7 +1426,7 @@ static int setup_pollfd(struct pollfd **pollfd, struct writer_arg *warg, bool se
 
 	p = xcalloc(nr_poll, sizeof(*p));
 
-	p[0].fd = thread_ctl[0];
+	p[0].fd = warg->efd;
 	p[0].events = POLLIN;
 	nr_poll = 1;
 
@@ -653,18 +1485,34 @@ static bool handle_pollfd(struct pollfd *pollfd, struct writer_arg *warg, bool t
 	return check_task;
 }
 
-static void finish_pollfd(struct pollfd *pollfd)
+static void finish_pollfd(struct pollfd *pollfd)
+{
+	free(pollfd);
+}
+
+static void write_buf_queue(struct writer_arg *warg, struct pollfd *pollfd)
 {
-	free(pollfd);
+	struct uftrace_opts *opts = warg->opts;
+	LIST_HEAD(head);
+
+	while (take_buf_queue(&warg->queue, &head)) {
+		write_buf_list(&head, opts, warg);
+
+		if (!has_perf_event && !opts->kernel)
+			continue;
+
+		handle_pollfd(pollfd, warg, false, has_perf_event, opts->kernel, 0);
+	}
 }
 
 void *writer_thread(void *arg)
 {
-	struct buf_list *buf, *pos;
 	struct writer_arg *warg = arg;
 	struct uftrace_opts *opts = warg->opts;
 	struct pollfd *pollfd;
-	int i, dummy;
+	uint64_t dummy;
+	int i;
+	int timeout = use_ring_buffer ? RING_POLL_MSEC : 1000;
 	sigset_t sigset;
 
 	pthread_setname_np(pthread_self(), "WriterThread");
@@ -685,68 +1533,46 @@ void *writer_thread(void *arg)
 
 	pr_dbg2("start writer thread %d\n", warg->idx);
 	while (!buf_done) {
-		LIST_HEAD(head);
 		bool check_list = false;
 
-		check_list = handle_pollfd(pollfd, warg, true, has_perf_event, opts->kernel, 1000);
+		check_list = handle_pollfd(pollfd, warg, true, has_perf_event, opts->kernel, timeout);
+		if (use_ring_buffer)
+			consume_ring_list(warg, false);
 		if (!check_list)
 			continue;
 
-		if (read(thread_ctl[0], &dummy, sizeof(dummy)) < 0) {
+		if (read(warg->efd, &dummy, sizeof(dummy)) < 0) {
 			if (errno == EAGAIN || errno == EINTR)
 				continue;
 			/* other errors are problematic */
 			break;
 		}
 
-		pthread_mutex_lock(&write_list_lock);
-
-		if (!list_empty(&buf_write_list)) {
-			/* pick first unhandled buf  */
-			buf = list_first_entry(&buf_write_list, struct buf_list, list);
-			list_move(&buf->list, &head);
-
-			warg->tid = buf->tid;
-			list_add(&warg->list, &writer_list);
-		}
-
-		list_for_each_entry_safe(buf, pos, &buf_write_list, list) {
-			/* list may have multiple buf for this task */
-			if (buf->tid == warg->tid)
-				list_move_tail(&buf->list, &head);
-		}
-
-		pthread_mutex_unlock(&write_list_lock);
-
-		while (!list_empty(&head)) {
-			write_buf_list(&head, opts, warg);
-
-			pthread_mutex_lock(&write_list_lock);
-			/* check someone sends bufs for me directly */
-			list_splice_tail_init(&warg->bufs, &head);
-
-			if (list_empty(&head)) {
-				/* I'm done with this tid */
-				warg->tid = -1;
-				list_del_init(&warg->list);
-			}
-			pthread_mutex_unlock(&write_list_lock);
-
-			if (!has_perf_event && !opts->kernel)
-				continue;
-
-			handle_pollfd(pollfd, warg, false, has_perf_event, opts->kernel, 0);
-		}
+		write_buf_queue(warg, pollfd);
 	}
 	pr_dbg2("stop writer thread %d\n", warg->idx);
 
+	/* the rest will be written by record_remaining_buffer() */
+	write_buf_queue(warg, pollfd);
+
+	if (use_ring_buffer)
+		consume_ring_list(warg, true);
+
 	if (has_perf_event) {
 		for (i = 0; i < warg->nr_cpu; i++)
 			record_perf_data(warg->perf, warg->cpus[i], warg->sock);
 	}
 
+	__sync_fetch_and_add(&total_write_bytes, warg->write_bytes);
+	__sync_fetch_and_add(&total_write_nsec, warg->write_nsec);
+
+	if (warg->pipe[0] >= 0) {
+		close(warg->pipe[0]);
+		close(warg->pipe[1]);
+	}
+
+	close_writer_fds(warg);
 	finish_pollfd(pollfd);
-	free(warg);
 	return NULL;
 }
 
@@ -763,17 +1589,18 @@ static struct buf_list *make_write_buffer(void)
 	return buf;
 }
 
-static void copy_to_buffer(struct mcount_shmem_buffer *shm, char *sess_id)
+static void copy_to_buffer(struct mcount_shmem_buffer *shm, char *sess_id, struct shmem_fd *sfd)
 {
 	struct buf_list *buf = NULL;
 	struct writer_arg *writer;
 
-	pthread_mutex_lock(&free_list_lock);
-	if (!list_empty(&buf_free_list)) {
-		buf = list_first_entry(&buf_free_list, struct buf_list, list);
-		list_del(&buf->list);
+	if (buf_free_cache == NULL)
+		buf_free_cache = __atomic_exchange_n(&buf_free_queue, NULL, __ATOMIC_ACQUIRE);
+
+	if (buf_free_cache) {
+		buf = buf_free_cache;
+		buf_free_cache = buf->next;
 	}
-	pthread_mutex_unlock(&free_list_lock);
 
 	if (buf == NULL) {
 		buf = make_write_buffer();
@@ -784,34 +1611,62 @@ static void copy_to_buffer(struct mcount_shmem_buffer *shm, char *sess_id)
 	}
 
 	buf->shmem_buf = shm;
+	buf->sfd = sfd;
 	parse_msg_id(sess_id, NULL, &buf->tid, NULL);
 
-	pthread_mutex_lock(&write_list_lock);
-	/* check some writers work for this tid */
-	list_for_each_entry(writer, &writer_list, list) {
-		if (buf->tid == writer->tid) {
-			/* if so, pass the buf directly */
-			list_add_tail(&buf->list, &writer->bufs);
-			break;
-		}
-	}
-	if (list_no_entry(writer, &writer_list, list)) {
-		int kick = 1;
+	/* the name of pooled buffers has a pool id */
+	if (shm->tid)
+		buf->tid = shm->tid;
+
+	/* bufs of a task always go to the same writer to keep the order */
+	writer = get_tid_writer(buf->tid);
+
+	/* no need to wake up the writer if it has pending bufs */
+	if (push_buf_queue(&writer->queue, buf))
+		wakeup_writer(writer);
+}
+
+/* remember the session to unlink all the shmem buffers at the end */
+static void add_shmem_need_unlink(char *sess_id)
+{
+	struct shmem_list *sl;
 
-		/* no writer is dealing with the tid */
-		list_add_tail(&buf->list, &buf_write_list);
-		if (write(thread_ctl[1], &kick, sizeof(kick)) < 0 && !buf_done)
-			pr_err("copying to buffer failed");
+	if (!list_empty(&shmem_need_unlink)) {
+		sl = list_last_entry(&shmem_need_unlink, struct shmem_list, list);
+
+		/* length of "uftrace-<session id>-" is 25 */
+		if (!strncmp(sl->id, sess_id, 25))
+			return;
 	}
-	pthread_mutex_unlock(&write_list_lock);
+
+	sl = xmalloc(sizeof(*sl));
+	memcpy(sl->id, sess_id, sizeof(sl->id));
+
+	/* link to shmem_list */
+	list_add_tail(&sl->list, &shmem_need_unlink);
 }
 
 static void record_mmap_file(const char *dirname, char *sess_id, int bufsize)
 {
 	int fd;
-	struct shmem_list *sl;
+	struct shmem_fd *sfd;
 	struct mcount_shmem_buffer *shmem_buf;
 
+	/* the fd was sent before the message */
+	recv_shmem_fd(bufsize);
+
+	sfd = find_shmem_fd(sess_id);
+	if (sfd) {
+		if (sfd->map == NULL) {
+			sfd->map = mmap(NULL, bufsize, PROT_READ | PROT_WRITE, MAP_SHARED, sfd->fd,
+					0);
+			if (sfd->map == MAP_FAILED)
+				pr_err("mmap shmem buffer");
+		}
+		shmem_buf = sfd->map;
+		goto check;
+	}
+
 	/* write (append) it to disk */
 	fd = shm_open(sess_id, O_RDWR, 0600);
 	if (fd < 0) {
@@ -825,66 +1680,86 @@ static void record_mmap_file(const char *dirname, char *sess_id, int bufsize)
 
 	close(fd);
 
+check:
 	if (shmem_buf->flag & SHMEM_FL_RECORDING) {
-		if (shmem_buf->flag & SHMEM_FL_NEW) {
-			bool found = false;
-
-			if (!list_empty(&shmem_need_unlink)) {
-				sl = list_last_entry(&shmem_need_unlink, struct shmem_list, list);
-
-				/* length of "uftrace-<session id>-" is 25 */
-				if (!strncmp(sl->id, sess_id, 25))
-					found = true;
-			}
+		if (shmem_buf->flag & SHMEM_FL_NEW)
+			add_shmem_need_unlink(sess_id);
 
-			if (!found) {
-				sl = xmalloc(sizeof(*sl));
-				memcpy(sl->id, sess_id, sizeof(sl->id));
-
-				/* link to shmem_list */
-				list_add_tail(&sl->list, &shmem_need_unlink);
+		if (shmem_buf->size) {
+			if (sfd) {
+				pthread_mutex_lock(&shmem_fd_lock);
+				sfd->refcnt++;
+				pthread_mutex_unlock(&shmem_fd_lock);
 			}
-		}
 
-		if (shmem_buf->size) {
-			/* shmem_buf will be unmapped */
-			copy_to_buffer(shmem_buf, sess_id);
+			/* shmem_buf will be unmapped (or released) */
+			copy_to_buffer(shmem_buf, sess_id, sfd);
 			return;
 		}
 	}
 
-	munmap(shmem_buf, bufsize);
+	if (sfd == NULL)
+		munmap(shmem_buf, bufsize);
 }
 
 static void stop_all_writers(void)
 {
+	int i;
+
 	buf_done = true;
-	close(thread_ctl[1]);
-	thread_ctl[1] = -1;
+
+	for (i = 0; i < nr_writer_args; i++)
+		wakeup_writer(writer_args[i]);
 }
 
 static void record_remaining_buffer(struct uftrace_opts *opts, int sock)
 {
 	struct buf_list *buf;
+	LIST_HEAD(head);
+	int i;
 
 	/* called after all writers gone, no lock is needed */
-	while (!list_empty(&buf_write_list)) {
-		buf = list_first_entry(&buf_write_list, struct buf_list, list);
+	for (i = 0; i < nr_writer_args; i++)
+		take_buf_queue(&writer_args[i]->queue, &head);
+
+	while (!list_empty(&head)) {
+		buf = list_first_entry(&head, struct buf_list, list);
 		write_buffer(buf, opts, sock);
-		munmap(buf->shmem_buf, opts->bufsize);
+		put_shmem_buffer(buf, opts->bufsize);
 
 		list_del(&buf->list);
 		free(buf);
 	}
 
-	while (!list_empty(&buf_free_list)) {
-		buf = list_first_entry(&buf_free_list, struct buf_list, list);
+	take_buf_queue(&buf_free_queue, &head);
+	while (buf_free_cache) {
+		buf = buf_free_cache;
+		buf_free_cache = buf->next;
+		list_add(&buf->list, &head);
+	}
+
+	while (!list_empty(&head)) {
+		buf = list_first_entry(&head, struct buf_list, list);
 
 		list_del(&buf->list);
 		free(buf);
 	}
 }
 
+static void free_writer_args(void)
+{
+	int i;
+
+	for (i = 0; i < nr_writer_args; i++) {
+		close(writer_args[i]->efd);
+		free(writer_args[i]);
+	}
+
+	free(writer_args);
+	writer_args = NULL;
+	nr_writer_args = 0;
+}
+
 static void flush_shmem_list(const char *dirname, int bufsize)
 {
 	struct shmem_list *sl, *tmp;
@@ -957,6 +1832,242 @@ static void flush_old_shmem(const char *dirname, int tid, int bufsize)
 	}
 }
 
+/* shmem buffers of a task for --flight-recorder, not sent to the writers */
+struct flight_task {
+	struct list_head list;
+	int tid;
+	int nr_buf;
+	char (*bufs)[SHMEM_NAME_SIZE];
+	/* the buffer (and its size) saved by the last snapshot */
+	unsigned last_seq;
+	unsigned last_size;
+};
+
+static LIST_HEAD(flight_tasks);
+static int nr_flight_snapshot;
+
+/* contents of a flight recorder buffer copied for a snapshot */
+struct flight_buffer {
+	unsigned seq;
+	unsigned nr;
+	unsigned flag;
+	unsigned size;
+	void *data;
+};
+
+static void add_flight_buffer(char *sess_id)
+{
+	struct flight_task *ft;
+	int tid;
+	int i;
+
+	parse_msg_id(sess_id, NULL, &tid, NULL);
+
+	list_for_each_entry(ft, &flight_tasks, list) {
+		if (ft->tid == tid)
+			break;
+	}
+
+	if (list_no_entry(ft, &flight_tasks, list)) {
+		ft = xzalloc(sizeof(*ft));
+		ft->tid = tid;
+		list_add_tail(&ft->list, &flight_tasks);
+	}
+
+	/* a new session (after exec) starts over with new buffers */
+	if (ft->nr_buf && strncmp(ft->bufs[0], sess_id, 25)) {
+		ft->nr_buf = 0;
+		ft->last_seq = 0;
+		ft->last_size = 0;
+	}
+
+	for (i = 0; i < ft->nr_buf; i++) {
+		if (!strcmp(ft->bufs[i], sess_id))
+			return;
+	}
+
+	ft->bufs = xrealloc(ft->bufs, (ft->nr_buf + 1) * sizeof(*ft->bufs));
+	strcpy(ft->bufs[ft->nr_buf++], sess_id);
+
+	add_shmem_need_unlink(sess_id);
+}
+
+/*
+ * The buffer can be overwritten by libmcount while copying, check the
+ * sequence number before and after that.  This is paired with
+ * libmcount/record.c::get_new_flight_buffer().
+ */
+static bool copy_flight_buffer(char *sess_id, int bufsize, struct flight_buffer *fb)
+{
+	struct mcount_shmem_buffer *shmbuf;
+	struct stat stbuf;
+	bool ret = false;
+	int fd;
+
+	fd = shm_open(sess_id, O_RDONLY, 0600);
+	if (fd < 0) {
+		pr_dbg("open flight buffer failed: %s: %m\n", sess_id);
+		return false;
+	}
+
+	if (fstat(fd, &stbuf) < 0 || stbuf.st_size < bufsize) {
+		close(fd);
+		return false;
+	}
+
+	shmbuf = mmap(NULL, bufsize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shmbuf == MAP_FAILED)
+		return false;
+
+	fb->seq = __atomic_load_n(&shmbuf->seq, __ATOMIC_ACQUIRE);
+	fb->nr = shmbuf->nr;
+	fb->flag = shmbuf->flag;
+	fb->size = __atomic_load_n(&shmbuf->size, __ATOMIC_ACQUIRE);
+
+	if (fb->seq == 0 || fb->size > bufsize - sizeof(*shmbuf))
+		goto out;
+
+	fb->data = xmalloc(fb->size + 1);
+	memcpy(fb->data, shmbuf->data, fb->size);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&shmbuf->seq, __ATOMIC_RELAXED) != fb->seq) {
+		pr_dbg2("flight buffer was overwritten: %s\n", sess_id);
+		free(fb->data);
+		fb->data = NULL;
+		goto out;
+	}
+	ret = true;
+
+out:
+	munmap(shmbuf, bufsize);
+	return ret;
+}
+
+static int cmp_flight_buffer(const void *a, const void *b)
+{
+	const struct flight_buffer *fa = a;
+	const struct flight_buffer *fb = b;
+
+	if (fa->seq == fb->seq)
+		return 0;
+	return fa->seq < fb->seq ? -1 : 1;
+}
+
+/* mark the cut-off point so that replay can restart from the next record */
+static void write_flight_cutoff(int fd)
+{
+	struct uftrace_record lost = {
+		.time = 0,
+		.type = UFTRACE_LOST,
+		.magic = RECORD_MAGIC,
+		.addr = 0,
+	};
+
+	if (write_all(fd, &lost, sizeof(lost)) < 0)
+		pr_err("write flight recorder data");
+}
+
+/* append the data not saved yet in the buffers of the task */
+static void save_flight_task(struct flight_task *ft, const char *dirname, int bufsize)
+{
+	struct flight_buffer *fbs;
+	unsigned offset = 0;
+	unsigned prev_nr = 0;
+	bool cutoff;
+	char *filename;
+	int nr = 0;
+	int fd;
+	int i;
+
+	fbs = xcalloc(ft->nr_buf, sizeof(*fbs));
+	for (i = 0; i < ft->nr_buf; i++) {
+		if (copy_flight_buffer(ft->bufs[i], bufsize, &fbs[nr]))
+			nr++;
+	}
+	qsort(fbs, nr, sizeof(*fbs), cmp_flight_buffer);
+
+	/* skip the buffers saved already */
+	for (i = 0; i < nr; i++) {
+		if (fbs[i].seq >= ft->last_seq)
+			break;
+	}
+	if (i == nr)
+		goto out;
+
+	if (fbs[i].seq == ft->last_seq) {
+		/* continue to the last buffer */
+		offset = ft->last_size;
+		cutoff = false;
+	}
+	else if (ft->last_seq) {
+		/* the last buffer was overwritten */
+		cutoff = true;
+	}
+	else {
+		/* it's not the first buffer of the task */
+		cutoff = !(fbs[i].flag & SHMEM_FL_NEW);
+	}
+
+	filename = make_disk_name(dirname, ft->tid);
+	fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+		pr_err("open disk file");
+
+	for (; i < nr; i++) {
+		struct flight_buffer *fb = &fbs[i];
+
+		/* a buffer in the middle was overwritten while copying */
+		if (prev_nr && fb->nr != prev_nr + 1)
+			cutoff = true;
+
+		if (cutoff && fb->size > offset) {
+			write_flight_cutoff(fd);
+			cutoff = false;
+		}
+
+		if (fb->size > offset && write_all(fd, fb->data + offset, fb->size - offset) < 0)
+			pr_err("write flight recorder data");
+
+		ft->last_seq = fb->seq;
+		ft->last_size = fb->size;
+		prev_nr = fb->nr;
+		offset = 0;
+	}
+
+	close(fd);
+	free(filename);
+
+out:
+	for (i = 0; i < nr; i++)
+		free(fbs[i].data);
+	free(fbs);
+}
+
+static void save_flight_snapshot(const char *dirname, int bufsize, struct uftrace_msg_task *tmsg)
+{
+	struct flight_task *ft;
+
+	pr_dbg("saving flight recorder snapshot requested by %d\n", tmsg->tid);
+
+	list_for_each_entry(ft, &flight_tasks, list)
+		save_flight_task(ft, dirname, bufsize);
+
+	nr_flight_snapshot++;
+}
+
+static void free_flight_tasks(void)
+{
+	struct flight_task *ft, *tmp;
+
+	list_for_each_entry_safe(ft, tmp, &flight_tasks, list) {
+		list_del(&ft->list);
+		free(ft->bufs);
+		free(ft);
+	}
+}
+
 static int shmem_lost_count;
 
 struct tid_list {
@@ -1095,6 +2206,18 @@ static void read_record_mmap(int pfd, const char *dirname, int bufsize)
 		sl->id[msg.len] = '\0';
 		pr_dbg2("MSG START: %s\n", sl->id);
 
+		if (use_ring_buffer) {
+			add_ring_list(sl->id);
+			free(sl);
+			break;
+		}
+
+		if (use_flight_recorder) {
+			add_flight_buffer(sl->id);
+			free(sl);
+			break;
+		}
+
 		/* link to shmem_list */
 		list_add_tail(&sl->list, &shmem_list_head);
 		break;
@@ -1109,6 +2232,11 @@ static void read_record_mmap(int pfd, const char *dirname, int bufsize)
 		buf[msg.len] = '\0';
 		pr_dbg2("MSG  END : %s\n", buf);
 
+		if (use_ring_buffer) {
+			finish_ring_list(buf);
+			break;
+		}
+
 		/* remove from shmem_list */
 		list_for_each_entry_safe(sl, tmp, &shmem_list_head, list) {
 			if (!memcmp(sl->id, buf, msg.len)) {
@@ -1160,6 +2288,9 @@ static void read_record_mmap(int pfd, const char *dirname, int bufsize)
 				break;
 			}
 		}
+
+		/* the last buffer was sent already */
+		release_task_shmem_fd(tmsg.tid, bufsize);
 		break;
 
 	case UFTRACE_MSG_FORK_START:
@@ -1269,6 +2400,18 @@ static void read_record_mmap(int pfd, const char *dirname, int bufsize)
 		finish_received = true;
 		break;
 
+	case UFTRACE_MSG_SNAPSHOT:
+		if (msg.len != sizeof(tmsg))
+			pr_err_ns("invalid message length\n");
+
+		if (read_all(pfd, &tmsg, sizeof(tmsg)) < 0)
+			pr_err("reading pipe failed");
+
+		pr_dbg2("MSG SNAPSHOT: %d/%d\n", tmsg.pid, tmsg.tid);
+
+		save_flight_snapshot(dirname, bufsize, &tmsg);
+		break;
+
 	default:
 		pr_warn("Unknown message type: %u\n", msg.type);
 		break;
@@ -1495,6 +2638,19 @@ static void print_child_usage(struct rusage *ru)
 	pr_out("   user time: %6lu.%06lu000 sec\n", ru->ru_utime.tv_sec, ru->ru_utime.tv_usec);
 }
 
+static void print_write_stat(struct uftrace_opts *opts)
+{
+	double mbytes = (double)total_write_bytes / (KB * KB);
+	double secs = (double)total_write_nsec / NSEC_PER_SEC;
+	const char *mode = "write";
+
+	if (opts->splice)
+		mode = splice_failed ? "splice, fallback" : "splice";
+
+	pr_out("  data write: %9.1f MB in %.6f sec (%.1f MB/s, %s)\n", mbytes, secs,
+	       secs > 0 ? mbytes / secs : 0.0, mode);
+}
+
 #define UFTRACE_MSG "Cannot trace '%s': No such executable file.\n"
 
 #define MCOUNT_MSG                                                                                 \
@@ -1703,6 +2859,93 @@ static void check_perf_event(struct uftrace_opts *opts)
 	has_perf_event = found;
 }
 
+static void check_tsc_clock(struct uftrace_opts *opts)
+{
+	if (!clock_is_tsc(opts->clock))
+		return;
+
+	if (!host_has_invariant_tsc()) {
+		pr_warn("invariant TSC is not available, fall back to 'mono' clock\n");
+		opts->clock = "mono";
+		return;
+	}
+
+	setup_tsc_clock(&tsc_clock);
+	use_tsc_clock = true;
+}
+
+static void check_hugepage(struct uftrace_opts *opts)
+{
+	if (!opts->hugepage)
+		return;
+
+	if (opts->ring_buffer) {
+		pr_warn("--hugepage is ignored with --ring-buffer\n");
+		opts->hugepage = false;
+		return;
+	}
+
+	/* huge pages should be allocated as a whole */
+	if (opts->bufsize & (SHMEM_HUGEPAGE_SIZE - 1)) {
+		opts->bufsize = ROUND_UP(opts->bufsize, SHMEM_HUGEPAGE_SIZE);
+		pr_dbg("buffer size is rounded up to %lu KB for huge pages\n", opts->bufsize / KB);
+	}
+}
+
+static void check_buffer_pool(struct uftrace_opts *opts)
+{
+	if (!opts->buffer_pool)
+		return;
+
+	/* the pool only has normal shmem buffers */
+	if (opts->ring_buffer || opts->flight_recorder || opts->hugepage) {
+		pr_warn("--buffer-pool is ignored with --%s\n",
+			opts->ring_buffer ? "ring-buffer" :
+			opts->flight_recorder ? "flight-recorder" : "hugepage");
+		opts->buffer_pool = 0;
+	}
+}
+
+static void check_aggregate(struct uftrace_opts *opts)
+{
+	if (!opts->aggregate)
+		return;
+
+	/* libmcount writes the summary to the data directory directly */
+	if (opts->host) {
+		pr_warn("--aggregate is ignored with --host\n");
+		opts->aggregate = false;
+	}
+}
+
+static void check_flight_recorder(struct uftrace_opts *opts)
+{
+	if (!opts->flight_recorder)
+		return;
+
+	/* snapshots are saved to the data directory directly */
+	if (opts->host || opts->aggregate) {
+		pr_warn("--flight-recorder is ignored with --%s\n",
+			opts->host ? "host" : "aggregate");
+		opts->flight_recorder = 0;
+		return;
+	}
+
+	/* snapshot needs named buffers and records in the normal format */
+	if (opts->ring_buffer) {
+		pr_warn("--ring-buffer is ignored with --flight-recorder\n");
+		opts->ring_buffer = false;
+	}
+	if (opts->hugepage) {
+		pr_warn("--hugepage is ignored with --flight-recorder\n");
+		opts->hugepage = false;
+	}
+	if (opts->compact_record) {
+		pr_warn("--compact-record is ignored with --flight-recorder\n");
+		opts->compact_record = false;
+	}
+}
+
 struct writer_data {
 	int pid;
 	int pipefd;
@@ -1760,7 +3003,8 @@ static void setup_writers(struct writer_data *wd, struct uftrace_opts *opts)
 		kernel->output_dir = opts->dirname;
 		kernel->depth = opts->kernel_depth ?: 1;
 		kernel->bufsize = opts->kernel_bufsize;
-		kernel->clock = opts->clock;
+		/* TSC timestamps will be converted to CLOCK_MONOTONIC */
+		kernel->clock = use_tsc_clock ? "mono" : opts->clock;
 
 		if (!opts->nr_thread) {
 			if (opts->kernel_depth >= 4)
@@ -1795,6 +3039,9 @@ static void setup_writers(struct writer_data *wd, struct uftrace_opts *opts)
 	else if (opts->nr_thread > wd->nr_cpu)
 		opts->nr_thread = wd->nr_cpu;
 
+	use_ring_buffer = opts->ring_buffer;
+	use_flight_recorder = opts->flight_recorder != 0;
+
 	if (has_perf_event) {
 		setup_clock_id(opts->clock);
 		if (setup_perf_record(perf, wd->nr_cpu, wd->pid, opts->dirname, has_sched_event) <
@@ -1805,9 +3052,7 @@ static void setup_writers(struct writer_data *wd, struct uftrace_opts *opts)
 out:
 	pr_dbg("creating %d thread(s) for recording\n", opts->nr_thread);
 	wd->writers = xmalloc(opts->nr_thread * sizeof(*wd->writers));
-
-	if (pipe(thread_ctl) < 0)
-		pr_err("cannot create an eventfd for writer thread");
+	setup_writer_fd_max(opts->nr_thread);
 }
 
 static void start_tracing(struct writer_data *wd, struct uftrace_opts *opts, int ready_fd)
@@ -1822,6 +3067,9 @@ static void start_tracing(struct writer_data *wd, struct uftrace_opts *opts, int
 		pr_warn("kernel tracing disabled due to an error\n");
 	}
 
+	writer_args = xcalloc(opts->nr_thread, sizeof(*writer_args));
+	nr_writer_args = opts->nr_thread;
+
 	for (i = 0; i < opts->nr_thread; i++) {
 		struct writer_arg *warg;
 		int cpu_per_thread = DIV_ROUND_UP(wd->nr_cpu, opts->nr_thread);
@@ -1834,8 +3082,16 @@ static void start_tracing(struct writer_data *wd, struct uftrace_opts *opts, int
 		warg->kern = &wd->kernel;
 		warg->perf = &wd->perf;
 		warg->nr_cpu = 0;
-		INIT_LIST_HEAD(&warg->list);
-		INIT_LIST_HEAD(&warg->bufs);
+		INIT_LIST_HEAD(&warg->rings);
+		INIT_LIST_HEAD(&warg->fds);
+		warg->pipe[0] = warg->pipe[1] = -1;
+		pthread_mutex_init(&warg->ring_lock, NULL);
+
+		warg->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (warg->efd < 0)
+			pr_err("cannot create an eventfd for writer thread");
+
+		writer_args[i] = warg;
 
 		if (opts->kernel || has_perf_event) {
 			warg->nr_cpu = cpu_per_thread;
@@ -1873,6 +3129,9 @@ static int stop_tracing(struct writer_data *wd, struct uftrace_opts *opts)
 			continue;
 		}
 
+		/* do not block tasks sending buffer fds */
+		recv_shmem_fd(opts->bufsize);
+
 		/* wait for SIGCHLD or FORK_END */
 		usleep(1000);
 
@@ -1925,6 +3184,9 @@ static int stop_tracing(struct writer_data *wd, struct uftrace_opts *opts)
 
 	clock_gettime(CLOCK_MONOTONIC, &wd->ts2);
 
+	if (use_tsc_clock)
+		update_tsc_clock(&tsc_clock);
+
 	wd->status = status;
 	return ret;
 }
@@ -1933,6 +3195,7 @@ static void finish_writers(struct writer_data *wd, struct uftrace_opts *opts)
 {
 	int i;
 	char *elapsed_time = get_child_time(&wd->ts1, &wd->ts2);
+	char *buf_backing;
 
 	if (opts->time) {
 		print_child_time(elapsed_time);
@@ -1944,23 +3207,39 @@ static void finish_writers(struct writer_data *wd, struct uftrace_opts *opts)
 		return;
 	}
 
-	if (fill_file_header(opts, wd->status, &wd->usage, elapsed_time) < 0)
+	buf_backing = get_shmem_backing_info(opts->bufsize);
+
+	if (fill_file_header(opts, wd->status, &wd->usage, elapsed_time,
+			     use_tsc_clock ? &tsc_clock : NULL, buf_backing) < 0)
 		pr_err("cannot generate data file");
 
 	free(elapsed_time);
+	free(buf_backing);
 
 	if (shmem_lost_count)
 		pr_warn("LOST %d records\n", shmem_lost_count);
 
+	if (use_flight_recorder) {
+		if (nr_flight_snapshot == 0)
+			pr_warn("no flight recorder snapshot was taken\n");
+		else
+			pr_dbg("saved %d flight recorder snapshot(s)\n", nr_flight_snapshot);
+	}
+
 	for (i = 0; i < opts->nr_thread; i++)
 		pthread_join(wd->writers[i], NULL);
 	free(wd->writers);
-	close(thread_ctl[0]);
+
+	if (opts->time && !opts->host)
+		print_write_stat(opts);
 
 	flush_shmem_list(opts->dirname, opts->bufsize);
 	record_remaining_buffer(opts, wd->sock);
+	free_writer_args();
+	finish_shmem_fd_channel(opts->dirname, opts->bufsize);
 	unlink_shmem_list();
 	free_tid_list();
+	free_flight_tasks();
 
 	if (opts->kernel)
 		finish_kernel_tracing(&wd->kernel);
@@ -2081,26 +3360,39 @@ int do_main_loop(int ready, struct uftrace_opts *opts, int pid)
 	if (opts->sig_trigger)
 		pr_out("uftrace: install signal handlers to task %d\n", pid);
 
+	if (opts->hugepage)
+		setup_shmem_fd_channel(opts->dirname);
+
 	setup_writers(&wd, opts);
 	start_tracing(&wd, opts, ready);
 	close(ready);
 
 	while (!uftrace_done) {
-		struct pollfd pollfd = {
-			.fd = wd.pipefd,
-			.events = POLLIN,
+		struct pollfd pollfd[2] = {
+			{
+				.fd = wd.pipefd,
+				.events = POLLIN,
+			},
+			{
+				.fd = shmem_fd_sock,
+				.events = POLLIN,
+			},
 		};
 
-		ret = poll(&pollfd, 1, 1000);
+		/* negative fd is ignored */
+		ret = poll(pollfd, 2, 1000);
 		if (ret < 0 && errno == EINTR)
 			continue;
 		if (ret < 0)
 			pr_err("error during poll");
 
-		if (pollfd.revents & POLLIN)
+		if (pollfd[1].revents & POLLIN)
+			recv_shmem_fd(opts->bufsize);
+
+		if (pollfd[0].revents & POLLIN)
 			read_record_mmap(wd.pipefd, opts->dirname, opts->bufsize);
 
-		if (pollfd.revents & (POLLERR | POLLHUP))
+		if (pollfd[0].revents & (POLLERR | POLLHUP))
 			break;
 	}
 
@@ -2179,12 +3471,21 @@ int command_record(int argc, char *argv[], struct uftrace_opts *opts)
 	int ret = -1;
 	char *channel = NULL;
 
+	/* change filters (or state) of the running process */
+	if (opts->pid)
+		return forward_options(opts);
+
 	/* apply script-provided options */
 	if (opts->script_file)
 		parse_script_opt(opts);
 
 	check_binary(opts);
 	check_perf_event(opts);
+	check_tsc_clock(opts);
+	check_aggregate(opts);
+	check_flight_recorder(opts);
+	check_hugepage(opts);
+	check_buffer_pool(opts);
 
 	if (!opts->nop) {
 		if (create_directory(opts->dirname) < 0)
@@ -1126,6 +1126,9 @@ int command_replay(int argc, char *argv[], struct uftrace_opts *opts)
 		return -1;
 	}
 
+	if (handle.hdr.feat_mask & AGGREGATE)
+		pr_warn("data was recorded with --aggregate, use 'uftrace report' instead\n");
+
 	fstack_setup_filters(opts, &handle);
 	setup_field(&output_fields, opts, &setup_default_field, field_table,
 		    ARRAY_SIZE(field_table));
@@ -1169,6 +1172,7 @@ int command_replay(int argc, char *argv[], struct uftrace_opts *opts)
 	}
 
 	print_remaining_stack(opts, &handle);
+	print_auto_unpatch(&handle);
 
 	if (format_mode == FORMAT_HTML)
 		pr_out(HTML_FOOTER);
@@ -1,7 +1,10 @@
+#include <glob.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "uftrace.h"
+#include "utils/event.h"
 #include "utils/field.h"
 #include "utils/fstack.h"
 #include "utils/list.h"
@@ -17,6 +20,11 @@ static int maxlen = 20;
 
 static LIST_HEAD(output_fields);
 
+/* number of calls dropped by the throttle trigger at record time */
+static struct rb_root throttle_root = RB_ROOT;
+/* number of calls traced by the sample trigger (and estimated total in total.sum) */
+static struct rb_root sample_root = RB_ROOT;
+
 static void print_field(struct uftrace_report_node *node, int space)
 {
 	struct field_data fd = {
@@ -56,6 +64,53 @@ static void find_insert_node(struct rb_root *root, struct uftrace_task_reader *t
 	symbol_putname(sym, symname);
 }
 
+static void add_throttle_node(struct uftrace_task_reader *task, uint64_t timestamp)
+{
+	struct uftrace_throttle *throttle = task->args.data;
+	struct uftrace_report_node *node;
+	struct uftrace_symbol *sym;
+	char *symname;
+
+	if (throttle == NULL)
+		return;
+
+	sym = task_find_sym_addr(&task->h->sessions, task, timestamp, throttle->addr);
+	symname = symbol_getname(sym, throttle->addr);
+
+	node = report_find_node(&throttle_root, symname);
+	if (node == NULL) {
+		node = xzalloc(sizeof(*node));
+		report_add_node(&throttle_root, symname, node);
+	}
+	node->call += throttle->dropped;
+
+	symbol_putname(sym, symname);
+}
+
+static void add_sample_node(struct uftrace_task_reader *task, uint64_t timestamp)
+{
+	struct uftrace_sample *sample = task->args.data;
+	struct uftrace_report_node *node;
+	struct uftrace_symbol *sym;
+	char *symname;
+
+	if (sample == NULL)
+		return;
+
+	sym = task_find_sym_addr(&task->h->sessions, task, timestamp, sample->addr);
+	symname = symbol_getname(sym, sample->addr);
+
+	node = report_find_node(&sample_root, symname);
+	if (node == NULL) {
+		node = xzalloc(sizeof(*node));
+		report_add_node(&sample_root, symname, node);
+	}
+	node->call++;
+	node->total.sum += sample->rate;
+
+	symbol_putname(sym, symname);
+}
+
 static void add_lost_fstack(struct rb_root *root, struct uftrace_task_reader *task,
 			    struct uftrace_opts *opts)
 {
@@ -119,6 +174,111 @@ static void add_remaining_fstack(struct uftrace_data *handle, struct rb_root *ro
 	}
 }
 
+static void add_summary_node(struct rb_root *root, struct uftrace_task_reader *task,
+			     uint64_t timestamp, struct uftrace_agg_entry *entry,
+			     struct uftrace_opts *opts)
+{
+	struct uftrace_session_link *sessions = &task->h->sessions;
+	struct uftrace_report_node *node;
+	struct uftrace_symbol *sym;
+	struct uftrace_dbg_loc *loc = NULL;
+	char *symname;
+
+	sym = task_find_sym_addr(sessions, task, timestamp, entry->addr);
+
+	/* skip it if --no-libcall is given */
+	if (!opts->libcall && sym && sym->type == ST_PLT_FUNC)
+		return;
+
+	if (opts->srcline)
+		loc = task_find_loc_addr(sessions, task, timestamp, entry->addr);
+
+	symname = symbol_getname(sym, entry->addr);
+
+	node = report_find_node(root, symname);
+	if (node == NULL) {
+		node = xzalloc(sizeof(*node));
+		report_add_node(root, symname, node);
+	}
+	report_update_summary(node, entry);
+	node->loc = loc;
+	if (sym != NULL)
+		node->size = sym->size;
+
+	symbol_putname(sym, symname);
+}
+
+static void convert_summary_time(struct uftrace_agg_entry *entry, uint64_t freq)
+{
+	entry->total = tsc_to_nsec(entry->total, freq);
+	entry->total_rec = tsc_to_nsec(entry->total_rec, freq);
+	entry->total_min = tsc_to_nsec(entry->total_min, freq);
+	entry->total_max = tsc_to_nsec(entry->total_max, freq);
+	entry->self = tsc_to_nsec(entry->self, freq);
+	entry->self_min = tsc_to_nsec(entry->self_min, freq);
+	entry->self_max = tsc_to_nsec(entry->self_max, freq);
+}
+
+/* read the summary files (<tid>.agg) saved by 'record --aggregate' */
+static void build_summary_tree(struct uftrace_data *handle, struct rb_root *root,
+			       struct uftrace_opts *opts)
+{
+	struct uftrace_agg_header hdr;
+	struct uftrace_agg_entry entry;
+	char *pattern = NULL;
+	glob_t g;
+	size_t i;
+
+	xasprintf(&pattern, "%s/[0-9]*.agg", opts->dirname);
+	if (glob(pattern, GLOB_NOSORT, NULL, &g) != 0) {
+		pr_dbg("no summary file found: %s\n", pattern);
+		free(pattern);
+		return;
+	}
+
+	for (i = 0; i < g.gl_pathc && !uftrace_done; i++) {
+		struct uftrace_task_reader task = {
+			.h = handle,
+		};
+		FILE *fp;
+
+		task.tid = strtol(strrchr(g.gl_pathv[i], '/') + 1, NULL, 10);
+		task.t = find_task(&handle->sessions, task.tid);
+
+		fp = fopen(g.gl_pathv[i], "rb");
+		if (fp == NULL) {
+			pr_dbg("cannot open summary file: %s: %m\n", g.gl_pathv[i]);
+			continue;
+		}
+
+		while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+			uint32_t k;
+
+			if (hdr.magic != UFTRACE_AGG_MAGIC) {
+				pr_warn("invalid summary data in %s\n", g.gl_pathv[i]);
+				break;
+			}
+
+			if (handle->hdr.info_mask & CLOCKINFO)
+				hdr.time = convert_tsc_time(&handle->info.clock, hdr.time);
+
+			for (k = 0; k < hdr.nr; k++) {
+				if (fread(&entry, sizeof(entry), 1, fp) != 1)
+					break;
+
+				if (handle->hdr.info_mask & CLOCKINFO)
+					convert_summary_time(&entry, handle->info.clock.freq);
+
+				add_summary_node(root, &task, hdr.time, &entry, opts);
+			}
+		}
+		fclose(fp);
+	}
+
+	globfree(&g);
+	free(pattern);
+}
+
 static void build_function_tree(struct uftrace_data *handle, struct rb_root *root,
 				struct uftrace_opts *opts)
 {
@@ -128,12 +288,27 @@ static void build_function_tree(struct uftrace_data *handle, struct rb_root *roo
 	struct uftrace_task_reader *task;
 	uint64_t addr;
 
+	if (handle->hdr.feat_mask & AGGREGATE) {
+		build_summary_tree(handle, root, opts);
+		return;
+	}
+
 	while (read_rstack(handle, &task) >= 0 && !uftrace_done) {
 		rstack = task->rstack;
 
 		if (rstack->type != UFTRACE_LOST)
 			task->timestamp_last = rstack->time;
 
+		/* it might be recorded out of any function (at exit) */
+		if (rstack->type == UFTRACE_EVENT && rstack->addr == EVENT_ID_THROTTLE) {
+			add_throttle_node(task, rstack->time);
+			continue;
+		}
+		if (rstack->type == UFTRACE_EVENT && rstack->addr == EVENT_ID_SAMPLE) {
+			add_sample_node(task, rstack->time);
+			continue;
+		}
+
 		if (!fstack_check_opts(task, opts))
 			continue;
 
@@ -233,6 +408,17 @@ static void print_function(struct uftrace_report_node *node, void *unused, int s
 	pr_out("\n");
 }
 
+static void print_throttle(struct uftrace_report_node *node, void *unused, int space)
+{
+	pr_out("%*s%10" PRIu64 "  %s\n", space, "", node->call, node->name);
+}
+
+static void print_sample(struct uftrace_report_node *node, void *unused, int space)
+{
+	pr_out("%*s%10" PRIu64 "  %10" PRIu64 "  %s\n", space, "", node->call, node->total.sum,
+	       node->name);
+}
+
 static void print_line(struct list_head *output_fields, int space)
 {
 	struct display_field *field;
@@ -275,6 +461,21 @@ static void report_functions(struct uftrace_data *handle, struct uftrace_opts *o
 
 	print_line(&output_fields, field_space);
 	print_and_delete(&sort_root, true, NULL, print_function, field_space);
+
+	if (!RB_EMPTY_ROOT(&throttle_root)) {
+		pr_out("\n%*s%10s  %s\n", field_space, "", "Dropped", "Function (throttled)");
+		pr_out("%*s==========  ====================\n", field_space, "");
+		print_and_delete(&throttle_root, false, NULL, print_throttle, field_space);
+	}
+
+	if (!RB_EMPTY_ROOT(&sample_root)) {
+		pr_out("\n%*s%10s  %10s  %s\n", field_space, "", "Sampled", "Estimated",
+		       "Function (sampled)");
+		pr_out("%*s==========  ==========  ====================\n", field_space, "");
+		print_and_delete(&sample_root, false, NULL, print_sample, field_space);
+	}
+
+	print_auto_unpatch(handle);
 }
 
 static void add_remaining_task_fstack(struct uftrace_data *handle, struct rb_root *root)
@@ -510,6 +711,12 @@ int command_report(int argc, char *argv[], struct uftrace_opts *opts)
 		return -1;
 	}
 
+	if (opts->show_task && (handle.hdr.feat_mask & AGGREGATE)) {
+		pr_use("--task is not supported for data recorded with --aggregate\n");
+		close_data_file(opts, &handle);
+		return -1;
+	}
+
 	fstack_setup_filters(opts, &handle);
 
 	if (opts->diff) {
@@ -12,10 +12,14 @@
  * -. find original code from hashmap
  * -. unpatch function
  */
+#include <errno.h>
 #include <link.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 /* This should be defined before #include "utils.h" */
 #define PR_FMT "dynamic"
@@ -38,6 +42,9 @@ static struct mcount_dynamic_stats {
 	int skipped;
 	int nomatch;
 	int unpatch;
+	/* elapsed time (in nsec) to disassemble and to write the code */
+	uint64_t plan_time;
+	uint64_t patch_time;
 } stats;
 
 #define PAGE_SIZE 4096
@@ -60,6 +67,16 @@ static unsigned min_size;
 /* disassembly engine for dynamic code patch (for capstone) */
 static struct mcount_disasm_engine disasm;
 
+/* number of threads to disassemble functions and their engines */
+static int patch_jobs = 1;
+static struct mcount_disasm_engine *job_disasm;
+
+/* directory to save the patch plans of each module (or NULL) */
+static char *patch_cache_dir;
+
+/* protects bad_syms list in mdi while planning the patch in parallel */
+static pthread_mutex_t badsym_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct mcount_orig_insn *create_code(struct Hashmap *map, unsigned long addr)
 {
 	struct mcount_orig_insn *entry;
@@ -79,12 +96,38 @@ static struct mcount_orig_insn *lookup_code(struct Hashmap *map, unsigned long a
 	return entry;
 }
 
-static struct code_page *alloc_codepage(void)
+/*
+ * The entry stubs are called by a (rel32) call instruction in the
+ * patched function so the code page should be close to it.
+ */
+#define CODE_NEAR_DIST (1UL << 30)
+#define CODE_NEAR_MAX ((1UL << 31) - CODE_CHUNK)
+
+/* mmap() ignored the hint, do not try to put code pages near the code again */
+static bool code_near_failed;
+
+static bool code_in_reach(struct code_page *cp, unsigned long addr)
+{
+	unsigned long page = (unsigned long)cp->page;
+
+	if (page > addr)
+		return page - addr < CODE_NEAR_MAX;
+	return addr - page < CODE_NEAR_MAX;
+}
+
+static struct code_page *alloc_codepage(unsigned long near)
 {
 	struct code_page *cp;
+	void *hint = NULL;
+
+	/* the space below the module is usually free, unless it's too low */
+	if (near > 2 * CODE_NEAR_DIST)
+		hint = PAGE_ADDR(near - CODE_NEAR_DIST);
+	else if (near)
+		hint = PAGE_ADDR(near + CODE_NEAR_DIST);
 
 	cp = xzalloc(sizeof(*cp));
-	cp->page = mmap(NULL, CODE_CHUNK, PROT_READ | PROT_WRITE | PROT_EXEC,
+	cp->page = mmap(hint, CODE_CHUNK, PROT_READ | PROT_WRITE | PROT_EXEC,
 			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
 	if (cp->page == MAP_FAILED)
@@ -94,56 +137,70 @@ static struct code_page *alloc_codepage(void)
 	return cp;
 }
 
-void mcount_save_code(struct mcount_disasm_info *info, unsigned call_size, void *jmp_insn,
-		      unsigned jmp_size)
+struct mcount_orig_insn *mcount_save_code(struct mcount_disasm_info *info, unsigned call_size,
+					  void *jmp_insn, unsigned jmp_size)
 {
 	struct code_page *cp = NULL;
 	struct mcount_orig_insn *orig;
+	unsigned long near;
 	int patch_size;
 
+	/* it'd call the trampoline directly without the stub */
+	if (code_near_failed)
+		info->stub_size = 0;
+	near = info->stub_size ? info->addr : 0;
+
 	if (unlikely(info->modified)) {
 		/* it needs to save original instructions as well */
 		int orig_size = ALIGN(info->orig_size, 16);
 		int copy_size = ALIGN(info->copy_size + jmp_size, 16);
 		int table_size = mcount_arch_branch_table_size(info);
 
-		patch_size = ALIGN(copy_size + orig_size + table_size, 32);
+		patch_size = ALIGN(info->stub_size + copy_size + orig_size + table_size, 32);
 	}
 	else {
-		patch_size = ALIGN(info->copy_size + jmp_size, 32);
+		patch_size = ALIGN(info->stub_size + info->copy_size + jmp_size, 32);
 	}
 
 	if (!list_empty(&code_pages))
 		cp = list_last_entry(&code_pages, struct code_page, list);
 
-	if (cp == NULL || (cp->pos + patch_size > CODE_CHUNK)) {
-		cp = alloc_codepage();
-	}
-
-	orig = create_code(code_hmap, info->addr + call_size);
-
 	/*
 	 * if dynamic patch has been processed before, cp be frozen by
 	 * calling freeze_code. so, when reaching here from the
 	 * mcount_handle_dlopen, cp unwriteable.
+	 *
+	 * [Caution]
+	 * even if a little memory loss occurs, it can be dangerous
+	 * that to re-assigned write and execute permission to exist
+	 * codepage, so be sure to allocate new memory.
 	 */
-	if (cp->frozen) {
-		/* [Caution]
-		 * even if a little memory loss occurs, it can be dangerous
-		 * that to re-assigned write and execute permission to exist
-		 * codepage, so be sure to allocate new memory.
-		 */
-		cp = alloc_codepage();
+	if (cp == NULL || cp->frozen || (cp->pos + patch_size > CODE_CHUNK) ||
+	    (near && !code_in_reach(cp, near))) {
+		cp = alloc_codepage(near);
+
+		/* the page is still usable for other functions (without stubs) */
+		if (near && !code_in_reach(cp, near)) {
+			pr_dbg("cannot allocate code page near %lx, entry stubs are not used\n",
+			       near);
+			code_near_failed = true;
+		}
 	}
 
-	orig->insn = cp->page + cp->pos;
+	orig = create_code(code_hmap, info->addr + call_size);
+
+	orig->stub = NULL;
+	if (info->stub_size && code_in_reach(cp, near))
+		orig->stub = cp->page + cp->pos;
+
+	orig->insn = cp->page + cp->pos + info->stub_size;
 	orig->orig = orig->insn;
 	orig->orig_size = info->orig_size;
 	orig->insn_size = info->copy_size + jmp_size;
 
 	if (info->modified) {
 		/* save original instructions before modification */
-		orig->orig = orig->insn + patch_size - ALIGN(info->orig_size, 16);
+		orig->orig = cp->page + cp->pos + patch_size - ALIGN(info->orig_size, 16);
 		memcpy(orig->orig, (void *)info->addr, info->orig_size);
 
 		mcount_arch_patch_branch(info, orig);
@@ -153,20 +210,43 @@ void mcount_save_code(struct mcount_disasm_info *info, unsigned call_size, void
 	memcpy(orig->insn + info->copy_size, jmp_insn, jmp_size);
 
 	cp->pos += patch_size;
+	return orig;
+}
+
+static void freeze_code_range(void *start, void *end)
+{
+	if (start == end)
+		return;
+
+	if (mprotect(start, end - start, PROT_READ | PROT_EXEC) < 0)
+		pr_err("mprotect to freeze code page failed");
 }
 
 void mcount_freeze_code(void)
 {
 	struct code_page *cp;
+	void *start = NULL;
+	void *end = NULL;
 
+	/* code pages are usually next to each other, change them at once */
 	list_for_each_entry(cp, &code_pages, list) {
 		if (cp->frozen)
 			continue;
 
-		if (mprotect(cp->page, CODE_CHUNK, PROT_READ | PROT_EXEC) < 0)
-			pr_err("mprotect to freeze code page failed");
+		if (cp->page == end) {
+			end += CODE_CHUNK;
+		}
+		else if (cp->page + CODE_CHUNK == start) {
+			start = cp->page;
+		}
+		else {
+			freeze_code_range(start, end);
+			start = cp->page;
+			end = cp->page + CODE_CHUNK;
+		}
 		cp->frozen = true;
 	}
+	freeze_code_range(start, end);
 }
 
 void *mcount_find_code(unsigned long addr)
@@ -230,6 +310,24 @@ __weak int mcount_unpatch_func(struct mcount_dynamic_info *mdi, struct uftrace_s
 	return -1;
 }
 
+/* do nothing in advance if the arch doesn't split the patch into two steps */
+__weak int mcount_plan_func(struct mcount_dynamic_info *mdi, struct mcount_disasm_info *info,
+			    struct mcount_disasm_engine *disasm, unsigned min_size)
+{
+	return INSTRUMENT_SUCCESS;
+}
+
+__weak int mcount_patch_planned(struct mcount_dynamic_info *mdi, struct mcount_disasm_info *info,
+				struct mcount_disasm_engine *disasm, unsigned min_size)
+{
+	return mcount_patch_func(mdi, info->sym, disasm, min_size);
+}
+
+__weak int mcount_arch_unpatch_runtime(unsigned long addr)
+{
+	return INSTRUMENT_SKIPPED;
+}
+
 __weak void mcount_arch_find_module(struct mcount_dynamic_info *mdi, struct uftrace_symtab *symtab)
 {
 }
@@ -495,10 +593,9 @@ static bool skip_sym(struct uftrace_symbol *sym, struct mcount_dynamic_info *mdi
 	return false;
 }
 
-static void mcount_patch_func_with_stats(struct mcount_dynamic_info *mdi,
-					 struct uftrace_symbol *sym)
+static void update_patch_stats(int result)
 {
-	switch (mcount_patch_func(mdi, sym, &disasm, min_size)) {
+	switch (result) {
 	case INSTRUMENT_FAILED:
 		stats.failed++;
 		break;
@@ -512,6 +609,112 @@ static void mcount_patch_func_with_stats(struct mcount_dynamic_info *mdi,
 	stats.total++;
 }
 
+static void mcount_patch_func_with_stats(struct mcount_dynamic_info *mdi,
+					 struct uftrace_symbol *sym)
+{
+	update_patch_stats(mcount_patch_func(mdi, sym, &disasm, min_size));
+}
+
+static uint64_t patch_gettime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* max number of threads to plan the patch */
+#define PATCH_JOBS_MAX 64
+
+/* number of functions to plan (and patch) at once */
+#define PATCH_BATCH 4096
+/* it's not worth to create threads for a small number of functions */
+#define PATCH_PARALLEL_MIN 256
+
+struct patch_plan {
+	struct mcount_disasm_info info;
+	int state;
+	bool cached;
+};
+
+struct patch_planner {
+	struct mcount_dynamic_info *mdi;
+	struct patch_plan *plans;
+	unsigned nr_plans;
+	unsigned next;
+};
+
+struct patch_job {
+	pthread_t thread;
+	struct patch_planner *planner;
+	struct mcount_disasm_engine *disasm;
+};
+
+static void *plan_funcs_job(void *arg)
+{
+	struct patch_job *job = arg;
+	struct patch_planner *planner = job->planner;
+	struct patch_plan *plan;
+	unsigned i;
+
+	while ((i = __atomic_fetch_add(&planner->next, 1, __ATOMIC_RELAXED)) < planner->nr_plans) {
+		plan = &planner->plans[i];
+		if (plan->cached)
+			continue;
+
+		plan->state = mcount_plan_func(planner->mdi, &plan->info, job->disasm, min_size);
+	}
+	return NULL;
+}
+
+/*
+ * Disassemble the functions and check if they can be patched.  It
+ * doesn't change the code so can be done in parallel (each thread has
+ * its own disasm engine).  The current thread works as the first job.
+ */
+static void plan_funcs(struct mcount_dynamic_info *mdi, struct patch_plan *plans, unsigned nr)
+{
+	struct patch_planner planner = {
+		.mdi = mdi,
+		.plans = plans,
+		.nr_plans = nr,
+	};
+	struct patch_job *jobs;
+	int nr_jobs = 1;
+	int i;
+
+	jobs = xcalloc(patch_jobs, sizeof(*jobs));
+	jobs[0].planner = &planner;
+	jobs[0].disasm = &disasm;
+
+	if (mdi->type == DYNAMIC_NONE && nr >= PATCH_PARALLEL_MIN && patch_jobs > 1) {
+		if (job_disasm == NULL) {
+			job_disasm = xcalloc(patch_jobs - 1, sizeof(*job_disasm));
+			for (i = 0; i < patch_jobs - 1; i++)
+				mcount_disasm_init(&job_disasm[i]);
+		}
+
+		for (i = 1; i < patch_jobs; i++) {
+			jobs[i].planner = &planner;
+			jobs[i].disasm = &job_disasm[i - 1];
+
+			errno = pthread_create(&jobs[i].thread, NULL, plan_funcs_job, &jobs[i]);
+			if (errno) {
+				pr_dbg("cannot start patch job: %m\n");
+				break;
+			}
+			nr_jobs++;
+		}
+	}
+
+	plan_funcs_job(&jobs[0]);
+
+	for (i = 1; i < nr_jobs; i++)
+		pthread_join(jobs[i].thread, NULL);
+
+	free(jobs);
+}
+
 static void patch_patchable_func_matched(struct mcount_dynamic_info *mdi, struct uftrace_mmap *map)
 {
 	struct uftrace_symtab *symtab;
@@ -555,26 +758,64 @@ static void patch_patchable_func_matched(struct mcount_dynamic_info *mdi, struct
 static void patch_normal_func_matched(struct mcount_dynamic_info *mdi, struct uftrace_mmap *map)
 {
 	struct uftrace_symtab *symtab;
-	unsigned i;
+	unsigned i = 0, k, nr;
 	struct uftrace_symbol *sym;
+	struct patch_plan *plans;
+	struct patch_cache *cache = NULL;
 	bool found = false;
 	char *soname = get_soname(map->libname);
+	uint64_t t0, t1;
 
 	symtab = &map->mod->symtab;
+	plans = xmalloc(PATCH_BATCH * sizeof(*plans));
 
-	for (i = 0; i < symtab->nr_sym; i++) {
-		sym = &symtab->sym[i];
+	if (mdi->type == DYNAMIC_NONE)
+		cache = patch_cache_open(mdi, patch_cache_dir, min_size);
 
-		if (skip_sym(sym, mdi, map, soname))
-			continue;
+	while (i < symtab->nr_sym) {
+		/* it might unpatch some functions, keep it serialized */
+		for (nr = 0; nr < PATCH_BATCH && i < symtab->nr_sym; i++) {
+			sym = &symtab->sym[i];
+
+			if (skip_sym(sym, mdi, map, soname))
+				continue;
+
+			memset(&plans[nr].info, 0, sizeof(plans[nr].info));
+			plans[nr].info.sym = sym;
+			plans[nr].cached = patch_cache_find(cache, &plans[nr].info, &plans[nr].state);
+			nr++;
+		}
 
+		if (nr == 0)
+			break;
 		found = true;
-		mcount_patch_func_with_stats(mdi, sym);
+
+		t0 = patch_gettime();
+		plan_funcs(mdi, plans, nr);
+		t1 = patch_gettime();
+
+		for (k = 0; k < nr; k++) {
+			if (!plans[k].cached)
+				patch_cache_add(cache, &plans[k].info, plans[k].state);
+		}
+
+		/* only the code writes are serialized */
+		for (k = 0; k < nr; k++) {
+			if (plans[k].state == INSTRUMENT_SUCCESS)
+				plans[k].state = mcount_patch_planned(mdi, &plans[k].info, &disasm,
+								      min_size);
+			update_patch_stats(plans[k].state);
+		}
+
+		stats.plan_time += t1 - t0;
+		stats.patch_time += patch_gettime() - t1;
 	}
 
 	if (!found)
 		stats.nomatch++;
 
+	patch_cache_close(cache);
+	free(plans);
 	free(soname);
 }
 
@@ -587,8 +828,12 @@ static void patch_func_matched(struct mcount_dynamic_info *mdi, struct uftrace_m
 	 * looping over all the symbols available and check if the function
 	 * begins with NOP patterns for patchable function entry.
 	 */
-	if (mdi->type == DYNAMIC_PATCHABLE)
+	if (mdi->type == DYNAMIC_PATCHABLE) {
+		uint64_t t0 = patch_gettime();
+
 		patch_patchable_func_matched(mdi, map);
+		stats.patch_time += patch_gettime() - t0;
+	}
 	else
 		patch_normal_func_matched(mdi, map);
 }
@@ -642,6 +887,28 @@ static void freeze_dynamic_update(void)
 	mcount_freeze_code();
 }
 
+/* $XDG_CACHE_HOME/uftrace/patch or ~/.cache/uftrace/patch */
+static void setup_patch_cache(void)
+{
+	/* the plan is meaningful only with the disassembler */
+#ifdef HAVE_LIBCAPSTONE
+	char *dir;
+
+	if (getenv("UFTRACE_NO_PATCH_CACHE"))
+		return;
+
+	dir = getenv("XDG_CACHE_HOME");
+	if (dir && *dir) {
+		xasprintf(&patch_cache_dir, "%s/uftrace/patch", dir);
+		return;
+	}
+
+	dir = getenv("HOME");
+	if (dir && *dir)
+		xasprintf(&patch_cache_dir, "%s/.cache/uftrace/patch", dir);
+#endif
+}
+
 /* do not use floating-point in libmcount */
 static int calc_percent(int n, int total, int *rem)
 {
@@ -656,6 +923,7 @@ int mcount_dynamic_update(struct uftrace_sym_info *sinfo, char *patch_funcs,
 {
 	int ret = 0;
 	char *size_filter;
+	char *jobs_str;
 	bool needs_modules = !!strchr(patch_funcs, '@');
 
 	mcount_disasm_init(&disasm);
@@ -666,8 +934,24 @@ int mcount_dynamic_update(struct uftrace_sym_info *sinfo, char *patch_funcs,
 	if (size_filter != NULL)
 		min_size = strtoul(size_filter, NULL, 0);
 
+	jobs_str = getenv("UFTRACE_PATCH_JOBS");
+	if (jobs_str != NULL)
+		patch_jobs = strtol(jobs_str, NULL, 0);
+	else
+		patch_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (patch_jobs > PATCH_JOBS_MAX)
+		patch_jobs = PATCH_JOBS_MAX;
+	if (patch_jobs < 1)
+		patch_jobs = 1;
+
+	setup_patch_cache();
+
 	ret = do_dynamic_update(sinfo, patch_funcs, ptype);
 
+	pr_dbg("dynamic patch time: plan %" PRIu64 " usec, patch %" PRIu64 " usec (%d jobs)\n",
+	       stats.plan_time / 1000, stats.patch_time / 1000, patch_jobs);
+
 	if (stats.total && stats.failed) {
 		int success = stats.total - stats.failed - stats.skipped;
 		int r, q;
@@ -731,10 +1015,276 @@ void mcount_dynamic_dlopen(struct uftrace_sym_info *sinfo, struct dl_phdr_info *
 
 void mcount_dynamic_finish(void)
 {
+	int i;
+
 	release_pattern_list();
 	mcount_disasm_finish(&disasm);
+
+	free(patch_cache_dir);
+	patch_cache_dir = NULL;
+
+	if (job_disasm) {
+		for (i = 0; i < patch_jobs - 1; i++)
+			mcount_disasm_finish(&job_disasm[i]);
+		free(job_disasm);
+		job_disasm = NULL;
+	}
+}
+
+/* initial number of entries in the call stats table, should be a power of 2 */
+#define UNPATCH_TABLE_SIZE 64
+
+/* name of the file in the data directory to log auto-unpatched functions */
+#define UNPATCH_LOG_FILE "unpatch.txt"
+
+bool mcount_auto_unpatch;
+
+static struct uftrace_sym_info *unpatch_sinfo;
+static uint64_t unpatch_rate;
+static uint64_t unpatch_time;
+static uint64_t unpatch_window;
+static pthread_mutex_t unpatch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* call stats of dynamically patched functions (from all threads) */
+struct mcount_unpatch_entry {
+	unsigned long addr;
+	uint64_t window;
+	uint64_t count;
+	uint64_t time;
+};
+
+/* the table doesn't grow so that threads can update it without a lock */
+static struct mcount_unpatch_entry *unpatch_table;
+static unsigned unpatch_size;
+static unsigned unpatch_nr;
+
+/* @unpatch_str is "RATE,TIME" where TIME is the duration floor in nsec */
+void setup_auto_unpatch(struct uftrace_sym_info *sinfo, char *unpatch_str)
+{
+	char *pos;
+
+	unpatch_rate = strtoull(unpatch_str, &pos, 0);
+	if (*pos == ',')
+		unpatch_time = strtoull(pos + 1, NULL, 0);
+
+	if (unpatch_rate == 0 || unpatch_time == 0)
+		return;
+
+	pr_dbg("auto-unpatch functions called over %" PRIu64 "/sec under %" PRIu64 " nsec\n",
+	       unpatch_rate, unpatch_time);
+
+	/* keep the load factor below 1/2 for the patched functions */
+	unpatch_size = UNPATCH_TABLE_SIZE;
+	while (unpatch_size < (unsigned)stats.total * 2)
+		unpatch_size *= 2;
+	unpatch_table = xcalloc(unpatch_size, sizeof(*unpatch_table));
+
+	unpatch_sinfo = sinfo;
+	unpatch_time = mcount_nsec_to_time(unpatch_time);
+	unpatch_window = mcount_nsec_to_time(NSEC_PER_SEC);
+	mcount_auto_unpatch = true;
+}
+
+static struct mcount_unpatch_entry *get_unpatch_entry(unsigned long addr)
+{
+	unsigned idx = hash_addr(addr, unpatch_size);
+
+	while (true) {
+		struct mcount_unpatch_entry *entry = &unpatch_table[idx];
+		unsigned long old = __atomic_load_n(&entry->addr, __ATOMIC_ACQUIRE);
+
+		if (old == addr)
+			return entry;
+
+		if (old == 0) {
+			/* functions patched later are not counted */
+			if (__atomic_load_n(&unpatch_nr, __ATOMIC_RELAXED) * 2 >= unpatch_size)
+				return NULL;
+
+			if (__atomic_compare_exchange_n(&entry->addr, &old, addr, false,
+							__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				__atomic_fetch_add(&unpatch_nr, 1, __ATOMIC_RELAXED);
+				return entry;
+			}
+			if (old == addr)
+				return entry;
+		}
+
+		idx = (idx + 1) & (unpatch_size - 1);
+	}
+}
+
+static void log_auto_unpatch(struct mcount_thread_data *mtdp, unsigned long addr,
+			     uint64_t count, uint64_t time, uint64_t timestamp)
+{
+	struct uftrace_symbol *sym = find_symtabs(unpatch_sinfo, addr);
+	char *symname = symbol_getname(sym, addr);
+	char *filename = NULL;
+	uint64_t avg = time / count;
+	FILE *fp;
+
+	if (mcount_use_tsc)
+		avg = tsc_to_nsec(avg, mcount_tsc_clock.freq);
+
+	xasprintf(&filename, "%s/%s", unpatch_sinfo->dirname, UNPATCH_LOG_FILE);
+	fp = fopen(filename, "a");
+	if (fp == NULL) {
+		pr_dbg("cannot open %s: %m\n", filename);
+		goto out;
+	}
+
+	fprintf(fp, "UNPATCH timestamp=%" PRIu64 ".%09" PRIu64 " tid=%d addr=%#lx",
+		timestamp / NSEC_PER_SEC, timestamp % NSEC_PER_SEC, mcount_gettid(mtdp), addr);
+	fprintf(fp, " calls=%" PRIu64 " avg=%" PRIu64 " name=%s\n", count, avg, symname);
+	fclose(fp);
+
+out:
+	free(filename);
+	symbol_putname(sym, symname);
+}
+
+/* returns the current protection of the page, or -1 if not found */
+static int get_page_prot(unsigned long page)
+{
+	FILE *fp;
+	char buf[PATH_MAX];
+	int prot = -1;
+
+	fp = fopen("/proc/self/maps", "r");
+	if (fp == NULL)
+		return -1;
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		char *next;
+		unsigned long start, end;
+
+		start = strtoul(buf, &next, 16);
+		end = strtoul(next + 1, &next, 16);
+		if (page < start || page >= end)
+			continue;
+
+		/* prot: rwxp */
+		next++;
+		prot = PROT_NONE;
+		if (next[0] == 'r')
+			prot |= PROT_READ;
+		if (next[1] == 'w')
+			prot |= PROT_WRITE;
+		if (next[2] == 'x')
+			prot |= PROT_EXEC;
+		break;
+	}
+	fclose(fp);
+
+	return prot;
+}
+
+static void unpatch_hot_func(struct mcount_thread_data *mtdp, unsigned long addr, uint64_t count,
+			     uint64_t time, uint64_t timestamp)
+{
+	/* it might touch a few bytes before and after the (return) address */
+	unsigned long pages[2] = {
+		(unsigned long)PAGE_ADDR(addr - 16),
+		(unsigned long)PAGE_ADDR(addr + 16),
+	};
+	int prot[2];
+	int i, ret;
+
+#ifndef DISABLE_MCOUNT_FILTER
+	/* keep functions that user asked for */
+	if (mcount_has_trigger(addr))
+		return;
+#endif
+
+	pthread_mutex_lock(&unpatch_lock);
+
+	/* the page might be writable already (e.g. not frozen yet), keep it */
+	for (i = 0; i < 2; i++) {
+		prot[i] = get_page_prot(pages[i]);
+		if (prot[i] < 0) {
+			pr_dbg("cannot find protection of %#lx\n", pages[i]);
+			goto out;
+		}
+		if (prot[i] & PROT_WRITE)
+			continue;
+
+		if (mprotect((void *)pages[i], PAGE_SIZE, prot[i] | PROT_WRITE) < 0) {
+			pr_dbg("cannot unpatch %#lx due to protection: %m\n", addr);
+			goto restore;
+		}
+	}
+
+	ret = mcount_arch_unpatch_runtime(addr);
+	if (ret == INSTRUMENT_SUCCESS)
+		log_auto_unpatch(mtdp, addr, count, time, timestamp);
+
+restore:
+	while (--i >= 0) {
+		if (prot[i] & PROT_WRITE)
+			continue;
+		if (mprotect((void *)pages[i], PAGE_SIZE, prot[i]) < 0)
+			pr_err("cannot restore protection after unpatch");
+	}
+
+out:
+	pthread_mutex_unlock(&unpatch_lock);
+}
+
+/*
+ * Count calls and total time of dynamically patched functions in a
+ * second (from all threads).  If a function reached the given rate
+ * within a second but ran shorter than the given time on average, it's
+ * not worth the overhead.  Restore the original code so that it won't
+ * be traced anymore.
+ */
+void check_auto_unpatch(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack)
+{
+	struct mcount_unpatch_entry *entry;
+	uint64_t window, count, time;
+
+	/* PLT hooks are not patched */
+	if (rstack->dyn_idx != MCOUNT_INVALID_DYNIDX || rstack->end_time == 0)
+		return;
+
+	entry = get_unpatch_entry(rstack->child_ip);
+	if (entry == NULL)
+		return;
+
+	/* other threads might start a new window with a later time */
+	window = __atomic_load_n(&entry->window, __ATOMIC_RELAXED);
+	if ((int64_t)(rstack->end_time - window) >= (int64_t)unpatch_window &&
+	    __atomic_compare_exchange_n(&entry->window, &window, rstack->end_time, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&entry->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&entry->time, 0, __ATOMIC_RELAXED);
+	}
+
+	time = __atomic_add_fetch(&entry->time, rstack->end_time - rstack->start_time,
+				  __ATOMIC_RELAXED);
+	count = __atomic_add_fetch(&entry->count, 1, __ATOMIC_RELAXED);
+
+	/* check only once when it reaches the rate in the window */
+	if (count == unpatch_rate && time < unpatch_time * count)
+		unpatch_hot_func(mtdp, entry->addr, count, time, rstack->end_time);
 }
 
+static struct dynamic_bad_symbol *find_badsym(struct mcount_dynamic_info *mdi,
+					       struct uftrace_symbol *sym)
+{
+	struct dynamic_bad_symbol *badsym;
+
+	list_for_each_entry(badsym, &mdi->bad_syms, list) {
+		if (badsym->sym == sym)
+			return badsym;
+	}
+
+	return NULL;
+}
+
+/*
+ * Callers don't patch the function if it's found, so mark it as reverted
+ * here (under the lock as other jobs might look at it).
+ */
 struct dynamic_bad_symbol *mcount_find_badsym(struct mcount_dynamic_info *mdi, unsigned long addr)
 {
 	struct uftrace_symbol *sym;
@@ -744,12 +1294,13 @@ struct dynamic_bad_symbol *mcount_find_badsym(struct mcount_dynamic_info *mdi, u
 	if (sym == NULL)
 		return NULL;
 
-	list_for_each_entry(badsym, &mdi->bad_syms, list) {
-		if (badsym->sym == sym)
-			return badsym;
-	}
+	pthread_mutex_lock(&badsym_lock);
+	badsym = find_badsym(mdi, sym);
+	if (badsym != NULL)
+		badsym->reverted = true;
+	pthread_mutex_unlock(&badsym_lock);
 
-	return NULL;
+	return badsym;
 }
 
 bool mcount_add_badsym(struct mcount_dynamic_info *mdi, unsigned long callsite,
@@ -758,28 +1309,52 @@ bool mcount_add_badsym(struct mcount_dynamic_info *mdi, unsigned long callsite,
 	struct uftrace_symbol *sym;
 	struct dynamic_bad_symbol *badsym;
 
-	if (mcount_find_badsym(mdi, target))
-		return true;
-
 	sym = find_sym(&mdi->map->mod->symtab, target - mdi->map->start);
 	if (sym == NULL)
 		return true;
 
+	pthread_mutex_lock(&badsym_lock);
+
+	if (find_badsym(mdi, sym))
+		goto out;
+
 	/* only care about jumps to the middle of a function */
-	if (sym->addr + mdi->map->start == target)
+	if (sym->addr + mdi->map->start == target) {
+		pthread_mutex_unlock(&badsym_lock);
 		return false;
+	}
 
-	pr_dbg2("bad jump: %s:%lx to %lx\n", sym ? sym->name : "<unknown>",
-		callsite - mdi->map->start, target - mdi->map->start);
+	pr_dbg2("bad jump: %s:%lx to %lx\n", sym->name, callsite - mdi->map->start,
+		target - mdi->map->start);
 
 	badsym = xmalloc(sizeof(*badsym));
 	badsym->sym = sym;
 	badsym->reverted = false;
 
 	list_add_tail(&badsym->list, &mdi->bad_syms);
+out:
+	pthread_mutex_unlock(&badsym_lock);
 	return true;
 }
 
+/* add the symbol known to be bad (from the patch cache) */
+void mcount_mark_badsym(struct mcount_dynamic_info *mdi, struct uftrace_symbol *sym)
+{
+	struct dynamic_bad_symbol *badsym;
+
+	pthread_mutex_lock(&badsym_lock);
+
+	if (find_badsym(mdi, sym) == NULL) {
+		badsym = xmalloc(sizeof(*badsym));
+		badsym->sym = sym;
+		badsym->reverted = false;
+
+		list_add_tail(&badsym->list, &mdi->bad_syms);
+	}
+
+	pthread_mutex_unlock(&badsym_lock);
+}
+
 void mcount_free_badsym(struct mcount_dynamic_info *mdi)
 {
 	struct dynamic_bad_symbol *badsym, *tmp;
@@ -805,16 +1380,30 @@ TEST_CASE(dynamic_find_code)
 		.orig_size = 2,
 		.copy_size = 4,
 	};
+	struct mcount_disasm_info info3 = {
+		.addr = (unsigned long)&info3,
+		.insns = { 0xe1, 0xe2, 0xe3, 0xe4, },
+		.orig_size = 4,
+		.copy_size = 4,
+		.stub_size = 16,
+	};
 	uint8_t jmp_insn[] = { 0xcc };
+	struct mcount_orig_insn *orig;
 	uint8_t *insn;
 
 	pr_dbg("create hash map to search code\n");
 	code_hmap = hashmap_create(4, hashmap_ptr_hash, hashmap_ptr_equals);
 
 	pr_dbg("save fake code to the hash\n");
-	mcount_save_code(&info1, 0, jmp_insn, sizeof(jmp_insn));
+	orig = mcount_save_code(&info1, 0, jmp_insn, sizeof(jmp_insn));
+	TEST_EQ(orig->stub, NULL);
 	mcount_save_code(&info2, 0, jmp_insn, sizeof(jmp_insn));
 
+	pr_dbg("save fake code with an entry stub\n");
+	orig = mcount_save_code(&info3, 0, jmp_insn, sizeof(jmp_insn));
+	TEST_NE(orig->stub, NULL);
+	TEST_EQ(orig->stub + info3.stub_size, orig->insn);
+
 	pr_dbg("freeze the code page\n");
 	mcount_freeze_code();
 
@@ -828,6 +1417,11 @@ TEST_CASE(dynamic_find_code)
 	TEST_NE(insn, NULL);
 	TEST_MEMEQ(insn, info2.insns, info2.orig_size);
 
+	pr_dbg("finding the code after the stub\n");
+	insn = mcount_find_code(info3.addr);
+	TEST_EQ(insn, orig->insn);
+	TEST_MEMEQ(insn, info3.insns, info3.orig_size);
+
 	pr_dbg("release the code page and hash\n");
 	mcount_release_code();
 	return TEST_OK;
@@ -926,6 +1520,7 @@ static void cleanup_test_map(struct mcount_dynamic_info *mdi)
 TEST_CASE(dynamic_find_badsym)
 {
 	struct test_map_data tmd = {};
+	struct dynamic_bad_symbol *badsym;
 	unsigned long base;
 
 	pr_dbg("setup test map info\n");
@@ -938,7 +1533,9 @@ TEST_CASE(dynamic_find_badsym)
 
 	pr_dbg("finding bad symbols\n");
 	TEST_EQ(mcount_find_badsym(tmd.mdi, base + 0x100), NULL);
-	TEST_NE(mcount_find_badsym(tmd.mdi, base + 0x234), NULL); /* found */
+	badsym = mcount_find_badsym(tmd.mdi, base + 0x234);
+	TEST_NE(badsym, NULL); /* found */
+	TEST_EQ(badsym->reverted, true);
 	TEST_EQ(mcount_find_badsym(tmd.mdi, base + 0x369), NULL);
 
 	pr_dbg("cleanup test map info\n");
@@ -947,4 +1544,64 @@ TEST_CASE(dynamic_find_badsym)
 
 	return TEST_OK;
 }
+
+#define TEST_PLAN_STATE 0x1234
+
+static int run_plan_funcs(struct mcount_dynamic_info *mdi, unsigned nr)
+{
+	struct uftrace_symbol *syms;
+	struct patch_plan *plans;
+	unsigned i;
+
+	syms = xcalloc(nr, sizeof(*syms));
+	plans = xcalloc(nr, sizeof(*plans));
+
+	for (i = 0; i < nr; i++) {
+		syms[i].addr = mdi->map->start + i;
+		syms[i].size = 1;
+		plans[i].info.sym = &syms[i];
+		plans[i].state = TEST_PLAN_STATE;
+		/* the cached plans should not be changed */
+		plans[i].cached = (i % 10 == 0);
+	}
+
+	plan_funcs(mdi, plans, nr);
+
+	for (i = 0; i < nr; i++) {
+		if (plans[i].cached)
+			TEST_EQ(plans[i].state, TEST_PLAN_STATE);
+		else
+			TEST_NE(plans[i].state, TEST_PLAN_STATE);
+	}
+
+	free(plans);
+	free(syms);
+	return TEST_OK;
+}
+
+TEST_CASE(dynamic_plan_funcs)
+{
+	struct test_map_data tmd = {};
+	int saved_jobs = patch_jobs;
+
+	pr_dbg("setup test map info\n");
+	dl_iterate_phdr(setup_test_map, &tmd);
+	tmd.mdi->type = DYNAMIC_NONE;
+	patch_jobs = 4;
+
+	pr_dbg("plan a few functions in the current thread\n");
+	TEST_EQ(run_plan_funcs(tmd.mdi, PATCH_PARALLEL_MIN - 1), TEST_OK);
+	TEST_EQ(job_disasm, NULL);
+
+	pr_dbg("plan many functions with %d jobs\n", patch_jobs);
+	TEST_EQ(run_plan_funcs(tmd.mdi, PATCH_PARALLEL_MIN * 4 + 1), TEST_OK);
+	TEST_NE(job_disasm, NULL);
+
+	pr_dbg("cleanup test map info\n");
+	mcount_dynamic_finish();
+	patch_jobs = saved_jobs;
+	cleanup_test_map(tmd.mdi);
+
+	return TEST_OK;
+}
 #endif /* UNIT_TEST */
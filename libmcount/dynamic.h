@@ -20,6 +20,7 @@
 /* target instrumentation function it needs to call */
 extern void __fentry__(void);
 extern void __dentry__(void);
+extern void __dentry_direct__(void);
 extern void __xray_entry(void);
 extern void __xray_exit(void);
 
@@ -75,6 +76,12 @@ struct mcount_disasm_engine {
  */
 #define MAX_COND_BRANCH 3
 
+/*
+ * An absolute address in the modified instructions takes 8 bytes after
+ * (at least) 2 bytes of opcode.  So it cannot have more than this.
+ */
+#define MAX_INSN_RELOC 8
+
 int mcount_dynamic_update(struct uftrace_sym_info *sinfo, char *patch_funcs,
 			  enum uftrace_pattern_type ptype);
 void mcount_dynamic_dlopen(struct uftrace_sym_info *sinfo, struct dl_phdr_info *info, char *path);
@@ -85,6 +92,8 @@ struct mcount_orig_insn {
 	unsigned long addr;
 	void *orig;
 	void *insn;
+	/* per-function entry stub right before @insn (or NULL) */
+	void *stub;
 	int orig_size;
 	int insn_size;
 };
@@ -107,6 +116,9 @@ struct cond_branch_info {
  * @copy_size : size of copied instructions (may be modified)
  * @modified : whether instruction is changed
  * @has_jump : whether jump_target should be added
+ * @stub_size : size of the entry stub to reserve before the insns
+ * @nr_reloc : number of absolute addresses in @insns
+ * @reloc : offsets of the (8-byte) absolute addresses in @insns
  */
 struct mcount_disasm_info {
 	struct uftrace_symbol *sym;
@@ -118,11 +130,14 @@ struct mcount_disasm_info {
 	bool has_jump;
 	bool has_intel_cet;
 	uint8_t nr_branch;
+	unsigned stub_size;
 	struct cond_branch_info branch_info[MAX_COND_BRANCH];
+	uint8_t nr_reloc;
+	uint8_t reloc[MAX_INSN_RELOC];
 };
 
-void mcount_save_code(struct mcount_disasm_info *info, unsigned call_size, void *jmp_insn,
-		      unsigned jmp_size);
+struct mcount_orig_insn *mcount_save_code(struct mcount_disasm_info *info, unsigned call_size,
+					  void *jmp_insn, unsigned jmp_size);
 void *mcount_find_code(unsigned long addr);
 struct mcount_orig_insn *mcount_find_insn(unsigned long addr);
 void mcount_freeze_code(void);
@@ -133,6 +148,11 @@ void mcount_cleanup_trampoline(struct mcount_dynamic_info *mdi);
 
 int mcount_patch_func(struct mcount_dynamic_info *mdi, struct uftrace_symbol *sym,
 		      struct mcount_disasm_engine *disasm, unsigned min_size);
+int mcount_plan_func(struct mcount_dynamic_info *mdi, struct mcount_disasm_info *info,
+		     struct mcount_disasm_engine *disasm, unsigned min_size);
+int mcount_patch_planned(struct mcount_dynamic_info *mdi, struct mcount_disasm_info *info,
+			 struct mcount_disasm_engine *disasm, unsigned min_size);
+int mcount_arch_unpatch_runtime(unsigned long addr);
 
 void mcount_disasm_init(struct mcount_disasm_engine *disasm);
 void mcount_disasm_finish(struct mcount_disasm_engine *disasm);
@@ -150,5 +170,14 @@ struct dynamic_bad_symbol *mcount_find_badsym(struct mcount_dynamic_info *mdi, u
 bool mcount_add_badsym(struct mcount_dynamic_info *mdi, unsigned long callsite,
 		       unsigned long target);
 void mcount_free_badsym(struct mcount_dynamic_info *mdi);
+void mcount_mark_badsym(struct mcount_dynamic_info *mdi, struct uftrace_symbol *sym);
+
+struct patch_cache;
+
+struct patch_cache *patch_cache_open(struct mcount_dynamic_info *mdi, char *dirname,
+				     unsigned min_size);
+bool patch_cache_find(struct patch_cache *pc, struct mcount_disasm_info *info, int *state);
+void patch_cache_add(struct patch_cache *pc, struct mcount_disasm_info *info, int state);
+void patch_cache_close(struct patch_cache *pc);
 
 #endif /* UFTRACE_MCOUNT_DYNAMIC_H */
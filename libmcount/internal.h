@@ -11,6 +11,7 @@
 
 #include <inttypes.h>
 #include <link.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/syscall.h>
@@ -53,6 +54,13 @@ struct filter_control {
 	uint16_t saved_depth;
 	uint64_t time;
 	uint64_t saved_time;
+	/* last mcount_filter_gen applied to the filter state */
+	unsigned gen;
+	/* filter rules used by the thread, updated with the gen */
+	struct mcount_filter_rules *rules;
+	/* number of sampled functions running and state of the PRNG */
+	int sample_count;
+	uint64_t sample_state;
 };
 #else
 struct filter_control {};
@@ -64,8 +72,12 @@ struct mcount_shmem {
 	int curr;
 	int nr_buf;
 	int max_buf;
+	/* id in the buffer names: tid or pool id (--buffer-pool) */
+	int name_id;
 	bool done;
 	struct mcount_shmem_buffer **buffer;
+	struct mcount_shmem_ring *ring;
+	struct uftrace_record_base base;
 };
 
 /* first 4 byte saves the actual size of the argbuf */
@@ -98,6 +110,80 @@ struct mcount_watchpoint {
 	/* global watch points */
 };
 
+/* per-thread call count of a function with the throttle trigger */
+struct mcount_throttle_entry {
+	unsigned long addr;
+	uint64_t window;
+	unsigned count;
+	unsigned dropped;
+};
+
+struct mcount_throttle {
+	struct mcount_throttle_entry *table;
+	unsigned size;
+	unsigned nr;
+};
+
+/*
+ * per-thread scratch buffer for the tail trigger.  Records of the subtree
+ * are kept here and copied to the shmem buffer only if the root function
+ * takes longer than the threshold.  Each record has a header (its size).
+ */
+struct mcount_tail {
+	void *buf;
+	unsigned size;
+	unsigned used;
+	bool active;
+	/* rstack index of the root function */
+	int root;
+	/* first rstack (of the parents) not written when it started */
+	int first;
+	uint64_t time;
+	/* compact record base to restore when the records are discarded */
+	struct uftrace_record_base base;
+};
+
+/* the outer call is saved to find recursive calls */
+struct mcount_agg_entry {
+	struct uftrace_agg_entry stat;
+	uint64_t outer_time;
+	int outer_idx;
+};
+
+/* per-thread function summary for --aggregate (open addressing by address) */
+struct mcount_aggregate {
+	struct mcount_agg_entry *table;
+	unsigned size;
+	unsigned nr;
+	int tid;
+	/* the table is also read by the flusher thread */
+	int lock;
+	struct list_head list;
+};
+
+/* classes of libmcount hooks for the overhead accounting */
+enum mcount_overhead_class {
+	MCOUNT_OVH_ENTRY,
+	MCOUNT_OVH_EXIT,
+	MCOUNT_OVH_PLTHOOK,
+	MCOUNT_OVH_MAX,
+};
+
+/* per-thread cost of the tracing itself, saved to overhead.txt (--overhead) */
+struct mcount_overhead {
+	unsigned long count[MCOUNT_OVH_MAX];
+	uint64_t ticks[MCOUNT_OVH_MAX];
+	unsigned long nr_switch;
+	unsigned long nr_alloc;
+	unsigned long nr_lost;
+	uint64_t bytes;
+	/* to convert ticks into nsec at the end */
+	uint64_t start_tick;
+	uint64_t start_time;
+	int tid;
+	struct list_head list;
+};
+
 #ifndef DISABLE_MCOUNT_FILTER
 struct mcount_mem_regions {
 	struct rb_root root;
@@ -133,15 +219,24 @@ struct mcount_thread_data {
 	unsigned long cygprof_dummy;
 	struct mcount_ret_stack *rstack;
 	void *argbuf;
+	/* number of rstack entries and argbuf bytes usable (committed) */
+	unsigned nr_rstack;
+	unsigned argbuf_size;
 	struct filter_control filter;
 	bool enable_cached;
 	struct mcount_shmem shmem;
+	struct mcount_aggregate agg;
+	struct mcount_overhead overhead;
+	struct mcount_throttle throttle;
+	struct mcount_tail tail;
 	struct mcount_event event[MAX_EVENT];
 	int nr_events;
 	struct mcount_mem_regions mem_regions;
 	struct mcount_watchpoint watch;
 	struct mcount_arch_context arch;
 	struct list_head pmu_fds;
+	/* buffers taken from the pool (--buffer-pool) */
+	struct mcount_pool_entry *pool;
 };
 
 #ifdef HAVE_MCOUNT_ARCH_CONTEXT
@@ -174,14 +269,24 @@ bool mcount_guard_recursion(struct mcount_thread_data *mtdp);
 void mcount_unguard_recursion(struct mcount_thread_data *mtdp);
 
 extern uint64_t mcount_threshold; /* nsec */
+extern int mcount_rstack_max;
 extern pthread_key_t mtd_key;
 extern int shmem_bufsize;
+extern bool shmem_use_ring;
+extern int shmem_flight_nr_buf;
+extern bool mcount_compact_record;
+extern bool mcount_use_aggregate;
+extern bool mcount_use_overhead;
+extern bool mcount_auto_unpatch;
 extern int pfd;
+extern int shmem_fd_sock;
 extern char *mcount_exename;
 extern int page_size_in_kb;
 extern bool kernel_pid_update;
 extern bool mcount_auto_recover;
 extern bool mcount_estimate_return;
+extern bool mcount_use_tsc;
+extern struct uftrace_clock_info mcount_tsc_clock;
 
 enum mcount_global_flag {
 	MCOUNT_GFL_SETUP = (1U << 0),
@@ -216,10 +321,58 @@ static inline void mcount_watch_release(struct mcount_thread_data *mtdp)
 static inline uint64_t mcount_gettime(void)
 {
 	struct timespec ts;
+
+	if (mcount_use_tsc)
+		return host_read_tsc();
+
 	clock_gettime(clock_source, &ts);
 	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
 }
 
+/* convert a duration in nsec to the unit of mcount_gettime() */
+static inline uint64_t mcount_nsec_to_time(uint64_t nsec)
+{
+	if (mcount_use_tsc)
+		return nsec_to_tsc(nsec, mcount_tsc_clock.freq);
+	return nsec;
+}
+
+/* index of a per-thread table (of @size, a power of 2) for the function */
+static inline unsigned hash_addr(unsigned long addr, unsigned size)
+{
+	/* Fibonacci hashing: functions are usually aligned */
+	return ((uint64_t)addr * 0x9e3779b97f4a7c15ULL) >> 32 & (size - 1);
+}
+
+/* cheap timestamp to measure the overhead: TSC on x86 or nsec elsewhere */
+static inline uint64_t mcount_overhead_tick(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return host_read_tsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+#endif
+}
+
+/* account the time spent in a libmcount hook since @start */
+static inline void mcount_update_overhead(enum mcount_overhead_class cls, uint64_t start)
+{
+	struct mcount_thread_data *mtdp = get_thread_data();
+
+	if (unlikely(check_thread_data(mtdp) || mtdp->dead))
+		return;
+
+	/* do not count the time before the (re)start of the counters */
+	if (unlikely(start < mtdp->overhead.start_tick))
+		start = mtdp->overhead.start_tick;
+
+	mtdp->overhead.count[cls]++;
+	mtdp->overhead.ticks[cls] += mcount_overhead_tick() - start;
+}
+
 static inline int mcount_gettid(struct mcount_thread_data *mtdp)
 {
 	if (!mtdp->tid)
@@ -291,6 +444,41 @@ extern bool mcount_rstack_has_plthook(struct mcount_thread_data *mtdp);
 extern void prepare_shmem_buffer(struct mcount_thread_data *mtdp);
 extern void clear_shmem_buffer(struct mcount_thread_data *mtdp);
 extern void shmem_finish(struct mcount_thread_data *mtdp);
+extern void mcount_flight_snapshot(void);
+extern void mcount_flight_snapshot_trigger(void);
+extern void shmem_setup_fd_channel(const char *dirname);
+
+extern void setup_aggregate(const char *dirname);
+extern void enter_aggregate(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack);
+extern void record_aggregate(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack);
+extern void flush_all_aggregate(void);
+extern void stop_aggregate(void);
+extern void reset_aggregate(struct mcount_thread_data *mtdp);
+extern void finish_aggregate(struct mcount_thread_data *mtdp);
+
+extern struct mcount_shmem_buffer *allocate_shmem_buffer(char *sess_id, size_t size, int tid,
+							 int idx);
+
+extern struct mcount_ret_stack *mcount_alloc_rstack(void);
+extern void mcount_free_rstack(struct mcount_ret_stack *rstack);
+extern void mcount_grow_rstack(struct mcount_thread_data *mtdp);
+extern void *mcount_alloc_argbuf(void);
+extern void mcount_free_argbuf(void *argbuf);
+extern void mcount_grow_argbuf(struct mcount_thread_data *mtdp, unsigned size);
+
+extern void mcount_pool_init(int size);
+extern void mcount_pool_finish(void);
+extern void mcount_pool_reset(struct mcount_thread_data *mtdp);
+extern bool mcount_pool_get(struct mcount_thread_data *mtdp);
+extern void mcount_pool_put(struct mcount_thread_data *mtdp);
+
+extern void setup_overhead(const char *dirname);
+extern void reset_overhead(struct mcount_thread_data *mtdp);
+extern void flush_all_overhead(void);
+extern void finish_overhead(struct mcount_thread_data *mtdp);
+
+extern void setup_auto_unpatch(struct uftrace_sym_info *sinfo, char *unpatch_str);
+extern void check_auto_unpatch(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack);
 
 enum plthook_special_action {
 	PLT_FL_SKIP = 1U << 0,
@@ -303,11 +491,6 @@ enum plthook_special_action {
 	PLT_FL_DLSYM = 1U << 7,
 };
 
-struct plthook_special_func {
-	unsigned idx;
-	unsigned flags; /* enum plthook_special_action */
-};
-
 struct plthook_skip_symbol {
 	const char *name;
 	void *addr;
@@ -330,9 +513,8 @@ struct plthook_data {
 	unsigned long *pltgot_ptr;
 	/* original address of each function (resolved by dynamic linker) */
 	unsigned long *resolved_addr;
-	/* array of function that needs special care (see above) */
-	struct plthook_special_func *special_funcs;
-	int nr_special;
+	/* special flags (see above) of each function indexed by dynsym index */
+	unsigned char *special_flags;
 	/* architecture-specific info */
 	void *arch;
 };
@@ -397,6 +579,17 @@ extern void save_argument(struct mcount_thread_data *mtdp, struct mcount_ret_sta
 void save_retval(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack, long *retval);
 void save_trigger_read(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
 		       enum trigger_read_type type, bool diff);
+unsigned get_argbuf_size(struct uftrace_trigger *tr);
+bool check_throttle(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
+		    struct uftrace_trigger *tr);
+void finish_throttle(struct mcount_thread_data *mtdp);
+void save_sample_event(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
+		       struct uftrace_trigger *tr);
+void start_tail_record(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
+		       struct uftrace_trigger *tr);
+bool end_tail_record(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack);
+void finish_tail_record(struct mcount_thread_data *mtdp);
+bool mcount_has_trigger(unsigned long addr);
 #endif /* DISABLE_MCOUNT_FILTER */
 
 bool check_mem_region(struct mcount_arg_context *ctx, unsigned long addr);
@@ -12,6 +12,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 #include <sys/un.h>
@@ -43,6 +44,15 @@ struct uftrace_sym_info mcount_sym_info = {
 /* size of shmem buffer to save uftrace_record */
 int shmem_bufsize = SHMEM_BUFFER_SIZE;
 
+/* use a single ring buffer per thread instead of rotating buffers */
+bool shmem_use_ring;
+
+/* save records in the compact (v5) format */
+bool mcount_compact_record;
+
+/* number of buffers overwritten in turn per thread (--flight-recorder) */
+int shmem_flight_nr_buf;
+
 /* recover return address of parent automatically */
 bool mcount_auto_recover = ARCH_SUPPORT_AUTO_RECOVER;
 
@@ -58,8 +68,11 @@ TLS struct mcount_thread_data mtd;
 /* pipe file descriptor to communite to uftrace */
 int pfd = -1;
 
+/* unix socket to pass fds of (huge page) shmem buffers to uftrace */
+int shmem_fd_sock = -1;
+
 /* maximum depth of mcount rstack */
-static int mcount_rstack_max = MCOUNT_RSTACK_MAX;
+int mcount_rstack_max = MCOUNT_RSTACK_MAX;
 
 /* name of main executable */
 char *mcount_exename;
@@ -76,36 +89,144 @@ static int __maybe_unused mcount_depth = MCOUNT_DEFAULT_DEPTH;
 /* boolean flag to turn on/off recording */
 static bool __maybe_unused mcount_enabled = true;
 
-/* function filtering mode - inclusive or exclusive */
-static enum filter_mode __maybe_unused mcount_filter_mode = FILTER_MODE_NONE;
+/* checked in the trampolines to return without calling mcount_entry() */
+unsigned char mcount_entry_disabled;
+
+/* trigger actions, replaced as a whole when the agent updates filters */
+struct mcount_filter_rules {
+	/* tree of trigger actions */
+	struct rb_root triggers;
+	/* flattened copy of the tree for lookup in the hot path */
+	struct uftrace_filter_table table;
+	/* function filtering mode - inclusive or exclusive */
+	enum filter_mode mode;
+	/* whether caller filter is activated */
+	bool has_caller;
+	/* whether nothing in the function entry can turn on the recording */
+	bool can_skip_entry;
+	/* previous rules which might be used by other threads */
+	struct mcount_filter_rules *retired;
+};
+
+static struct mcount_filter_rules __maybe_unused mcount_initial_rules = {
+	.triggers = RB_ROOT,
+	.mode = FILTER_MODE_NONE,
+};
+
+/* current rules, read with an acquire load as the agent can swap it */
+static struct mcount_filter_rules __maybe_unused *mcount_rules = &mcount_initial_rules;
 
-/* tree of trigger actions */
-static struct rb_root __maybe_unused mcount_triggers = RB_ROOT;
+/* incremented when the agent changes filters, depth or time filter */
+static unsigned __maybe_unused mcount_filter_gen;
 
 /* bitmask of active watch points */
 static unsigned long __maybe_unused mcount_watchpoints;
 
-/* whether caller filter is activated */
-static bool __maybe_unused mcount_has_caller;
-
 /* address of function will be called when a function returns */
 unsigned long mcount_return_fn;
 
 /* do not hook return address and inject EXIT record between functions */
 bool mcount_estimate_return;
 
+/* use TSC for timestamp (--clock=tsc) */
+bool mcount_use_tsc;
+struct uftrace_clock_info mcount_tsc_clock;
+
 /* agent thread */
 static pthread_t agent;
 
 /* state flag for the agent */
 static bool agent_run = false;
 
+/* max length of filter strings sent to the agent */
+#define AGENT_STRING_MAX (64 * 1024)
+
 __weak void dynamic_return(void)
 {
 }
 
+/*
+ * The rstack and argbuf only reserve the address space for the maximum
+ * depth.  The pages are committed when the call depth reaches there for
+ * the first time, so memory usage follows the actual depth of threads.
+ */
+static void *reserve_stack_mem(size_t size)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+		pr_err("cannot reserve memory for rstack");
+
+	return ptr;
+}
+
+/* make the memory usable up to @size bytes, returns the new usable size */
+static size_t commit_stack_mem(void *ptr, size_t old_size, size_t size)
+{
+	old_size = ALIGN(old_size, getpagesize());
+	size = ALIGN(size, getpagesize());
+
+	if (mprotect(ptr + old_size, size - old_size, PROT_READ | PROT_WRITE) < 0)
+		pr_err("cannot commit memory for rstack");
+
+	return size;
+}
+
+struct mcount_ret_stack *mcount_alloc_rstack(void)
+{
+	return reserve_stack_mem(mcount_rstack_max * sizeof(struct mcount_ret_stack));
+}
+
+void mcount_free_rstack(struct mcount_ret_stack *rstack)
+{
+	if (rstack)
+		munmap(rstack, mcount_rstack_max * sizeof(*rstack));
+}
+
+/* called when the rstack at the current index is not usable */
+void mcount_grow_rstack(struct mcount_thread_data *mtdp)
+{
+	size_t size = mtdp->nr_rstack * sizeof(*mtdp->rstack);
+
+	size = commit_stack_mem(mtdp->rstack, size, (mtdp->idx + 1) * sizeof(*mtdp->rstack));
+	mtdp->nr_rstack = size / sizeof(*mtdp->rstack);
+}
+
+void *mcount_alloc_argbuf(void)
+{
+	return reserve_stack_mem(mcount_rstack_max * ARGBUF_SIZE);
+}
+
+void mcount_free_argbuf(void *argbuf)
+{
+	if (argbuf)
+		munmap(argbuf, mcount_rstack_max * ARGBUF_SIZE);
+}
+
+/* make the argbuf usable up to @size bytes */
+void mcount_grow_argbuf(struct mcount_thread_data *mtdp, unsigned size)
+{
+	mtdp->argbuf_size = commit_stack_mem(mtdp->argbuf, mtdp->argbuf_size, size);
+}
+
+/* filter changes sent to the agent, applied together at the end */
+struct filter_request {
+	char *filter;
+	char *trigger;
+	int depth;
+	uint64_t threshold; /* nsec */
+	bool has_depth;
+	bool has_threshold;
+};
+
 #ifdef DISABLE_MCOUNT_FILTER
 
+static void mcount_filter_update(struct filter_request *req)
+{
+	pr_warn("filter update is not supported without filters\n");
+}
+
 static void mcount_filter_init(enum uftrace_pattern_type ptype, bool force)
 {
 	if (getenv("UFTRACE_SRCLINE") == NULL)
@@ -168,6 +289,18 @@ static void add_signal_trigger(int sig, const char *name, struct uftrace_trigger
 	list_add(&item->list, &siglist);
 }
 
+static void mcount_select_handlers(void);
+
+/* turn on/off recording, the entry handler might be skipped when off */
+static void mcount_set_enabled(bool enabled)
+{
+	if (mcount_enabled == enabled)
+		return;
+
+	mcount_enabled = enabled;
+	mcount_select_handlers();
+}
+
 static void mcount_signal_trigger(int sig)
 {
 	struct uftrace_trigger *tr;
@@ -179,14 +312,17 @@ static void mcount_signal_trigger(int sig)
 	pr_dbg("got signal %d\n", sig);
 
 	if (tr->flags & TRIGGER_FL_TRACE_ON) {
-		mcount_enabled = true;
+		mcount_set_enabled(true);
 	}
 	if (tr->flags & TRIGGER_FL_TRACE_OFF) {
-		mcount_enabled = false;
+		mcount_set_enabled(false);
 	}
 	if (tr->flags & TRIGGER_FL_FINISH) {
 		mcount_finish_trigger();
 	}
+	if (tr->flags & TRIGGER_FL_SNAPSHOT) {
+		mcount_flight_snapshot();
+	}
 }
 
 /* clang-format off */
@@ -358,6 +494,77 @@ static void mcount_signal_finish(void)
 	}
 }
 
+/* settings to build the filter rules, the agent can change filter and trigger */
+static struct {
+	char *filter;
+	char *trigger;
+	char *argument;
+	char *retval;
+	char *caller;
+	bool auto_args;
+	struct uftrace_filter_setting setting;
+} filter_spec;
+
+/* build new trigger actions from the spec without touching current rules */
+static void build_filter_rules(struct mcount_filter_rules *rules)
+{
+	struct uftrace_filter_setting setting = filter_spec.setting;
+	struct rb_root *root = &rules->triggers;
+	enum filter_mode *mode = &rules->mode;
+
+	uftrace_setup_filter(filter_spec.filter, &mcount_sym_info, root, mode, &setting);
+	uftrace_setup_trigger(filter_spec.trigger, &mcount_sym_info, root, mode, &setting);
+	uftrace_setup_argument(filter_spec.argument, &mcount_sym_info, root, &setting);
+	uftrace_setup_retval(filter_spec.retval, &mcount_sym_info, root, &setting);
+
+	if (filter_spec.caller)
+		uftrace_setup_caller_filter(filter_spec.caller, &mcount_sym_info, root, &setting);
+
+	if (filter_spec.auto_args) {
+		char *autoarg = ".";
+		char *autoret = ".";
+
+		if (setting.ptype == PATT_GLOB)
+			autoarg = autoret = "*";
+
+		setting.auto_args = true;
+
+		uftrace_setup_argument(autoarg, &mcount_sym_info, root, &setting);
+		uftrace_setup_retval(autoret, &mcount_sym_info, root, &setting);
+	}
+
+	uftrace_build_filter_table(root, &rules->table);
+
+	/* only sampled functions (and their children) are traced */
+	if (uftrace_count_filter(root, TRIGGER_FL_SAMPLE) != 0)
+		*mode = FILTER_MODE_IN;
+
+	/* there might be caller triggers, count it separately */
+	rules->has_caller = uftrace_count_filter(root, TRIGGER_FL_CALLER) != 0;
+
+	/* trace_on triggers should be checked even if it's disabled */
+	rules->can_skip_entry = !uftrace_count_filter(root, TRIGGER_FL_TRACE_ON);
+}
+
+/*
+ * Make the rules visible to all threads.  The old rules are not freed
+ * until the end since other threads can still look up the table and
+ * functions not returned yet can refer to the argument specs in it.
+ */
+static void publish_filter_rules(struct mcount_filter_rules *rules)
+{
+	if (rules != mcount_rules) {
+		rules->retired = mcount_rules;
+		__atomic_store_n(&mcount_rules, rules, __ATOMIC_RELEASE);
+	}
+}
+
+/* the table and the flags should be read from the same rules */
+static inline struct mcount_filter_rules *mcount_current_rules(void)
+{
+	return __atomic_load_n(&mcount_rules, __ATOMIC_ACQUIRE);
+}
+
 static void mcount_filter_init(enum uftrace_pattern_type ptype, bool force)
 {
 	char *filter_str = getenv("UFTRACE_FILTER");
@@ -397,62 +604,130 @@ static void mcount_filter_init(enum uftrace_pattern_type ptype, bool force)
 		save_debug_info(&mcount_sym_info, mcount_sym_info.dirname);
 	}
 
-	uftrace_setup_filter(filter_str, &mcount_sym_info, &mcount_triggers, &mcount_filter_mode,
-			     &filter_setting);
-	uftrace_setup_trigger(trigger_str, &mcount_sym_info, &mcount_triggers, &mcount_filter_mode,
-			      &filter_setting);
-	uftrace_setup_argument(argument_str, &mcount_sym_info, &mcount_triggers, &filter_setting);
-	uftrace_setup_retval(retval_str, &mcount_sym_info, &mcount_triggers, &filter_setting);
+	/* keep a copy as the agent might rebuild the rules later */
+	filter_spec.filter = filter_str ? xstrdup(filter_str) : NULL;
+	filter_spec.trigger = trigger_str ? xstrdup(trigger_str) : NULL;
+	filter_spec.argument = argument_str ? xstrdup(argument_str) : NULL;
+	filter_spec.retval = retval_str ? xstrdup(retval_str) : NULL;
+	filter_spec.caller = caller_str ? xstrdup(caller_str) : NULL;
+	filter_spec.auto_args = !!autoargs_str;
+	filter_spec.setting = filter_setting;
 
-	if (caller_str) {
-		uftrace_setup_caller_filter(caller_str, &mcount_sym_info, &mcount_triggers,
-					    &filter_setting);
-	}
+	build_filter_rules(&mcount_initial_rules);
+	publish_filter_rules(&mcount_initial_rules);
 
-	/* there might be caller triggers, count it separately */
-	if (uftrace_count_filter(&mcount_triggers, TRIGGER_FL_CALLER) != 0)
-		mcount_has_caller = true;
+	if (getenv("UFTRACE_DEPTH"))
+		mcount_depth = strtol(getenv("UFTRACE_DEPTH"), NULL, 0);
 
-	if (autoargs_str) {
-		char *autoarg = ".";
-		char *autoret = ".";
+	if (getenv("UFTRACE_DISABLED"))
+		mcount_enabled = false;
+}
 
-		if (ptype == PATT_GLOB)
-			autoarg = autoret = "*";
+/*
+ * Rebuild the rules in the agent thread and replace them at once so that
+ * traced threads never wait for it.  Unchanged parts are kept as is.
+ */
+static void mcount_filter_update(struct filter_request *req)
+{
+	if (req->filter || req->trigger) {
+		struct mcount_filter_rules *rules;
+
+		if (req->filter) {
+			free(filter_spec.filter);
+			filter_spec.filter = req->filter;
+			req->filter = NULL;
+		}
+		if (req->trigger) {
+			free(filter_spec.trigger);
+			filter_spec.trigger = req->trigger;
+			req->trigger = NULL;
+		}
 
-		filter_setting.auto_args = true;
+		rules = xzalloc(sizeof(*rules));
+		rules->triggers = RB_ROOT;
 
-		uftrace_setup_argument(autoarg, &mcount_sym_info, &mcount_triggers,
-				       &filter_setting);
-		uftrace_setup_retval(autoret, &mcount_sym_info, &mcount_triggers, &filter_setting);
+		build_filter_rules(rules);
+		publish_filter_rules(rules);
+
+		pr_dbg("agent updated filters: %d entries\n", rules->table.nr);
 	}
 
-	if (getenv("UFTRACE_DEPTH"))
-		mcount_depth = strtol(getenv("UFTRACE_DEPTH"), NULL, 0);
+	if (req->has_depth) {
+		mcount_depth = req->depth;
+		pr_dbg("agent updated depth: %d\n", req->depth);
+	}
+	if (req->has_threshold) {
+		mcount_threshold = mcount_nsec_to_time(req->threshold);
+		pr_dbg("agent updated time filter: %" PRIu64 " nsec\n", req->threshold);
+	}
 
-	if (getenv("UFTRACE_DISABLED"))
-		mcount_enabled = false;
+	/* running threads will resync at the next function entry */
+	__atomic_fetch_add(&mcount_filter_gen, 1, __ATOMIC_RELEASE);
+
+	mcount_select_handlers();
 }
 
 static void mcount_filter_setup(struct mcount_thread_data *mtdp)
 {
 	mtdp->filter.depth = mcount_depth;
 	mtdp->filter.time = mcount_threshold;
+	/* load the rules after the gen so that it cannot miss an update */
+	mtdp->filter.gen = __atomic_load_n(&mcount_filter_gen, __ATOMIC_ACQUIRE);
+	mtdp->filter.rules = mcount_current_rules();
 	mtdp->enable_cached = mcount_enabled;
-	mtdp->argbuf = xmalloc(mcount_rstack_max * ARGBUF_SIZE);
+	if (mtdp->argbuf == NULL) {
+		mtdp->argbuf = mcount_alloc_argbuf();
+		mtdp->argbuf_size = 0;
+	}
 	INIT_LIST_HEAD(&mtdp->pmu_fds);
 }
 
 static void mcount_filter_release(struct mcount_thread_data *mtdp)
 {
-	free(mtdp->argbuf);
+	/* pooled argbuf will be returned with the shmem buffers */
+	if (mtdp->pool == NULL)
+		mcount_free_argbuf(mtdp->argbuf);
 	mtdp->argbuf = NULL;
 	finish_pmu_event(mtdp);
+	finish_throttle(mtdp);
+	finish_tail_record(mtdp);
+}
+
+/* whether the function has any filter or trigger given by user */
+bool mcount_has_trigger(unsigned long addr)
+{
+	struct uftrace_trigger tr = {};
+
+	uftrace_match_filter_table(addr, &mcount_current_rules()->table, &tr);
+	return tr.flags != 0;
 }
 
 static void mcount_filter_finish(void)
 {
-	uftrace_cleanup_filter(&mcount_triggers);
+	struct mcount_filter_rules *rules = mcount_rules;
+	struct mcount_filter_rules *next;
+
+	__atomic_store_n(&mcount_rules, &mcount_initial_rules, __ATOMIC_RELEASE);
+
+	while (rules != NULL) {
+		next = rules->retired;
+
+		uftrace_free_filter_table(&rules->table);
+		uftrace_cleanup_filter(&rules->triggers);
+		if (rules != &mcount_initial_rules)
+			free(rules);
+
+		rules = next;
+	}
+	mcount_initial_rules.retired = NULL;
+
+	free(filter_spec.filter);
+	free(filter_spec.trigger);
+	free(filter_spec.argument);
+	free(filter_spec.retval);
+	free(filter_spec.caller);
+	memset(&filter_spec, 0, sizeof(filter_spec));
+
 	finish_auto_args();
 
 	finish_debug_info(&mcount_sym_info);
@@ -599,7 +874,9 @@ void mtd_dtor(void *arg)
 	mcount_rstack_restore(mtdp);
 
 	if (ARCH_CAN_RESTORE_PLTHOOK || !mcount_rstack_has_plthook(mtdp)) {
-		free(mtdp->rstack);
+		/* pooled rstack will be returned with the shmem buffers */
+		if (mtdp->pool == NULL)
+			mcount_free_rstack(mtdp->rstack);
 		mtdp->rstack = NULL;
 		mtdp->idx = 0;
 	}
@@ -608,6 +885,8 @@ void mtd_dtor(void *arg)
 	mcount_watch_release(mtdp);
 	finish_mem_region(&mtdp->mem_regions);
 	shmem_finish(mtdp);
+	finish_aggregate(mtdp);
+	finish_overhead(mtdp);
 
 	tmsg.pid = getpid();
 	tmsg.tid = mcount_gettid(mtdp);
@@ -774,9 +1053,18 @@ struct mcount_thread_data *mcount_prepare(void)
 
 	compiler_barrier();
 
+	/* count the setup below as a part of the first hook */
+	reset_overhead(mtdp);
+
+	/* it sets up the rstack, argbuf and shmem buffers if available */
+	mcount_pool_get(mtdp);
+
 	mcount_filter_setup(mtdp);
 	mcount_watch_setup(mtdp);
-	mtdp->rstack = xmalloc(mcount_rstack_max * sizeof(*mtd.rstack));
+	if (mtdp->rstack == NULL) {
+		mtdp->rstack = mcount_alloc_rstack();
+		mtdp->nr_rstack = 0;
+	}
 
 	pthread_once(&once_control, mcount_init_file);
 	prepare_shmem_buffer(mtdp);
@@ -795,15 +1083,27 @@ struct mcount_thread_data *mcount_prepare(void)
 
 static void mcount_finish(void)
 {
-	if (!mcount_should_stop())
-		mcount_trace_finish(false);
+	struct mcount_thread_data *mtdp = get_thread_data();
 
-	if (mcount_estimate_return) {
-		struct mcount_thread_data *mtdp = get_thread_data();
-		if (!check_thread_data(mtdp))
-			mcount_rstack_estimate_finish(mtdp);
+	if (!mcount_should_stop()) {
+#ifndef DISABLE_MCOUNT_FILTER
+		/* save pending throttle events before finishing the buffer */
+		if (!check_thread_data(mtdp)) {
+			finish_throttle(mtdp);
+			finish_tail_record(mtdp);
+		}
+#endif
+		mcount_trace_finish(false);
 	}
 
+	if (mcount_estimate_return && !check_thread_data(mtdp))
+		mcount_rstack_estimate_finish(mtdp);
+
+	/* other threads might not exit normally, flush theirs too */
+	if (mcount_use_aggregate)
+		stop_aggregate();
+	flush_all_overhead();
+
 	mcount_global_flags |= MCOUNT_GFL_FINISH;
 }
 
@@ -824,9 +1124,69 @@ static bool mcount_check_rstack(struct mcount_thread_data *mtdp)
 		return true;
 	}
 	mtdp->warned = false;
+
+	if (unlikely(mtdp->idx >= (int)mtdp->nr_rstack))
+		mcount_grow_rstack(mtdp);
+
 	return false;
 }
 
+/*
+ * Simplified filter functions when no filter or trigger is used.  They
+ * still save the filter state to the rstack in case it's restored by
+ * the full version (e.g. in plthook or mcount_rstack_inject_return).
+ */
+static __always_inline enum filter_result mcount_entry_nofilter_check(struct mcount_thread_data *mtdp)
+{
+	if (mcount_check_rstack(mtdp))
+		return FILTER_RSTACK;
+
+	return FILTER_IN;
+}
+
+static __always_inline void mcount_entry_nofilter_record(struct mcount_thread_data *mtdp,
+							 struct mcount_ret_stack *rstack)
+{
+	mtdp->record_idx++;
+	rstack->child_time = 0;
+
+	if (mcount_use_aggregate)
+		enter_aggregate(mtdp, rstack);
+
+#ifndef DISABLE_MCOUNT_FILTER
+	rstack->filter_depth = mtdp->filter.depth;
+	rstack->filter_time = mtdp->filter.time;
+
+	/* no argbuf is needed, but keep the offset for the children */
+	rstack->argbuf_ofs = 0;
+	if (rstack > mtdp->rstack)
+		rstack->argbuf_ofs = rstack[-1].argbuf_ofs + rstack[-1].argbuf_size;
+	rstack->argbuf_size = 0;
+	rstack->event_idx = 0;
+#endif
+}
+
+static __always_inline void mcount_exit_nofilter_record(struct mcount_thread_data *mtdp,
+							struct mcount_ret_stack *rstack)
+{
+	if (mtdp->record_idx > 0)
+		mtdp->record_idx--;
+
+#ifndef DISABLE_MCOUNT_FILTER
+	/* it might be called by the full version at entry */
+	mtdp->filter.depth = rstack->filter_depth;
+	mtdp->filter.time = rstack->filter_time;
+#endif
+
+	if (rstack->end_time - rstack->start_time > mcount_threshold ||
+	    rstack->flags & MCOUNT_FL_WRITTEN) {
+		if (mcount_use_aggregate)
+			record_aggregate(mtdp, rstack);
+		else if (record_trace_data(mtdp, rstack, NULL) < 0)
+			pr_err("error during record");
+	}
+}
+
 #ifndef DISABLE_MCOUNT_FILTER
 extern void *get_argbuf(struct mcount_thread_data *, struct mcount_ret_stack *);
 
@@ -837,6 +1197,102 @@ static void mcount_save_filter(struct mcount_thread_data *mtdp)
 	mtdp->filter.saved_time = mtdp->filter.time;
 }
 
+/*
+ * Re-evaluate the filter state of running functions after the agent
+ * changed the rules, as if the new rules were used from the start.
+ * It's called by the owner thread so there's no race with the exit.
+ */
+static void mcount_filter_resync(struct mcount_thread_data *mtdp)
+{
+	unsigned gen = __atomic_load_n(&mcount_filter_gen, __ATOMIC_ACQUIRE);
+	struct mcount_filter_rules *rules = mcount_current_rules();
+	int depth = mcount_depth;
+	uint64_t time = mcount_threshold;
+	int i;
+
+	mtdp->filter.in_count = 0;
+	mtdp->filter.out_count = 0;
+
+	for (i = 0; i < mtdp->idx; i++) {
+		struct mcount_ret_stack *rstack = &mtdp->rstack[i];
+		struct uftrace_trigger tr = {};
+
+		/* filter state before the call, it'll be restored at exit */
+		rstack->filter_depth = depth;
+		rstack->filter_time = time;
+
+		rstack->flags &= ~(MCOUNT_FL_FILTERED | MCOUNT_FL_NOTRACE);
+
+		/* the rest is the same as mcount_entry_filter_check() */
+		if (mtdp->filter.out_count > 0)
+			continue;
+
+		uftrace_match_filter_table(rstack->child_ip, &rules->table, &tr);
+
+		if (tr.flags & TRIGGER_FL_FILTER) {
+			if (tr.fmode == FILTER_MODE_IN) {
+				rstack->flags |= MCOUNT_FL_FILTERED;
+				mtdp->filter.in_count++;
+			}
+			else if (tr.fmode == FILTER_MODE_OUT) {
+				rstack->flags |= MCOUNT_FL_NOTRACE;
+				mtdp->filter.out_count++;
+			}
+			depth = mcount_depth;
+		}
+		else if (rules->mode == FILTER_MODE_IN && mtdp->filter.in_count == 0) {
+			continue;
+		}
+
+		if (tr.flags & TRIGGER_FL_DEPTH)
+			depth = tr.depth;
+		if (tr.flags & TRIGGER_FL_TIME_FILTER)
+			time = mcount_nsec_to_time(tr.time);
+
+		if (depth > 0)
+			depth--;
+	}
+
+	mtdp->filter.depth = depth;
+	mtdp->filter.time = time;
+	mtdp->filter.rules = rules;
+	mtdp->filter.gen = gen;
+}
+
+/*
+ * Decide whether to trace the function with the sample trigger.  It works
+ * as a filter (or notrace) trigger for the call.  Nested ones in a sampled
+ * function are ignored.
+ */
+static void mcount_sample_check(struct mcount_thread_data *mtdp, struct uftrace_trigger *tr)
+{
+	uint64_t x = mtdp->filter.sample_state;
+
+	if (mtdp->filter.sample_count > 0) {
+		tr->flags &= ~TRIGGER_FL_SAMPLE;
+		return;
+	}
+
+	if (unlikely(x == 0))
+		x = (mcount_gettime() ^ ((uint64_t)mcount_gettid(mtdp) << 32)) | 1;
+
+	/* xorshift64 */
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	mtdp->filter.sample_state = x;
+
+	tr->flags |= TRIGGER_FL_FILTER;
+	if (x % tr->sample == 0) {
+		tr->fmode = FILTER_MODE_IN;
+		mtdp->filter.sample_count++;
+	}
+	else {
+		tr->fmode = FILTER_MODE_OUT;
+		tr->flags &= ~TRIGGER_FL_SAMPLE;
+	}
+}
+
 /* update filter state from trigger result */
 enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp, unsigned long child,
 					     struct uftrace_trigger *tr)
@@ -846,13 +1302,19 @@ enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp, un
 	if (mcount_check_rstack(mtdp))
 		return FILTER_RSTACK;
 
+	if (unlikely(mtdp->filter.gen != mcount_filter_gen))
+		mcount_filter_resync(mtdp);
+
 	mcount_save_filter(mtdp);
 
 	/* already filtered by notrace option */
 	if (mtdp->filter.out_count > 0)
 		return FILTER_OUT;
 
-	uftrace_match_filter(child, &mcount_triggers, tr);
+	uftrace_match_filter_table(child, &mtdp->filter.rules->table, tr);
+
+	if (unlikely(tr->flags & TRIGGER_FL_SAMPLE))
+		mcount_sample_check(mtdp, tr);
 
 	pr_dbg3(" tr->flags: %x, filter mode: %d, count: %d/%d, depth: %d\n", tr->flags, tr->fmode,
 		mtdp->filter.in_count, mtdp->filter.out_count, mtdp->filter.depth);
@@ -868,7 +1330,7 @@ enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp, un
 	}
 	else {
 		/* not matched by filter */
-		if (mcount_filter_mode == FILTER_MODE_IN && mtdp->filter.in_count == 0)
+		if (mtdp->filter.rules->mode == FILTER_MODE_IN && mtdp->filter.in_count == 0)
 			return FILTER_OUT;
 	}
 
@@ -880,13 +1342,13 @@ enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp, un
 			mtdp->filter.depth = tr->depth;
 
 		if (tr->flags & TRIGGER_FL_TRACE_ON)
-			mcount_enabled = true;
+			mcount_set_enabled(true);
 
 		if (tr->flags & TRIGGER_FL_TRACE_OFF)
-			mcount_enabled = false;
+			mcount_set_enabled(false);
 
 		if (tr->flags & TRIGGER_FL_TIME_FILTER)
-			mtdp->filter.time = tr->time;
+			mtdp->filter.time = mcount_nsec_to_time(tr->time);
 	}
 
 #undef FLAGS_TO_CHECK
@@ -913,6 +1375,12 @@ static int script_save_context(struct script_context *sc_ctx, struct mcount_thre
 	if (rstack->end_time)
 		sc_ctx->duration = rstack->end_time - rstack->start_time;
 
+	if (mcount_use_tsc) {
+		sc_ctx->timestamp = convert_tsc_time(&mcount_tsc_clock, sc_ctx->timestamp);
+		if (rstack->end_time)
+			sc_ctx->duration = tsc_to_nsec(sc_ctx->duration, mcount_tsc_clock.freq);
+	}
+
 	if (has_arg_retval) {
 		unsigned *argbuf = get_argbuf(mtdp, rstack);
 
@@ -969,20 +1437,48 @@ skip:
 	symbol_putname(sym, symname);
 }
 
+/* place the argbuf of the rstack right after the parent's */
+static void mcount_setup_argbuf(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
+				struct uftrace_trigger *tr)
+{
+	struct mcount_ret_stack *parent = rstack - 1;
+	unsigned size = 0;
+
+	rstack->argbuf_ofs = 0;
+	if (rstack > mtdp->rstack)
+		rstack->argbuf_ofs = parent->argbuf_ofs + parent->argbuf_size;
+
+	if (tr->flags & (TRIGGER_FL_ARGUMENT | TRIGGER_FL_RETVAL | TRIGGER_FL_READ) &&
+	    !(rstack->flags & MCOUNT_FL_NORECORD))
+		size = get_argbuf_size(tr);
+
+	rstack->argbuf_size = size;
+	/* read events are saved from the end */
+	rstack->event_idx = size;
+
+	if (unlikely(rstack->argbuf_ofs + size > mtdp->argbuf_size))
+		mcount_grow_argbuf(mtdp, rstack->argbuf_ofs + size);
+}
+
 /* save current filter state to rstack */
 void mcount_entry_filter_record(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
 				struct uftrace_trigger *tr, struct mcount_regs *regs)
 {
 	if (mtdp->filter.out_count > 0 ||
-	    (mtdp->filter.in_count == 0 && mcount_filter_mode == FILTER_MODE_IN))
+	    (mtdp->filter.in_count == 0 && mtdp->filter.rules->mode == FILTER_MODE_IN))
+		rstack->flags |= MCOUNT_FL_NORECORD;
+	else if (unlikely(tr->flags & TRIGGER_FL_THROTTLE) && check_throttle(mtdp, rstack, tr))
 		rstack->flags |= MCOUNT_FL_NORECORD;
 
 	rstack->filter_depth = mtdp->filter.saved_depth;
 	rstack->filter_time = mtdp->filter.saved_time;
+	rstack->child_time = 0;
+
+	mcount_setup_argbuf(mtdp, rstack, tr);
 
 #define FLAGS_TO_CHECK                                                                             \
 	(TRIGGER_FL_FILTER | TRIGGER_FL_RETVAL | TRIGGER_FL_TRACE | TRIGGER_FL_FINISH |            \
-	 TRIGGER_FL_CALLER)
+	 TRIGGER_FL_CALLER | TRIGGER_FL_SNAPSHOT | TRIGGER_FL_SAMPLE)
 
 	if (tr->flags & FLAGS_TO_CHECK) {
 		if (tr->flags & TRIGGER_FL_FILTER) {
@@ -1004,6 +1500,14 @@ void mcount_entry_filter_record(struct mcount_thread_data *mtdp, struct mcount_r
 		if (tr->flags & TRIGGER_FL_CALLER)
 			rstack->flags |= MCOUNT_FL_CALLER;
 
+		if (tr->flags & TRIGGER_FL_SNAPSHOT)
+			mcount_flight_snapshot_trigger();
+
+		if (tr->flags & TRIGGER_FL_SAMPLE) {
+			rstack->flags |= MCOUNT_FL_SAMPLE;
+			save_sample_event(mtdp, rstack, tr);
+		}
+
 		if (tr->flags & TRIGGER_FL_FINISH) {
 			record_trace_data(mtdp, rstack, NULL);
 			mcount_finish_trigger();
@@ -1016,6 +1520,9 @@ void mcount_entry_filter_record(struct mcount_thread_data *mtdp, struct mcount_r
 	if (!(rstack->flags & MCOUNT_FL_NORECORD)) {
 		mtdp->record_idx++;
 
+		if (mcount_use_aggregate)
+			enter_aggregate(mtdp, rstack);
+
 		if (!mcount_enabled) {
 			rstack->flags |= MCOUNT_FL_DISABLED;
 			/*
@@ -1028,6 +1535,8 @@ void mcount_entry_filter_record(struct mcount_thread_data *mtdp, struct mcount_r
 				record_trace_data(mtdp, rstack, NULL);
 		}
 		else {
+			if (unlikely(tr->flags & TRIGGER_FL_TAIL))
+				start_tail_record(mtdp, rstack, tr);
 			if (tr->flags & TRIGGER_FL_ARGUMENT)
 				save_argument(mtdp, rstack, tr->pargs, regs);
 			if (tr->flags & TRIGGER_FL_READ) {
@@ -1079,10 +1588,12 @@ void mcount_exit_filter_record(struct mcount_thread_data *mtdp, struct mcount_re
 			       long *retval)
 {
 	uint64_t time_filter = mtdp->filter.time;
+	bool tail_drop = false;
 
 	pr_dbg3("<%d> exit  %lx\n", mtdp->idx, rstack->child_ip);
 
-#define FLAGS_TO_CHECK (MCOUNT_FL_FILTERED | MCOUNT_FL_NOTRACE | MCOUNT_FL_RECOVER)
+#define FLAGS_TO_CHECK                                                                             \
+	(MCOUNT_FL_FILTERED | MCOUNT_FL_NOTRACE | MCOUNT_FL_RECOVER | MCOUNT_FL_SAMPLE)
 
 	if (rstack->flags & FLAGS_TO_CHECK) {
 		if (rstack->flags & MCOUNT_FL_FILTERED)
@@ -1090,6 +1601,9 @@ void mcount_exit_filter_record(struct mcount_thread_data *mtdp, struct mcount_re
 		else if (rstack->flags & MCOUNT_FL_NOTRACE)
 			mtdp->filter.out_count--;
 
+		if (rstack->flags & MCOUNT_FL_SAMPLE)
+			mtdp->filter.sample_count--;
+
 		if (rstack->flags & MCOUNT_FL_RECOVER)
 			mcount_rstack_reset(mtdp);
 	}
@@ -1099,31 +1613,49 @@ void mcount_exit_filter_record(struct mcount_thread_data *mtdp, struct mcount_re
 	mtdp->filter.depth = rstack->filter_depth;
 	mtdp->filter.time = rstack->filter_time;
 
+	if (unlikely(mcount_auto_unpatch))
+		check_auto_unpatch(mtdp, rstack);
+
 	if (!(rstack->flags & MCOUNT_FL_NORECORD)) {
 		if (mtdp->record_idx > 0)
 			mtdp->record_idx--;
 
-		if (!mcount_enabled)
+		/* discard the subtree if it's not slow enough */
+		if (unlikely(rstack->flags & MCOUNT_FL_TAIL))
+			tail_drop = !end_tail_record(mtdp, rstack);
+
+		if (!mcount_enabled) {
+			/*
+			 * The entries can be skipped when it's disabled so
+			 * flush the parents here instead (see the entry).
+			 */
+			if (mcount_entry_disabled && mtdp->enable_cached)
+				record_trace_data(mtdp, rstack - 1, NULL);
 			return;
+		}
 
 		if (!(rstack->flags & MCOUNT_FL_RETVAL))
 			retval = NULL;
 
 		if (rstack->flags & MCOUNT_FL_READ) {
-			struct uftrace_trigger tr;
+			struct uftrace_trigger tr = {};
 
 			/* there's a possibility of overwriting by return value */
-			uftrace_match_filter(rstack->child_ip, &mcount_triggers, &tr);
+			uftrace_match_filter_table(rstack->child_ip, &mtdp->filter.rules->table,
+						   &tr);
 			save_trigger_read(mtdp, rstack, tr.read, true);
 		}
 
 		if (mcount_watchpoints)
 			save_watchpoint(mtdp, rstack, mcount_watchpoints);
 
-		if (((rstack->end_time - rstack->start_time > time_filter) &&
-		     (!mcount_has_caller || rstack->flags & MCOUNT_FL_CALLER)) ||
-		    rstack->flags & (MCOUNT_FL_WRITTEN | MCOUNT_FL_TRACE)) {
-			if (record_trace_data(mtdp, rstack, retval) < 0)
+		if (!tail_drop &&
+		    (((rstack->end_time - rstack->start_time > time_filter) &&
+		      (!mtdp->filter.rules->has_caller || rstack->flags & MCOUNT_FL_CALLER)) ||
+		     rstack->flags & (MCOUNT_FL_WRITTEN | MCOUNT_FL_TRACE))) {
+			if (mcount_use_aggregate)
+				record_aggregate(mtdp, rstack);
+			else if (record_trace_data(mtdp, rstack, retval) < 0)
 				pr_err("error during record");
 		}
 		else if (mtdp->nr_events) {
@@ -1158,28 +1690,19 @@ void mcount_exit_filter_record(struct mcount_thread_data *mtdp, struct mcount_re
 enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp, unsigned long child,
 					     struct uftrace_trigger *tr)
 {
-	if (mcount_check_rstack(mtdp))
-		return FILTER_RSTACK;
-
-	return FILTER_IN;
+	return mcount_entry_nofilter_check(mtdp);
 }
 
 void mcount_entry_filter_record(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
 				struct uftrace_trigger *tr, struct mcount_regs *regs)
 {
-	mtdp->record_idx++;
+	mcount_entry_nofilter_record(mtdp, rstack);
 }
 
 void mcount_exit_filter_record(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
 			       long *retval)
 {
-	mtdp->record_idx--;
-
-	if (rstack->end_time - rstack->start_time > mcount_threshold ||
-	    rstack->flags & MCOUNT_FL_WRITTEN) {
-		if (record_trace_data(mtdp, rstack, NULL) < 0)
-			pr_err("error during record");
-	}
+	mcount_exit_nofilter_record(mtdp, rstack);
 }
 
 static void mcount_save_filter(struct mcount_thread_data *mtdp)
@@ -1255,12 +1778,27 @@ void mcount_rstack_inject_return(struct mcount_thread_data *mtdp, unsigned long
 	mcount_save_filter(mtdp);
 }
 
-static int __mcount_entry(unsigned long *parent_loc, unsigned long child, struct mcount_regs *regs)
+/*
+ * Features checked in the mcount entry and exit handlers.  The handlers
+ * are compiled for some combinations of them (see MCOUNT_HANDLERS) and
+ * the one which has all the features in use is selected at startup.
+ */
+#define MCOUNT_FEAT_FILTER (1U << 0) /* filters, triggers, arguments, ... */
+#define MCOUNT_FEAT_ESTIMATE_RETURN (1U << 1)
+#define MCOUNT_FEAT_AUTO_RECOVER (1U << 2)
+#define MCOUNT_FEAT_OVERHEAD (1U << 3) /* measure time in the handlers */
+#define MCOUNT_FEAT_ALL                                                                            \
+	(MCOUNT_FEAT_FILTER | MCOUNT_FEAT_ESTIMATE_RETURN | MCOUNT_FEAT_AUTO_RECOVER |             \
+	 MCOUNT_FEAT_OVERHEAD)
+
+static __always_inline int __mcount_entry(unsigned long *parent_loc, unsigned long child,
+					  struct mcount_regs *regs, const unsigned features)
 {
 	enum filter_result filtered;
 	struct mcount_thread_data *mtdp;
 	struct mcount_ret_stack *rstack;
 	struct uftrace_trigger tr;
+	bool estimate_return = (features & MCOUNT_FEAT_ESTIMATE_RETURN) && mcount_estimate_return;
 
 	/* Access the mtd through TSD pointer to reduce TLS overhead */
 	mtdp = get_thread_data();
@@ -1275,7 +1813,11 @@ static int __mcount_entry(unsigned long *parent_loc, unsigned long child, struct
 	}
 
 	tr.flags = 0;
-	filtered = mcount_entry_filter_check(mtdp, child, &tr);
+	if (features & MCOUNT_FEAT_FILTER)
+		filtered = mcount_entry_filter_check(mtdp, child, &tr);
+	else
+		filtered = mcount_entry_nofilter_check(mtdp);
+
 	if (filtered != FILTER_IN) {
 		mcount_unguard_recursion(mtdp);
 		return -1;
@@ -1298,7 +1840,7 @@ static int __mcount_entry(unsigned long *parent_loc, unsigned long child, struct
 	/* fixup the parent_loc in an arch-dependant way (if needed) */
 	parent_loc = mcount_arch_parent_location(&mcount_sym_info, parent_loc, child);
 
-	if (mcount_estimate_return)
+	if (estimate_return)
 		mcount_rstack_inject_return(mtdp, parent_loc, child);
 
 	rstack = &mtdp->rstack[mtdp->idx++];
@@ -1312,32 +1854,26 @@ static int __mcount_entry(unsigned long *parent_loc, unsigned long child, struct
 	rstack->end_time = 0;
 	rstack->flags = 0;
 	rstack->nr_events = 0;
-	rstack->event_idx = ARGBUF_SIZE;
 
-	if (!mcount_estimate_return) {
+	if (!estimate_return) {
 		/* hijack the return address of child */
 		*parent_loc = mcount_return_fn;
 
 		/* restore return address of parent */
-		if (mcount_auto_recover)
+		if ((features & MCOUNT_FEAT_AUTO_RECOVER) && mcount_auto_recover)
 			mcount_auto_restore(mtdp);
 	}
 
-	mcount_entry_filter_record(mtdp, rstack, &tr, regs);
+	if (features & MCOUNT_FEAT_FILTER)
+		mcount_entry_filter_record(mtdp, rstack, &tr, regs);
+	else
+		mcount_entry_nofilter_record(mtdp, rstack);
+
 	mcount_unguard_recursion(mtdp);
 	return 0;
 }
 
-int mcount_entry(unsigned long *parent_loc, unsigned long child, struct mcount_regs *regs)
-{
-	int saved_errno = errno;
-	int ret = __mcount_entry(parent_loc, child, regs);
-
-	errno = saved_errno;
-	return ret;
-}
-
-static unsigned long __mcount_exit(long *retval)
+static __always_inline unsigned long __mcount_exit(long *retval, const unsigned features)
 {
 	struct mcount_thread_data *mtdp;
 	struct mcount_ret_stack *rstack;
@@ -1358,13 +1894,16 @@ static unsigned long __mcount_exit(long *retval)
 	rstack = &mtdp->rstack[mtdp->idx - 1];
 
 	rstack->end_time = mcount_gettime();
-	mcount_exit_filter_record(mtdp, rstack, retval);
+	if (features & MCOUNT_FEAT_FILTER)
+		mcount_exit_filter_record(mtdp, rstack, retval);
+	else
+		mcount_exit_nofilter_record(mtdp, rstack);
 
 	ret_loc = rstack->parent_loc;
 	retaddr = rstack->parent_ip;
 
 	/* re-hijack return address of parent */
-	if (mcount_auto_recover)
+	if ((features & MCOUNT_FEAT_AUTO_RECOVER) && mcount_auto_recover)
 		mcount_auto_reset(mtdp);
 
 	__mcount_unguard_recursion(mtdp);
@@ -1386,13 +1925,137 @@ static unsigned long __mcount_exit(long *retval)
 	return retaddr;
 }
 
-unsigned long mcount_exit(long *retval)
+#define MCOUNT_HANDLERS(name, features)                                                            \
+	static int mcount_entry_##name(unsigned long *parent_loc, unsigned long child,             \
+				       struct mcount_regs *regs)                                    \
+	{                                                                                          \
+		int saved_errno = errno;                                                           \
+		bool overhead = ((features) & MCOUNT_FEAT_OVERHEAD) && mcount_use_overhead;        \
+		uint64_t start = overhead ? mcount_overhead_tick() : 0;                            \
+		int ret = __mcount_entry(parent_loc, child, regs, features);                       \
+                                                                                                   \
+		if (overhead)                                                                      \
+			mcount_update_overhead(MCOUNT_OVH_ENTRY, start);                           \
+		errno = saved_errno;                                                               \
+		return ret;                                                                        \
+	}                                                                                          \
+                                                                                                   \
+	static unsigned long mcount_exit_##name(long *retval)                                      \
+	{                                                                                          \
+		int saved_errno = errno;                                                           \
+		bool overhead = ((features) & MCOUNT_FEAT_OVERHEAD) && mcount_use_overhead;        \
+		uint64_t start = overhead ? mcount_overhead_tick() : 0;                            \
+		unsigned long ret = __mcount_exit(retval, features);                               \
+                                                                                                   \
+		if (overhead)                                                                      \
+			mcount_update_overhead(MCOUNT_OVH_EXIT, start);                            \
+		errno = saved_errno;                                                               \
+		return ret;                                                                        \
+	}
+
+MCOUNT_HANDLERS(nofilter, 0)
+MCOUNT_HANDLERS(recover, MCOUNT_FEAT_AUTO_RECOVER)
+MCOUNT_HANDLERS(filter, MCOUNT_FEAT_FILTER)
+MCOUNT_HANDLERS(filter_recover, MCOUNT_FEAT_FILTER | MCOUNT_FEAT_AUTO_RECOVER)
+MCOUNT_HANDLERS(overhead, MCOUNT_FEAT_FILTER | MCOUNT_FEAT_AUTO_RECOVER | MCOUNT_FEAT_OVERHEAD)
+MCOUNT_HANDLERS(full, MCOUNT_FEAT_ALL)
+
+#undef MCOUNT_HANDLERS
+
+#define MCOUNT_HANDLER_ENTRY(name, features)                                                       \
+	{                                                                                          \
+		#name, features, mcount_entry_##name, mcount_exit_##name                           \
+	}
+
+/* in the order of preference: lesser features first */
+static const struct mcount_handler {
+	const char *name;
+	unsigned features;
+	int (*entry)(unsigned long *parent_loc, unsigned long child, struct mcount_regs *regs);
+	unsigned long (*exit)(long *retval);
+} mcount_handlers[] = {
+	MCOUNT_HANDLER_ENTRY(nofilter, 0),
+	MCOUNT_HANDLER_ENTRY(recover, MCOUNT_FEAT_AUTO_RECOVER),
+	MCOUNT_HANDLER_ENTRY(filter, MCOUNT_FEAT_FILTER),
+	MCOUNT_HANDLER_ENTRY(filter_recover, MCOUNT_FEAT_FILTER | MCOUNT_FEAT_AUTO_RECOVER),
+	MCOUNT_HANDLER_ENTRY(overhead,
+			     MCOUNT_FEAT_FILTER | MCOUNT_FEAT_AUTO_RECOVER | MCOUNT_FEAT_OVERHEAD),
+	MCOUNT_HANDLER_ENTRY(full, MCOUNT_FEAT_ALL),
+};
+
+#undef MCOUNT_HANDLER_ENTRY
+
+/* the trampolines call them (directly or through mcount_entry/exit) */
+int (*mcount_entry_fn)(unsigned long *parent_loc, unsigned long child,
+		       struct mcount_regs *regs) = mcount_entry_full;
+unsigned long (*mcount_exit_fn)(long *retval) = mcount_exit_full;
+
+/* whether it needs to check filters and triggers for each function */
+static bool mcount_need_filter(void)
 {
-	int saved_errno = errno;
-	unsigned long ret = __mcount_exit(retval);
+#ifndef DISABLE_MCOUNT_FILTER
+	struct mcount_filter_rules *rules = mcount_current_rules();
 
-	errno = saved_errno;
-	return ret;
+	if (rules->table.nr || rules->mode != FILTER_MODE_NONE)
+		return true;
+	if (mcount_depth != MCOUNT_DEFAULT_DEPTH || !mcount_enabled)
+		return true;
+	if (mcount_watchpoints || rules->has_caller || mcount_auto_unpatch)
+		return true;
+	/* signal triggers and (async) events */
+	if (!list_empty(&siglist) || getenv("UFTRACE_EVENT"))
+		return true;
+	if (SCRIPT_ENABLED && script_str)
+		return true;
+#endif
+	return false;
+}
+
+/*
+ * Select the entry and exit handlers for the features in use.  It can
+ * be called at runtime as the handlers save and restore the same state.
+ */
+static void mcount_select_handlers(void)
+{
+	unsigned features = 0;
+	size_t i;
+
+	if (mcount_need_filter())
+		features |= MCOUNT_FEAT_FILTER;
+	if (mcount_estimate_return)
+		features |= MCOUNT_FEAT_ESTIMATE_RETURN;
+	if (mcount_auto_recover)
+		features |= MCOUNT_FEAT_AUTO_RECOVER;
+	if (mcount_use_overhead)
+		features |= MCOUNT_FEAT_OVERHEAD;
+
+	for (i = 0; i < ARRAY_SIZE(mcount_handlers); i++) {
+		const struct mcount_handler *h = &mcount_handlers[i];
+
+		if ((h->features & features) != features)
+			continue;
+
+		pr_dbg("use '%s' handlers for function entry and exit\n", h->name);
+		mcount_entry_fn = h->entry;
+		mcount_exit_fn = h->exit;
+		break;
+	}
+
+#ifndef DISABLE_MCOUNT_FILTER
+	/* the exit handler above should check mcount_enabled before it */
+	compiler_barrier();
+	mcount_entry_disabled = !mcount_enabled && mcount_current_rules()->can_skip_entry;
+#endif
+}
+
+int mcount_entry(unsigned long *parent_loc, unsigned long child, struct mcount_regs *regs)
+{
+	return mcount_entry_fn(parent_loc, child, regs);
+}
+
+unsigned long mcount_exit(long *retval)
+{
+	return mcount_exit_fn(retval);
 }
 
 static int __cygprof_entry(unsigned long parent, unsigned long child)
@@ -1460,7 +2123,6 @@ static int __cygprof_entry(unsigned long parent, unsigned long child)
 	rstack->child_ip = child;
 	rstack->end_time = 0;
 	rstack->nr_events = 0;
-	rstack->event_idx = ARGBUF_SIZE;
 
 	if (filtered == FILTER_IN) {
 		rstack->start_time = mcount_gettime();
@@ -1479,8 +2141,11 @@ static int __cygprof_entry(unsigned long parent, unsigned long child)
 static int cygprof_entry(unsigned long parent, unsigned long child)
 {
 	int saved_errno = errno;
+	uint64_t start = unlikely(mcount_use_overhead) ? mcount_overhead_tick() : 0;
 	int ret = __cygprof_entry(parent, child);
 
+	if (unlikely(mcount_use_overhead))
+		mcount_update_overhead(MCOUNT_OVH_ENTRY, start);
 	errno = saved_errno;
 	return ret;
 }
@@ -1523,8 +2188,11 @@ out:
 static void cygprof_exit(unsigned long parent, unsigned long child)
 {
 	int saved_errno = errno;
+	uint64_t start = unlikely(mcount_use_overhead) ? mcount_overhead_tick() : 0;
 
 	__cygprof_exit(parent, child);
+	if (unlikely(mcount_use_overhead))
+		mcount_update_overhead(MCOUNT_OVH_EXIT, start);
 	errno = saved_errno;
 }
 
@@ -1581,7 +2249,6 @@ static void _xray_entry(unsigned long parent, unsigned long child, struct mcount
 	rstack->child_ip = child;
 	rstack->end_time = 0;
 	rstack->nr_events = 0;
-	rstack->event_idx = ARGBUF_SIZE;
 
 	if (filtered == FILTER_IN) {
 		rstack->start_time = mcount_gettime();
@@ -1690,9 +2357,17 @@ static void atfork_child_handler(void)
 	mtdp->tid = tmsg.tid;
 	/* flush event data */
 	mtdp->nr_events = 0;
+	/* the records in the tail buffer belong to the parent */
+	mtdp->tail.active = false;
+	mtdp->tail.used = 0;
+
+	/* the pool is shared with the parent, do not use it anymore */
+	mcount_pool_reset(mtdp);
 
 	clear_shmem_buffer(mtdp);
+	reset_overhead(mtdp);
 	prepare_shmem_buffer(mtdp);
+	reset_aggregate(mtdp);
 
 	uftrace_send_message(UFTRACE_MSG_FORK_END, &tmsg, sizeof(tmsg));
 
@@ -1762,6 +2437,24 @@ static void agent_fini(struct sockaddr_un *addr, int sfd)
 	socket_unlink(addr);
 }
 
+/* read a string option: the length (including NUL) and the contents */
+static char *agent_read_string(int fd)
+{
+	uint32_t len;
+	char *str;
+
+	if (read_all(fd, &len, sizeof(len)) < 0 || len == 0 || len > AGENT_STRING_MAX)
+		return NULL;
+
+	str = xmalloc(len);
+	if (read_all(fd, str, len) < 0) {
+		free(str);
+		return NULL;
+	}
+	str[len - 1] = '\0';
+	return str;
+}
+
 /* Agent routine, applying instructions from the CLI. */
 void *agent_apply_commands(void *arg)
 {
@@ -1769,6 +2462,7 @@ void *agent_apply_commands(void *arg)
 	bool close_connection;
 	enum uftrace_dopt dopt;
 	struct sockaddr_un addr;
+	struct filter_request req;
 
 	sfd = agent_init(&addr);
 	if (sfd == -1) {
@@ -1787,6 +2481,8 @@ void *agent_apply_commands(void *arg)
 		pr_dbg2("agent connection open\n");
 
 		close_connection = false;
+		memset(&req, 0, sizeof(req));
+
 		while (!close_connection) {
 			if (read(cfd, &dopt, sizeof(enum uftrace_dopt)) == -1) {
 				pr_warn("error reading option\n", errno);
@@ -1796,15 +2492,73 @@ void *agent_apply_commands(void *arg)
 			switch (dopt) {
 			case UFTRACE_DOPT_CLOSE:
 				close_connection = true;
+				if (req.filter || req.trigger || req.has_depth || req.has_threshold)
+					mcount_filter_update(&req);
 				if (agent_run)
 					socket_send_option(cfd, UFTRACE_DOPT_CLOSE, NULL, 0);
 				break;
 
+			case UFTRACE_DOPT_SNAPSHOT:
+				mcount_flight_snapshot();
+				break;
+
+			case UFTRACE_DOPT_TRACE: {
+				bool enable;
+
+				if (read(cfd, &enable, sizeof(enable)) != sizeof(enable)) {
+					pr_warn("error reading trace state\n");
+					close_connection = true;
+					break;
+				}
+#ifndef DISABLE_MCOUNT_FILTER
+				pr_dbg("agent turns %s tracing\n", enable ? "on" : "off");
+				mcount_set_enabled(enable);
+#else
+				pr_warn("trace state is not supported without filters\n");
+#endif
+				break;
+			}
+
+			case UFTRACE_DOPT_FILTER:
+			case UFTRACE_DOPT_TRIGGER: {
+				char **pstr = dopt == UFTRACE_DOPT_FILTER ? &req.filter : &req.trigger;
+
+				free(*pstr);
+				*pstr = agent_read_string(cfd);
+				if (*pstr == NULL) {
+					pr_warn("error reading filter string\n");
+					close_connection = true;
+				}
+				break;
+			}
+
+			case UFTRACE_DOPT_DEPTH:
+				if (read_all(cfd, &req.depth, sizeof(req.depth)) < 0) {
+					pr_warn("error reading filter depth\n");
+					close_connection = true;
+					break;
+				}
+				req.has_depth = true;
+				break;
+
+			case UFTRACE_DOPT_THRESHOLD:
+				if (read_all(cfd, &req.threshold, sizeof(req.threshold)) < 0) {
+					pr_warn("error reading time filter\n");
+					close_connection = true;
+					break;
+				}
+				req.has_threshold = true;
+				break;
+
 			default:
 				close_connection = true;
 				pr_warn("option not recognized: %d\n", dopt);
 			}
 		}
+		/* discard partial requests when the connection was broken */
+		free(req.filter);
+		free(req.trigger);
+
 		if (close(cfd) == -1)
 			pr_dbg2("cannot close socket connection\n");
 		else
@@ -1859,6 +2613,29 @@ error:
 	pthread_cancel(agent);
 }
 
+static void mcount_setup_clock(char *clock_str)
+{
+	struct uftrace_clock_info *clock = &mcount_tsc_clock;
+	char *tsc_str = getenv("UFTRACE_TSC_CLOCK");
+
+	if (!clock_is_tsc(clock_str)) {
+		setup_clock_id(clock_str);
+		return;
+	}
+
+	/* the calibration data is passed by the uftrace record */
+	if (tsc_str == NULL || !host_has_invariant_tsc() ||
+	    sscanf(tsc_str, "%" SCNu64 ",%" SCNu64 ",%" SCNu64, &clock->freq, &clock->tsc,
+		   &clock->mono) != 3 ||
+	    clock->freq == 0) {
+		pr_warn("cannot use TSC clock, fall back to 'mono'\n");
+		return;
+	}
+
+	pr_dbg("use TSC clock: %" PRIu64 " Hz\n", clock->freq);
+	mcount_use_tsc = true;
+}
+
 static __used void mcount_startup(void)
 {
 	char *pipefd_str;
@@ -1967,6 +2744,23 @@ static __used void mcount_startup(void)
 	if (bufsize_str)
 		shmem_bufsize = strtol(bufsize_str, NULL, 0);
 
+	if (getenv("UFTRACE_RING_BUFFER"))
+		shmem_use_ring = true;
+
+	if (getenv("UFTRACE_FLIGHT_RECORDER")) {
+		unsigned long size = strtoul(getenv("UFTRACE_FLIGHT_RECORDER"), NULL, 0);
+
+		shmem_flight_nr_buf = size / shmem_bufsize;
+		if (shmem_flight_nr_buf < SHMEM_FLIGHT_MIN_BUF)
+			shmem_flight_nr_buf = SHMEM_FLIGHT_MIN_BUF;
+	}
+
+	if (getenv("UFTRACE_COMPACT_RECORD"))
+		mcount_compact_record = true;
+
+	if (getenv("UFTRACE_HUGEPAGE"))
+		shmem_setup_fd_channel(dirname);
+
 	mcount_exename = read_exename();
 	mcount_sym_info.dirname = dirname;
 	mcount_sym_info.symdir = symdir_str ?: dirname;
@@ -1991,12 +2785,27 @@ static __used void mcount_startup(void)
 	if (maxstack_str)
 		mcount_rstack_max = strtol(maxstack_str, NULL, 0);
 
+	if (clock_str)
+		mcount_setup_clock(clock_str);
+
 	if (threshold_str)
-		mcount_threshold = strtoull(threshold_str, NULL, 0);
+		mcount_threshold = mcount_nsec_to_time(strtoull(threshold_str, NULL, 0));
+
+	if (getenv("UFTRACE_AGGREGATE"))
+		setup_aggregate(dirname);
+
+	if (getenv("UFTRACE_OVERHEAD"))
+		setup_overhead(dirname);
+
+	if (patch_str) {
+		char *unpatch_str = getenv("UFTRACE_AUTO_UNPATCH");
 
-	if (patch_str)
 		mcount_dynamic_update(&mcount_sym_info, patch_str, patt_type);
 
+		if (unpatch_str)
+			setup_auto_unpatch(&mcount_sym_info, unpatch_str);
+	}
+
 	if (event_str)
 		mcount_setup_events(dirname, event_str, patt_type);
 
@@ -2011,12 +2820,19 @@ static __used void mcount_startup(void)
 		mcount_setup_plthook(mcount_exename, nest_libcall);
 	}
 
-	if (clock_str)
-		setup_clock_id(clock_str);
-
 	if (getenv("UFTRACE_AGENT"))
 		agent_spawn();
 
+	if (getenv("UFTRACE_BUFFER_POOL")) {
+		int pool_size = strtol(getenv("UFTRACE_BUFFER_POOL"), NULL, 0);
+
+		/* pooled buffers are only for the normal (named) shmem buffers */
+		if (shmem_use_ring || shmem_flight_nr_buf || shmem_fd_sock >= 0)
+			pr_dbg("buffer pool is not supported with this mode\n");
+		else
+			mcount_pool_init(pool_size);
+	}
+
 	pthread_atfork(atfork_prepare_handler, NULL, atfork_child_handler);
 
 	mcount_hook_functions();
@@ -2025,6 +2841,8 @@ static __used void mcount_startup(void)
 	if (SCRIPT_ENABLED && script_str)
 		mcount_script_init(patt_type);
 
+	mcount_select_handlers();
+
 	compiler_barrier();
 	pr_dbg("mcount setup done\n");
 
@@ -2036,6 +2854,7 @@ static void mcount_cleanup(void)
 {
 	agent_kill();
 	mcount_finish();
+	mcount_pool_finish();
 	destroy_dynsym_indexes();
 	mcount_dynamic_finish();
 
@@ -2183,9 +3002,13 @@ TEST_CASE(mcount_signal_setup)
 	};
 
 	/* it signal triggers are maintained in a stack (LIFO) */
-	mcount_signal_init("SIGUSR1@traceon;USR2@traceoff;RTMIN+3@finish", &setting);
+	mcount_signal_init("SIGUSR1@traceon;USR2@traceoff;RTMIN+3@finish;HUP@snapshot", &setting);
 
 	item = list_first_entry(&siglist, typeof(*item), list);
+	TEST_EQ(item->sig, SIGHUP);
+	TEST_EQ(item->tr.flags, TRIGGER_FL_SNAPSHOT);
+
+	item = list_next_entry(item, list);
 	TEST_EQ(item->sig, SIGRTMIN + 3);
 	TEST_EQ(item->tr.flags, TRIGGER_FL_FINISH);
 
@@ -2248,6 +3071,34 @@ TEST_CASE(mcount_estimate_return_depth)
 	return TEST_OK;
 }
 
+TEST_CASE(mcount_select_handlers)
+{
+	bool estimate_return = mcount_estimate_return;
+
+	pr_dbg("select handlers without filters\n");
+	mcount_estimate_return = false;
+	mcount_select_handlers();
+	TEST_EQ(mcount_entry_fn == mcount_entry_full, false);
+	TEST_EQ(mcount_exit_fn == mcount_exit_full, false);
+
+	pr_dbg("select handlers with estimate return\n");
+	mcount_estimate_return = true;
+	mcount_select_handlers();
+	TEST_EQ(mcount_entry_fn == mcount_entry_full, true);
+	TEST_EQ(mcount_exit_fn == mcount_exit_full, true);
+
+	pr_dbg("select handlers with overhead\n");
+	mcount_estimate_return = false;
+	mcount_use_overhead = true;
+	mcount_select_handlers();
+	TEST_EQ(mcount_entry_fn == mcount_entry_overhead, true);
+	TEST_EQ(mcount_exit_fn == mcount_exit_overhead, true);
+
+	mcount_use_overhead = false;
+	mcount_estimate_return = estimate_return;
+	return TEST_OK;
+}
+
 #define TESTDIR_NAME "testdir"
 
 TEST_CASE(mcount_setup)
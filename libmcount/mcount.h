@@ -36,6 +36,9 @@ enum mcount_rstack_flag {
 	MCOUNT_FL_ARGUMENT = (1U << 11),
 	MCOUNT_FL_READ = (1U << 12),
 	MCOUNT_FL_CALLER = (1U << 13),
+	MCOUNT_FL_TAIL = (1U << 14),
+	MCOUNT_FL_SAMPLE = (1U << 15),
+	MCOUNT_FL_RECURSIVE = (1U << 16),
 };
 
 struct plthook_data;
@@ -52,6 +55,8 @@ struct mcount_ret_stack {
 	int tid;
 	unsigned dyn_idx;
 	uint64_t filter_time;
+	/* time spent in (recorded) children, used by --aggregate */
+	uint64_t child_time;
 	unsigned short depth;
 	unsigned short filter_depth;
 	unsigned short nr_events;
@@ -59,6 +64,9 @@ struct mcount_ret_stack {
 	struct plthook_data *pd;
 	/* set arg_spec at function entry and use it at exit */
 	struct list_head *pargs;
+	/* area in the argbuf for arguments and events (see get_argbuf) */
+	unsigned argbuf_ofs;
+	unsigned argbuf_size;
 };
 
 void __monstartup(unsigned long low, unsigned long high);
@@ -73,15 +81,66 @@ enum shmem_buffer_flags {
 	SHMEM_FL_NEW = (1U << 0),
 	SHMEM_FL_WRITTEN = (1U << 1),
 	SHMEM_FL_RECORDING = (1U << 2),
+	SHMEM_FL_RING = (1U << 3),
 };
 
 struct mcount_shmem_buffer {
 	unsigned size;
 	unsigned flag;
-	unsigned unused[2];
+	/* for --flight-recorder: order of buffers (0 while resetting) */
+	unsigned seq;
+	/* for --flight-recorder: buffer count of the task (to find a gap) */
+	unsigned nr;
+	/* task using the buffer, the name might not have it (--buffer-pool) */
+	int tid;
+	unsigned unused;
 	char data[];
 };
 
+/* huge page size used for shmem buffers (--hugepage) */
+#define SHMEM_HUGEPAGE_SIZE (2 * 1024 * KB)
+
+/* name of unix socket in the data directory to receive buffer fds */
+#define SHMEM_FD_CHANNEL ".bufchannel"
+
+enum shmem_buffer_backing {
+	SHMEM_BACKING_SHM,
+	SHMEM_BACKING_MEMFD,
+	SHMEM_BACKING_HUGEPAGE,
+	SHMEM_BACKING_MAX,
+};
+
+/* sent with the fd of a shmem buffer (by SCM_RIGHTS) for --hugepage */
+struct mcount_shmem_fd_msg {
+	int backing;
+	char name[64];
+};
+
+/* buffer names of --buffer-pool use an id above any (valid) tid */
+#define SHMEM_POOL_ID_BASE (4 * 1024 * 1024)
+
+/* minimum number of buffers for each task in --flight-recorder */
+#define SHMEM_FLIGHT_MIN_BUF 2
+
+/* ring buffer size is (at least) this times the buffer size */
+#define SHMEM_RING_FACTOR 32
+
+/*
+ * Single producer (libmcount), single consumer (writer thread) ring.
+ * The data area starts at @offset and is mapped twice in a row by
+ * libmcount so that a record can be written contiguously across the
+ * end of the ring.  The @head and @tail are free-running byte counts
+ * and are in separate cache lines as they're updated by each side.
+ */
+struct mcount_shmem_ring {
+	unsigned size;
+	unsigned flag;
+	unsigned offset;
+	unsigned unused;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+};
+
 /* must be in sync with enum debug_domain (bits) */
 #define DBG_DOMAIN_STR "TSDFfsKMpPERWw"
 
@@ -0,0 +1,642 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* This should be defined before #include "utils.h" */
+#define PR_FMT "dynamic"
+#define PR_DOMAIN DBG_DYNAMIC
+
+#include "libmcount/dynamic.h"
+#include "libmcount/internal.h"
+#include "utils/list.h"
+#include "utils/symbol.h"
+#include "utils/utils.h"
+
+/*
+ * The patch plan cache saves the result of mcount_plan_func() for each
+ * function in a module so that next run of the same binary (with the
+ * same build-id) doesn't need to disassemble the functions again.
+ *
+ * The file has a header, entries and (relative) addresses of bad
+ * symbols.  Each entry is followed by the copied instructions, the
+ * conditional branch info and the offsets of absolute addresses in the
+ * instructions, padded to 8 bytes.  The absolute addresses are saved
+ * relative to the module base so that they're valid after the module is
+ * loaded at a different address.  The checksum covers the entries and
+ * the bad symbols.
+ */
+#define PATCH_CACHE_MAGIC "UFTPLAN"
+#define PATCH_CACHE_VERSION 2
+
+struct patch_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t min_size;
+	uint32_t nr_entry;
+	uint32_t nr_badsym;
+	uint32_t checksum;
+	uint32_t unused;
+};
+
+#define PCE_FL_MODIFIED (1U << 0)
+#define PCE_FL_HAS_JUMP (1U << 1)
+#define PCE_FL_CET (1U << 2)
+
+struct patch_cache_entry {
+	uint64_t addr;
+	int8_t state;
+	uint8_t flags;
+	uint8_t orig_size;
+	uint8_t copy_size;
+	uint8_t nr_branch;
+	uint8_t nr_reloc;
+	uint8_t pad[2];
+};
+
+struct patch_cache_index {
+	uint64_t addr;
+	struct patch_cache_entry *ent;
+};
+
+struct patch_cache {
+	char *filename;
+	char *tmpname;
+	FILE *fp;
+	struct mcount_dynamic_info *mdi;
+	/* contents of the existing cache file */
+	void *buf;
+	struct patch_cache_index *idx;
+	unsigned nr_idx;
+	unsigned nr_badsym;
+	unsigned min_size;
+	unsigned nr_hit;
+	unsigned nr_new;
+	/* checksum of the new file */
+	uint32_t checksum;
+};
+
+static unsigned entry_size(struct patch_cache_entry *ent)
+{
+	unsigned size = sizeof(*ent) + ent->copy_size;
+
+	size += ent->nr_branch * sizeof(struct cond_branch_info);
+	size += ent->nr_reloc;
+	return ALIGN(size, 8);
+}
+
+/* FNV-1a hash, it only needs to detect a broken file */
+#define CHECKSUM_INIT 2166136261U
+
+static uint32_t update_checksum(uint32_t csum, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len--) {
+		csum ^= *p++;
+		csum *= 16777619U;
+	}
+	return csum;
+}
+
+static void write_cache(struct patch_cache *pc, const void *buf, size_t len)
+{
+	fwrite(buf, 1, len, pc->fp);
+	pc->checksum = update_checksum(pc->checksum, buf, len);
+}
+
+/* convert the absolute addresses in the plan to (or from) relative ones */
+static void relocate_plan(struct mcount_disasm_info *info, long offset)
+{
+	uint64_t addr;
+	unsigned i;
+
+	for (i = 0; i < info->nr_reloc; i++) {
+		memcpy(&addr, info->insns + info->reloc[i], sizeof(addr));
+		addr += offset;
+		memcpy(info->insns + info->reloc[i], &addr, sizeof(addr));
+	}
+
+	for (i = 0; i < info->nr_branch; i++) {
+		info->branch_info[i].branch_target += offset;
+		info->branch_info[i].insn_addr += offset;
+	}
+}
+
+/* the copied instructions start after the endbr64 */
+static void *code_start(struct patch_cache_entry *ent, unsigned long addr)
+{
+#ifdef ENDBR_INSN_SIZE
+	if (ent->flags & PCE_FL_CET)
+		addr += ENDBR_INSN_SIZE;
+#endif
+	return (void *)addr;
+}
+
+static int cmp_index(const void *a, const void *b)
+{
+	const struct patch_cache_index *x = a;
+	const struct patch_cache_index *y = b;
+
+	if (x->addr == y->addr)
+		return 0;
+	return x->addr > y->addr ? 1 : -1;
+}
+
+/* it's ok to fail, the existing directory is fine too */
+static void make_cache_dir(char *dirname)
+{
+	char *p = dirname;
+
+	while ((p = strchr(p + 1, '/')) != NULL) {
+		*p = '\0';
+		mkdir(dirname, 0700);
+		*p = '/';
+	}
+	mkdir(dirname, 0700);
+}
+
+static bool read_cache_file(struct patch_cache *pc)
+{
+	struct patch_cache_header *hdr;
+	struct uftrace_symtab *symtab = &pc->mdi->map->mod->symtab;
+	uint64_t *badsym;
+	void *pos, *end;
+	size_t len;
+	unsigned i;
+	FILE *fp;
+
+	fp = fopen(pc->filename, "r");
+	if (fp == NULL)
+		return false;
+
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	pc->buf = xmalloc(len);
+	if (len < sizeof(*hdr) || fread(pc->buf, 1, len, fp) != len)
+		goto invalid;
+	fclose(fp);
+	fp = NULL;
+
+	hdr = pc->buf;
+	if (memcmp(hdr->magic, PATCH_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != PATCH_CACHE_VERSION || hdr->min_size != pc->min_size)
+		goto invalid;
+
+	if (update_checksum(CHECKSUM_INIT, pc->buf + sizeof(*hdr), len - sizeof(*hdr)) !=
+	    hdr->checksum)
+		goto invalid;
+
+	pc->idx = xcalloc(hdr->nr_entry, sizeof(*pc->idx));
+
+	pos = pc->buf + sizeof(*hdr);
+	end = pc->buf + len;
+
+	for (i = 0; i < hdr->nr_entry; i++) {
+		struct patch_cache_entry *ent = pos;
+
+		if (pos + sizeof(*ent) > end || pos + entry_size(ent) > end)
+			goto invalid;
+		if (ent->copy_size > sizeof(((struct mcount_disasm_info *)0)->insns) ||
+		    ent->nr_branch > MAX_COND_BRANCH || ent->nr_reloc > MAX_INSN_RELOC)
+			goto invalid;
+
+		pos += entry_size(ent);
+
+		pc->idx[pc->nr_idx].addr = ent->addr;
+		pc->idx[pc->nr_idx].ent = ent;
+		pc->nr_idx++;
+	}
+
+	if (pos + hdr->nr_badsym * sizeof(*badsym) > end)
+		goto invalid;
+
+	/* entries from the previous run might not be sorted */
+	qsort(pc->idx, pc->nr_idx, sizeof(*pc->idx), cmp_index);
+
+	badsym = pos;
+	for (i = 0; i < hdr->nr_badsym; i++) {
+		struct uftrace_symbol *sym = find_sym(symtab, badsym[i]);
+
+		if (sym != NULL)
+			mcount_mark_badsym(pc->mdi, sym);
+	}
+	pc->nr_badsym = hdr->nr_badsym;
+	return true;
+
+invalid:
+	pr_dbg("ignore invalid patch cache: %s\n", pc->filename);
+	if (fp)
+		fclose(fp);
+	free(pc->buf);
+	free(pc->idx);
+	pc->buf = NULL;
+	pc->idx = NULL;
+	pc->nr_idx = 0;
+	return false;
+}
+
+struct patch_cache *patch_cache_open(struct mcount_dynamic_info *mdi, char *dirname,
+				     unsigned min_size)
+{
+	struct patch_cache *pc;
+
+	if (dirname == NULL || mdi->map->build_id[0] == '\0')
+		return NULL;
+
+	pc = xzalloc(sizeof(*pc));
+	pc->mdi = mdi;
+	pc->min_size = min_size;
+
+	xasprintf(&pc->filename, "%s/%s", dirname, mdi->map->build_id);
+	xasprintf(&pc->tmpname, "%s.%d", pc->filename, getpid());
+	pc->checksum = CHECKSUM_INIT;
+
+	if (!read_cache_file(pc)) {
+		/* make sure it can be written later */
+		make_cache_dir(dirname);
+	}
+
+	pc->fp = fopen(pc->tmpname, "w+");
+	if (pc->fp == NULL) {
+		pr_dbg("cannot create patch cache: %s: %m\n", pc->tmpname);
+		goto out;
+	}
+
+	/* the header will be written at last */
+	if (fseek(pc->fp, sizeof(struct patch_cache_header), SEEK_SET) < 0)
+		goto out;
+
+	return pc;
+
+out:
+	if (pc->fp) {
+		fclose(pc->fp);
+		unlink(pc->tmpname);
+	}
+	free(pc->buf);
+	free(pc->idx);
+	free(pc->tmpname);
+	free(pc->filename);
+	free(pc);
+	return NULL;
+}
+
+bool patch_cache_find(struct patch_cache *pc, struct mcount_disasm_info *info, int *state)
+{
+	struct patch_cache_index key = {
+		.addr = info->sym->addr,
+	};
+	struct patch_cache_index *idx;
+	struct patch_cache_entry *ent;
+	unsigned long base;
+	void *data;
+
+	if (pc == NULL)
+		return false;
+
+	idx = bsearch(&key, pc->idx, pc->nr_idx, sizeof(*idx), cmp_index);
+	if (idx == NULL || idx->ent == NULL)
+		return false;
+
+	ent = idx->ent;
+	data = ent + 1;
+	base = pc->mdi->map->start;
+
+	/* the same build-id should have the same code, but make sure */
+	if (!(ent->flags & PCE_FL_MODIFIED) &&
+	    memcmp(code_start(ent, base + info->sym->addr), data, ent->copy_size)) {
+		pr_dbg("patch cache doesn't match the code: %s\n", info->sym->name);
+		/* it'll be planned and added again */
+		idx->ent = NULL;
+		return false;
+	}
+
+	info->addr = base + info->sym->addr;
+	info->orig_size = ent->orig_size;
+	info->copy_size = ent->copy_size;
+	info->modified = ent->flags & PCE_FL_MODIFIED;
+	info->has_jump = ent->flags & PCE_FL_HAS_JUMP;
+	info->has_intel_cet = ent->flags & PCE_FL_CET;
+	info->nr_branch = ent->nr_branch;
+	info->nr_reloc = ent->nr_reloc;
+
+	memcpy(info->insns, data, ent->copy_size);
+	data += ent->copy_size;
+	memcpy(info->branch_info, data, ent->nr_branch * sizeof(*info->branch_info));
+	data += ent->nr_branch * sizeof(*info->branch_info);
+	memcpy(info->reloc, data, ent->nr_reloc);
+
+	if (info->modified)
+		relocate_plan(info, base);
+
+	*state = ent->state;
+	pc->nr_hit++;
+	return true;
+}
+
+static void write_entry(struct patch_cache *pc, struct patch_cache_entry *ent, void *data)
+{
+	char pad[8] = {};
+	unsigned len = ent->copy_size + ent->nr_reloc;
+
+	len += ent->nr_branch * sizeof(struct cond_branch_info);
+
+	write_cache(pc, ent, sizeof(*ent));
+	write_cache(pc, data, len);
+	write_cache(pc, pad, entry_size(ent) - sizeof(*ent) - len);
+}
+
+void patch_cache_add(struct patch_cache *pc, struct mcount_disasm_info *info, int state)
+{
+	struct patch_cache_entry ent = {
+		.addr = info->sym->addr,
+		.state = state,
+	};
+	struct mcount_disasm_info plan;
+	char data[sizeof(plan.insns) + sizeof(plan.branch_info) + sizeof(plan.reloc)];
+	unsigned len = 0;
+
+	if (pc == NULL)
+		return;
+
+	if (state == INSTRUMENT_SUCCESS) {
+		ent.orig_size = info->orig_size;
+		ent.copy_size = info->copy_size;
+		ent.nr_branch = info->nr_branch;
+		ent.nr_reloc = info->nr_reloc;
+
+		if (info->modified)
+			ent.flags |= PCE_FL_MODIFIED;
+		if (info->has_jump)
+			ent.flags |= PCE_FL_HAS_JUMP;
+		if (info->has_intel_cet)
+			ent.flags |= PCE_FL_CET;
+
+		/* save the addresses relative to the module */
+		plan = *info;
+		if (info->modified)
+			relocate_plan(&plan, -pc->mdi->map->start);
+
+		memcpy(data, plan.insns, ent.copy_size);
+		len += ent.copy_size;
+		memcpy(data + len, plan.branch_info, ent.nr_branch * sizeof(*plan.branch_info));
+		len += ent.nr_branch * sizeof(*plan.branch_info);
+		memcpy(data + len, plan.reloc, ent.nr_reloc);
+	}
+
+	write_entry(pc, &ent, data);
+	pc->nr_new++;
+}
+
+/* save the new cache file only if something has changed */
+void patch_cache_close(struct patch_cache *pc)
+{
+	struct patch_cache_header hdr = {
+		.magic = PATCH_CACHE_MAGIC,
+		.version = PATCH_CACHE_VERSION,
+	};
+	struct dynamic_bad_symbol *badsym;
+	unsigned i;
+
+	if (pc == NULL)
+		return;
+
+	hdr.min_size = pc->min_size;
+
+	list_for_each_entry(badsym, &pc->mdi->bad_syms, list)
+		hdr.nr_badsym++;
+
+	pr_dbg("patch cache for %s: %u hit, %u new\n", basename(pc->mdi->map->libname),
+	       pc->nr_hit, pc->nr_new);
+
+	if (pc->nr_new == 0 && hdr.nr_badsym == pc->nr_badsym) {
+		fclose(pc->fp);
+		unlink(pc->tmpname);
+		goto out;
+	}
+
+	/* keep the valid entries in the existing cache */
+	hdr.nr_entry = pc->nr_new;
+	for (i = 0; i < pc->nr_idx; i++) {
+		struct patch_cache_entry *ent = pc->idx[i].ent;
+
+		if (ent == NULL)
+			continue;
+
+		write_entry(pc, ent, ent + 1);
+		hdr.nr_entry++;
+	}
+
+	list_for_each_entry(badsym, &pc->mdi->bad_syms, list) {
+		uint64_t addr = badsym->sym->addr;
+
+		write_cache(pc, &addr, sizeof(addr));
+	}
+
+	hdr.checksum = pc->checksum;
+
+	fseek(pc->fp, 0, SEEK_SET);
+	fwrite(&hdr, sizeof(hdr), 1, pc->fp);
+
+	if (fclose(pc->fp) < 0 || rename(pc->tmpname, pc->filename) < 0) {
+		pr_dbg("cannot save patch cache: %s: %m\n", pc->filename);
+		unlink(pc->tmpname);
+	}
+
+out:
+	free(pc->buf);
+	free(pc->idx);
+	free(pc->tmpname);
+	free(pc->filename);
+	free(pc);
+}
+
+#ifdef UNIT_TEST
+/* fake code of the module, the cache checks it */
+static uint8_t test_code[2][0x1300];
+
+static void corrupt_cache_file(char *dirname, char *build_id)
+{
+	char *filename;
+	FILE *fp;
+	int c;
+
+	xasprintf(&filename, "%s/%s", dirname, build_id);
+	fp = fopen(filename, "r+");
+	if (fp) {
+		/* the first entry after the header */
+		fseek(fp, sizeof(struct patch_cache_header), SEEK_SET);
+		c = fgetc(fp);
+		fseek(fp, sizeof(struct patch_cache_header), SEEK_SET);
+		fputc(c ^ 0xff, fp);
+		fclose(fp);
+	}
+	free(filename);
+}
+
+TEST_CASE(dynamic_patch_cache)
+{
+	struct uftrace_symbol syms[] = {
+		{ .addr = 0x1000, .size = 0x100, .type = ST_GLOBAL_FUNC, .name = "foo" },
+		{ .addr = 0x1100, .size = 0x100, .type = ST_GLOBAL_FUNC, .name = "bar" },
+		{ .addr = 0x1200, .size = 0x100, .type = ST_GLOBAL_FUNC, .name = "baz" },
+	};
+	struct uftrace_module mod = {
+		.symtab = {
+			.sym = syms,
+			.nr_sym = ARRAY_SIZE(syms),
+		},
+	};
+	struct uftrace_mmap *map;
+	struct mcount_dynamic_info mdi = {
+		.type = DYNAMIC_NONE,
+	};
+	struct mcount_disasm_info foo = {
+		.sym = &syms[0],
+		.insns = { 0x55, 0x48, 0x89, 0xe5, 0x90 },
+		.orig_size = 5,
+		.copy_size = 5,
+	};
+	/* movabs $<addr>,%rax; jne <target> */
+	struct mcount_disasm_info bar = {
+		.sym = &syms[1],
+		.insns = { 0x48, 0xb8, [10] = 0x75, 0x00 },
+		.orig_size = 9,
+		.copy_size = 12,
+		.modified = true,
+		.nr_branch = 1,
+		.nr_reloc = 1,
+		.reloc = { 2 },
+	};
+	struct mcount_disasm_info info;
+	struct patch_cache *pc;
+	char dirname[] = "patch-cache.XXXXXX";
+	unsigned long base = (unsigned long)test_code[0];
+	uint64_t addr;
+	int state;
+
+	TEST_NE(mkdtemp(dirname), NULL);
+
+	memcpy(test_code[0] + syms[0].addr, foo.insns, foo.copy_size);
+	memcpy(test_code[1] + syms[0].addr, foo.insns, foo.copy_size);
+
+	addr = base + 0x2000;
+	memcpy(bar.insns + 2, &addr, sizeof(addr));
+	bar.addr = base + syms[1].addr;
+	bar.branch_info[0].insn_index = 10;
+	bar.branch_info[0].branch_target = base + 0x1180;
+	bar.branch_info[0].insn_addr = bar.addr + 7;
+	bar.branch_info[0].insn_size = 2;
+
+	map = xzalloc(sizeof(*map) + 16);
+	map->mod = &mod;
+	map->start = base;
+	strcpy(map->build_id, "0123456789abcdef");
+	mdi.map = map;
+	INIT_LIST_HEAD(&mdi.bad_syms);
+
+	pr_dbg("save plans to a new cache\n");
+	pc = patch_cache_open(&mdi, dirname, 0);
+	TEST_NE(pc, NULL);
+
+	memset(&info, 0, sizeof(info));
+	info.sym = &syms[0];
+	TEST_EQ(patch_cache_find(pc, &info, &state), false);
+
+	patch_cache_add(pc, &foo, INSTRUMENT_SUCCESS);
+	patch_cache_add(pc, &bar, INSTRUMENT_SUCCESS);
+	mcount_mark_badsym(&mdi, &syms[2]);
+	patch_cache_close(pc);
+	mcount_free_badsym(&mdi);
+
+	pr_dbg("load the plans at the same address\n");
+	pc = patch_cache_open(&mdi, dirname, 0);
+	TEST_NE(pc, NULL);
+	TEST_NE(mcount_find_badsym(&mdi, map->start + syms[2].addr), NULL);
+
+	memset(&info, 0, sizeof(info));
+	info.sym = &syms[0];
+	TEST_EQ(patch_cache_find(pc, &info, &state), true);
+	TEST_EQ(state, INSTRUMENT_SUCCESS);
+	TEST_EQ(info.addr, map->start + syms[0].addr);
+	TEST_EQ(info.copy_size, foo.copy_size);
+	TEST_MEMEQ(info.insns, foo.insns, foo.copy_size);
+
+	memset(&info, 0, sizeof(info));
+	info.sym = &syms[1];
+	TEST_EQ(patch_cache_find(pc, &info, &state), true);
+	TEST_EQ(info.modified, true);
+	TEST_EQ(info.nr_reloc, 1);
+	TEST_MEMEQ(info.insns, bar.insns, bar.copy_size);
+	TEST_EQ(info.branch_info[0].branch_target, bar.branch_info[0].branch_target);
+	TEST_EQ(info.branch_info[0].insn_addr, bar.branch_info[0].insn_addr);
+	patch_cache_close(pc);
+	mcount_free_badsym(&mdi);
+
+	pr_dbg("the cache is not used if the code is different\n");
+	pc = patch_cache_open(&mdi, dirname, 0);
+	TEST_NE(pc, NULL);
+
+	test_code[0][syms[0].addr] = 0xcc;
+	memset(&info, 0, sizeof(info));
+	info.sym = &syms[0];
+	TEST_EQ(patch_cache_find(pc, &info, &state), false);
+	TEST_EQ(info.copy_size, 0);
+	test_code[0][syms[0].addr] = foo.insns[0];
+	patch_cache_close(pc);
+	mcount_free_badsym(&mdi);
+
+	pr_dbg("modified code is relocated at a different address\n");
+	map->start = (unsigned long)test_code[1];
+	pc = patch_cache_open(&mdi, dirname, 0);
+	TEST_NE(pc, NULL);
+
+	memset(&info, 0, sizeof(info));
+	info.sym = &syms[0];
+	TEST_EQ(patch_cache_find(pc, &info, &state), true);
+	TEST_EQ(info.addr, map->start + syms[0].addr);
+
+	memset(&info, 0, sizeof(info));
+	info.sym = &syms[1];
+	TEST_EQ(patch_cache_find(pc, &info, &state), true);
+	TEST_EQ(info.addr, map->start + syms[1].addr);
+
+	memcpy(&addr, info.insns + 2, sizeof(addr));
+	TEST_EQ(addr, map->start + 0x2000);
+	TEST_EQ(info.branch_info[0].branch_target, map->start + 0x1180);
+	TEST_EQ(info.branch_info[0].insn_addr, info.addr + 7);
+	patch_cache_close(pc);
+	mcount_free_badsym(&mdi);
+
+	pr_dbg("the cache is invalid for a different size filter\n");
+	pc = patch_cache_open(&mdi, dirname, 100);
+	TEST_NE(pc, NULL);
+
+	memset(&info, 0, sizeof(info));
+	info.sym = &syms[0];
+	TEST_EQ(patch_cache_find(pc, &info, &state), false);
+	patch_cache_close(pc);
+	mcount_free_badsym(&mdi);
+
+	pr_dbg("the cache is invalid if the checksum doesn't match\n");
+	corrupt_cache_file(dirname, map->build_id);
+	pc = patch_cache_open(&mdi, dirname, 0);
+	TEST_NE(pc, NULL);
+
+	memset(&info, 0, sizeof(info));
+	info.sym = &syms[0];
+	TEST_EQ(patch_cache_find(pc, &info, &state), false);
+	patch_cache_close(pc);
+	mcount_free_badsym(&mdi);
+
+	free(map);
+	remove_directory(dirname);
+	return TEST_OK;
+}
+#endif /* UNIT_TEST */
@@ -33,6 +33,10 @@ unsigned long plthook_resolver_addr; /* referenced by arch/.../plthook.S */
 /* list of plthook_data for each library (module) */
 static LIST_HEAD(plthook_modules);
 
+/* hash table to find plthook_data by module id (GOT[1]) */
+static struct plthook_data **plthook_module_table;
+static unsigned plthook_module_size;
+
 /* check getenv("LD_BIND_NOT") */
 static bool plthook_no_pltbind;
 
@@ -249,8 +253,7 @@ static int find_got(struct uftrace_elf_data *elf, struct uftrace_elf_iter *iter,
 	load_elf_dynsymtab(&pd->dsymtab, elf, pd->base_addr, 0);
 
 	pd->resolved_addr = xcalloc(pd->dsymtab.nr_sym, sizeof(long));
-	pd->special_funcs = NULL;
-	pd->nr_special = 0;
+	pd->special_flags = NULL;
 
 	mcount_arch_plthook_setup(pd, elf);
 	list_add_tail(&pd->list, &plthook_modules);
@@ -373,28 +376,6 @@ static const char *resolve_syms[] = {
 	"execvpe", "fexecve", "posix_spawn", "posix_spawnp", "pthread_exit",
 };
 
-static void add_special_func(struct plthook_data *pd, unsigned idx, unsigned flags)
-{
-	int i;
-	struct plthook_special_func *func;
-
-	for (i = 0; i < pd->nr_special; i++) {
-		func = &pd->special_funcs[i];
-
-		if (func->idx == idx) {
-			func->flags |= flags;
-			return;
-		}
-	}
-
-	pd->special_funcs = xrealloc(pd->special_funcs, (pd->nr_special + 1) * sizeof(*func));
-
-	func = &pd->special_funcs[pd->nr_special++];
-
-	func->idx = idx;
-	func->flags = flags;
-}
-
 static void build_special_funcs(struct plthook_data *pd, const char *syms[], unsigned nr_sym,
 				unsigned flag)
 {
@@ -403,35 +384,15 @@ static void build_special_funcs(struct plthook_data *pd, const char *syms[], uns
 
 	build_dynsym_idxlist(&pd->dsymtab, &idxlist, syms, nr_sym);
 	for (i = 0; i < idxlist.count; i++)
-		add_special_func(pd, idxlist.idx[i], flag);
+		pd->special_flags[idxlist.idx[i]] |= flag;
 	destroy_dynsym_idxlist(&idxlist);
 }
 
-static int idxsort(const void *a, const void *b)
-{
-	const struct plthook_special_func *func_a = a;
-	const struct plthook_special_func *func_b = b;
-
-	if (func_a->idx > func_b->idx)
-		return 1;
-	if (func_a->idx < func_b->idx)
-		return -1;
-	return 0;
-}
-
-static int idxfind(const void *a, const void *b)
-{
-	unsigned idx = (unsigned long)a;
-	const struct plthook_special_func *func = b;
-
-	if (func->idx == idx)
-		return 0;
-
-	return (idx > func->idx) ? 1 : -1;
-}
-
 void setup_dynsym_indexes(struct plthook_data *pd)
 {
+	/* it's checked for every call, use a flat array rather than searching */
+	pd->special_flags = xcalloc(pd->dsymtab.nr_sym + 1, sizeof(*pd->special_flags));
+
 	build_special_funcs(pd, skip_syms, ARRAY_SIZE(skip_syms), PLT_FL_SKIP);
 	build_special_funcs(pd, longjmp_syms, ARRAY_SIZE(longjmp_syms), PLT_FL_LONGJMP);
 	build_special_funcs(pd, setjmp_syms, ARRAY_SIZE(setjmp_syms), PLT_FL_SETJMP);
@@ -440,9 +401,6 @@ void setup_dynsym_indexes(struct plthook_data *pd)
 	build_special_funcs(pd, flush_syms, ARRAY_SIZE(flush_syms), PLT_FL_FLUSH);
 	build_special_funcs(pd, except_syms, ARRAY_SIZE(except_syms), PLT_FL_EXCEPT);
 	build_special_funcs(pd, resolve_syms, ARRAY_SIZE(resolve_syms), PLT_FL_RESOLVE);
-
-	/* built all table, now sorting */
-	qsort(pd->special_funcs, pd->nr_special, sizeof(*pd->special_funcs), idxsort);
 }
 
 void destroy_dynsym_indexes(void)
@@ -452,10 +410,65 @@ void destroy_dynsym_indexes(void)
 	pr_dbg2("destroy plthook special function index\n");
 
 	list_for_each_entry(pd, &plthook_modules, list) {
-		free(pd->special_funcs);
-		pd->special_funcs = NULL;
-		pd->nr_special = 0;
+		free(pd->special_flags);
+		pd->special_flags = NULL;
 	}
+
+	free(plthook_module_table);
+	plthook_module_table = NULL;
+	plthook_module_size = 0;
+}
+
+/* build the module id table, should be a power of 2 with load factor below 1/2 */
+static void setup_module_table(void)
+{
+	struct plthook_data *pd;
+	unsigned size = 4;
+	unsigned idx;
+	unsigned nr = 0;
+
+	list_for_each_entry(pd, &plthook_modules, list)
+		nr++;
+
+	while (size < nr * 2)
+		size *= 2;
+
+	plthook_module_table = xcalloc(size, sizeof(*plthook_module_table));
+
+	list_for_each_entry(pd, &plthook_modules, list) {
+		idx = hash_addr(pd->module_id, size);
+		while (plthook_module_table[idx])
+			idx = (idx + 1) & (size - 1);
+
+		plthook_module_table[idx] = pd;
+	}
+
+	/* publish it after the entries are set */
+	__atomic_store_n(&plthook_module_size, size, __ATOMIC_RELEASE);
+}
+
+static struct plthook_data *find_plthook_module(unsigned long module_id)
+{
+	struct plthook_data *pd;
+	unsigned size = __atomic_load_n(&plthook_module_size, __ATOMIC_ACQUIRE);
+	unsigned idx;
+
+	if (likely(size)) {
+		idx = hash_addr(module_id, size);
+		while ((pd = plthook_module_table[idx]) != NULL) {
+			if (pd->module_id == module_id)
+				return pd;
+			idx = (idx + 1) & (size - 1);
+		}
+		return NULL;
+	}
+
+	/* the table is not ready yet */
+	list_for_each_entry(pd, &plthook_modules, list) {
+		if (module_id == pd->module_id)
+			return pd;
+	}
+	return NULL;
 }
 
 static int setup_mod_plthook_data(struct dl_phdr_info *info, size_t sz, void *arg)
@@ -530,6 +543,8 @@ void mcount_setup_plthook(char *exename, bool nest_libcall)
 
 	list_for_each_entry(pd, &plthook_modules, list)
 		setup_dynsym_indexes(pd);
+
+	setup_module_table();
 }
 
 struct mcount_jmpbuf_rstack {
@@ -726,7 +741,6 @@ static unsigned long __plthook_entry(unsigned long *ret_addr, unsigned long chil
 	bool recursion = true;
 	enum filter_result filtered;
 	struct plthook_data *pd;
-	struct plthook_special_func *func;
 	unsigned long special_flag = 0;
 	unsigned long real_addr = 0;
 	struct uftrace_trigger tr;
@@ -735,14 +749,9 @@ static unsigned long __plthook_entry(unsigned long *ret_addr, unsigned long chil
 
 	// if necessary, implement it by architecture.
 	child_idx = mcount_arch_child_idx(child_idx);
-	list_for_each_entry(pd, &plthook_modules, list) {
-		if (module_id == pd->module_id)
-			break;
-	}
-
-	if (list_no_entry(pd, &plthook_modules, list)) {
+	pd = find_plthook_module(module_id);
+	if (pd == NULL) {
 		pr_dbg("cannot find pd for module id: %lx\n", module_id);
-		pd = NULL;
 		goto out;
 	}
 
@@ -759,15 +768,13 @@ static unsigned long __plthook_entry(unsigned long *ret_addr, unsigned long chil
 
 	recursion = false;
 
-	func = bsearch((void *)child_idx, pd->special_funcs, pd->nr_special, sizeof(*func),
-		       idxfind);
-	if (func)
-		special_flag |= func->flags;
+	if (likely(child_idx < pd->dsymtab.nr_sym)) {
+		if (pd->special_flags)
+			special_flag = pd->special_flags[child_idx];
 
-	if (unlikely(special_flag & PLT_FL_SKIP))
-		goto out;
+		if (unlikely(special_flag & PLT_FL_SKIP))
+			goto out;
 
-	if (likely(child_idx < pd->dsymtab.nr_sym)) {
 		sym = &pd->dsymtab.sym[child_idx];
 
 		if (dbg_domain[DBG_PLTHOOK] >= 3) {
@@ -816,7 +823,6 @@ static unsigned long __plthook_entry(unsigned long *ret_addr, unsigned long chil
 	rstack->end_time = 0;
 	rstack->flags = skip ? MCOUNT_FL_NORECORD : 0;
 	rstack->nr_events = 0;
-	rstack->event_idx = ARGBUF_SIZE;
 
 	if (!mcount_estimate_return) {
 		/* hijack the return address of child */
@@ -899,9 +905,12 @@ unsigned long plthook_entry(unsigned long *ret_addr, unsigned long child_idx,
 			    unsigned long module_id, struct mcount_regs *regs)
 {
 	int saved_errno = errno;
+	uint64_t start = unlikely(mcount_use_overhead) ? mcount_overhead_tick() : 0;
 	unsigned long ret;
 
 	ret = __plthook_entry(ret_addr, child_idx, module_id, regs);
+	if (unlikely(mcount_use_overhead))
+		mcount_update_overhead(MCOUNT_OVH_PLTHOOK, start);
 	errno = saved_errno;
 	return ret;
 }
@@ -958,7 +967,7 @@ again:
 		mtdp->idx--;
 
 		if (!mcount_rstack_has_plthook(mtdp)) {
-			free(mtdp->rstack);
+			mcount_free_rstack(mtdp->rstack);
 			mtdp->rstack = NULL;
 			mtdp->idx = 0;
 		}
@@ -1012,8 +1021,11 @@ again:
 unsigned long plthook_exit(long *retval)
 {
 	int saved_errno = errno;
+	uint64_t start = unlikely(mcount_use_overhead) ? mcount_overhead_tick() : 0;
 	unsigned long ret = __plthook_exit(retval);
 
+	if (unlikely(mcount_use_overhead))
+		mcount_update_overhead(MCOUNT_OVH_PLTHOOK, start);
 	errno = saved_errno;
 	return ret;
 }
@@ -1,5 +1,6 @@
 #include <linux/perf_event.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
@@ -9,16 +10,26 @@
 
 #include "libmcount/internal.h"
 #include "libmcount/mcount.h"
+#include "utils/arch.h"
+#include "utils/compiler.h"
 #include "utils/list.h"
 #include "utils/utils.h"
 
+/* a perf event and its (optional) mmap page for rdpmc */
+struct pmu_counter {
+	int fd;
+	struct perf_event_mmap_page *page;
+};
+
 /* PMU management data for given event */
 struct pmu_data {
 	struct list_head list;
 	enum uftrace_event_id evt_id;
 	int n_members;
 	int refcnt;
-	int fd[];
+	/* all members have the mmap page and rdpmc is allowed */
+	bool use_rdpmc;
+	struct pmu_counter cnt[];
 };
 
 /* attribute for perf_event_open(2) */
@@ -108,6 +119,88 @@ static void read_perf_event(int fd, void *buf, ssize_t len)
 		pr_dbg("reading perf_event failed: %m\n");
 }
 
+/* map the first page of the event to read the counter in user space */
+static void mmap_perf_event(struct pmu_counter *cnt)
+{
+	void *page;
+
+	cnt->page = NULL;
+	if (!host_has_rdpmc())
+		return;
+
+	page = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, cnt->fd, 0);
+	if (page == MAP_FAILED) {
+		pr_dbg("mmap perf_event failed: %m\n");
+		return;
+	}
+	cnt->page = page;
+}
+
+static void close_perf_event(struct pmu_counter *cnt)
+{
+	if (cnt->page)
+		munmap(cnt->page, getpagesize());
+	close(cnt->fd);
+}
+
+/*
+ * Read the counter using rdpmc following the seqlock protocol in the
+ * perf_event_mmap_page.  It returns false if the counter is not
+ * available in user space at the moment (i.e. not scheduled on the
+ * PMU) so that the caller can fall back to read(2).
+ */
+static bool read_perf_counter(struct perf_event_mmap_page *pc, uint64_t *value)
+{
+	uint32_t seq, idx, width;
+	uint64_t count;
+	int64_t pmc;
+
+	do {
+		seq = __atomic_load_n(&pc->lock, __ATOMIC_RELAXED);
+		compiler_barrier();
+
+		idx = pc->index;
+		if (!pc->cap_user_rdpmc || idx == 0)
+			return false;
+
+		count = pc->offset;
+		width = pc->pmc_width;
+
+		/* sign-extend the counter value to 64-bit */
+		pmc = host_read_pmc(idx - 1);
+		pmc <<= 64 - width;
+		pmc >>= 64 - width;
+		count += pmc;
+
+		compiler_barrier();
+	} while (__atomic_load_n(&pc->lock, __ATOMIC_RELAXED) != seq);
+
+	*value = count;
+	return true;
+}
+
+static bool read_pmu_counters(struct pmu_data *pd, uint64_t *data)
+{
+	int i;
+
+	for (i = 0; i < pd->n_members; i++) {
+		if (!read_perf_counter(pd->cnt[i].page, &data[i]))
+			return false;
+	}
+	return true;
+}
+
+static bool check_rdpmc(struct pmu_data *pd)
+{
+	int i;
+
+	for (i = 0; i < pd->n_members; i++) {
+		if (pd->cnt[i].page == NULL || !pd->cnt[i].page->cap_user_rdpmc)
+			return false;
+	}
+	return true;
+}
+
 static struct pmu_data *prepare_pmu_event(struct mcount_thread_data *mtdp, enum uftrace_event_id id)
 {
 	struct pmu_data *pd;
@@ -129,7 +222,7 @@ static struct pmu_data *prepare_pmu_event(struct mcount_thread_data *mtdp, enum
 		if (id != info->event_id)
 			continue;
 
-		pd = xmalloc(sizeof(*pd) + info->n_members * sizeof(int));
+		pd = xmalloc(sizeof(*pd) + info->n_members * sizeof(*pd->cnt));
 		pd->evt_id = id;
 
 		group_fd = open_perf_event(info->setting[0].type, info->setting[0].config, -1);
@@ -139,11 +232,11 @@ static struct pmu_data *prepare_pmu_event(struct mcount_thread_data *mtdp, enum
 			return NULL;
 		}
 
-		pd->fd[0] = group_fd;
+		pd->cnt[0].fd = group_fd;
 		for (k = 1; k < info->n_members; k++) {
-			pd->fd[k] = open_perf_event(info->setting[k].type, info->setting[k].config,
-						    group_fd);
-			if (pd->fd[k] < 0) {
+			pd->cnt[k].fd = open_perf_event(info->setting[k].type,
+							info->setting[k].config, group_fd);
+			if (pd->cnt[k].fd < 0) {
 				pr_warn("failed to open '%s' perf event: %m\n",
 					info->setting[k].name);
 				free(pd);
@@ -152,6 +245,11 @@ static struct pmu_data *prepare_pmu_event(struct mcount_thread_data *mtdp, enum
 		}
 
 		pd->n_members = info->n_members;
+		for (k = 0; k < info->n_members; k++)
+			mmap_perf_event(&pd->cnt[k]);
+
+		pd->use_rdpmc = check_rdpmc(pd);
+		pr_dbg("read PMU event (%d) using %s\n", id, pd->use_rdpmc ? "rdpmc" : "read");
 		break;
 	}
 	pd->refcnt = 1;
@@ -176,8 +274,14 @@ int read_pmu_event(struct mcount_thread_data *mtdp, enum uftrace_event_id id, vo
 	if (pd == NULL)
 		return -1;
 
+	if (pd->use_rdpmc && read_pmu_counters(pd, read_buf.data)) {
+		read_buf.nr_members = pd->n_members;
+		mcount_memcpy4(buf, read_buf.data, sizeof(*read_buf.data) * read_buf.nr_members);
+		return 0;
+	}
+
 	/* read group events at once */
-	read_perf_event(pd->fd[0], &read_buf, sizeof(read_buf));
+	read_perf_event(pd->cnt[0].fd, &read_buf, sizeof(read_buf));
 	mcount_memcpy4(buf, read_buf.data, sizeof(*read_buf.data) * read_buf.nr_members);
 
 	return 0;
@@ -194,8 +298,8 @@ void finish_pmu_event(struct mcount_thread_data *mtdp)
 		case EVENT_ID_READ_PMU_CYCLE:
 		case EVENT_ID_READ_PMU_CACHE:
 		case EVENT_ID_READ_PMU_BRANCH:
-			close(pd->fd[0]);
-			close(pd->fd[1]);
+			close_perf_event(&pd->cnt[0]);
+			close_perf_event(&pd->cnt[1]);
 			break;
 		default:
 			break;
@@ -223,8 +327,8 @@ void release_pmu_event(struct mcount_thread_data *mtdp, enum uftrace_event_id id
 		case EVENT_ID_READ_PMU_CYCLE:
 		case EVENT_ID_READ_PMU_CACHE:
 		case EVENT_ID_READ_PMU_BRANCH:
-			close(pd->fd[0]);
-			close(pd->fd[1]);
+			close_perf_event(&pd->cnt[0]);
+			close_perf_event(&pd->cnt[1]);
 			break;
 		default:
 			break;
@@ -240,6 +344,7 @@ TEST_CASE(mcount_pmu_event)
 	enum uftrace_event_id eid = EVENT_ID_READ_PMU_CYCLE;
 	struct pmu_data *pd;
 	char buf[32];
+	uint64_t val1[2], val2[2];
 
 	pr_dbg("checking PMU cycle event\n");
 	INIT_LIST_HEAD(&mtd.pmu_fds);
@@ -249,6 +354,13 @@ TEST_CASE(mcount_pmu_event)
 
 	TEST_EQ(pd->refcnt, 1);
 	TEST_EQ(read_pmu_event(&mtd, eid, buf), 0);
+
+	pr_dbg("checking PMU counters are increasing (using %s)\n",
+	       pd->use_rdpmc ? "rdpmc" : "read");
+	TEST_EQ(read_pmu_event(&mtd, eid, val1), 0);
+	TEST_EQ(read_pmu_event(&mtd, eid, val2), 0);
+	TEST_GE(val2[0], val1[0]);
+	TEST_GE(val2[1], val1[1]);
 	finish_pmu_event(&mtd);
 
 	pr_dbg("checking PMU cache event\n");
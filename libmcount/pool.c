@@ -0,0 +1,418 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* This should be defined before #include "utils.h" */
+#define PR_FMT "mcount"
+#define PR_DOMAIN DBG_MCOUNT
+
+#include "libmcount/internal.h"
+#include "libmcount/mcount.h"
+#include "utils/list.h"
+#include "utils/utils.h"
+
+/*
+ * A set of buffers for a thread (--buffer-pool).  They are created by
+ * the refill thread in advance so that a new thread can start tracing
+ * without allocating memory or creating shmem buffers.  The entry is
+ * returned to the pool when the thread exits.
+ */
+struct mcount_pool_entry {
+	struct list_head list;
+	/* id in the shmem buffer names instead of tid */
+	int name_id;
+	int nr_buf;
+	struct mcount_shmem_buffer **buffer;
+	struct mcount_ret_stack *rstack;
+	void *argbuf;
+	unsigned nr_rstack;
+	unsigned argbuf_size;
+};
+
+static LIST_HEAD(pool_list);
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_thread;
+
+/*
+ * Returned entries cannot be used until uftrace record writes all the
+ * data in them.  So it keeps more entries (up to this times the pool
+ * size) to have enough entries ready.
+ */
+#define POOL_MAX_FACTOR 4
+
+/* number of ready entries to keep in the pool, 0 if disabled */
+static int pool_size;
+static int pool_nr_free;
+static int pool_next_id;
+static bool pool_running;
+
+static struct mcount_pool_entry *create_pool_entry(void)
+{
+	struct mcount_pool_entry *entry;
+	char buf[128];
+	int idx;
+
+	entry = xzalloc(sizeof(*entry));
+
+	pthread_mutex_lock(&pool_lock);
+	entry->name_id = SHMEM_POOL_ID_BASE + pool_next_id++;
+	pthread_mutex_unlock(&pool_lock);
+
+	entry->nr_buf = 2;
+	entry->buffer = xcalloc(entry->nr_buf, sizeof(*entry->buffer));
+
+	for (idx = 0; idx < entry->nr_buf; idx++) {
+		entry->buffer[idx] = allocate_shmem_buffer(buf, sizeof(buf), entry->name_id, idx);
+		if (entry->buffer[idx] == NULL) {
+			pr_dbg("cannot create pooled buffer: %s: %m\n", buf);
+			entry->nr_buf = idx;
+			return entry;
+		}
+	}
+
+	entry->rstack = mcount_alloc_rstack();
+#ifndef DISABLE_MCOUNT_FILTER
+	entry->argbuf = mcount_alloc_argbuf();
+#endif
+	return entry;
+}
+
+static void destroy_pool_entry(struct mcount_pool_entry *entry)
+{
+	int i;
+
+	for (i = 0; i < entry->nr_buf; i++)
+		munmap(entry->buffer[i], shmem_bufsize);
+
+	free(entry->buffer);
+	mcount_free_rstack(entry->rstack);
+	mcount_free_argbuf(entry->argbuf);
+	free(entry);
+}
+
+/* all buffers should be written by uftrace record before reusing */
+static bool pool_entry_ready(struct mcount_pool_entry *entry)
+{
+	int i;
+
+	for (i = 0; i < entry->nr_buf; i++) {
+		if (__atomic_load_n(&entry->buffer[i]->flag, __ATOMIC_ACQUIRE) & SHMEM_FL_RECORDING)
+			return false;
+	}
+	return true;
+}
+
+/* should be called with pool_lock held */
+static bool pool_need_refill(void)
+{
+	struct mcount_pool_entry *entry;
+	int nr_ready = 0;
+
+	if (pool_nr_free >= POOL_MAX_FACTOR * pool_size)
+		return false;
+
+	list_for_each_entry(entry, &pool_list, list) {
+		if (pool_entry_ready(entry) && ++nr_ready >= pool_size)
+			return false;
+	}
+	return true;
+}
+
+static void *pool_refill_thread(void *arg)
+{
+	struct mcount_pool_entry *entry;
+
+	/* do not trace this thread (e.g. malloc in the program) */
+	mtd.recursion_marker = true;
+
+	pthread_mutex_lock(&pool_lock);
+	while (pool_running) {
+		if (!pool_need_refill()) {
+			pthread_cond_wait(&pool_cond, &pool_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool_lock);
+
+		entry = create_pool_entry();
+		if (entry->rstack == NULL) {
+			pr_dbg("stop refilling the buffer pool\n");
+			destroy_pool_entry(entry);
+			pthread_mutex_lock(&pool_lock);
+			break;
+		}
+
+		pthread_mutex_lock(&pool_lock);
+		list_add_tail(&entry->list, &pool_list);
+		pool_nr_free++;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	return NULL;
+}
+
+/* keep the pool consistent in the child, see mcount_pool_reset() */
+static void pool_atfork_prepare(void)
+{
+	pthread_mutex_lock(&pool_lock);
+}
+
+static void pool_atfork_release(void)
+{
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void mcount_pool_init(int size)
+{
+#ifdef SINGLE_THREAD
+	/* no other thread would use it (and mtd is not thread-local) */
+	return;
+#endif
+	if (size <= 0)
+		return;
+
+	pool_size = size;
+	pool_running = true;
+
+	errno = pthread_create(&pool_thread, NULL, pool_refill_thread, NULL);
+	if (errno) {
+		pr_dbg("cannot start buffer pool thread: %m\n");
+		pool_size = 0;
+		pool_running = false;
+		return;
+	}
+
+	/* it should be before libmcount's fork handler calls mcount_pool_reset() */
+	pthread_atfork(pool_atfork_prepare, pool_atfork_release, pool_atfork_release);
+
+	pr_dbg("buffer pool started: %d entries\n", size);
+}
+
+void mcount_pool_finish(void)
+{
+	struct mcount_pool_entry *entry, *tmp;
+	bool running;
+
+	pthread_mutex_lock(&pool_lock);
+	running = pool_running;
+	pool_running = false;
+	pool_size = 0;
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	if (running)
+		pthread_join(pool_thread, NULL);
+
+	pthread_mutex_lock(&pool_lock);
+	list_for_each_entry_safe(entry, tmp, &pool_list, list) {
+		list_del(&entry->list);
+		destroy_pool_entry(entry);
+	}
+	pool_nr_free = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * Called in a forked child.  The pooled buffers are shared with the
+ * parent and the refill thread is gone, just drop them.
+ */
+void mcount_pool_reset(struct mcount_thread_data *mtdp)
+{
+	struct mcount_pool_entry *entry, *tmp;
+
+	if (!pool_running)
+		return;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_running = false;
+	pool_size = 0;
+
+	list_for_each_entry_safe(entry, tmp, &pool_list, list) {
+		list_del(&entry->list);
+		destroy_pool_entry(entry);
+	}
+	pool_nr_free = 0;
+	pthread_mutex_unlock(&pool_lock);
+
+	/* the rstack and argbuf are owned by the thread now */
+	free(mtdp->pool);
+	mtdp->pool = NULL;
+}
+
+bool mcount_pool_get(struct mcount_thread_data *mtdp)
+{
+	struct mcount_pool_entry *entry;
+	bool found = false;
+
+	if (!pool_size)
+		return false;
+
+	pthread_mutex_lock(&pool_lock);
+	list_for_each_entry(entry, &pool_list, list) {
+		if (pool_entry_ready(entry)) {
+			list_del(&entry->list);
+			pool_nr_free--;
+			found = true;
+			break;
+		}
+	}
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	if (!found)
+		return false;
+
+	/* the previous thread might keep them (see mcount_pool_put) */
+	if (entry->rstack == NULL) {
+		entry->rstack = mcount_alloc_rstack();
+		entry->nr_rstack = 0;
+	}
+#ifndef DISABLE_MCOUNT_FILTER
+	if (entry->argbuf == NULL) {
+		entry->argbuf = mcount_alloc_argbuf();
+		entry->argbuf_size = 0;
+	}
+#endif
+
+	mtdp->rstack = entry->rstack;
+	mtdp->nr_rstack = entry->nr_rstack;
+	mtdp->argbuf = entry->argbuf;
+	mtdp->argbuf_size = entry->argbuf_size;
+	mtdp->shmem.buffer = entry->buffer;
+	mtdp->shmem.nr_buf = entry->nr_buf;
+	mtdp->shmem.max_buf = entry->nr_buf;
+	mtdp->shmem.name_id = entry->name_id;
+	mtdp->pool = entry;
+
+	return true;
+}
+
+/* return the buffers to the pool when the thread is done */
+void mcount_pool_put(struct mcount_thread_data *mtdp)
+{
+	struct mcount_pool_entry *entry = mtdp->pool;
+	struct mcount_shmem *shmem = &mtdp->shmem;
+	bool keep;
+	int i;
+
+	/* the thread might add more buffers */
+	entry->buffer = shmem->buffer;
+	entry->nr_buf = shmem->nr_buf;
+
+	/* uftrace record won't touch an empty buffer, mark it as done */
+	for (i = 0; i < entry->nr_buf; i++) {
+		if (entry->buffer[i]->size == 0)
+			__atomic_fetch_and(&entry->buffer[i]->flag, ~SHMEM_FL_RECORDING,
+					   __ATOMIC_RELEASE);
+	}
+
+	/* they're still used (by plthook) after the thread is done */
+	if (mtdp->rstack)
+		entry->rstack = NULL;
+	else
+		entry->nr_rstack = mtdp->nr_rstack;
+	if (mtdp->argbuf)
+		entry->argbuf = NULL;
+	else
+		entry->argbuf_size = mtdp->argbuf_size;
+
+	mtdp->pool = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	keep = pool_nr_free < POOL_MAX_FACTOR * pool_size;
+	if (keep) {
+		list_add_tail(&entry->list, &pool_list);
+		pool_nr_free++;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (!keep)
+		destroy_pool_entry(entry);
+}
+
+#ifdef UNIT_TEST
+
+#define SHMEM_SESSION_FMT "/uftrace-%s-%d-%03d"
+
+static void pool_test_unlink(struct mcount_pool_entry *entry)
+{
+	char buf[128];
+	int i;
+
+	for (i = 0; i < entry->nr_buf; i++) {
+		snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT, mcount_session_name(),
+			 entry->name_id, i);
+		shm_unlink(buf);
+	}
+}
+
+TEST_CASE(mcount_pool_reuse)
+{
+	struct mcount_thread_data td1 = {
+		.tid = 1234,
+	};
+	struct mcount_thread_data td2 = {
+		.tid = 5678,
+	};
+	struct mcount_pool_entry *entry;
+
+	pr_dbg("add an entry to the pool without the refill thread\n");
+	entry = create_pool_entry();
+	TEST_EQ(entry->nr_buf, 2);
+	TEST_GE(entry->name_id, SHMEM_POOL_ID_BASE);
+
+	list_add_tail(&entry->list, &pool_list);
+	pool_nr_free = 1;
+	pool_size = 1;
+
+	pr_dbg("the first thread gets the entry\n");
+	TEST_EQ(mcount_pool_get(&td1), true);
+	TEST_EQ(td1.pool, entry);
+	TEST_EQ(td1.shmem.name_id, entry->name_id);
+	TEST_EQ(list_empty(&pool_list), true);
+
+	pr_dbg("buffers have the tid in the header, not the name id\n");
+	prepare_shmem_buffer(&td1);
+	TEST_EQ(td1.shmem.buffer[0]->tid, 1234);
+	TEST_EQ(td1.shmem.buffer[0]->flag & SHMEM_FL_RECORDING, SHMEM_FL_RECORDING);
+
+	pr_dbg("the second thread cannot get it until the first one returns\n");
+	TEST_EQ(mcount_pool_get(&td2), false);
+
+	/* pretend the thread wrote something before exit */
+	td1.shmem.buffer[0]->size = 16;
+	mcount_pool_put(&td1);
+	TEST_EQ(td1.pool, NULL);
+	TEST_EQ(pool_nr_free, 1);
+
+	pr_dbg("it cannot be reused until uftrace record writes the data\n");
+	TEST_EQ(mcount_pool_get(&td2), false);
+
+	__atomic_fetch_and(&entry->buffer[0]->flag, ~SHMEM_FL_RECORDING, __ATOMIC_RELEASE);
+
+	pr_dbg("the second thread reuses the same entry\n");
+	TEST_EQ(mcount_pool_get(&td2), true);
+	TEST_EQ(td2.pool, entry);
+	TEST_EQ(td2.shmem.name_id, entry->name_id);
+	TEST_EQ(td2.shmem.buffer, td1.shmem.buffer);
+
+	prepare_shmem_buffer(&td2);
+	TEST_EQ(td2.shmem.buffer[0]->tid, 5678);
+	TEST_EQ(td2.shmem.buffer[0]->size, 0U);
+
+	/* the rstack of the first thread was not returned to the pool */
+	TEST_NE(td2.rstack, td1.rstack);
+	mcount_free_rstack(td1.rstack);
+	mcount_free_argbuf(td1.argbuf);
+
+	pool_test_unlink(entry);
+	destroy_pool_entry(entry);
+	pool_nr_free = 0;
+	pool_size = 0;
+
+	return TEST_OK;
+}
+
+#endif /* UNIT_TEST */
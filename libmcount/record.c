@@ -5,7 +5,11 @@
 #include <stdio.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 /* This should be defined before #include "utils.h" */
@@ -24,8 +28,152 @@
 
 #define ARG_STR_MAX 98
 
-static struct mcount_shmem_buffer *allocate_shmem_buffer(char *sess_id, size_t size, int tid,
-							 int idx)
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+#ifndef MFD_HUGE_2MB
+#define MFD_HUGE_2MB (21U << 26)
+#endif
+
+/* connect to the unix socket of uftrace record to pass buffer fds */
+void shmem_setup_fd_channel(const char *dirname)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	int sock;
+
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", dirname, SHMEM_FD_CHANNEL) >=
+	    (int)sizeof(addr.sun_path)) {
+		pr_dbg("directory name is too long for buffer channel\n");
+		return;
+	}
+
+	sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		pr_dbg("cannot create buffer channel: %m\n");
+		return;
+	}
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		pr_dbg("cannot connect to buffer channel: %m\n");
+		close(sock);
+		return;
+	}
+
+	shmem_fd_sock = sock;
+}
+
+static int shmem_memfd_create(const char *name, unsigned int flags)
+{
+#ifdef SYS_memfd_create
+	return syscall(SYS_memfd_create, name, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int send_shmem_fd(int fd, const char *name, int backing)
+{
+	struct mcount_shmem_fd_msg fdmsg = {
+		.backing = backing,
+	};
+	struct iovec iov = {
+		.iov_base = &fdmsg,
+		.iov_len = sizeof(fdmsg),
+	};
+	char cbuf[CMSG_SPACE(sizeof(fd))];
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+
+	strncpy(fdmsg.name, name, sizeof(fdmsg.name) - 1);
+
+	memset(cbuf, 0, sizeof(cbuf));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+	return sendmsg(shmem_fd_sock, &msg, MSG_NOSIGNAL);
+}
+
+/* no huge page is available, do not try it again */
+static bool shmem_no_hugetlb;
+
+/*
+ * Allocate a buffer in an anonymous memory file and pass the fd to
+ * uftrace record.  It tries huge pages first and falls back to normal
+ * pages (with a hint for transparent huge pages) if not available.
+ * Returns NULL if it cannot pass the fd so that the caller can use the
+ * usual shm_open() instead.
+ */
+static struct mcount_shmem_buffer *allocate_shmem_memfd(const char *sess_id)
+{
+	int fd;
+	int backing = SHMEM_BACKING_HUGEPAGE;
+	void *buffer = MAP_FAILED;
+
+	/* skip the leading '/' for memfd name */
+	if (!shmem_no_hugetlb) {
+		fd = shmem_memfd_create(sess_id + 1, MFD_CLOEXEC | MFD_HUGETLB | MFD_HUGE_2MB);
+		if (fd >= 0) {
+			/* it'd fail here if huge pages are not reserved */
+			if (ftruncate(fd, shmem_bufsize) == 0)
+				buffer = mmap(NULL, shmem_bufsize, PROT_READ | PROT_WRITE,
+					      MAP_SHARED, fd, 0);
+			if (buffer == MAP_FAILED)
+				close(fd);
+		}
+
+		if (buffer == MAP_FAILED) {
+			pr_dbg("cannot use huge pages for shmem buffer: %m\n");
+			shmem_no_hugetlb = true;
+		}
+	}
+
+	if (buffer == MAP_FAILED) {
+		backing = SHMEM_BACKING_MEMFD;
+
+		fd = shmem_memfd_create(sess_id + 1, MFD_CLOEXEC);
+		if (fd < 0) {
+			pr_dbg("cannot create memfd for shmem buffer: %m\n");
+			return NULL;
+		}
+
+		if (ftruncate(fd, shmem_bufsize) == 0)
+			buffer = mmap(NULL, shmem_bufsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+				      0);
+		if (buffer == MAP_FAILED) {
+			pr_dbg("cannot map memfd for shmem buffer: %m\n");
+			close(fd);
+			return NULL;
+		}
+
+		/* it's just a hint, ignore the error */
+		madvise(buffer, shmem_bufsize, MADV_HUGEPAGE);
+	}
+
+	if (send_shmem_fd(fd, sess_id, backing) < 0) {
+		pr_dbg("cannot pass shmem buffer fd: %m\n");
+		munmap(buffer, shmem_bufsize);
+		buffer = NULL;
+	}
+
+	close(fd);
+	return buffer;
+}
+
+struct mcount_shmem_buffer *allocate_shmem_buffer(char *sess_id, size_t size, int tid, int idx)
 {
 	int fd;
 	int saved_errno = 0;
@@ -33,6 +181,12 @@ static struct mcount_shmem_buffer *allocate_shmem_buffer(char *sess_id, size_t s
 
 	snprintf(sess_id, size, SHMEM_SESSION_FMT, mcount_session_name(), tid, idx);
 
+	if (shmem_fd_sock >= 0) {
+		buffer = allocate_shmem_memfd(sess_id);
+		if (buffer != NULL)
+			return buffer;
+	}
+
 	fd = shm_open(sess_id, O_RDWR | O_CREAT | O_TRUNC, 0600);
 	if (fd < 0) {
 		saved_errno = errno;
@@ -61,6 +215,113 @@ out:
 	return buffer;
 }
 
+static size_t shmem_ring_size(void)
+{
+	size_t size = (size_t)shmem_bufsize * SHMEM_RING_FACTOR;
+
+	/* round up to a power of 2 to get the position by masking */
+	return 1UL << (sizeof(long) * 8 - __builtin_clzl(size - 1));
+}
+
+static struct mcount_shmem_ring *allocate_shmem_ring(char *sess_id, size_t size, int tid)
+{
+	int fd;
+	int saved_errno = 0;
+	size_t hdr_size = getpagesize();
+	size_t data_size = shmem_ring_size();
+	size_t map_size = hdr_size + 2 * data_size;
+	struct mcount_shmem_ring *ring = NULL;
+	void *base;
+
+	snprintf(sess_id, size, SHMEM_SESSION_FMT, mcount_session_name(), tid, 0);
+
+	fd = shm_open(sess_id, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		saved_errno = errno;
+		pr_dbg("failed to open shmem ring: %s\n", sess_id);
+		goto out;
+	}
+
+	if (ftruncate(fd, hdr_size + data_size) < 0) {
+		saved_errno = errno;
+		pr_dbg("failed to resizing shmem ring: %s\n", sess_id);
+		goto out;
+	}
+
+	/* reserve address space for the header, data and its mirror */
+	base = mmap(NULL, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		saved_errno = errno;
+		pr_dbg("failed to reserve shmem ring: %s\n", sess_id);
+		goto out;
+	}
+
+	if (mmap(base, hdr_size + data_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+		 0) == MAP_FAILED ||
+	    mmap(base + hdr_size + data_size, data_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, hdr_size) == MAP_FAILED) {
+		saved_errno = errno;
+		pr_dbg("failed to mmap shmem ring: %s\n", sess_id);
+		munmap(base, map_size);
+		goto out;
+	}
+
+	ring = base;
+	ring->size = data_size;
+	ring->offset = hdr_size;
+	ring->flag = SHMEM_FL_RING;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	errno = saved_errno;
+	return ring;
+}
+
+static void release_shmem_ring(struct mcount_shmem_ring *ring)
+{
+	munmap(ring, ring->offset + 2 * ring->size);
+}
+
+static void prepare_shmem_ring(struct mcount_thread_data *mtdp)
+{
+	char buf[128];
+	struct mcount_shmem *shmem = &mtdp->shmem;
+
+	pr_dbg2("preparing shmem ring: tid = %d\n", mcount_gettid(mtdp));
+
+	shmem->ring = allocate_shmem_ring(buf, sizeof(buf), mcount_gettid(mtdp));
+	if (shmem->ring == NULL)
+		pr_err("mmap shmem ring");
+	mtdp->overhead.nr_alloc++;
+
+	/* this is the only message until the thread finishes */
+	uftrace_send_message(UFTRACE_MSG_REC_START, buf, strlen(buf));
+
+	shmem->done = false;
+	shmem->curr = 0;
+	memset(&shmem->base, 0, sizeof(shmem->base));
+}
+
+/* global order of the flight recorder buffers, 0 is reserved */
+static unsigned flight_seq;
+
+/* make the buffer visible to snapshots, paired with cmd-record.c::copy_flight_buffer() */
+static void start_flight_buffer(struct mcount_shmem *shmem, struct mcount_shmem_buffer *buf)
+{
+	buf->nr = ++shmem->seqnum;
+	__atomic_store_n(&buf->seq, __atomic_add_fetch(&flight_seq, 1, __ATOMIC_RELAXED),
+			 __ATOMIC_RELEASE);
+}
+
+/* the buffers from the pool are named after the pool entry */
+static int shmem_name_id(struct mcount_thread_data *mtdp)
+{
+	if (mtdp->shmem.name_id)
+		return mtdp->shmem.name_id;
+	return mcount_gettid(mtdp);
+}
+
 void prepare_shmem_buffer(struct mcount_thread_data *mtdp)
 {
 	char buf[128];
@@ -68,25 +329,62 @@ void prepare_shmem_buffer(struct mcount_thread_data *mtdp)
 	int tid = mcount_gettid(mtdp);
 	struct mcount_shmem *shmem = &mtdp->shmem;
 
+	if (shmem_use_ring) {
+		prepare_shmem_ring(mtdp);
+		return;
+	}
+
+	/* buffers were taken from the pool already */
+	if (shmem->buffer) {
+		pr_dbg2("using pooled shmem buffers: tid = %d (id = %d)\n", tid, shmem->name_id);
+		goto start;
+	}
+
 	pr_dbg2("preparing shmem buffers: tid = %d\n", tid);
 
 	shmem->nr_buf = 2;
 	shmem->max_buf = 2;
+	shmem->name_id = 0;
 	shmem->buffer = xcalloc(sizeof(*shmem->buffer), 2);
 
 	for (idx = 0; idx < shmem->nr_buf; idx++) {
 		shmem->buffer[idx] = allocate_shmem_buffer(buf, sizeof(buf), tid, idx);
 		if (shmem->buffer[idx] == NULL)
 			pr_err("mmap shmem buffer");
+		mtdp->overhead.nr_alloc++;
 	}
 
+start:
 	/* set idx 0 as current buffer */
-	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT, mcount_session_name(), tid, 0);
+	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT, mcount_session_name(), shmem_name_id(mtdp), 0);
 	uftrace_send_message(UFTRACE_MSG_REC_START, buf, strlen(buf));
 
 	shmem->done = false;
 	shmem->curr = 0;
+	shmem->buffer[0]->size = 0;
+	shmem->buffer[0]->tid = tid;
 	shmem->buffer[0]->flag = SHMEM_FL_RECORDING | SHMEM_FL_NEW;
+	if (shmem_flight_nr_buf)
+		start_flight_buffer(shmem, shmem->buffer[0]);
+	/* the first compact record will have the absolute values */
+	memset(&shmem->base, 0, sizeof(shmem->base));
+}
+
+static unsigned save_lost_record(struct mcount_shmem *shmem, void *buf)
+{
+	struct uftrace_record *frstack = buf;
+
+	if (mcount_compact_record)
+		return encode_compact_record(buf, &shmem->base, 0, UFTRACE_LOST, false, 0,
+					     shmem->losts);
+
+	frstack->time = 0;
+	frstack->type = UFTRACE_LOST;
+	frstack->magic = RECORD_MAGIC;
+	frstack->more = 0;
+	frstack->addr = shmem->losts;
+
+	return sizeof(*frstack);
 }
 
 static void get_new_shmem_buffer(struct mcount_thread_data *mtdp)
@@ -112,15 +410,17 @@ static void get_new_shmem_buffer(struct mcount_thread_data *mtdp)
 		 */
 		shmem->buffer = new_buffer;
 
-		curr_buf = allocate_shmem_buffer(buf, sizeof(buf), mcount_gettid(mtdp), idx);
+		curr_buf = allocate_shmem_buffer(buf, sizeof(buf), shmem_name_id(mtdp), idx);
 	}
 
 	if (new_buffer == NULL || curr_buf == NULL) {
 		shmem->losts++;
+		mtdp->overhead.nr_lost++;
 		shmem->curr = -1;
 		return;
 	}
 
+	mtdp->overhead.nr_alloc++;
 	shmem->buffer[idx] = curr_buf;
 	shmem->nr_buf++;
 	if (shmem->nr_buf > shmem->max_buf)
@@ -133,9 +433,11 @@ reuse:
 	 */
 	__sync_fetch_and_or(&curr_buf->flag, SHMEM_FL_RECORDING);
 
+	mtdp->overhead.nr_switch++;
 	shmem->seqnum++;
 	shmem->curr = idx;
 	curr_buf->size = 0;
+	curr_buf->tid = mcount_gettid(mtdp);
 
 	/* shrink unused buffers */
 	if (idx + 3 <= shmem->nr_buf) {
@@ -156,33 +458,123 @@ reuse:
 		}
 	}
 
-	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT, mcount_session_name(), mcount_gettid(mtdp),
+	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT, mcount_session_name(), shmem_name_id(mtdp),
 		 idx);
 
 	pr_dbg2("new buffer: [%d] %s\n", idx, buf);
 	uftrace_send_message(UFTRACE_MSG_REC_START, buf, strlen(buf));
 
 	if (shmem->losts) {
-		struct uftrace_record *frstack = (void *)curr_buf->data;
-
-		frstack->time = 0;
-		frstack->type = UFTRACE_LOST;
-		frstack->magic = RECORD_MAGIC;
-		frstack->more = 0;
-		frstack->addr = shmem->losts;
-
 		uftrace_send_message(UFTRACE_MSG_LOST, &shmem->losts, sizeof(shmem->losts));
 
-		curr_buf->size = sizeof(*frstack);
+		curr_buf->size = save_lost_record(shmem, curr_buf->data);
 		shmem->losts = 0;
 	}
 }
 
+/*
+ * In the flight recorder mode, buffers are not sent to the writer.
+ * It overwrites the oldest buffer (after adding buffers up to the limit)
+ * and uftrace record copies them only when it takes a snapshot.
+ */
+static void get_new_flight_buffer(struct mcount_thread_data *mtdp)
+{
+	char buf[128];
+	struct mcount_shmem *shmem = &mtdp->shmem;
+	struct mcount_shmem_buffer *curr_buf = NULL;
+	struct mcount_shmem_buffer **new_buffer;
+	int tid = mcount_gettid(mtdp);
+	int idx = shmem->curr + 1;
+
+	if (idx == shmem->nr_buf && idx < shmem_flight_nr_buf) {
+		new_buffer = realloc(shmem->buffer, sizeof(*new_buffer) * (idx + 1));
+		if (new_buffer) {
+			shmem->buffer = new_buffer;
+			curr_buf = allocate_shmem_buffer(buf, sizeof(buf), tid, idx);
+		}
+
+		if (curr_buf) {
+			shmem->buffer[idx] = curr_buf;
+			shmem->nr_buf++;
+			mtdp->overhead.nr_alloc++;
+		}
+	}
+
+	/* just overwrite the oldest one if it cannot add more */
+	if (idx >= shmem->nr_buf)
+		idx = 0;
+
+	curr_buf = shmem->buffer[idx];
+
+	/* let uftrace record know the buffer when it's used at first */
+	if (curr_buf->seq == 0) {
+		snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT, mcount_session_name(), tid, idx);
+
+		pr_dbg2("new flight buffer: [%d] %s\n", idx, buf);
+		uftrace_send_message(UFTRACE_MSG_REC_START, buf, strlen(buf));
+	}
+
+	/* invalidate the old contents before overwriting them */
+	__atomic_store_n(&curr_buf->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	curr_buf->size = 0;
+	curr_buf->tid = tid;
+	curr_buf->flag = SHMEM_FL_RECORDING;
+	start_flight_buffer(shmem, curr_buf);
+
+	mtdp->overhead.nr_switch++;
+	shmem->curr = idx;
+}
+
+/* ask uftrace record to save the flight recorder buffers, can be called from signal handler */
+void mcount_flight_snapshot(void)
+{
+	struct uftrace_msg_task tmsg = {
+		.time = mcount_gettime(),
+		.pid = getpid(),
+		.tid = syscall(SYS_gettid),
+	};
+
+	if (!shmem_flight_nr_buf)
+		return;
+
+	uftrace_send_message(UFTRACE_MSG_SNAPSHOT, &tmsg, sizeof(tmsg));
+}
+
+/* minimum interval between snapshots by triggers */
+#define FLIGHT_SNAPSHOT_INTERVAL NSEC_PER_SEC
+
+/*
+ * A snapshot trigger can be hit by every call of the function (in any
+ * thread).  Take a snapshot only if the last one was long enough ago
+ * as saving the buffers takes time and later ones would be mostly same.
+ */
+void mcount_flight_snapshot_trigger(void)
+{
+	static uint64_t last_time;
+	uint64_t prev = __atomic_load_n(&last_time, __ATOMIC_RELAXED);
+	uint64_t now = mcount_gettime();
+
+	if (!shmem_flight_nr_buf)
+		return;
+
+	if (prev && now - prev < FLIGHT_SNAPSHOT_INTERVAL)
+		return;
+
+	/* other thread might take it at the same time */
+	if (!__atomic_compare_exchange_n(&last_time, &prev, now, false, __ATOMIC_RELAXED,
+					 __ATOMIC_RELAXED))
+		return;
+
+	mcount_flight_snapshot();
+}
+
 static void finish_shmem_buffer(struct mcount_thread_data *mtdp, int idx)
 {
 	char buf[64];
 
-	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT, mcount_session_name(), mcount_gettid(mtdp),
+	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT, mcount_session_name(), shmem_name_id(mtdp),
 		 idx);
 
 	uftrace_send_message(UFTRACE_MSG_REC_END, buf, strlen(buf));
@@ -195,6 +587,20 @@ void clear_shmem_buffer(struct mcount_thread_data *mtdp)
 
 	pr_dbg2("releasing all shmem buffers for task %d\n", mcount_gettid(mtdp));
 
+	if (shmem->ring) {
+		release_shmem_ring(shmem->ring);
+		shmem->ring = NULL;
+	}
+
+	if (mtdp->pool) {
+		/* it'll be reused by other thread */
+		mcount_pool_put(mtdp);
+		shmem->buffer = NULL;
+		shmem->nr_buf = 0;
+		shmem->name_id = 0;
+		return;
+	}
+
 	for (i = 0; i < shmem->nr_buf; i++)
 		munmap(shmem->buffer[i], shmem_bufsize);
 
@@ -209,7 +615,9 @@ void shmem_finish(struct mcount_thread_data *mtdp)
 	struct mcount_shmem_buffer *curr_buf;
 	int curr = shmem->curr;
 
-	if (curr >= 0 && shmem->buffer) {
+	if (shmem->ring)
+		finish_shmem_buffer(mtdp, 0);
+	else if (curr >= 0 && shmem->buffer && !shmem_flight_nr_buf) {
 		curr_buf = shmem->buffer[curr];
 
 		if (curr_buf->flag & SHMEM_FL_RECORDING)
@@ -241,9 +649,7 @@ static struct mcount_event *get_event_pointer(void *base, unsigned idx)
 #ifndef DISABLE_MCOUNT_FILTER
 void *get_argbuf(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack)
 {
-	ptrdiff_t idx = rstack - mtdp->rstack;
-
-	return mtdp->argbuf + (idx * ARGBUF_SIZE);
+	return mtdp->argbuf + rstack->argbuf_ofs;
 }
 
 #define HEAP_REGION_UNIT 128 * MB
@@ -400,12 +806,11 @@ void finish_mem_region(struct mcount_mem_regions *regions)
 	}
 }
 
-static unsigned save_to_argbuf(void *argbuf, struct list_head *args_spec,
+static unsigned save_to_argbuf(void *argbuf, unsigned max_size, struct list_head *args_spec,
 			       struct mcount_arg_context *ctx)
 {
 	struct uftrace_arg_spec *spec;
 	unsigned size, total_size = 0;
-	unsigned max_size = ARGBUF_SIZE - sizeof(size);
 	bool is_retval = !!ctx->retval;
 	void *ptr;
 
@@ -522,7 +927,8 @@ void save_argument(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rst
 	ctx.regions = &mtdp->mem_regions;
 	ctx.arch = &mtdp->arch;
 
-	size = save_to_argbuf(argbuf, args_spec, &ctx);
+	/* it's saved before the read events at the end */
+	size = save_to_argbuf(argbuf, rstack->event_idx - sizeof(size), args_spec, &ctx);
 	if (size == -1U) {
 		pr_warn("argument data is too big\n");
 		return;
@@ -544,7 +950,7 @@ void save_retval(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstac
 	ctx.regions = &mtdp->mem_regions;
 	ctx.arch = &mtdp->arch;
 
-	size = save_to_argbuf(argbuf, args_spec, &ctx);
+	size = save_to_argbuf(argbuf, rstack->event_idx - sizeof(size), args_spec, &ctx);
 	if (size == -1U) {
 		pr_warn("retval data is too big\n");
 		rstack->flags &= ~MCOUNT_FL_RETVAL;
@@ -694,7 +1100,7 @@ void save_trigger_read(struct mcount_thread_data *mtdp, struct mcount_ret_stack
 	size_t i;
 
 	if (rstack->flags & (MCOUNT_FL_ARGUMENT | MCOUNT_FL_RETVAL))
-		arg_data += *(uint32_t *)ptr;
+		arg_data += sizeof(uint32_t) + *(uint32_t *)arg_data;
 
 	for (i = 0; i < ARRAY_SIZE(read_events); i++) {
 		struct read_event_data *red = &read_events[i];
@@ -742,6 +1148,54 @@ void save_trigger_read(struct mcount_thread_data *mtdp, struct mcount_ret_stack
 	}
 }
 
+/*
+ * Return the size of argbuf needed for the function.  It has the
+ * arguments (or return value) at the beginning and the read events
+ * (at entry and exit) at the end.
+ */
+unsigned get_argbuf_size(struct uftrace_trigger *tr)
+{
+	struct uftrace_arg_spec *spec;
+	unsigned args_size = 0;
+	unsigned retval_size = 0;
+	unsigned event_size = 0;
+	unsigned size;
+	size_t i;
+
+	if (tr->flags & (TRIGGER_FL_ARGUMENT | TRIGGER_FL_RETVAL)) {
+		list_for_each_entry(spec, tr->pargs, list) {
+			if (spec->fmt == ARG_FMT_STR || spec->fmt == ARG_FMT_STD_STRING)
+				size = ALIGN(ARG_STR_MAX + 3, 4);
+			else
+				size = ALIGN(spec->size, 4);
+
+			if (spec->idx == RETVAL_IDX)
+				retval_size += size;
+			else
+				args_size += size;
+		}
+	}
+
+	if (tr->flags & TRIGGER_FL_READ) {
+		for (i = 0; i < ARRAY_SIZE(read_events); i++) {
+			if (tr->read & read_events[i].type)
+				event_size += 2 * (EVTBUF_HDR + read_events[i].size);
+		}
+	}
+
+	if (args_size == 0 && retval_size == 0 && event_size == 0)
+		return 0;
+
+	if (args_size < retval_size)
+		args_size = retval_size;
+
+	size = ALIGN(sizeof(uint32_t) + args_size, 8) + event_size;
+	if (size > ARGBUF_SIZE)
+		size = ARGBUF_SIZE;
+
+	return size;
+}
+
 void save_watchpoint(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
 		     unsigned long watchpoints)
 {
@@ -786,6 +1240,124 @@ void save_watchpoint(struct mcount_thread_data *mtdp, struct mcount_ret_stack *r
 	}
 }
 
+/* initial number of entries in the throttle table, should be a power of 2 */
+#define THROTTLE_TABLE_SIZE 16
+
+static uint64_t throttle_window;
+
+static struct mcount_throttle_entry *find_throttle_entry(struct mcount_throttle *thr,
+							 unsigned long addr)
+{
+	unsigned idx = hash_addr(addr, thr->size);
+
+	while (thr->table[idx].addr != addr && thr->table[idx].addr != 0)
+		idx = (idx + 1) & (thr->size - 1);
+
+	return &thr->table[idx];
+}
+
+static struct mcount_throttle_entry *get_throttle_entry(struct mcount_throttle *thr,
+							unsigned long addr)
+{
+	struct mcount_throttle_entry *entry;
+
+	/* keep the load factor below 1/2 */
+	if (thr->nr * 2 >= thr->size) {
+		struct mcount_throttle_entry *old = thr->table;
+		unsigned old_size = thr->size;
+		unsigned i;
+
+		thr->size = old_size ? old_size * 2 : THROTTLE_TABLE_SIZE;
+		thr->table = xcalloc(thr->size, sizeof(*thr->table));
+
+		for (i = 0; i < old_size; i++) {
+			if (old[i].addr)
+				*find_throttle_entry(thr, old[i].addr) = old[i];
+		}
+		free(old);
+	}
+
+	entry = find_throttle_entry(thr, addr);
+	if (entry->addr == 0) {
+		entry->addr = addr;
+		thr->nr++;
+	}
+	return entry;
+}
+
+/*
+ * Count calls of the function with the throttle trigger in a second.
+ * Once it exceeds the limit, only 1 in N calls (or none) are recorded
+ * until the next window.  The number of dropped calls is saved as an
+ * event before the next recorded call of the function.  It returns
+ * %true if the call should not be recorded.
+ */
+bool check_throttle(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
+		    struct uftrace_trigger *tr)
+{
+	struct mcount_throttle_entry *entry;
+	uint64_t over;
+
+	if (unlikely(throttle_window == 0))
+		throttle_window = mcount_nsec_to_time(NSEC_PER_SEC);
+
+	entry = get_throttle_entry(&mtdp->throttle, rstack->child_ip);
+
+	if (rstack->start_time - entry->window >= throttle_window) {
+		entry->window = rstack->start_time;
+		entry->count = 0;
+	}
+
+	if (++entry->count > tr->throttle) {
+		over = entry->count - tr->throttle;
+
+		if (tr->throttle_every == 0 || over % tr->throttle_every) {
+			entry->dropped++;
+			return true;
+		}
+	}
+
+	if (entry->dropped && mtdp->nr_events < MAX_EVENT) {
+		struct mcount_event *event = &mtdp->event[mtdp->nr_events++];
+		struct uftrace_throttle data = {
+			.addr = rstack->child_ip,
+			.dropped = entry->dropped,
+		};
+
+		/* save it before the entry record */
+		event->id = EVENT_ID_THROTTLE;
+		event->time = rstack->start_time - 1;
+		event->idx = rstack - mtdp->rstack;
+		event->dsize = sizeof(data);
+
+		memcpy(event->data, &data, sizeof(data));
+		entry->dropped = 0;
+	}
+	return false;
+}
+
+/* save the sampling rate before the entry record of the sampled function */
+void save_sample_event(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
+		       struct uftrace_trigger *tr)
+{
+	struct mcount_event *event;
+	struct uftrace_sample data = {
+		.addr = rstack->child_ip,
+		.rate = tr->sample,
+	};
+
+	if (mtdp->nr_events >= MAX_EVENT)
+		return;
+
+	event = &mtdp->event[mtdp->nr_events++];
+	event->id = EVENT_ID_SAMPLE;
+	event->time = rstack->start_time - 1;
+	event->idx = rstack - mtdp->rstack;
+	event->dsize = sizeof(data);
+
+	memcpy(event->data, &data, sizeof(data));
+}
+
 #else
 void *get_argbuf(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack)
 {
@@ -826,12 +1398,22 @@ static struct mcount_shmem_buffer *get_shmem_buffer(struct mcount_thread_data *m
 get_buffer:
 		if (shmem->done)
 			return NULL;
+
+		if (shmem_flight_nr_buf) {
+			if (shmem->buffer == NULL)
+				return NULL;
+
+			get_new_flight_buffer(mtdp);
+			return shmem->buffer[shmem->curr];
+		}
+
 		if (shmem->curr > -1)
 			finish_shmem_buffer(mtdp, shmem->curr);
 		get_new_shmem_buffer(mtdp);
 
 		if (shmem->curr == -1) {
 			shmem->losts++;
+			mtdp->overhead.nr_lost++;
 			return NULL;
 		}
 
@@ -841,54 +1423,318 @@ get_buffer:
 	return curr_buf;
 }
 
-static int record_event(struct mcount_thread_data *mtdp, struct mcount_event *event)
+static void *get_shmem_ring(struct mcount_thread_data *mtdp, size_t size)
 {
-	struct mcount_shmem_buffer *curr_buf;
-	struct {
-		uint64_t time;
-		uint64_t data;
-	} * rec;
-	size_t size = sizeof(*rec);
-	uint16_t data_size = event->dsize;
+	struct mcount_shmem *shmem = &mtdp->shmem;
+	struct mcount_shmem_ring *ring = shmem->ring;
+	uint64_t head, tail;
+	unsigned lost_size;
+	void *data;
 
-	if (data_size)
-		size += ALIGN(data_size + 2, 8);
+	if (unlikely(ring == NULL))
+		return NULL;
 
-	curr_buf = get_shmem_buffer(mtdp, size);
-	if (curr_buf == NULL)
-		return mtdp->shmem.done ? 0 : -1;
+	size = ALIGN(size, 8);
+	if (unlikely(shmem->losts))
+		size += RECORD_COMPACT_MAX;
 
-	rec = (void *)(curr_buf->data + curr_buf->size);
+	head = ring->head;
+	/* paired with cmd-record.c::consume_ring() */
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
 
-	/*
-	 * instead of set bit fields, do the bit operations manually.
-	 * this would be good for both performance and portability.
-	 */
-	rec->data = UFTRACE_EVENT | RECORD_MAGIC << 3;
-	rec->data += (uint64_t)event->id << 16;
-	rec->time = event->time;
+	if (unlikely(head + size - tail > ring->size)) {
+		shmem->losts++;
+		mtdp->overhead.nr_lost++;
+		return NULL;
+	}
 
-	if (data_size) {
-		void *ptr = rec + 1;
+	/* it's ok to go beyond the end as it's mapped twice */
+	data = (void *)ring + ring->offset + (head & (ring->size - 1));
 
-		rec->data += 4; /* set 'more' bit in uftrace_record */
+	if (unlikely(shmem->losts)) {
+		uftrace_send_message(UFTRACE_MSG_LOST, &shmem->losts, sizeof(shmem->losts));
 
-		*(uint16_t *)ptr = data_size;
-		memcpy(ptr + 2, event->data, data_size);
-	}
+		lost_size = save_lost_record(shmem, data);
+		__atomic_store_n(&ring->head, head + lost_size, __ATOMIC_RELEASE);
+		shmem->losts = 0;
 
-	curr_buf->size += size;
+		data += lost_size;
+	}
 
-	return 0;
+	return data;
 }
 
-static int record_ret_stack(struct mcount_thread_data *mtdp, enum uftrace_record_type type,
-			    struct mcount_ret_stack *mrstack)
+/* size of the scratch buffer for the tail trigger (per thread) */
+#define TAIL_BUFFER_SIZE (4 * 1024 * KB)
+/* each record in the scratch buffer has its size before the data */
+#define TAIL_RECORD_HDR 8
+
+static void *get_record_buffer(struct mcount_thread_data *mtdp, size_t size);
+static void commit_record_buffer(struct mcount_thread_data *mtdp, size_t size);
+
+/* copy the records in the scratch buffer to the shmem buffer */
+static void flush_tail_buffer(struct mcount_thread_data *mtdp)
+{
+	struct mcount_tail *tail = &mtdp->tail;
+	unsigned ofs = 0;
+	unsigned size;
+	void *buf;
+
+	/* now records go to the shmem buffer */
+	tail->active = false;
+
+	while (ofs < tail->used) {
+		size = *(unsigned *)(tail->buf + ofs);
+
+		buf = get_record_buffer(mtdp, size);
+		if (buf == NULL)
+			break;
+
+		memcpy(buf, tail->buf + ofs + TAIL_RECORD_HDR, size);
+		commit_record_buffer(mtdp, size);
+
+		ofs += TAIL_RECORD_HDR + ALIGN(size, 8);
+	}
+	tail->used = 0;
+}
+
+static void *get_tail_buffer(struct mcount_thread_data *mtdp, size_t size)
+{
+	struct mcount_tail *tail = &mtdp->tail;
+
+	if (unlikely(tail->used + TAIL_RECORD_HDR + ALIGN(size, 8) > tail->size)) {
+		/* too big to hold, keep the records rather than losing them */
+		pr_dbg2("tail buffer is full, save the records directly\n");
+		flush_tail_buffer(mtdp);
+		return get_record_buffer(mtdp, size);
+	}
+
+	return tail->buf + tail->used + TAIL_RECORD_HDR;
+}
+
+/* returns a pointer to save a record of the given size */
+static void *get_record_buffer(struct mcount_thread_data *mtdp, size_t size)
 {
-	struct uftrace_record *frstack;
-	uint64_t timestamp = mrstack->start_time;
 	struct mcount_shmem_buffer *curr_buf;
+
+	if (unlikely(mtdp->tail.active))
+		return get_tail_buffer(mtdp, size);
+
+	if (shmem_use_ring)
+		return get_shmem_ring(mtdp, size);
+
+	curr_buf = get_shmem_buffer(mtdp, size);
+	if (curr_buf == NULL)
+		return NULL;
+
+	return curr_buf->data + curr_buf->size;
+}
+
+/* make the record visible to the writer */
+static void commit_record_buffer(struct mcount_thread_data *mtdp, size_t size)
+{
+	struct mcount_shmem *shmem = &mtdp->shmem;
+	struct mcount_shmem_ring *ring = shmem->ring;
+
+	if (unlikely(mtdp->tail.active)) {
+		struct mcount_tail *tail = &mtdp->tail;
+
+		*(unsigned *)(tail->buf + tail->used) = size;
+		tail->used += TAIL_RECORD_HDR + ALIGN(size, 8);
+		return;
+	}
+
+	mtdp->overhead.bytes += size;
+
+	if (shmem_use_ring) {
+		/* paired with cmd-record.c::consume_ring() */
+		__atomic_store_n(&ring->head, ring->head + size, __ATOMIC_RELEASE);
+		return;
+	}
+
+	/* the snapshot of flight recorder can read it anytime */
+	__atomic_store_n(&shmem->buffer[shmem->curr]->size, shmem->buffer[shmem->curr]->size + size,
+			 __ATOMIC_RELEASE);
+}
+
+static int record_event(struct mcount_thread_data *mtdp, struct mcount_event *event)
+{
+	struct {
+		uint64_t time;
+		uint64_t data;
+	} * rec;
+	size_t size = sizeof(*rec);
+	uint16_t data_size = event->dsize;
+	void *buf;
+
+	if (mcount_compact_record)
+		size = RECORD_COMPACT_MAX;
+	if (data_size)
+		size += ALIGN(data_size + 2, 8);
+
+	buf = get_record_buffer(mtdp, size);
+	if (buf == NULL)
+		return mtdp->shmem.done ? 0 : -1;
+
+	if (mcount_compact_record) {
+		size = encode_compact_record(buf, &mtdp->shmem.base, event->time, UFTRACE_EVENT,
+					     data_size != 0, 0, event->id);
+	}
+	else {
+		rec = buf;
+		size = sizeof(*rec);
+
+		/*
+		 * instead of set bit fields, do the bit operations manually.
+		 * this would be good for both performance and portability.
+		 */
+		rec->data = UFTRACE_EVENT | RECORD_MAGIC << 3;
+		rec->data += (uint64_t)event->id << 16;
+		rec->time = event->time;
+
+		if (data_size)
+			rec->data += 4; /* set 'more' bit in uftrace_record */
+	}
+
+	if (data_size) {
+		void *ptr = buf + size;
+
+		memcpy(ptr, &data_size, sizeof(data_size));
+		memcpy(ptr + 2, event->data, data_size);
+
+		size += ALIGN(data_size + 2, 8);
+	}
+
+	commit_record_buffer(mtdp, size);
+
+	return 0;
+}
+
+#ifndef DISABLE_MCOUNT_FILTER
+/* save the calls dropped after the last recorded call and release the table */
+void finish_throttle(struct mcount_thread_data *mtdp)
+{
+	struct mcount_throttle *thr = &mtdp->throttle;
+	struct mcount_event event = {
+		.id = EVENT_ID_THROTTLE,
+		.dsize = sizeof(struct uftrace_throttle),
+	};
+	unsigned i;
+
+	for (i = 0; i < thr->size; i++) {
+		struct uftrace_throttle data = {
+			.addr = thr->table[i].addr,
+			.dropped = thr->table[i].dropped,
+		};
+
+		if (data.dropped == 0)
+			continue;
+
+		event.time = mcount_gettime();
+		memcpy(event.data, &data, sizeof(data));
+		record_event(mtdp, &event);
+	}
+
+	free(thr->table);
+	thr->table = NULL;
+	thr->size = 0;
+	thr->nr = 0;
+}
+#endif
+
+#ifndef DISABLE_MCOUNT_FILTER
+/*
+ * Start to keep the records in the scratch buffer from the function with
+ * the tail trigger.  Nested ones are part of the outer subtree.
+ */
+void start_tail_record(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack,
+		       struct uftrace_trigger *tr)
+{
+	struct mcount_tail *tail = &mtdp->tail;
+	int first = rstack - mtdp->rstack;
+
+	if (tail->active || mcount_use_aggregate)
+		return;
+
+	if (unlikely(tail->buf == NULL)) {
+		/* pages are allocated when they're used */
+		tail->buf = mmap(NULL, TAIL_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (tail->buf == MAP_FAILED) {
+			pr_dbg("cannot allocate tail buffer: %m\n");
+			tail->buf = NULL;
+			return;
+		}
+		tail->size = TAIL_BUFFER_SIZE;
+	}
+
+	/* the parents written in the subtree should be written again if discarded */
+	while (first > 0 && !(mtdp->rstack[first - 1].flags & MCOUNT_FL_WRITTEN))
+		first--;
+
+	tail->root = rstack - mtdp->rstack;
+	tail->first = first;
+	tail->time = mcount_nsec_to_time(tr->tail);
+	tail->base = mtdp->shmem.base;
+	tail->used = 0;
+	tail->active = true;
+
+	rstack->flags |= MCOUNT_FL_TAIL;
+}
+
+/*
+ * Called at the exit of the function with the tail trigger.  It saves
+ * the records of the subtree if the function was slow enough and returns
+ * %true.  Otherwise the records are discarded and it returns %false.
+ */
+bool end_tail_record(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack)
+{
+	struct mcount_tail *tail = &mtdp->tail;
+	int i;
+
+	/* the records were saved already (buffer was full) */
+	if (!tail->active || tail->root != rstack - mtdp->rstack)
+		return true;
+
+	if (rstack->end_time - rstack->start_time >= tail->time) {
+		flush_tail_buffer(mtdp);
+		rstack->flags |= MCOUNT_FL_TRACE;
+		return true;
+	}
+
+	tail->active = false;
+	tail->used = 0;
+	mtdp->shmem.base = tail->base;
+
+	for (i = tail->first; i <= tail->root; i++)
+		mtdp->rstack[i].flags &= ~MCOUNT_FL_WRITTEN;
+
+	return false;
+}
+
+/* save the pending records (if any) and release the scratch buffer */
+void finish_tail_record(struct mcount_thread_data *mtdp)
+{
+	struct mcount_tail *tail = &mtdp->tail;
+
+	if (tail->active)
+		flush_tail_buffer(mtdp);
+
+	if (tail->buf)
+		munmap(tail->buf, tail->size);
+
+	tail->buf = NULL;
+	tail->size = 0;
+}
+#endif
+
+static int record_ret_stack(struct mcount_thread_data *mtdp, enum uftrace_record_type type,
+			    struct mcount_ret_stack *mrstack)
+{
+	struct uftrace_record *frstack;
+	uint64_t timestamp = mrstack->start_time;
 	size_t size = sizeof(*frstack);
+	size_t argsize = 0;
 	void *argbuf = NULL;
 	uint64_t *buf;
 	uint64_t rec;
@@ -933,15 +1779,24 @@ static int record_ret_stack(struct mcount_thread_data *mtdp, enum uftrace_record
 	    (type == UFTRACE_EXIT && mrstack->flags & MCOUNT_FL_RETVAL)) {
 		argbuf = get_argbuf(mtdp, mrstack);
 		if (argbuf)
-			size += *(unsigned *)argbuf;
+			argsize = *(unsigned *)argbuf;
 	}
 
-	curr_buf = get_shmem_buffer(mtdp, size);
-	if (curr_buf == NULL)
+	if (mcount_compact_record)
+		size = RECORD_COMPACT_MAX;
+
+	buf = get_record_buffer(mtdp, size + argsize);
+	if (buf == NULL)
 		return mtdp->shmem.done ? 0 : -1;
 
+	if (mcount_compact_record) {
+		size = encode_compact_record(buf, &mtdp->shmem.base, timestamp, type, !!argbuf,
+					     mrstack->depth, mrstack->child_ip);
+		goto out;
+	}
+
 #if 0
-	frstack = (void *)(curr_buf->data + curr_buf->size);
+	frstack = (void *)buf;
 
 	frstack->time   = timestamp;
 	frstack->type   = type;
@@ -959,24 +1814,27 @@ static int record_ret_stack(struct mcount_thread_data *mtdp, enum uftrace_record
 	rec += mrstack->depth << 6;
 	rec += (uint64_t)mrstack->child_ip << 16;
 
-	buf = (void *)(curr_buf->data + curr_buf->size);
 	buf[0] = timestamp;
 	buf[1] = rec;
 #endif
 
-	curr_buf->size += sizeof(*frstack);
+out:
 	mrstack->flags |= MCOUNT_FL_WRITTEN;
 
 	if (argbuf) {
-		unsigned int *ptr = (void *)curr_buf->data + curr_buf->size;
-
-		size -= sizeof(*frstack);
+		void *ptr = (void *)buf + size;
 
-		mcount_memcpy4(ptr, argbuf + 4, size);
+		/* compact record can make it unaligned */
+		if (mcount_compact_record)
+			mcount_memcpy1(ptr, argbuf + 4, argsize);
+		else
+			mcount_memcpy4(ptr, argbuf + 4, argsize);
 
-		curr_buf->size += ALIGN(size, 8);
+		size += ALIGN(argsize, 8);
 	}
 
+	commit_record_buffer(mtdp, size);
+
 	pr_dbg3("rstack[%d] %s %lx\n", mrstack->depth, type == UFTRACE_ENTRY ? "ENTRY" : "EXIT ",
 		mrstack->child_ip);
 
@@ -1012,6 +1870,10 @@ int record_trace_data(struct mcount_thread_data *mtdp, struct mcount_ret_stack *
 
 #define SKIP_FLAGS (MCOUNT_FL_NORECORD | MCOUNT_FL_DISABLED)
 
+	/* only summary is saved (by record_aggregate) */
+	if (mcount_use_aggregate)
+		return 0;
+
 	if (mrstack < mtdp->rstack)
 		return 0;
 
@@ -1086,6 +1948,486 @@ int record_trace_data(struct mcount_thread_data *mtdp, struct mcount_ret_stack *
 	return 0;
 }
 
+/* initial number of entries in the table, should be a power of 2 */
+#define AGG_TABLE_SIZE 256
+/* flush the tables to the files (at least) every second */
+#define AGG_FLUSH_INTERVAL NSEC_PER_SEC
+
+bool mcount_use_aggregate;
+static const char *agg_dirname;
+
+/*
+ * All summary tables in the process.  The flusher thread writes them to
+ * the files periodically so that threads don't do I/O when recording.
+ * The list lock is taken before the table locks.
+ */
+static LIST_HEAD(agg_list);
+static pthread_mutex_t agg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t agg_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t agg_thread;
+static bool agg_running;
+
+static void lock_agg_table(struct mcount_aggregate *agg)
+{
+	while (__atomic_exchange_n(&agg->lock, 1, __ATOMIC_ACQUIRE))
+		cpu_relax();
+}
+
+static void unlock_agg_table(struct mcount_aggregate *agg)
+{
+	__atomic_store_n(&agg->lock, 0, __ATOMIC_RELEASE);
+}
+
+static void reset_agg_stat(struct uftrace_agg_entry *stat)
+{
+	uint64_t addr = stat->addr;
+
+	memset(stat, 0, sizeof(*stat));
+	stat->addr = addr;
+	stat->total_min = -1ULL;
+	stat->self_min = -1ULL;
+}
+
+/* append the summary to <tid>.agg file and start over */
+static void flush_aggregate(struct mcount_aggregate *agg)
+{
+	struct uftrace_agg_header hdr = {
+		.magic = UFTRACE_AGG_MAGIC,
+	};
+	struct uftrace_agg_entry *entries;
+	char *filename = NULL;
+	unsigned i, n;
+	int fd;
+
+	lock_agg_table(agg);
+
+	entries = xmalloc(agg->nr * sizeof(*entries));
+	for (i = 0, n = 0; i < agg->size; i++) {
+		struct uftrace_agg_entry *stat = &agg->table[i].stat;
+
+		/* keep the entries to find outer (recursive) calls */
+		if (stat->call == 0)
+			continue;
+
+		entries[n++] = *stat;
+		reset_agg_stat(stat);
+	}
+	hdr.time = mcount_gettime();
+
+	unlock_agg_table(agg);
+
+	hdr.nr = n;
+	if (n == 0)
+		goto out;
+
+	xasprintf(&filename, "%s/%d.agg", agg_dirname, agg->tid);
+	fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		pr_warn("cannot open summary file: %s: %m\n", filename);
+	else {
+		struct iovec iov[2] = {
+			{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+			{ .iov_base = entries, .iov_len = n * sizeof(*entries) },
+		};
+
+		if (writev(fd, iov, 2) != (ssize_t)(iov[0].iov_len + iov[1].iov_len))
+			pr_warn("writing summary failed: %s: %m\n", filename);
+		close(fd);
+	}
+
+	pr_dbg2("task %d flushed %u summary entries\n", agg->tid, n);
+
+out:
+	free(filename);
+	free(entries);
+}
+
+static void *agg_flush_thread(void *arg)
+{
+	struct mcount_aggregate *agg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&agg_lock);
+	while (agg_running) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += AGG_FLUSH_INTERVAL / NSEC_PER_SEC;
+
+		if (pthread_cond_timedwait(&agg_cond, &agg_lock, &ts) != ETIMEDOUT)
+			continue;
+
+		list_for_each_entry(agg, &agg_list, list)
+			flush_aggregate(agg);
+	}
+	pthread_mutex_unlock(&agg_lock);
+
+	return NULL;
+}
+
+static void start_agg_thread(void)
+{
+	agg_running = true;
+
+	errno = pthread_create(&agg_thread, NULL, agg_flush_thread, NULL);
+	if (errno) {
+		pr_dbg("cannot start summary flusher: %m\n");
+		agg_running = false;
+	}
+}
+
+/* do not fork while the flusher holds a table lock */
+static void agg_atfork_prepare(void)
+{
+	pthread_mutex_lock(&agg_lock);
+}
+
+static void agg_atfork_parent(void)
+{
+	pthread_mutex_unlock(&agg_lock);
+}
+
+/* the tables of other threads are gone, reset_aggregate() adds ours */
+static void agg_atfork_child(void)
+{
+	INIT_LIST_HEAD(&agg_list);
+	pthread_mutex_unlock(&agg_lock);
+
+	start_agg_thread();
+}
+
+void setup_aggregate(const char *dirname)
+{
+	mcount_use_aggregate = true;
+	agg_dirname = dirname;
+
+	pthread_atfork(agg_atfork_prepare, agg_atfork_parent, agg_atfork_child);
+	start_agg_thread();
+}
+
+static struct mcount_agg_entry *find_agg_entry(struct mcount_agg_entry *table, unsigned size,
+					       unsigned long addr)
+{
+	unsigned idx = hash_addr(addr, size);
+
+	while (table[idx].stat.addr != addr && table[idx].stat.addr != 0)
+		idx = (idx + 1) & (size - 1);
+
+	return &table[idx];
+}
+
+static void grow_agg_table(struct mcount_aggregate *agg)
+{
+	struct mcount_agg_entry *old = agg->table;
+	unsigned old_size = agg->size;
+	unsigned i;
+
+	agg->size = old_size ? old_size * 2 : AGG_TABLE_SIZE;
+	agg->table = xcalloc(agg->size, sizeof(*agg->table));
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].stat.addr == 0)
+			continue;
+		*find_agg_entry(agg->table, agg->size, old[i].stat.addr) = old[i];
+	}
+	free(old);
+}
+
+/* mark recursive calls at entry, so that the exit doesn't need to scan the rstack */
+void enter_aggregate(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack)
+{
+	struct mcount_aggregate *agg = &mtdp->agg;
+	struct mcount_agg_entry *entry;
+	int idx = rstack - mtdp->rstack;
+
+	if (unlikely(agg->table == NULL)) {
+		grow_agg_table(agg);
+		agg->tid = mcount_gettid(mtdp);
+
+		pthread_mutex_lock(&agg_lock);
+		list_add_tail(&agg->list, &agg_list);
+		pthread_mutex_unlock(&agg_lock);
+	}
+
+	lock_agg_table(agg);
+
+	/* keep the load factor below 1/2 */
+	if (agg->nr * 2 >= agg->size)
+		grow_agg_table(agg);
+
+	entry = find_agg_entry(agg->table, agg->size, rstack->child_ip);
+	if (entry->stat.addr == 0) {
+		entry->stat.addr = rstack->child_ip;
+		reset_agg_stat(&entry->stat);
+		entry->outer_idx = -1;
+		agg->nr++;
+	}
+
+	/* the outer call might be gone without exit (e.g. longjmp) */
+	if (entry->outer_idx >= 0 && entry->outer_idx < idx &&
+	    mtdp->rstack[entry->outer_idx].child_ip == rstack->child_ip &&
+	    mtdp->rstack[entry->outer_idx].start_time == entry->outer_time)
+		rstack->flags |= MCOUNT_FL_RECURSIVE;
+	else {
+		entry->outer_idx = idx;
+		entry->outer_time = rstack->start_time;
+	}
+
+	unlock_agg_table(agg);
+}
+
+/* update the summary of the function at exit instead of writing records */
+void record_aggregate(struct mcount_thread_data *mtdp, struct mcount_ret_stack *rstack)
+{
+	struct mcount_aggregate *agg = &mtdp->agg;
+	struct uftrace_agg_entry *entry;
+	uint64_t total = rstack->end_time - rstack->start_time;
+	uint64_t self = total > rstack->child_time ? total - rstack->child_time : 0;
+
+	if (rstack > mtdp->rstack)
+		rstack[-1].child_time += total;
+
+	/* the table is set up by enter_aggregate() */
+	if (unlikely(agg->table == NULL))
+		return;
+
+	lock_agg_table(agg);
+
+	entry = &find_agg_entry(agg->table, agg->size, rstack->child_ip)->stat;
+
+	entry->call++;
+	/* same as 'uftrace report', total time of inner calls is not added */
+	if (rstack->flags & MCOUNT_FL_RECURSIVE)
+		entry->total_rec += total;
+	else
+		entry->total += total;
+	if (entry->total_min > total)
+		entry->total_min = total;
+	if (entry->total_max < total)
+		entry->total_max = total;
+
+	entry->self += self;
+	if (entry->self_min > self)
+		entry->self_min = self;
+	if (entry->self_max < self)
+		entry->self_max = self;
+
+	unlock_agg_table(agg);
+}
+
+/* flush the summary of all threads, as other threads won't do it at exit */
+void flush_all_aggregate(void)
+{
+	struct mcount_aggregate *agg;
+
+	pthread_mutex_lock(&agg_lock);
+	list_for_each_entry(agg, &agg_list, list)
+		flush_aggregate(agg);
+	pthread_mutex_unlock(&agg_lock);
+}
+
+void stop_aggregate(void)
+{
+	bool running;
+
+	pthread_mutex_lock(&agg_lock);
+	running = agg_running;
+	agg_running = false;
+	pthread_cond_signal(&agg_cond);
+	pthread_mutex_unlock(&agg_lock);
+
+	if (running)
+		pthread_join(agg_thread, NULL);
+
+	flush_all_aggregate();
+}
+
+/* drop the summary (inherited from the parent at fork) */
+void reset_aggregate(struct mcount_thread_data *mtdp)
+{
+	struct mcount_aggregate *agg = &mtdp->agg;
+	unsigned i;
+
+	if (agg->table == NULL)
+		return;
+
+	for (i = 0; i < agg->size; i++) {
+		if (agg->table[i].stat.addr)
+			reset_agg_stat(&agg->table[i].stat);
+	}
+	agg->tid = mcount_gettid(mtdp);
+	agg->lock = 0;
+
+	pthread_mutex_lock(&agg_lock);
+	list_add_tail(&agg->list, &agg_list);
+	pthread_mutex_unlock(&agg_lock);
+}
+
+void finish_aggregate(struct mcount_thread_data *mtdp)
+{
+	struct mcount_aggregate *agg = &mtdp->agg;
+
+	if (agg->table == NULL)
+		return;
+
+	pthread_mutex_lock(&agg_lock);
+	list_del(&agg->list);
+	pthread_mutex_unlock(&agg_lock);
+
+	flush_aggregate(agg);
+
+	free(agg->table);
+	agg->table = NULL;
+	agg->size = 0;
+	agg->nr = 0;
+}
+
+#define OVERHEAD_FILE "overhead.txt"
+
+bool mcount_use_overhead;
+static const char *overhead_dirname;
+
+/* overhead of all threads, to flush them at once */
+static LIST_HEAD(overhead_list);
+static pthread_mutex_t overhead_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void overhead_atfork_prepare(void)
+{
+	pthread_mutex_lock(&overhead_lock);
+}
+
+static void overhead_atfork_parent(void)
+{
+	pthread_mutex_unlock(&overhead_lock);
+}
+
+/* the counters of other threads are gone, reset_overhead() adds ours */
+static void overhead_atfork_child(void)
+{
+	INIT_LIST_HEAD(&overhead_list);
+	pthread_mutex_unlock(&overhead_lock);
+}
+
+void setup_overhead(const char *dirname)
+{
+	mcount_use_overhead = true;
+	overhead_dirname = dirname;
+
+	pthread_atfork(overhead_atfork_prepare, overhead_atfork_parent, overhead_atfork_child);
+}
+
+static void clear_overhead(struct mcount_overhead *ovh)
+{
+	struct timespec ts;
+
+	memset(ovh->count, 0, sizeof(ovh->count));
+	memset(ovh->ticks, 0, sizeof(ovh->ticks));
+	ovh->nr_switch = 0;
+	ovh->nr_alloc = 0;
+	ovh->nr_lost = 0;
+	ovh->bytes = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ovh->start_time = (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+	ovh->start_tick = mcount_overhead_tick();
+}
+
+/* start counting the overhead of the current thread (again after fork) */
+void reset_overhead(struct mcount_thread_data *mtdp)
+{
+	struct mcount_overhead *ovh = &mtdp->overhead;
+	struct mcount_overhead *iter;
+
+	if (!mcount_use_overhead)
+		return;
+
+	clear_overhead(ovh);
+	ovh->tid = mcount_gettid(mtdp);
+
+	pthread_mutex_lock(&overhead_lock);
+	/* the fork handler might call it after mcount_prepare() */
+	list_for_each_entry(iter, &overhead_list, list) {
+		if (iter == ovh)
+			goto out;
+	}
+	list_add_tail(&ovh->list, &overhead_list);
+out:
+	pthread_mutex_unlock(&overhead_lock);
+}
+
+/*
+ * Append the overhead of the thread to the file and start over.  It
+ * might be called for other threads, then the counters can be off by a
+ * few as the thread keeps updating them.
+ */
+static void flush_overhead(struct mcount_overhead *ovh)
+{
+	struct timespec ts;
+	uint64_t elapsed;
+	char filename[PATH_MAX];
+	char buf[512];
+	int len;
+	int fd;
+
+	/* nothing happened since the last flush */
+	if (ovh->count[MCOUNT_OVH_ENTRY] + ovh->count[MCOUNT_OVH_PLTHOOK] == 0 && ovh->bytes == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	elapsed = (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec - ovh->start_time;
+
+	len = snprintf(buf, sizeof(buf),
+		       "OVERHEAD tid=%d elapsed=%" PRIu64 " ticks=%" PRIu64 " entry=%lu,%" PRIu64
+		       " exit=%lu,%" PRIu64 " plthook=%lu,%" PRIu64
+		       " switch=%lu alloc=%lu lost=%lu bytes=%" PRIu64 "\n",
+		       ovh->tid, elapsed, mcount_overhead_tick() - ovh->start_tick,
+		       ovh->count[MCOUNT_OVH_ENTRY], ovh->ticks[MCOUNT_OVH_ENTRY],
+		       ovh->count[MCOUNT_OVH_EXIT], ovh->ticks[MCOUNT_OVH_EXIT],
+		       ovh->count[MCOUNT_OVH_PLTHOOK], ovh->ticks[MCOUNT_OVH_PLTHOOK],
+		       ovh->nr_switch, ovh->nr_alloc, ovh->nr_lost, ovh->bytes);
+
+	/* do not call malloc() as it might be traced */
+	snprintf(filename, sizeof(filename), "%s/%s", overhead_dirname, OVERHEAD_FILE);
+	/* a single write with O_APPEND so that lines from other tasks are not mixed */
+	fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		pr_dbg("cannot open overhead file: %s: %m\n", filename);
+	else {
+		if (write(fd, buf, len) != len)
+			pr_dbg("writing overhead failed: %s: %m\n", filename);
+		close(fd);
+	}
+
+	clear_overhead(ovh);
+}
+
+/* other threads might not exit normally (or be killed by exec) */
+void flush_all_overhead(void)
+{
+	struct mcount_overhead *ovh;
+
+	if (!mcount_use_overhead)
+		return;
+
+	pthread_mutex_lock(&overhead_lock);
+	list_for_each_entry(ovh, &overhead_list, list)
+		flush_overhead(ovh);
+	pthread_mutex_unlock(&overhead_lock);
+}
+
+void finish_overhead(struct mcount_thread_data *mtdp)
+{
+	struct mcount_overhead *ovh = &mtdp->overhead;
+
+	if (!mcount_use_overhead || ovh->start_time == 0)
+		return;
+
+	pthread_mutex_lock(&overhead_lock);
+	list_del(&ovh->list);
+	pthread_mutex_unlock(&overhead_lock);
+
+	flush_overhead(ovh);
+	ovh->start_time = 0;
+}
+
 static void write_map(FILE *out, struct uftrace_mmap *map, unsigned char major, unsigned char minor,
 		      uint32_t ino, uint64_t off)
 {
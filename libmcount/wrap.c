@@ -526,6 +526,15 @@ __visible_default int posix_spawnp(pid_t *pid, const char *file,
 	return real_posix_spawnp(pid, file, actions, attr, argv, new_envp);
 }
 
+/* the summary and overhead in memory will be gone after exec */
+static void flush_before_exec(void)
+{
+	/* exec kills other threads too */
+	if (mcount_use_aggregate)
+		flush_all_aggregate();
+	flush_all_overhead();
+}
+
 __visible_default int execve(const char *path, char *const argv[], char *const envp[])
 {
 	char **uftrace_envp;
@@ -538,6 +547,7 @@ __visible_default int execve(const char *path, char *const argv[], char *const e
 	new_envp = merge_envp(envp, uftrace_envp);
 
 	pr_dbg("%s is called for '%s'\n", __func__, path);
+	flush_before_exec();
 	return real_execve(path, argv, new_envp);
 }
 
@@ -553,6 +563,7 @@ __visible_default int execvpe(const char *file, char *const argv[], char *const
 	new_envp = merge_envp(envp, uftrace_envp);
 
 	pr_dbg("%s is called for '%s'\n", __func__, file);
+	flush_before_exec();
 	return real_execvpe(file, argv, new_envp);
 }
 
@@ -568,6 +579,7 @@ __visible_default int fexecve(int fd, char *const argv[], char *const envp[])
 	new_envp = merge_envp(envp, uftrace_envp);
 
 	pr_dbg("%s is called for fd %d\n", __func__, fd);
+	flush_before_exec();
 	return real_fexecve(fd, argv, new_envp);
 }
 
@@ -0,0 +1,26 @@
+/*
+ *  This is a test to change filters through the agent.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+static int a(void)
+{
+	return getpid() % 100000;
+}
+
+static int b(void)
+{
+	return a() + 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = 0;
+
+	ret += b();
+	getchar();
+	ret += b();
+	return ret ? 0 : 1;
+}
@@ -0,0 +1,40 @@
+/*
+ * The worker thread is still running when main() returns, so its
+ * summary should be saved by the main thread for --aggregate.
+ */
+#include <pthread.h>
+#include <unistd.h>
+
+static volatile int done;
+static volatile int sum;
+
+void work(int n)
+{
+	sum += n;
+}
+
+void *worker(void *arg)
+{
+	int i;
+
+	for (i = 0; i < *(int *)arg; i++)
+		work(i);
+
+	done = 1;
+	while (1)
+		pause();
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t t;
+	int n = 5;
+
+	pthread_create(&t, NULL, worker, &n);
+	while (!done)
+		continue;
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+void *mem_alloc(void)
+{
+	return malloc(0);
+}
+
+void mem_free(void *ptr)
+{
+	free(ptr);
+}
+
+/* the snapshot is taken asynchronously, wait until it's written */
+void wait_snapshot(void)
+{
+	const char *dirname = getenv("UFTRACE_DIR") ?: "uftrace.data";
+	char filename[4096];
+	struct stat st;
+	int i;
+
+	snprintf(filename, sizeof(filename), "%s/%ld.dat", dirname, syscall(SYS_gettid));
+
+	for (i = 0; i < 500; i++) {
+		if (stat(filename, &st) == 0 && st.st_size > 0)
+			break;
+		/* it would trigger snapshots again */
+		usleep(1000);
+	}
+}
+
+void foo(void)
+{
+	void *p = mem_alloc();
+	wait_snapshot();
+	mem_free(p);
+}
+
+int main(void)
+{
+	foo();
+	return 0;
+}
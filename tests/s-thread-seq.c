@@ -0,0 +1,23 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#define NUM_THREAD 4
+
+void *foo(void *arg)
+{
+	return arg;
+}
+
+int main(void)
+{
+	pthread_t th;
+	int i;
+
+	/* run threads one by one so that they can reuse the buffers */
+	for (i = 0; i < NUM_THREAD; i++) {
+		pthread_create(&th, NULL, foo, NULL);
+		pthread_join(th, NULL);
+		usleep(10000);
+	}
+	return 0;
+}
@@ -0,0 +1,27 @@
+#!/usr/bin/env python
+
+import os
+
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'sleep', result="""
+# DURATION    TID     FUNCTION
+            [18219] | main() {
+            [18219] |   foo() {
+            [18219] |     bar() {
+   2.093 ms [18219] |       usleep();
+   2.095 ms [18219] |     } /* bar */
+   2.106 ms [18219] |   } /* foo */
+   2.107 ms [18219] | } /* main */
+""")
+
+    def prerun(self, timeout):
+        # TSC clock is only available on x86
+        if os.uname()[4] not in ['x86_64', 'i386', 'i686']:
+            return TestBase.TEST_SKIP
+        return TestBase.TEST_SUCCESS
+
+    def setup(self):
+        self.option = '--clock=tsc -t 1ms'
@@ -0,0 +1,39 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'abc', """
+# buffer backing      : hugepage x 1 (2048 KB buffer)
+""")
+
+    def prerun(self, timeout):
+        # huge pages should be reserved (vm.nr_hugepages) to be used
+        try:
+            with open('/proc/meminfo') as f:
+                for ln in f:
+                    if ln.startswith('HugePages_Free:') and int(ln.split()[1]) > 0:
+                        return TestBase.prerun(self, timeout)
+        except Exception:
+            pass
+        return TestBase.TEST_SKIP
+
+    def prepare(self):
+        self.subcmd = 'record'
+        self.option = '--hugepage'
+        return self.runcmd()
+
+    def setup(self):
+        self.subcmd = 'info'
+        self.option = ''
+
+    def sort(self, output):
+        result = []
+
+        for ln in output.split('\n'):
+            # only check the buffer came from huge pages, not the count
+            if ln.startswith('# buffer backing'):
+                result.append(ln.split(':')[1].split()[0])
+
+        return '\n'.join(result)
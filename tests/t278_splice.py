@@ -0,0 +1,46 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'abc', """
+  data write:       0.0 MB in 0.000021 sec (0.7 MB/s, splice)
+  data write:       0.0 MB in 0.000016 sec (0.9 MB/s, write)
+# DURATION     TID     FUNCTION
+            [ 21514] | main() {
+            [ 21514] |   a() {
+            [ 21514] |     b() {
+            [ 21514] |       c() {
+   0.705 us [ 21514] |         getpid();
+   1.429 us [ 21514] |       } /* c */
+   1.802 us [ 21514] |     } /* b */
+   2.162 us [ 21514] |   } /* a */
+   2.747 us [ 21514] | } /* main */
+""")
+
+    def runcmd(self):
+        uftrace = '%s %%s %s' % (TestBase.uftrace_cmd, TestBase.default_opt)
+        record = uftrace % 'record' + ' --time -d %s ' + self.option + ' t-' + self.name
+        replay = uftrace % 'replay' + ' -d %s'
+
+        # the data written by splice should be same as by write
+        return ' && '.join([
+            record % ('splice.data --splice') + ' | grep "data write"',
+            record % ('write.data') + ' | grep "data write"',
+            replay % 'splice.data' + ' -f none > splice.out',
+            replay % 'write.data' + ' -f none > write.out',
+            'diff splice.out write.out',
+            replay % 'splice.data',
+        ])
+
+    def sort(self, output):
+        result = []
+
+        for ln in output.split('\n'):
+            # check the write method only as the time can vary
+            if ln.strip().startswith('data write:'):
+                result.append(ln.split(', ')[-1].rstrip(')'))
+        result.append(TestBase.task_sort(self, output))
+
+        return '\n'.join(result)
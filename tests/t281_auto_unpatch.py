@@ -0,0 +1,47 @@
+#!/usr/bin/env python
+
+import subprocess as sp
+
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'sort', """
+  Total time   Self time       Calls  Function
+  ==========  ==========  ==========  ====================
+   10.234 ms   69.363 us           1  main
+   10.112 ms   10.112 ms           1  bar
+   52.016 us   40.803 us           2  foo
+   11.213 us   11.213 us           3  loop
+
+uftrace auto-removed functions during recording
+================================================
+    Avg time   Calls/sec  Function
+    3.737 us           3  loop
+""", sort='report')
+
+    def prerun(self, timeout):
+        # runtime unpatching is only supported on x86_64
+        if TestBase.get_machine(self) != 'x86_64':
+            return TestBase.TEST_SKIP
+
+        self.subcmd = 'record'
+        self.option = '-P . --no-libcall --auto-unpatch=3,1s'
+        self.exearg = 't-' + self.name
+
+        record_cmd = self.runcmd()
+        sp.call(record_cmd.split())
+        return TestBase.TEST_SUCCESS
+
+    def build(self, name, cflags='', ldflags=''):
+        cflags = cflags.replace('-pg', '')
+        cflags = cflags.replace('-finstrument-functions', '')
+
+        # add patchable function entry option
+        cflags += ' -fpatchable-function-entry=5'
+
+        return TestBase.build(self, name, cflags, ldflags)
+
+    def setup(self):
+        self.subcmd = 'report'
+        self.option = ''
@@ -0,0 +1,69 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+
+UNITS = { 'ns': 1, 'us': 1000, 'ms': 1000000, 's': 1000000000 }
+
+def to_nsec(value, unit):
+    return float(value) * UNITS[unit]
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'abc', """
+# recorder overhead per task
+# ==========================
+#   TID       Elapsed    Overhead    Ratio       Hooks  Switches  Allocs   Lost   Written
+   28141  183.312 us    7.618 us    4.16%          14         0       1      0      0 KB
+
+# recorder overhead per hook
+# ==========================
+#  Hook           Calls    Overhead    Avg/call    Ratio
+  entry              4    1.152 us    0.288 us   15.12%
+  exit               4    0.702 us    0.175 us    9.21%
+  plthook            6    5.764 us    0.960 us   75.66%
+
+# total:   7.618 us in 1 task(s) (4.16% of task time), 0 buffer switches, 1 allocations, 0 lost records
+""")
+
+    def prepare(self):
+        self.subcmd = 'record'
+        self.option = '--overhead'
+        return self.runcmd()
+
+    def setup(self):
+        self.subcmd = 'info'
+        self.option = '--overhead'
+
+    def sort(self, output):
+        result = []
+        hooks = 0
+        time = 0
+
+        for ln in output.split('\n'):
+            fields = ln.split()
+            if len(fields) < 2 or fields[0].startswith('#'):
+                continue
+
+            # per-task: TID, elapsed, overhead, ratio, hooks, switches, allocs, ...
+            if fields[0].isdigit():
+                elapsed = to_nsec(fields[1], fields[2])
+                task_time = to_nsec(fields[3], fields[4])
+                result.append('task %s %s' % (0 < task_time < elapsed,
+                                              int(fields[8]) > 0))
+                hooks += int(fields[6])
+                continue
+
+            # per-hook: name, calls, overhead, avg, ratio
+            if fields[0] in ['entry', 'exit', 'plthook']:
+                hook_time = to_nsec(fields[2], fields[3])
+                time += hook_time
+                hooks -= int(fields[1])
+
+                # the time and library calls can vary
+                if fields[0] != 'plthook':
+                    result.append('%s %s %s' % (fields[0], fields[1], hook_time > 0))
+
+        # the numbers of hooks and the total time should match
+        result.append('hooks %d' % hooks)
+        result.append('time %s' % (time > 0))
+        return '\n'.join(result)
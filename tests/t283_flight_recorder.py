@@ -0,0 +1,23 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'snapshot', """
+# DURATION    TID     FUNCTION
+            [ 8011] | main() {
+            [ 8011] |   foo() {
+            [ 8011] |     mem_alloc() {
+   0.666 us [ 8011] |       malloc();
+   1.254 us [ 8011] |     } /* mem_alloc */
+            [ 8011] |     wait_snapshot() {
+   3.469 us [ 8011] |       getenv();
+   1.033 us [ 8011] |       syscall();
+   1.823 us [ 8011] |       snprintf();
+  20.412 us [ 8011] |       stat();
+""")
+
+    def setup(self):
+        # it only has the data written before the (first) snapshot
+        self.option = '--flight-recorder=1m -T usleep@snapshot'
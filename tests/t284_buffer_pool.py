@@ -0,0 +1,45 @@
+#!/usr/bin/env python
+
+import os
+import subprocess as sp
+
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'thread-seq', ldflags='-pthread', result="""
+# DURATION     TID     FUNCTION
+            [ 5186] | main() {
+   0.472 us [ 5187] | foo();
+   0.226 us [ 5188] | foo();
+   0.247 us [ 5189] | foo();
+   0.239 us [ 5190] | foo();
+  42.512 ms [ 5186] | } /* main */
+""")
+
+    def prerun(self, timeout):
+        self.subcmd = 'record'
+        self.option = '--no-libcall --buffer-pool=1'
+
+        record_cmd = self.runcmd()
+        sp.call(record_cmd.split())
+        return TestBase.TEST_SUCCESS
+
+    def setup(self):
+        tids = set()
+        for ln in open(os.path.join('uftrace.data', 'task.txt')):
+            if ln.startswith('TASK'):
+                tids.add(ln.split()[2].split('=')[1])
+
+        # pooled buffers are named by an id, data should go to the tid
+        files = set()
+        for name in os.listdir('uftrace.data'):
+            if name.endswith('.dat'):
+                files.add(name[:-4])
+
+        if len(tids) != 5 or files != tids:
+            self.subcmd = 'FAILED TO SAVE DATA OF EACH TASK'
+            return
+
+        self.subcmd = 'replay'
+        self.option = ''
@@ -0,0 +1,25 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'sort', """
+  Total time   Self time       Calls  Function
+  ==========  ==========  ==========  ====================================
+   37.525 us    1.137 us           2  foo
+   36.388 us   36.388 us           6  loop
+
+     Sampled   Estimated  Function (sampled)
+  ==========  ==========  ====================
+           2           2  foo
+""", sort='report')
+
+    def prepare(self):
+        self.subcmd = 'record'
+        self.option = '-T foo@sample=1'
+        return self.runcmd()
+
+    def setup(self):
+        self.subcmd = 'report'
+        self.option = ''
@@ -0,0 +1,32 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'abc', """
+# DURATION     TID     FUNCTION
+            [ 28141] | main() {
+            [ 28141] |   a() {
+            [ 28141] |     b() {
+            [ 28141] |       c() {
+   0.753 us [ 28141] |         getpid();
+   1.430 us [ 28141] |       } /* c */
+   1.915 us [ 28141] |     } /* b */
+   2.405 us [ 28141] |   } /* a */
+   3.005 us [ 28141] | } /* main */
+""")
+
+    def prerun(self, timeout):
+        if not TestBase.check_arch_full_dynamic_support(self):
+            return TestBase.TEST_SKIP
+        return TestBase.TEST_SUCCESS
+
+    def build(self, name, cflags='', ldflags=''):
+        cflags = cflags.replace('-pg', '')
+        cflags = cflags.replace('-finstrument-functions', '')
+        cflags += ' -fno-pie -fno-plt'  # workaround of build failure
+        return TestBase.build(self, name, cflags, ldflags)
+
+    def setup(self):
+        self.option = '-P main -P a -P b -P c --patch-jobs=2'
@@ -0,0 +1,21 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'agg-thread', """
+  Total time   Self time       Calls  Function
+  ==========  ==========  ==========  ====================================
+   46.337 us   19.152 us           1  main
+    8.512 us    8.512 us           5  work
+""", sort='report')
+
+    def prepare(self):
+        self.subcmd = 'record'
+        self.option = '--aggregate --no-libcall'
+        return self.runcmd()
+
+    def setup(self):
+        self.subcmd = 'report'
+        self.option = ''
@@ -0,0 +1,52 @@
+#!/usr/bin/env python
+
+import subprocess as sp
+
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'thread', """
+  Total time   Self time       Calls  Function
+  ==========  ==========  ==========  ====================
+    1.909 ms  236.337 us           1  main
+  250.950 us   50.723 us           4  foo
+  200.227 us   52.450 us           4  a
+  147.777 us  146.369 us           4  b
+    1.408 us    1.408 us           4  c
+
+uftrace auto-removed functions during recording
+================================================
+    Avg time   Calls/sec  Function
+    0.352 us           4  c
+   36.944 us           4  b
+   50.056 us           4  a
+   62.737 us           4  foo
+""", sort='report')
+
+    def prerun(self, timeout):
+        # runtime unpatching is only supported on x86_64
+        if TestBase.get_machine(self) != 'x86_64':
+            return TestBase.TEST_SKIP
+
+        # each thread calls the functions once, count them together
+        self.subcmd = 'record'
+        self.option = '-P . --no-libcall --auto-unpatch=4,1s'
+        self.exearg = 't-' + self.name
+
+        record_cmd = self.runcmd()
+        sp.call(record_cmd.split())
+        return TestBase.TEST_SUCCESS
+
+    def build(self, name, cflags='', ldflags=''):
+        cflags = cflags.replace('-pg', '')
+        cflags = cflags.replace('-finstrument-functions', '')
+
+        # add patchable function entry option
+        cflags += ' -fpatchable-function-entry=5'
+
+        return TestBase.build(self, name, cflags, ldflags)
+
+    def setup(self):
+        self.subcmd = 'report'
+        self.option = ''
@@ -0,0 +1,64 @@
+#!/usr/bin/env python
+
+import os
+import re
+import subprocess as sp
+
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'abc', """
+# DURATION     TID     FUNCTION
+            [ 28141] | main() {
+            [ 28141] |   a() {
+            [ 28141] |     b() {
+            [ 28141] |       c() {
+   0.753 us [ 28141] |         getpid();
+   1.430 us [ 28141] |       } /* c */
+   1.915 us [ 28141] |     } /* b */
+   2.405 us [ 28141] |   } /* a */
+   3.005 us [ 28141] | } /* main */
+""")
+
+    def record(self):
+        record_cmd = self.runcmd()
+        p = sp.Popen(record_cmd.split(), stdout=sp.PIPE, stderr=sp.PIPE)
+        err = p.communicate()[1].decode(errors='ignore')
+
+        m = re.search(r'patch cache for t-abc: (\d+) hit, (\d+) new', err)
+        if m is None:
+            return None
+        return (int(m.group(1)), int(m.group(2)))
+
+    def prerun(self, timeout):
+        if not TestBase.check_arch_full_dynamic_support(self):
+            return TestBase.TEST_SKIP
+
+        # do not touch the user's cache
+        os.environ['XDG_CACHE_HOME'] = os.path.abspath('cache')
+
+        self.subcmd = 'record'
+        self.option = '-P . -v --debug-domain=dynamic:1'
+
+        # the first run saves the plans and the second one (at a
+        # different address by ASLR) should use them only
+        self.first = self.record()
+        self.second = self.record()
+        return TestBase.TEST_SUCCESS
+
+    def build(self, name, cflags='', ldflags=''):
+        cflags = cflags.replace('-pg', '')
+        cflags = cflags.replace('-finstrument-functions', '')
+        return TestBase.build(self, name, cflags, ldflags)
+
+    def setup(self):
+        if self.first is None or self.first[1] == 0:
+            self.subcmd = 'FAILED TO SAVE PATCH CACHE'
+            return
+        if self.second is None or self.second[0] == 0 or self.second[1] != 0:
+            self.subcmd = 'FAILED TO USE PATCH CACHE'
+            return
+
+        self.subcmd = 'replay'
+        self.option = ''
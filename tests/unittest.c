@@ -272,6 +272,9 @@ void __fentry__(void)
 void __dentry__(void)
 {
 }
+void __dentry_direct__(void)
+{
+}
 void __xray_entry(void)
 {
 }
@@ -102,6 +102,19 @@ enum uftrace_short_options {
 	OPT_usage,
 	OPT_libmcount_path,
 	OPT_mermaid,
+	OPT_ring_buffer,
+	OPT_compact_record,
+	OPT_hugepage,
+	OPT_splice,
+	OPT_aggregate,
+	OPT_auto_unpatch,
+	OPT_overhead,
+	OPT_flight_recorder,
+	OPT_snapshot,
+	OPT_buffer_pool,
+	OPT_trace,
+	OPT_patch_jobs,
+	OPT_no_patch_cache,
 };
 
 /* clang-format off */
@@ -125,16 +138,22 @@ __used static const char uftrace_usage[] =
 
 __used static const char uftrace_help[] =
 " OPTION:\n"
+"      --aggregate            Record function summary instead of each call\n"
 "      --avg-self             Show average/min/max of self function time\n"
 "      --avg-total            Show average/min/max of total function time\n"
 "  -a, --auto-args            Show arguments and return value of known functions\n"
+"      --auto-unpatch=RATE[,TIME]\n"
+"                             Unpatch functions called over RATE/sec and shorter than\n"
+"                             TIME (default: 1us) at runtime\n"
 "  -A, --argument=FUNC@arg[,arg,...]\n"
 "                             Show function arguments\n"
 "  -b, --buffer=SIZE          Size of tracing buffer (default: "
 	stringify(SHMEM_BUFFER_SIZE_KB) "K)\n"
+"      --buffer-pool=NUM      Keep NUM sets of buffers ready for new threads\n"
 "      --chrome               Dump recorded data in chrome trace format\n"
 "      --clock                Set clock source for timestamp (default: mono)\n"
 "      --color=SET            Use color for output: yes, no, auto (default: auto)\n"
+"      --compact-record       Save records in a compact (delta-encoded) format\n"
 "      --column-offset=DEPTH  Offset of each column (default: "
 	stringify(OPT_COLUMN_OFFSET) ")\n"
 "      --column-view          Print tasks in separate columns\n"
@@ -152,6 +171,7 @@ __used static const char uftrace_help[] =
 "      --event-full           Show all events outside of function\n"
 "  -E, --Event=EVENT          Enable EVENT to save more information\n"
 "      --flame-graph          Dump recorded data in FlameGraph format\n"
+"      --flight-recorder=SIZE Keep last SIZE of trace per task and save it on snapshot\n"
 "      --flat                 Use flat output format\n"
 "      --force                Trace even if executable is not instrumented\n"
 "      --format=FORMAT        Use FORMAT for output: normal, html (default: normal)\n"
@@ -160,6 +180,7 @@ __used static const char uftrace_help[] =
 "  -g  --agent                Start an agent in mcount to listen to commands\n"
 "      --graphviz             Dump recorded data in DOT format\n"
 "  -H, --hide=FUNC            Hide FUNCs from trace\n"
+"      --hugepage             Use 2MB huge pages for recording buffers\n"
 "      --host=HOST            Send trace data to HOST instead of write to file\n"
 "  -k, --kernel               Trace kernel functions also (if supported)\n"
 "      --keep-pid             Keep same pid during execution of traced program\n"
@@ -187,19 +208,23 @@ __used static const char uftrace_help[] =
 "      --no-libcall           Don't trace library function calls\n"
 "      --no-merge             Don't merge leaf functions\n"
 "      --no-pager             Do not use pager\n"
+"      --no-patch-cache       Do not use saved dynamic patch plans\n"
 "      --no-pltbind           Do not bind dynamic symbols (LD_BIND_NOT)\n"
 "      --no-randomize-addr    Disable ASLR (Address Space Layout Randomization)\n"
 "      --nop                  No operation (for performance test)\n"
 "      --num-thread=NUM       Create NUM recorder threads\n"
 "  -N, --notrace=FUNC         Don't trace those FUNCs\n"
 "      --opt-file=FILE        Read command-line options from FILE\n"
+"      --overhead             Measure (record) or show (info) overhead of recording\n"
 "  -p  --pid=PID              PID of an interactive mcount instance\n"
 "      --port=PORT            Use PORT for network connection (default: "
 	stringify(UFTRACE_RECV_PORT) ")\n"
 "  -P, --patch=FUNC           Apply dynamic patching for FUNCs\n"
+"      --patch-jobs=NUM       Use NUM threads to prepare dynamic patching\n"
 "      --record               Record a new trace data before running command\n"
 "      --report               Show live report\n"
 "      --rt-prio=PRIO         Record with real-time (FIFO) priority\n"
+"      --ring-buffer          Use a lock-free ring buffer per thread for recording\n"
 "  -r, --time-range=TIME~TIME Show output within the TIME(timestamp or elapsed time)\n"
 "                             range only\n"
 "      --run-cmd=CMDLINE      Command line that want to execute after tracing\n"
@@ -207,7 +232,9 @@ __used static const char uftrace_help[] =
 "  -R, --retval=FUNC@retval   Show function return value\n"
 "      --sample-time=TIME     Show flame graph with this sampling time\n"
 "      --signal=SIG@act[,act,...]   Trigger action on those SIGnal\n"
+"      --snapshot             Request flight recorder snapshot to the agent (with -p)\n"
 "      --sort-column=INDEX    Sort diff report on column INDEX (default: 2)\n"
+"      --splice               Write recorded data with splice() instead of write()\n"
 "      --srcline              Enable recording source line info\n"
 "      --symbols              Print symbol tables\n"
 "  -s, --sort=KEY[,KEY,...]   Sort reported functions by KEYs (default: "
@@ -218,6 +245,7 @@ __used static const char uftrace_help[] =
 "      --task-newline         Interleave a newline when task is changed\n"
 "      --tid=TID[,TID,...]    Only replay those tasks\n"
 "      --time                 Print time information\n"
+"      --trace=STATE          Turn on/off tracing by the agent: on, off (with -p)\n"
 "  -T, --trigger=FUNC@act[,act,...]\n"
 "                             Trigger action on those FUNCs\n"
 "  -U, --unpatch=FUNC         Don't apply dynamic patching for FUNCs\n"
@@ -329,6 +357,19 @@ static const struct option uftrace_options[] = {
 	NO_ARG(srcline, OPT_srcline),
 	REQ_ARG(hide, 'H'),
 	REQ_ARG(clock, OPT_clock),
+	NO_ARG(ring-buffer, OPT_ring_buffer),
+	NO_ARG(compact-record, OPT_compact_record),
+	NO_ARG(hugepage, OPT_hugepage),
+	NO_ARG(splice, OPT_splice),
+	NO_ARG(aggregate, OPT_aggregate),
+	REQ_ARG(auto-unpatch, OPT_auto_unpatch),
+	NO_ARG(overhead, OPT_overhead),
+	REQ_ARG(flight-recorder, OPT_flight_recorder),
+	NO_ARG(snapshot, OPT_snapshot),
+	REQ_ARG(trace, OPT_trace),
+	REQ_ARG(buffer-pool, OPT_buffer_pool),
+	REQ_ARG(patch-jobs, OPT_patch_jobs),
+	NO_ARG(no-patch-cache, OPT_no_patch_cache),
 	NO_ARG(help, 'h'),
 	NO_ARG(usage, OPT_usage),
 	NO_ARG(version, 'V'),
@@ -537,6 +578,22 @@ static bool parse_time_range(struct uftrace_time_range *range, char *arg)
 	return true;
 }
 
+/* RATE[,TIME] : the duration floor is 1us by default */
+static bool parse_auto_unpatch(struct uftrace_opts *opts, char *arg)
+{
+	char *pos;
+
+	opts->unpatch_rate = strtoul(arg, &pos, 10);
+	if (*pos == ',')
+		opts->unpatch_time = parse_time(pos + 1, 3);
+	else if (*pos == '\0')
+		opts->unpatch_time = 1000;
+	else
+		return false;
+
+	return opts->unpatch_rate && opts->unpatch_time;
+}
+
 static char *remove_trailing_slash(char *path)
 {
 	size_t len = strlen(path);
@@ -1014,7 +1071,8 @@ static int parse_option(struct uftrace_opts *opts, int key, char *arg)
 		break;
 
 	case OPT_clock:
-		if (strcmp(arg, "mono") && strcmp(arg, "mono_raw") && strcmp(arg, "boot")) {
+		if (strcmp(arg, "mono") && strcmp(arg, "mono_raw") && strcmp(arg, "boot") &&
+		    strcmp(arg, "tsc")) {
 			pr_use("invalid clock source: '%s' "
 			       "(force to use 'mono')\n",
 			       arg);
@@ -1027,6 +1085,76 @@ static int parse_option(struct uftrace_opts *opts, int key, char *arg)
 		opts->mermaid = true;
 		break;
 
+	case OPT_ring_buffer:
+		opts->ring_buffer = true;
+		break;
+
+	case OPT_compact_record:
+		opts->compact_record = true;
+		break;
+
+	case OPT_hugepage:
+		opts->hugepage = true;
+		break;
+
+	case OPT_splice:
+		opts->splice = true;
+		break;
+
+	case OPT_aggregate:
+		opts->aggregate = true;
+		break;
+
+	case OPT_auto_unpatch:
+		if (!parse_auto_unpatch(opts, arg)) {
+			pr_use("invalid --auto-unpatch: %s\n", arg);
+			opts->unpatch_rate = 0;
+		}
+		break;
+
+	case OPT_overhead:
+		opts->overhead = true;
+		break;
+
+	case OPT_flight_recorder:
+		opts->flight_recorder = parse_size(arg);
+		if (opts->flight_recorder == 0)
+			pr_use("invalid flight recorder size: %s\n", arg);
+		break;
+
+	case OPT_snapshot:
+		opts->snapshot = true;
+		break;
+
+	case OPT_trace:
+		if (!strcmp(arg, "on"))
+			opts->trace = TRACE_STATE_ON;
+		else if (!strcmp(arg, "off"))
+			opts->trace = TRACE_STATE_OFF;
+		else
+			pr_use("invalid trace state: %s\n", arg);
+		break;
+
+	case OPT_buffer_pool:
+		opts->buffer_pool = strtol(arg, NULL, 0);
+		if (opts->buffer_pool <= 0) {
+			pr_use("invalid buffer pool size: %s\n", arg);
+			opts->buffer_pool = 0;
+		}
+		break;
+
+	case OPT_no_patch_cache:
+		opts->no_patch_cache = true;
+		break;
+
+	case OPT_patch_jobs:
+		opts->patch_jobs = strtol(arg, NULL, 0);
+		if (opts->patch_jobs <= 0) {
+			pr_use("--patch-jobs should be positive\n");
+			opts->patch_jobs = 0;
+		}
+		break;
+
 	default:
 		return -1;
 	}
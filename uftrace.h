@@ -17,6 +17,8 @@
 #define UFTRACE_MAGIC_STR "Ftrace!"
 #define UFTRACE_FILE_VERSION 4
 #define UFTRACE_FILE_VERSION_MIN 3
+/* data files with COMPACT_RECORD cannot be read by older versions */
+#define UFTRACE_FILE_VERSION_MAX 5
 #define UFTRACE_DIR_NAME "uftrace.data"
 #define UFTRACE_DIR_OLD_NAME "ftrace.dir"
 
@@ -61,6 +63,8 @@ enum uftrace_feat_bits {
 	AUTO_ARGS_BIT,
 	DEBUG_INFO_BIT,
 	ESTIMATE_RETURN_BIT,
+	COMPACT_RECORD_BIT,
+	AGGREGATE_BIT,
 
 	FEAT_BIT_MAX,
 
@@ -77,6 +81,8 @@ enum uftrace_feat_bits {
 	AUTO_ARGS = (1U << AUTO_ARGS_BIT),
 	DEBUG_INFO = (1U << DEBUG_INFO_BIT),
 	ESTIMATE_RETURN = (1U << ESTIMATE_RETURN_BIT),
+	COMPACT_RECORD = (1U << COMPACT_RECORD_BIT),
+	AGGREGATE = (1U << AGGREGATE_BIT),
 };
 
 enum uftrace_info_bits {
@@ -95,6 +101,8 @@ enum uftrace_info_bits {
 	RECORD_DATE_BIT,
 	PATTERN_TYPE_BIT,
 	VERSION_BIT,
+	CLOCKINFO_BIT,
+	BUFINFO_BIT,
 
 	INFO_BIT_MAX,
 
@@ -113,6 +121,8 @@ enum uftrace_info_bits {
 	RECORD_DATE = (1U << RECORD_DATE_BIT),
 	PATTERN_TYPE = (1U << PATTERN_TYPE_BIT),
 	VERSION = (1U << VERSION_BIT),
+	CLOCKINFO = (1U << CLOCKINFO_BIT),
+	BUFINFO = (1U << BUFINFO_BIT),
 };
 
 struct uftrace_info {
@@ -151,6 +161,8 @@ struct uftrace_info {
 	float load15;
 	enum uftrace_pattern_type patt_type;
 	char *uftrace_version;
+	struct uftrace_clock_info clock;
+	char *buf_backing;
 };
 
 enum {
@@ -176,6 +188,7 @@ struct uftrace_session_link {
 	struct rb_root tasks;
 	struct uftrace_session *first;
 	struct uftrace_task *first_task;
+	struct uftrace_clock_info *clock;
 };
 
 struct uftrace_data {
@@ -219,6 +232,13 @@ bool data_is_lp64(struct uftrace_data *handle);
 
 #define UFTRACE_MODE_DEFAULT UFTRACE_MODE_LIVE
 
+/* tracing state to set by the agent (--trace) */
+enum uftrace_trace_state {
+	TRACE_STATE_NONE,
+	TRACE_STATE_ON,
+	TRACE_STATE_OFF,
+};
+
 struct uftrace_opts {
 	char *lib_path;
 	char *filter;
@@ -256,20 +276,27 @@ struct uftrace_opts {
 	int column_offset;
 	int sort_column;
 	int nr_thread;
+	int buffer_pool;
 	int rt_prio;
 	int size_filter;
+	int patch_jobs;
 	int pid;
 	unsigned long bufsize;
 	unsigned long kernel_bufsize;
+	unsigned long flight_recorder;
 	uint64_t threshold;
 	uint64_t sample_time;
+	unsigned long unpatch_rate;
+	uint64_t unpatch_time;
 	bool flat;
 	bool libcall;
 	bool print_symtab;
 	bool force;
 	bool show_task;
+	bool overhead;
 	bool no_merge;
 	bool nop;
+	bool no_patch_cache;
 	bool time;
 	bool backtrace;
 	bool use_pager;
@@ -304,6 +331,13 @@ struct uftrace_opts {
 	bool estimate_return;
 	bool mermaid;
 	bool agent;
+	bool ring_buffer;
+	bool compact_record;
+	bool hugepage;
+	bool splice;
+	bool aggregate;
+	bool snapshot;
+	enum uftrace_trace_state trace;
 	struct uftrace_time_range range;
 	enum uftrace_pattern_type patt_type;
 };
@@ -328,6 +362,9 @@ int command_graph(int argc, char *argv[], struct uftrace_opts *opts);
 int command_script(int argc, char *argv[], struct uftrace_opts *opts);
 int command_tui(int argc, char *argv[], struct uftrace_opts *opts);
 
+/* send options to the agent in a running process (-p) */
+int forward_options(struct uftrace_opts *opts);
+
 extern volatile bool uftrace_done;
 
 int open_data_file(struct uftrace_opts *opts, struct uftrace_data *handle);
@@ -342,6 +379,7 @@ int read_task_file(struct uftrace_session_link *sess, char *dirname, bool needs_
 		   bool sym_rel_addr, bool needs_srcline);
 int read_task_txt_file(struct uftrace_session_link *sess, char *dirname, char *symdir,
 		       bool needs_symtab, bool sym_rel_addr, bool needs_srcline);
+void print_auto_unpatch(struct uftrace_data *handle);
 
 char *get_libmcount_path(struct uftrace_opts *opts);
 void put_libmcount_path(char *libpath);
@@ -404,6 +442,7 @@ enum uftrace_msg_type {
 	UFTRACE_MSG_LOST,
 	UFTRACE_MSG_DLOPEN,
 	UFTRACE_MSG_FINISH,
+	UFTRACE_MSG_SNAPSHOT,
 
 	UFTRACE_MSG_SEND_START = 100,
 	UFTRACE_MSG_SEND_DIR_NAME,
@@ -418,6 +457,12 @@ enum uftrace_msg_type {
 /* Dynamic options sent by the client to the agent */
 enum uftrace_dopt {
 	UFTRACE_DOPT_CLOSE, /* Close the connection with the client */
+	UFTRACE_DOPT_SNAPSHOT, /* Save the flight recorder buffers */
+	UFTRACE_DOPT_TRACE, /* Turn on/off tracing (with a bool value) */
+	UFTRACE_DOPT_FILTER, /* Replace function filters (with a string) */
+	UFTRACE_DOPT_TRIGGER, /* Replace triggers (with a string) */
+	UFTRACE_DOPT_DEPTH, /* Change the default depth (with an int value) */
+	UFTRACE_DOPT_THRESHOLD, /* Change the time filter (with a u64 value in nsec) */
 };
 
 /* msg format for communicating by pipe */
@@ -526,6 +571,63 @@ static inline bool is_v3_compat(struct uftrace_record *urec)
 	return urec->magic == RECORD_MAGIC && urec->more == 0;
 }
 
+/*
+ * Compact (v5) record has a header byte (type:2, more:1, abs:1, magic:4)
+ * followed by varints of depth, time and addr.  The time and addr (of
+ * ENTRY and EXIT) are saved as a delta from the previous record of the
+ * task unless the 'abs' bit is set.  It's only used in the data files
+ * with the COMPACT_RECORD feature.
+ */
+#define RECORD_MAGIC_V5 0xc
+#define RECORD_COMPACT_ABS (1U << 3)
+#define RECORD_COMPACT_MAX 32
+
+struct uftrace_record_base {
+	uint64_t time;
+	uint64_t addr;
+};
+
+static inline uint64_t zigzag_encode(int64_t val)
+{
+	return ((uint64_t)val << 1) ^ (val >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t val)
+{
+	return (val >> 1) ^ -(int64_t)(val & 1);
+}
+
+static inline unsigned char *put_varint(unsigned char *p, uint64_t val)
+{
+	while (val >= 0x80) {
+		*p++ = val | 0x80;
+		val >>= 7;
+	}
+	*p++ = val;
+	return p;
+}
+
+/* returns the size of the encoded record, the base will be updated */
+static inline unsigned encode_compact_record(void *buf, struct uftrace_record_base *base,
+					     uint64_t time, enum uftrace_record_type type,
+					     bool more, unsigned depth, uint64_t addr)
+{
+	unsigned char *p = buf;
+	bool abs = base->time == 0;
+	bool func = type == UFTRACE_ENTRY || type == UFTRACE_EXIT;
+
+	*p++ = type | more << 2 | (abs ? RECORD_COMPACT_ABS : 0) | RECORD_MAGIC_V5 << 4;
+	p = put_varint(p, depth);
+	p = put_varint(p, abs ? time : zigzag_encode(time - base->time));
+	p = put_varint(p, abs || !func ? addr : zigzag_encode(addr - base->addr));
+
+	base->time = time;
+	if (func)
+		base->addr = addr;
+
+	return p - (unsigned char *)buf;
+}
+
 struct uftrace_fstack_args {
 	struct list_head *args;
 	unsigned len;
@@ -544,6 +646,32 @@ struct uftrace_rstack_list_node {
 	struct uftrace_fstack_args args;
 };
 
+/*
+ * Function summary saved by 'record --aggregate'.  Each thread appends a
+ * header followed by @nr entries to the <tid>.agg file whenever it flushes
+ * its table.  The entries have stats since the last flush so readers should
+ * accumulate them.  The @time is when it's flushed (to find the session).
+ */
+#define UFTRACE_AGG_MAGIC 0x47474155 /* "UAGG" */
+
+struct uftrace_agg_header {
+	uint32_t magic;
+	uint32_t nr;
+	uint64_t time;
+};
+
+struct uftrace_agg_entry {
+	uint64_t addr;
+	uint64_t call;
+	uint64_t total;
+	uint64_t total_rec; /* total time in recursive calls */
+	uint64_t total_min;
+	uint64_t total_max;
+	uint64_t self;
+	uint64_t self_min;
+	uint64_t self_max;
+};
+
 void setup_rstack_list(struct uftrace_rstack_list *list);
 void add_to_rstack_list(struct uftrace_rstack_list *list, struct uftrace_record *rstack,
 			struct uftrace_fstack_args *args);
@@ -569,9 +697,10 @@ static inline bool has_event_data(struct uftrace_data *handle)
 struct rusage;
 
 int fill_file_header(struct uftrace_opts *opts, int status, struct rusage *rusage,
-		     char *elapsed_time);
+		     char *elapsed_time, struct uftrace_clock_info *clock, char *buf_backing);
 void fill_uftrace_info(uint64_t *info_mask, int fd, struct uftrace_opts *opts, int status,
-		       struct rusage *rusage, char *elapsed_time);
+		       struct rusage *rusage, char *elapsed_time, struct uftrace_clock_info *clock,
+		       char *buf_backing);
 int read_uftrace_info(uint64_t info_mask, struct uftrace_data *handle);
 void process_uftrace_info(struct uftrace_data *handle, struct uftrace_opts *opts,
 			  void (*process)(void *data, const char *fmt, ...), void *data);
@@ -595,6 +724,8 @@ enum uftrace_event_id {
 	EVENT_ID_READ_PMU_BRANCH,
 	EVENT_ID_DIFF_PMU_BRANCH,
 	EVENT_ID_WATCH_CPU,
+	EVENT_ID_THROTTLE,
+	EVENT_ID_SAMPLE,
 
 	/* supported perf events */
 	EVENT_ID_PERF = 200000U,
@@ -5,6 +5,11 @@
 #define UFTRACE_ARCH_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 
 enum uftrace_cpu_arch {
 	UFT_CPU_NONE,
@@ -40,6 +45,54 @@ static inline bool arch_is_lp64(enum uftrace_cpu_arch arch)
 	}
 }
 
+/* TSC can be used as a clock only if it runs at a constant rate in any state */
+static inline bool host_has_invariant_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		return false;
+	return edx & (1U << 8);
+#else
+	return false;
+#endif
+}
+
+static inline uint64_t host_read_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+
+/* whether PMU counters can be read in user space by host_read_pmc() */
+static inline bool host_has_rdpmc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return true;
+#else
+	return false;
+#endif
+}
+
+static inline uint64_t host_read_pmc(uint32_t counter)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	asm volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+	return ((uint64_t)hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+
 enum uftrace_x86_64_reg_index {
 	UFT_X86_64_REG_INT_BASE = 0,
 	/* integer registers */
@@ -53,5 +53,8 @@
 #define __noreturn __attribute__((noreturn))
 #endif
 #define __align(n) __attribute__((aligned(n)))
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
 
 #endif /* UFTRACE_COMPILER_H */
@@ -93,6 +93,16 @@ out:
 	return ret;
 }
 
+static uint64_t task_txt_time(struct uftrace_session_link *sess, unsigned long sec,
+			      unsigned long nsec)
+{
+	uint64_t time = (uint64_t)sec * NSEC_PER_SEC + nsec;
+
+	if (sess->clock)
+		time = convert_tsc_time(sess->clock, time);
+	return time;
+}
+
 /**
  * read_task_txt_file - read 'task.txt' file from data directory
  * @sess: session link to manage sessions and tasks
@@ -137,7 +147,7 @@ int read_task_txt_file(struct uftrace_session_link *sess, char *dirname, char *s
 			if (num != 4)
 				goto out;
 
-			tmsg.time = (uint64_t)sec * NSEC_PER_SEC + nsec;
+			tmsg.time = task_txt_time(sess, sec, nsec);
 			create_task(sess, &tmsg, false);
 		}
 		else if (!strncmp(line, "FORK", 4)) {
@@ -146,7 +156,7 @@ int read_task_txt_file(struct uftrace_session_link *sess, char *dirname, char *s
 			if (num != 4)
 				goto out;
 
-			tmsg.time = (uint64_t)sec * NSEC_PER_SEC + nsec;
+			tmsg.time = task_txt_time(sess, sec, nsec);
 			create_task(sess, &tmsg, true);
 		}
 		else if (!strncmp(line, "SESS", 4)) {
@@ -166,7 +176,7 @@ int read_task_txt_file(struct uftrace_session_link *sess, char *dirname, char *s
 				*pos = '\0';
 
 			smsg.task.tid = smsg.task.pid;
-			smsg.task.time = (uint64_t)sec * NSEC_PER_SEC + nsec;
+			smsg.task.time = task_txt_time(sess, sec, nsec);
 			smsg.namelen = strlen(exename);
 
 			create_session(sess, &smsg, dirname, symdir, exename, sym_rel_addr,
@@ -194,7 +204,7 @@ int read_task_txt_file(struct uftrace_session_link *sess, char *dirname, char *s
 				*pos = '\0';
 
 			dlop.task.pid = dlop.task.tid;
-			dlop.task.time = (uint64_t)sec * NSEC_PER_SEC + nsec;
+			dlop.task.time = task_txt_time(sess, sec, nsec);
 			dlop.namelen = strlen(exename);
 
 			s = get_session_from_sid(sess, dlop.sid);
@@ -215,6 +225,84 @@ out:
 	return ret;
 }
 
+/**
+ * print_auto_unpatch - show functions removed at runtime
+ * @handle: handle for the data file
+ *
+ * This function reads the 'unpatch.txt' file in the data directory
+ * which has the list of functions that libmcount unpatched by the
+ * --auto-unpatch option and prints them as auto-removed.
+ */
+void print_auto_unpatch(struct uftrace_data *handle)
+{
+	FILE *fp;
+	char *fname = NULL;
+	char *line = NULL;
+	size_t sz = 0;
+	unsigned long sec, nsec;
+	uint64_t addr, calls, avg;
+	int tid;
+	bool first = true;
+
+	xasprintf(&fname, "%s/%s", handle->dirname, "unpatch.txt");
+
+	fp = fopen(fname, "r");
+	if (fp == NULL) {
+		free(fname);
+		return;
+	}
+
+	pr_dbg("reading %s file\n", fname);
+	while (getline(&line, &sz, fp) >= 0) {
+		struct uftrace_task_reader *task;
+		struct uftrace_symbol *sym = NULL;
+		char *symname, *pos;
+
+		if (strncmp(line, "UNPATCH", 7))
+			continue;
+
+		if (sscanf(line + 8, "timestamp=%lu.%lu tid=%d addr=%" SCNx64 " calls=%" SCNu64
+				     " avg=%" SCNu64,
+			   &sec, &nsec, &tid, &addr, &calls, &avg) != 6)
+			continue;
+
+		task = get_task_handle(handle, tid);
+		if (task)
+			sym = task_find_sym_addr(&handle->sessions, task,
+						 task_txt_time(&handle->sessions, sec, nsec), addr);
+
+		if (sym)
+			symname = symbol_getname(sym, addr);
+		else {
+			/* use the name libmcount saw at the time */
+			pos = strstr(line, "name=");
+			symname = xstrdup(pos ? pos + 5 : "<unknown>");
+			pos = strchr(symname, '\n');
+			if (pos)
+				*pos = '\0';
+		}
+
+		if (first) {
+			pr_out("\nuftrace auto-removed functions during recording\n");
+			pr_out("================================================\n");
+			pr_out("    Avg time   Calls/sec  Function\n");
+			first = false;
+		}
+		pr_out("  ");
+		print_time_unit(avg);
+		pr_out("  %10" PRIu64 "  %s\n", calls, symname);
+
+		if (sym)
+			symbol_putname(sym, symname);
+		else
+			free(symname);
+	}
+
+	free(line);
+	fclose(fp);
+	free(fname);
+}
+
 static void snprint_timestamp(char *buf, size_t sz, uint64_t timestamp)
 {
 	snprintf(buf, sz, "%" PRIu64 ".%09" PRIu64, // sec.nsec
@@ -403,6 +491,7 @@ ok:
 	handle->time_range = opts->range;
 	handle->sessions.root = RB_ROOT;
 	handle->sessions.tasks = RB_ROOT;
+	handle->sessions.clock = NULL;
 	handle->last_perf_idx = -1;
 	INIT_LIST_HEAD(&handle->events);
 
@@ -422,12 +511,16 @@ ok:
 	}
 
 	if (handle->hdr.version < UFTRACE_FILE_VERSION_MIN ||
-	    handle->hdr.version > UFTRACE_FILE_VERSION)
+	    handle->hdr.version > UFTRACE_FILE_VERSION_MAX)
 		pr_err_ns("unsupported file version: %u\n", handle->hdr.version);
 
 	if (read_uftrace_info(handle->hdr.info_mask, handle) < 0)
 		pr_err_ns("cannot read uftrace header info!\n");
 
+	/* timestamps in the task.txt should be converted too */
+	if (handle->hdr.info_mask & CLOCKINFO)
+		handle->sessions.clock = &handle->info.clock;
+
 	if (opts->exename == NULL)
 		opts->exename = handle->info.exename;
 
@@ -562,6 +655,13 @@ int open_data_file(struct uftrace_opts *opts, struct uftrace_data *handle)
 				goto out;
 		}
 
+		if (handle->hdr.feat_mask & AGGREGATE) {
+			snprintf(buf, sizeof(buf), "%s/[0-9]*.agg", opts->dirname);
+
+			if (check_data_file(handle, buf))
+				goto out;
+		}
+
 		if (saved_errno == 0)
 			saved_errno = ENODATA;
 	}
@@ -613,7 +713,7 @@ void __close_data_file(struct uftrace_opts *opts, struct uftrace_data *handle, b
 #define TEST_EXIT_STATUS 37
 #define TEST_INFO_MASK ((1U << EXE_NAME) | (1U << EXIT_STATUS))
 
-static int create_data(struct uftrace_opts *opts)
+static int create_data(struct uftrace_opts *opts, struct uftrace_clock_info *clock)
 {
 	struct uftrace_msg_sess sess_msg = {
 		.task = { .time = 100, .pid = 10 },
@@ -659,7 +759,7 @@ static int create_data(struct uftrace_opts *opts)
 	fclose(fp);
 	free(filename);
 
-	fill_file_header(opts, TEST_EXIT_STATUS, NULL, (char *)"1ms");
+	fill_file_header(opts, TEST_EXIT_STATUS, NULL, (char *)"1ms", clock, NULL);
 
 	return 0;
 }
@@ -681,7 +781,7 @@ TEST_CASE(data_basic)
 	struct uftrace_task *t;
 
 	pr_dbg("create test data\n");
-	if (create_data(&opts) < 0)
+	if (create_data(&opts, NULL) < 0)
 		return TEST_SKIP;
 
 	open_data_file(&opts, &handle);
@@ -718,4 +818,49 @@ TEST_CASE(data_basic)
 
 	return TEST_OK;
 }
+
+TEST_CASE(data_tsc_clock)
+{
+	struct uftrace_opts opts = {
+		.dirname = "data-tsc-test",
+		.exename = read_exename(),
+		.max_stack = 10,
+	};
+	struct uftrace_clock_info clock = {
+		.freq = 2 * NSEC_PER_SEC,
+		.tsc = 100,
+		.mono = 1000000,
+	};
+	struct uftrace_data handle;
+	struct uftrace_session *s;
+	struct uftrace_dlopen_list *udl;
+
+	pr_dbg("create test data with TSC clock\n");
+	if (create_data(&opts, &clock) < 0)
+		return TEST_SKIP;
+
+	open_data_file(&opts, &handle);
+
+	pr_dbg("verify clock info\n");
+	TEST_NE(handle.hdr.info_mask & CLOCKINFO, 0);
+	TEST_EQ(handle.info.clock.freq, clock.freq);
+	TEST_EQ(handle.info.clock.tsc, clock.tsc);
+	TEST_EQ(handle.info.clock.mono, clock.mono);
+
+	pr_dbg("verify converted timestamps\n");
+	s = handle.sessions.first;
+	TEST_NE(s, NULL);
+	TEST_EQ(s->start_time, clock.mono);
+
+	udl = list_first_entry(&s->dlopen_libs, struct uftrace_dlopen_list, list);
+	TEST_EQ(udl->time, clock.mono + 150);
+
+	close_data_file(&opts, &handle);
+
+	pr_dbg("delete test data\n");
+	if (remove_data(&opts) < 0)
+		pr_dbg("failed to remove data\n");
+
+	return TEST_OK;
+}
 #endif /* UNIT_TEST */
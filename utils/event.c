@@ -118,6 +118,12 @@ char *event_get_name(struct uftrace_data *handle, unsigned evt_id)
 		case EVENT_ID_WATCH_CPU:
 			xasprintf(&evt_name, "watch:cpu");
 			break;
+		case EVENT_ID_THROTTLE:
+			xasprintf(&evt_name, "throttle");
+			break;
+		case EVENT_ID_SAMPLE:
+			xasprintf(&evt_name, "sample");
+			break;
 		default:
 			xasprintf(&evt_name, "builtin_event:%u", evt_id);
 			break;
@@ -155,6 +161,8 @@ char *event_get_data_str(unsigned evt_id, void *data, bool verbose)
 		struct uftrace_pmu_cycle cycle;
 		struct uftrace_pmu_cache cache;
 		struct uftrace_pmu_branch branch;
+		struct uftrace_throttle throttle;
+		struct uftrace_sample sample;
 		int cpu;
 	} u;
 
@@ -238,6 +246,16 @@ char *event_get_data_str(unsigned evt_id, void *data, bool verbose)
 		xasprintf(&str, "cpu=%d", u.cpu);
 		break;
 
+	case EVENT_ID_THROTTLE:
+		memcpy(&u.throttle, data, sizeof(u.throttle));
+		xasprintf(&str, "dropped=%" PRIu64, u.throttle.dropped);
+		break;
+
+	case EVENT_ID_SAMPLE:
+		memcpy(&u.sample, data, sizeof(u.sample));
+		xasprintf(&str, "rate=1/%" PRIu64, u.sample.rate);
+		break;
+
 	default:
 		/* kernel tracepoints */
 		if (evt_id < EVENT_ID_BUILTIN)
@@ -335,6 +353,8 @@ TEST_CASE(event_name)
 		{ EVENT_ID_READ_PMU_CACHE, "read:pmu-cache" },
 		{ EVENT_ID_DIFF_PMU_CACHE, "diff:pmu-cache" },
 		{ EVENT_ID_WATCH_CPU, "watch:cpu" },
+		{ EVENT_ID_THROTTLE, "throttle" },
+		{ EVENT_ID_SAMPLE, "sample" },
 	};
 
 	pr_dbg("testing event name strings\n");
@@ -354,6 +374,8 @@ TEST_CASE(event_data)
 	struct uftrace_page_fault pgfault = { 1977, 1102 };
 	struct uftrace_pmu_cycle cycle = { 1024, 2048 };
 	int cpu = 123;
+	struct uftrace_throttle throttle = { 0x1234, 42 };
+	struct uftrace_sample sample = { 0x1234, 100 };
 
 	struct {
 		unsigned evt_id;
@@ -365,6 +387,8 @@ TEST_CASE(event_data)
 		{ EVENT_ID_READ_PAGE_FAULT, &pgfault, "major=1977 minor=1102" },
 		{ EVENT_ID_DIFF_PMU_CYCLE, &cycle, "cycles=+1024 instructions=+2048 IPC=2.00" },
 		{ EVENT_ID_WATCH_CPU, &cpu, "cpu=123" },
+		{ EVENT_ID_THROTTLE, &throttle, "dropped=42" },
+		{ EVENT_ID_SAMPLE, &sample, "rate=1/100" },
 	};
 
 	pr_dbg("testing event data strings\n");
@@ -33,6 +33,16 @@ struct uftrace_pmu_branch {
 	uint64_t misses; /* branch misses */
 };
 
+struct uftrace_throttle {
+	uint64_t addr; /* function address */
+	uint64_t dropped; /* number of calls not recorded */
+};
+
+struct uftrace_sample {
+	uint64_t addr; /* function address */
+	uint64_t rate; /* 1 in N calls are traced */
+};
+
 char *event_get_name(struct uftrace_data *handle, unsigned evt_id);
 char *event_get_data_str(unsigned evt_id, void *data, bool verbose);
 
@@ -58,6 +58,8 @@ static void print_trigger(struct uftrace_trigger *tr)
 		pr_dbg("\ttrigger: recover\n");
 	if (tr->flags & TRIGGER_FL_FINISH)
 		pr_dbg("\ttrigger: finish\n");
+	if (tr->flags & TRIGGER_FL_SNAPSHOT)
+		pr_dbg("\ttrigger: snapshot\n");
 
 	if (tr->flags & TRIGGER_FL_ARGUMENT) {
 		struct uftrace_arg_spec *arg;
@@ -88,6 +90,12 @@ static void print_trigger(struct uftrace_trigger *tr)
 		pr_dbg("\ttrigger: time filter %" PRIu64 "\n", tr->time);
 	if (tr->flags & TRIGGER_FL_CALLER)
 		pr_dbg("\ttrigger: caller filter\n");
+	if (tr->flags & TRIGGER_FL_THROTTLE)
+		pr_dbg("\ttrigger: throttle %u/sec (1/%u)\n", tr->throttle, tr->throttle_every);
+	if (tr->flags & TRIGGER_FL_TAIL)
+		pr_dbg("\ttrigger: tail %" PRIu64 "\n", tr->tail);
+	if (tr->flags & TRIGGER_FL_SAMPLE)
+		pr_dbg("\ttrigger: sample 1/%u\n", tr->sample);
 
 	if (tr->flags & TRIGGER_FL_READ) {
 		char buf[1024];
@@ -159,6 +167,101 @@ struct uftrace_filter *uftrace_match_filter(uint64_t addr, struct rb_root *root,
 	return NULL;
 }
 
+/**
+ * uftrace_build_filter_table - flatten filters in @root for fast lookup
+ * @root  - root of rbtree which has filters
+ * @table - filter table to build
+ *
+ * This function copies address ranges in the rbtree into sorted arrays
+ * so that uftrace_match_filter_table() can search them without chasing
+ * pointers.  The table should be rebuilt whenever the rbtree changes.
+ */
+void uftrace_build_filter_table(struct rb_root *root, struct uftrace_filter_table *table)
+{
+	struct rb_node *node;
+	struct uftrace_filter *iter;
+	int nr = 0;
+
+	uftrace_free_filter_table(table);
+
+	for (node = rb_first(root); node; node = rb_next(node))
+		nr++;
+
+	if (nr == 0)
+		return;
+
+	table->start = xmalloc(nr * sizeof(*table->start));
+	table->end = xmalloc(nr * sizeof(*table->end));
+	table->filters = xmalloc(nr * sizeof(*table->filters));
+
+	/* rb_first() and rb_next() return filters sorted by start address */
+	for (node = rb_first(root); node; node = rb_next(node)) {
+		iter = rb_entry(node, struct uftrace_filter, node);
+
+		table->start[table->nr] = iter->start;
+		table->end[table->nr] = iter->end;
+		table->filters[table->nr] = iter;
+		table->nr++;
+	}
+
+	pr_dbg2("filter table has %d entries\n", table->nr);
+}
+
+/**
+ * uftrace_match_filter_table - try to match @addr with filters in @table
+ * @addr  - instruction address to match
+ * @table - filter table built by uftrace_build_filter_table()
+ * @tr    - trigger data
+ *
+ * It's the same as uftrace_match_filter() but uses a binary search on the
+ * sorted array.  The loop has no data-dependent branch except the final
+ * range check so it's friendly to the branch predictor.
+ */
+struct uftrace_filter *uftrace_match_filter_table(uint64_t addr,
+						  struct uftrace_filter_table *table,
+						  struct uftrace_trigger *tr)
+{
+	const uint64_t *base = table->start;
+	struct uftrace_filter *filter;
+	int n = table->nr;
+	int idx;
+
+	if (n == 0 || addr < base[0])
+		return NULL;
+
+	/* find the last entry which has start <= addr */
+	while (n > 1) {
+		int half = n / 2;
+
+		base = (base[half] <= addr) ? base + half : base;
+		n -= half;
+	}
+
+	idx = base - table->start;
+	if (addr >= table->end[idx])
+		return NULL;
+
+	filter = table->filters[idx];
+	*tr = filter->trigger;
+
+	pr_dbg2("filter match: %s\n", filter->name);
+	if (dbg_domain[DBG_FILTER] >= 3)
+		print_trigger(tr);
+	return filter;
+}
+
+void uftrace_free_filter_table(struct uftrace_filter_table *table)
+{
+	free(table->start);
+	free(table->end);
+	free(table->filters);
+
+	table->start = NULL;
+	table->end = NULL;
+	table->filters = NULL;
+	table->nr = 0;
+}
+
 static void add_arg_spec(struct list_head *arg_list, struct uftrace_arg_spec *arg, bool exact_match)
 {
 	bool found = false;
@@ -260,6 +363,14 @@ void add_trigger(struct uftrace_filter *filter, struct uftrace_trigger *tr, bool
 		filter->trigger.time = tr->time;
 	if (tr->flags & TRIGGER_FL_READ)
 		filter->trigger.read |= tr->read;
+	if (tr->flags & TRIGGER_FL_THROTTLE) {
+		filter->trigger.throttle = tr->throttle;
+		filter->trigger.throttle_every = tr->throttle_every;
+	}
+	if (tr->flags & TRIGGER_FL_TAIL)
+		filter->trigger.tail = tr->tail;
+	if (tr->flags & TRIGGER_FL_SAMPLE)
+		filter->trigger.sample = tr->sample;
 }
 
 static int add_filter(struct rb_root *root, struct uftrace_filter *filter,
@@ -505,6 +616,51 @@ static int parse_time_action(char *action, struct uftrace_trigger *tr,
 	return 0;
 }
 
+/* throttle=RATE[/N] : record 1 in N calls (or none) beyond RATE calls/sec */
+static int parse_throttle_action(char *action, struct uftrace_trigger *tr,
+				 struct uftrace_filter_setting *setting)
+{
+	char *pos;
+
+	tr->throttle = strtoul(action + 9, &pos, 10);
+	tr->throttle_every = 0;
+	if (*pos == '/')
+		tr->throttle_every = strtoul(pos + 1, &pos, 10);
+
+	if (*pos != '\0' || tr->throttle == 0) {
+		pr_use("skipping invalid trigger throttle: %s\n", action + 9);
+		return -1;
+	}
+
+	tr->flags |= TRIGGER_FL_THROTTLE;
+	return 0;
+}
+
+/* tail=TIME : save the whole subtree only if the function is slower than TIME */
+static int parse_tail_action(char *action, struct uftrace_trigger *tr,
+			     struct uftrace_filter_setting *setting)
+{
+	tr->flags |= TRIGGER_FL_TAIL;
+	tr->tail = parse_time(action + 5, 3);
+	return 0;
+}
+
+/* sample=N : trace 1 in N calls of the function with the subtree */
+static int parse_sample_action(char *action, struct uftrace_trigger *tr,
+			       struct uftrace_filter_setting *setting)
+{
+	char *pos;
+
+	tr->sample = strtoul(action + 7, &pos, 10);
+	if (*pos != '\0' || tr->sample == 0) {
+		pr_use("skipping invalid trigger sample: %s\n", action + 7);
+		return -1;
+	}
+
+	tr->flags |= TRIGGER_FL_SAMPLE;
+	return 0;
+}
+
 static int parse_read_action(char *action, struct uftrace_trigger *tr,
 			     struct uftrace_filter_setting *setting)
 {
@@ -598,6 +754,13 @@ static int parse_finish_action(char *action, struct uftrace_trigger *tr,
 	return 0;
 }
 
+static int parse_snapshot_action(char *action, struct uftrace_trigger *tr,
+				 struct uftrace_filter_setting *setting)
+{
+	tr->flags |= TRIGGER_FL_SNAPSHOT;
+	return 0;
+}
+
 static int parse_filter_action(char *action, struct uftrace_trigger *tr,
 			       struct uftrace_filter_setting *setting)
 {
@@ -698,6 +861,11 @@ static const struct trigger_action_parser actions[] = {
 		parse_finish_action,
 		TRIGGER_FL_SIGNAL,
 	},
+	{
+		"snapshot",
+		parse_snapshot_action,
+		TRIGGER_FL_SIGNAL,
+	},
 	{
 		"read=",
 		parse_read_action,
@@ -718,6 +886,18 @@ static const struct trigger_action_parser actions[] = {
 		"auto-args",
 		parse_auto_args_action,
 	},
+	{
+		"throttle=",
+		parse_throttle_action,
+	},
+	{
+		"tail=",
+		parse_tail_action,
+	},
+	{
+		"sample=",
+		parse_sample_action,
+	},
 };
 
 int setup_trigger_action(char *str, struct uftrace_trigger *tr, char **module,
@@ -1331,6 +1511,58 @@ TEST_CASE(filter_match)
 	return TEST_OK;
 }
 
+TEST_CASE(filter_match_table)
+{
+	struct uftrace_sym_info sinfo = {
+		.loaded = false,
+	};
+	struct rb_root root = RB_ROOT;
+	struct uftrace_filter_table table = {
+		.nr = 0,
+	};
+	enum filter_mode fmode;
+	struct uftrace_trigger tr1, tr2;
+	struct uftrace_filter_setting setting = {
+		.ptype = PATT_REGEX,
+	};
+	uint64_t addr;
+
+	filter_test_load_symtabs(&sinfo);
+
+	pr_dbg("empty table should not match anything\n");
+	uftrace_build_filter_table(&root, &table);
+	TEST_EQ(table.nr, 0);
+	TEST_EQ(uftrace_match_filter_table(0x1000, &table, &tr1), NULL);
+
+	uftrace_setup_filter("foo::foo;foo::baz1;free", &sinfo, &root, &fmode, &setting);
+	uftrace_setup_trigger("foo::baz3@depth=2", &sinfo, &root, &fmode, &setting);
+	uftrace_build_filter_table(&root, &table);
+	TEST_EQ(table.nr, 4);
+
+	pr_dbg("table lookup should return the same result as the rbtree\n");
+	for (addr = 0; addr < 0x24000; addr += 0x100) {
+		memset(&tr1, 0, sizeof(tr1));
+		memset(&tr2, 0, sizeof(tr2));
+
+		TEST_EQ(uftrace_match_filter_table(addr, &table, &tr1),
+			uftrace_match_filter(addr, &root, &tr2));
+		TEST_EQ(tr1.flags, tr2.flags);
+		TEST_EQ(tr1.depth, tr2.depth);
+	}
+
+	pr_dbg("check boundary of the last entry\n");
+	TEST_NE(uftrace_match_filter_table(0x22fff, &table, &tr1), NULL);
+	TEST_EQ(uftrace_match_filter_table(0x23000, &table, &tr1), NULL);
+
+	uftrace_free_filter_table(&table);
+	TEST_EQ(table.nr, 0);
+
+	uftrace_cleanup_filter(&root);
+	TEST_EQ(RB_EMPTY_ROOT(&root), true);
+
+	return TEST_OK;
+}
+
 TEST_CASE(trigger_setup_actions)
 {
 	struct uftrace_sym_info sinfo = {
@@ -1379,6 +1611,34 @@ TEST_CASE(trigger_setup_actions)
 	TEST_NE(uftrace_match_filter(0x4200, &root, &tr), NULL);
 	TEST_EQ(tr.flags, TRIGGER_FL_CALLER);
 
+	pr_dbg("checking throttle trigger\n");
+	uftrace_setup_trigger("foo::baz2@throttle=1000/10", &sinfo, &root, NULL, &setting);
+	memset(&tr, 0, sizeof(tr));
+	TEST_NE(uftrace_match_filter(0x4200, &root, &tr), NULL);
+	TEST_EQ(tr.flags, TRIGGER_FL_CALLER | TRIGGER_FL_THROTTLE);
+	TEST_EQ(tr.throttle, 1000);
+	TEST_EQ(tr.throttle_every, 10);
+
+	pr_dbg("checking snapshot trigger\n");
+	uftrace_setup_trigger("foo::baz3@snapshot", &sinfo, &root, NULL, &setting);
+	memset(&tr, 0, sizeof(tr));
+	TEST_NE(uftrace_match_filter(0x5000, &root, &tr), NULL);
+	TEST_EQ(tr.flags, TRIGGER_FL_TRACE_OFF | TRIGGER_FL_DEPTH | TRIGGER_FL_SNAPSHOT);
+
+	pr_dbg("checking tail trigger\n");
+	uftrace_setup_trigger("foo::~foo@tail=2ms", &sinfo, &root, NULL, &setting);
+	memset(&tr, 0, sizeof(tr));
+	TEST_NE(uftrace_match_filter(0x6000, &root, &tr), NULL);
+	TEST_EQ(tr.flags, TRIGGER_FL_TAIL);
+	TEST_EQ(tr.tail, 2 * NSEC_PER_MSEC);
+
+	pr_dbg("checking sample trigger\n");
+	uftrace_setup_trigger("foo::~foo@sample=100", &sinfo, &root, NULL, &setting);
+	memset(&tr, 0, sizeof(tr));
+	TEST_NE(uftrace_match_filter(0x6000, &root, &tr), NULL);
+	TEST_EQ(tr.flags, TRIGGER_FL_TAIL | TRIGGER_FL_SAMPLE);
+	TEST_EQ(tr.sample, 100);
+
 	uftrace_cleanup_filter(&root);
 	TEST_EQ(RB_EMPTY_ROOT(&root), true);
 
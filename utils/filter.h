@@ -36,6 +36,10 @@ enum trigger_flag {
 	TRIGGER_FL_CALLER = (1U << 15),
 	TRIGGER_FL_SIGNAL = (1U << 16),
 	TRIGGER_FL_HIDE = (1U << 17),
+	TRIGGER_FL_THROTTLE = (1U << 18),
+	TRIGGER_FL_SNAPSHOT = (1U << 19),
+	TRIGGER_FL_TAIL = (1U << 20),
+	TRIGGER_FL_SAMPLE = (1U << 21),
 };
 
 enum filter_mode {
@@ -60,6 +64,13 @@ struct uftrace_trigger {
 	uint64_t time;
 	enum filter_mode fmode;
 	enum trigger_read_type read;
+	/* max calls per second and record 1 in N calls beyond that */
+	unsigned throttle;
+	unsigned throttle_every;
+	/* save the subtree only if the function runs longer than this */
+	uint64_t tail;
+	/* trace 1 in N calls of the function (with the subtree) */
+	unsigned sample;
 	struct list_head *pargs;
 };
 
@@ -72,6 +83,14 @@ struct uftrace_filter {
 	struct uftrace_trigger trigger;
 };
 
+/* sorted array of filters for fast lookup (see uftrace_build_filter_table) */
+struct uftrace_filter_table {
+	uint64_t *start;
+	uint64_t *end;
+	struct uftrace_filter **filters;
+	int nr;
+};
+
 enum uftrace_pattern_type {
 	PATT_NONE,
 	PATT_SIMPLE,
@@ -115,6 +134,11 @@ void uftrace_setup_hide_filter(char *filter_str, struct uftrace_sym_info *sinfo,
 
 struct uftrace_filter *uftrace_match_filter(uint64_t ip, struct rb_root *root,
 					    struct uftrace_trigger *tr);
+void uftrace_build_filter_table(struct rb_root *root, struct uftrace_filter_table *table);
+struct uftrace_filter *uftrace_match_filter_table(uint64_t addr,
+						  struct uftrace_filter_table *table,
+						  struct uftrace_trigger *tr);
+void uftrace_free_filter_table(struct uftrace_filter_table *table);
 void uftrace_cleanup_filter(struct rb_root *root);
 void uftrace_print_filter(struct rb_root *root);
 int uftrace_count_filter(struct rb_root *root, unsigned long flag);
@@ -1172,7 +1172,75 @@ static void swap_bitfields(struct uftrace_record *rstack)
 	rstack->addr = (data >> 16) & 0xffffffffffffULL;
 }
 
-static int __read_task_ustack(struct uftrace_task_reader *task)
+static int read_varint(FILE *fp, uint64_t *val)
+{
+	uint64_t v = 0;
+	int shift = 0;
+	int c;
+
+	do {
+		c = getc(fp);
+		if (c == EOF)
+			return -1;
+
+		v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while ((c & 0x80) && shift < 64);
+
+	*val = v;
+	return 0;
+}
+
+/* decode a compact (v5) record into task->ustack */
+static int __read_task_compact(struct uftrace_task_reader *task)
+{
+	FILE *fp = task->fp;
+	struct uftrace_record *rec = &task->ustack;
+	uint64_t depth, time, addr;
+	bool func;
+	int hdr;
+
+	hdr = getc(fp);
+	if (hdr == EOF) {
+		if (ferror(fp))
+			pr_warn("error reading rstack: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if ((hdr >> 4) != RECORD_MAGIC_V5) {
+		pr_warn("invalid rstack read\n");
+		return -1;
+	}
+
+	if (read_varint(fp, &depth) < 0 || read_varint(fp, &time) < 0 ||
+	    read_varint(fp, &addr) < 0) {
+		pr_warn("incomplete rstack read\n");
+		return -1;
+	}
+
+	rec->type = hdr & 0x3;
+	rec->more = (hdr >> 2) & 0x1;
+	rec->magic = RECORD_MAGIC;
+	rec->depth = depth;
+
+	func = rec->type == UFTRACE_ENTRY || rec->type == UFTRACE_EXIT;
+	if (!(hdr & RECORD_COMPACT_ABS)) {
+		time = task->base.time + zigzag_decode(time);
+		if (func)
+			addr = task->base.addr + zigzag_decode(addr);
+	}
+
+	rec->time = time;
+	rec->addr = addr;
+
+	task->base.time = time;
+	if (func)
+		task->base.addr = addr;
+
+	return 0;
+}
+
+static int __read_task_record(struct uftrace_task_reader *task)
 {
 	FILE *fp = task->fp;
 
@@ -1197,6 +1265,23 @@ static int __read_task_ustack(struct uftrace_task_reader *task)
 	return 0;
 }
 
+static int __read_task_ustack(struct uftrace_task_reader *task)
+{
+	struct uftrace_data *handle = task->h;
+	int ret;
+
+	if (handle->hdr.feat_mask & COMPACT_RECORD)
+		ret = __read_task_compact(task);
+	else
+		ret = __read_task_record(task);
+
+	/* LOST records have no timestamp */
+	if (ret == 0 && (handle->hdr.info_mask & CLOCKINFO) && task->ustack.time)
+		task->ustack.time = convert_tsc_time(&handle->info.clock, task->ustack.time);
+
+	return ret;
+}
+
 static int read_task_arg(struct uftrace_task_reader *task, struct uftrace_arg_spec *spec)
 {
 	FILE *fp = task->fp;
@@ -1331,6 +1416,8 @@ int read_task_event(struct uftrace_task_reader *task, struct uftrace_record *rec
 		struct uftrace_pmu_cycle cycle;
 		struct uftrace_pmu_cache cache;
 		struct uftrace_pmu_branch branch;
+		struct uftrace_throttle throttle;
+		struct uftrace_sample sample;
 		int cpu;
 	} u;
 
@@ -1410,6 +1497,30 @@ int read_task_event(struct uftrace_task_reader *task, struct uftrace_record *rec
 		save_task_event(task, &u.cpu, sizeof(u.cpu));
 		break;
 
+	case EVENT_ID_THROTTLE:
+		if (read_task_event_size(task, &u.throttle, sizeof(u.throttle)) < 0)
+			return -1;
+
+		if (task->h->needs_byte_swap) {
+			u.throttle.addr = bswap_64(u.throttle.addr);
+			u.throttle.dropped = bswap_64(u.throttle.dropped);
+		}
+
+		save_task_event(task, &u.throttle, sizeof(u.throttle));
+		break;
+
+	case EVENT_ID_SAMPLE:
+		if (read_task_event_size(task, &u.sample, sizeof(u.sample)) < 0)
+			return -1;
+
+		if (task->h->needs_byte_swap) {
+			u.sample.addr = bswap_64(u.sample.addr);
+			u.sample.rate = bswap_64(u.sample.rate);
+		}
+
+		save_task_event(task, &u.sample, sizeof(u.sample));
+		break;
+
 	default:
 		pr_err_ns("unknown event has data: %u\n", rec->addr);
 		break;
@@ -2439,7 +2550,21 @@ static int fstack_test_setup_file(struct uftrace_data *handle, int nr_tid, int *
 			return -1;
 		}
 
-		fwrite(records[i], sizeof(**records), nr_record, fp);
+		if (handle->hdr.feat_mask & COMPACT_RECORD) {
+			struct uftrace_record_base base = {};
+			unsigned char buf[RECORD_COMPACT_MAX];
+			struct uftrace_record *rec;
+			int k;
+
+			for (k = 0; k < nr_record; k++) {
+				rec = &records[i][k];
+				fwrite(buf, encode_compact_record(buf, &base, rec->time, rec->type,
+								  rec->more, rec->depth, rec->addr),
+				       1, fp);
+			}
+		}
+		else
+			fwrite(records[i], sizeof(**records), nr_record, fp);
 
 		free(filename);
 		fclose(fp);
@@ -2569,6 +2694,30 @@ TEST_CASE(fstack_read)
 	return TEST_OK;
 }
 
+TEST_CASE(fstack_compact_read)
+{
+	struct uftrace_data *handle = &fstack_test_handle;
+	struct uftrace_task_reader *task;
+	int i, k;
+
+	handle->hdr.feat_mask |= COMPACT_RECORD;
+	TEST_EQ(fstack_test_setup_normal(handle), 0);
+
+	for (i = 0; i < NUM_RECORD; i++) {
+		for (k = 0; k < NUM_TASK; k++) {
+			pr_dbg("[%d] read compact rstack from task %d\n", i, test_tids[k]);
+			TEST_EQ(read_rstack(handle, &task), 0);
+			TEST_EQ(task->tid, test_tids[k]);
+			TEST_EQ(task->rstack->time, test_record[k][i].time);
+			TEST_EQ((uint64_t)task->rstack->type, (uint64_t)test_record[k][i].type);
+			TEST_EQ((uint64_t)task->rstack->depth, (uint64_t)test_record[k][i].depth);
+			TEST_EQ((uint64_t)task->rstack->addr, (uint64_t)test_record[k][i].addr);
+		}
+	}
+
+	return TEST_OK;
+}
+
 TEST_CASE(fstack_skip)
 {
 	struct uftrace_data *handle = &fstack_test_handle;
@@ -50,6 +50,7 @@ struct uftrace_task_reader {
 	struct uftrace_record estack;
 	struct uftrace_record xstack;
 	struct uftrace_record *rstack;
+	struct uftrace_record_base base;
 	struct uftrace_rstack_list rstack_list;
 	struct uftrace_rstack_list event_list;
 	int stack_count;
@@ -121,6 +121,25 @@ void report_update_node(struct uftrace_report_node *node, struct uftrace_task_re
 		node->size = task->func->size;
 }
 
+/* merge the function summary saved by 'record --aggregate' */
+void report_update_summary(struct uftrace_report_node *node, struct uftrace_agg_entry *entry)
+{
+	node->total.sum += entry->total;
+	node->total.rec += entry->total_rec;
+	if (node->total.min > entry->total_min)
+		node->total.min = entry->total_min;
+	if (node->total.max < entry->total_max)
+		node->total.max = entry->total_max;
+
+	node->self.sum += entry->self;
+	if (node->self.min > entry->self_min)
+		node->self.min = entry->self_min;
+	if (node->self.max < entry->self_max)
+		node->self.max = entry->self_max;
+
+	node->call += entry->call;
+}
+
 void report_calc_avg(struct rb_root *root)
 {
 	struct uftrace_report_node *node;
@@ -53,6 +53,7 @@ struct uftrace_report_node *report_find_node(struct rb_root *root, const char *n
 void report_add_node(struct rb_root *root, const char *name, struct uftrace_report_node *node);
 void report_update_node(struct uftrace_report_node *node, struct uftrace_task_reader *task,
 			struct uftrace_dbg_loc *loc);
+void report_update_summary(struct uftrace_report_node *node, struct uftrace_agg_entry *entry);
 void report_calc_avg(struct rb_root *root);
 void report_delete_node(struct rb_root *root, struct uftrace_report_node *node);
 
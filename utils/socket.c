@@ -1,4 +1,6 @@
 #include <errno.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -62,6 +64,16 @@ int socket_send_option(int fd, enum uftrace_dopt opt, void *value, size_t size)
 	return 0;
 }
 
+/* send a string option with its length (including NUL) */
+int socket_send_string(int fd, enum uftrace_dopt opt, const char *str)
+{
+	uint32_t len = strlen(str) + 1;
+
+	if (socket_send_option(fd, opt, &len, sizeof(len)) == -1)
+		return -1;
+	return write_all(fd, str, len);
+}
+
 int socket_connect(int fd, struct sockaddr_un *addr)
 {
 	if (connect(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_un)) == -1) {
@@ -13,5 +13,6 @@ int socket_listen(int fd, struct sockaddr_un *addr);
 int socket_connect(int fd, struct sockaddr_un *addr);
 int socket_accept(int fd);
 int socket_send_option(int fd, enum uftrace_dopt opt, void *value, size_t size);
+int socket_send_string(int fd, enum uftrace_dopt opt, const char *str);
 
 #endif // UFTRACE_SOCKET_H
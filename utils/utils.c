@@ -1,5 +1,6 @@
 #include <dirent.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -402,6 +403,63 @@ void setup_clock_id(const char *clock_str)
 	}
 }
 
+#define TSC_CALIBRATE_USEC 10000
+
+/* read a pair of TSC and CLOCK_MONOTONIC as close as possible */
+static void read_tsc_anchor(uint64_t *tsc, uint64_t *mono)
+{
+	struct timespec ts1, ts2;
+	uint64_t t1, t2, best = -1ULL;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &ts1);
+		t1 = host_read_tsc();
+		clock_gettime(CLOCK_MONOTONIC, &ts2);
+
+		t2 = (uint64_t)ts2.tv_sec * NSEC_PER_SEC + ts2.tv_nsec;
+		t2 -= (uint64_t)ts1.tv_sec * NSEC_PER_SEC + ts1.tv_nsec;
+		if (t2 < best) {
+			best = t2;
+			*tsc = t1;
+			*mono = (uint64_t)ts1.tv_sec * NSEC_PER_SEC + ts1.tv_nsec + t2 / 2;
+		}
+	}
+}
+
+/**
+ * setup_tsc_clock - set the anchor and estimate the TSC frequency
+ * @clock: clock info to set up
+ *
+ * This function takes the anchor (a pair of TSC and CLOCK_MONOTONIC) and
+ * waits for a short time to estimate the TSC frequency.  The frequency
+ * will be refined later by update_tsc_clock() at the end of recording.
+ */
+void setup_tsc_clock(struct uftrace_clock_info *clock)
+{
+	uint64_t tsc, mono;
+
+	read_tsc_anchor(&clock->tsc, &clock->mono);
+	usleep(TSC_CALIBRATE_USEC);
+	read_tsc_anchor(&tsc, &mono);
+
+	clock->freq = (double)(tsc - clock->tsc) * NSEC_PER_SEC / (mono - clock->mono);
+	pr_dbg("TSC clock frequency: %" PRIu64 " Hz\n", clock->freq);
+}
+
+/* update the TSC frequency using the whole recording time */
+void update_tsc_clock(struct uftrace_clock_info *clock)
+{
+	uint64_t tsc, mono;
+
+	read_tsc_anchor(&tsc, &mono);
+	if (mono - clock->mono <= TSC_CALIBRATE_USEC * 1000ULL)
+		return;
+
+	clock->freq = (double)(tsc - clock->tsc) * NSEC_PER_SEC / (mono - clock->mono);
+	pr_dbg("TSC clock frequency: %" PRIu64 " Hz\n", clock->freq);
+}
+
 bool check_time_range(struct uftrace_time_range *range, uint64_t timestamp)
 {
 	/* maybe it's called before first timestamp set */
@@ -352,6 +352,41 @@ char *read_exename(void);
 extern clockid_t clock_source;
 void setup_clock_id(const char *clock_str);
 
+/* calibration data to convert TSC timestamps (--clock=tsc) */
+struct uftrace_clock_info {
+	uint64_t freq; /* TSC ticks per second */
+	uint64_t tsc; /* TSC value at the anchor */
+	uint64_t mono; /* CLOCK_MONOTONIC at the anchor (nsec) */
+};
+
+static inline bool clock_is_tsc(const char *clock_str)
+{
+	return clock_str && !strcmp(clock_str, "tsc");
+}
+
+static inline uint64_t tsc_to_nsec(uint64_t ticks, uint64_t freq)
+{
+	/* split it not to overflow during the multiplication */
+	return (ticks / freq) * NSEC_PER_SEC + (ticks % freq) * NSEC_PER_SEC / freq;
+}
+
+static inline uint64_t nsec_to_tsc(uint64_t nsec, uint64_t freq)
+{
+	return (nsec / NSEC_PER_SEC) * freq + (nsec % NSEC_PER_SEC) * freq / NSEC_PER_SEC;
+}
+
+/* convert TSC timestamp to CLOCK_MONOTONIC using the anchor */
+static inline uint64_t convert_tsc_time(struct uftrace_clock_info *clock, uint64_t tsc)
+{
+	if (tsc >= clock->tsc)
+		return clock->mono + tsc_to_nsec(tsc - clock->tsc, clock->freq);
+	else
+		return clock->mono - tsc_to_nsec(clock->tsc - tsc, clock->freq);
+}
+
+void setup_tsc_clock(struct uftrace_clock_info *clock);
+void update_tsc_clock(struct uftrace_clock_info *clock);
+
 void print_time_unit(uint64_t delta_nsec);
 void print_diff_percent(uint64_t base_nsec, uint64_t delta_nsec);
 void print_diff_time_unit(uint64_t base_nsec, uint64_t pair_nsec);